@@ -0,0 +1,172 @@
+/*!
+ * \file acl.c
+ * \brief Loading and evaluating the access control list.
+ */
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acl.h"
+#include "prefix_trie.h"
+
+struct acl_rule {
+	enum acl_action action;
+	char *pattern;  // NULL matches every file.
+};
+
+// The rules given for one prefix, in file order.
+struct acl_rules {
+	struct acl_rule *rules;
+	size_t count;
+	size_t capacity;
+};
+
+static struct prefix_trie acl;
+static int loaded;
+static enum acl_action default_action = ACL_ALLOW;
+
+
+static int parse_action( const char *text, enum acl_action *action )
+{
+	if( strcmp( text, "allow" ) == 0 ) {
+		*action = ACL_ALLOW;
+		return 0;
+	}
+	if( strcmp( text, "deny" ) == 0 ) {
+		*action = ACL_DENY;
+		return 0;
+	}
+	return -1;
+}
+
+
+// Appends a rule to the list for address/length, creating the list on first use.
+static int add_rule( int family, const uint8_t *address, unsigned length, enum acl_action action, const char *pattern )
+{
+	struct acl_rules *list = prefix_trie_get( &acl, family, address, length );
+	struct acl_rule *rule;
+
+	if( list == NULL ) {
+		if( (list = calloc( 1, sizeof(*list) )) == NULL ||
+		    prefix_trie_insert( &acl, family, address, length, list ) == -1 ) {
+			free( list );
+			return -1;
+		}
+	}
+
+	if( list->count == list->capacity ) {
+		size_t capacity = list->capacity == 0 ? 1 : list->capacity * 2;
+		struct acl_rule *rules = realloc( list->rules, capacity * sizeof(*rules) );
+
+		if( rules == NULL ) {
+			return -1;
+		}
+		list->rules = rules;
+		list->capacity = capacity;
+	}
+
+	rule = &list->rules[list->count];
+	rule->action = action;
+	rule->pattern = NULL;
+	if( pattern != NULL && (rule->pattern = strdup( pattern )) == NULL ) {
+		return -1;
+	}
+	list->count++;
+	return 0;
+}
+
+
+//! Reads the rules at path. Returns 0, or -1 after reporting the problem on stderr.
+int acl_load( const char *path )
+{
+	char line[1024];
+	unsigned line_number = 0;
+	FILE *file;
+
+	if( (file = fopen( path, "r" )) == NULL ) {
+		fprintf( stderr, "Unable to open ACL file %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+	if( !loaded ) {
+		if( prefix_trie_init( &acl ) == -1 ) {
+			fclose( file );
+			return -1;
+		}
+		loaded = 1;
+	}
+
+	while( fgets( line, sizeof(line), file ) != NULL ) {
+		char *save;
+		char *word = strtok_r( line, " \t\r\n", &save );
+		char *prefix;
+		char *pattern;
+		enum acl_action action;
+		uint8_t address[16];
+		unsigned length;
+		int family;
+
+		++line_number;
+		if( word == NULL || word[0] == '#' ) {
+			continue;
+		}
+		prefix = strtok_r( NULL, " \t\r\n", &save );
+		pattern = prefix == NULL ? NULL : strtok_r( NULL, " \t\r\n", &save );
+
+		if( strcmp( word, "default" ) == 0 ) {
+			if( prefix == NULL || parse_action( prefix, &default_action ) == -1 ) {
+				fprintf( stderr, "%s:%u: expected \"default allow\" or \"default deny\"\n", path, line_number );
+				fclose( file );
+				return -1;
+			}
+			continue;
+		}
+
+		if( parse_action( word, &action ) == -1 || prefix == NULL ||
+		    prefix_parse( prefix, &family, address, &length ) == -1 ) {
+			fprintf( stderr, "%s:%u: expected \"allow|deny PREFIX [PATTERN]\"\n", path, line_number );
+			fclose( file );
+			return -1;
+		}
+		if( add_rule( family, address, length, action, pattern ) == -1 ) {
+			fprintf( stderr, "%s:%u: out of memory\n", path, line_number );
+			fclose( file );
+			return -1;
+		}
+	}
+
+	fclose( file );
+	return 0;
+}
+
+
+//! Decides whether the client may read file_name.
+enum acl_action acl_check( const client_key *key, const char *file_name )
+{
+	void *matches[129];  // At most one list per prefix length on the path.
+	size_t count;
+
+	if( !loaded ) {
+		return default_action;
+	}
+
+	while( *file_name == '/' ) {
+		++file_name;
+	}
+
+	count = prefix_trie_matches( &acl, key, matches, sizeof(matches) / sizeof(matches[0]) );
+	while( count > 0 ) {
+		const struct acl_rules *list = matches[--count];
+
+		for( size_t i = 0; i < list->count; ++i ) {
+			const struct acl_rule *rule = &list->rules[i];
+
+			if( rule->pattern == NULL || fnmatch( rule->pattern, file_name, 0 ) == 0 ) {
+				return rule->action;
+			}
+		}
+	}
+	return default_action;
+}
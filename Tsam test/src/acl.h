@@ -0,0 +1,35 @@
+/*!
+ * \file acl.h
+ * \brief Allow/deny rules by source prefix and file name pattern.
+ *
+ * An ACL file has one rule per line,
+ *
+ *     allow 10.0.0.0/8
+ *     deny  10.66.0.0/16
+ *     deny  0.0.0.0/0     *.key
+ *     allow 10.66.1.0/24  pxelinux.cfg/01-*
+ *     default deny
+ *
+ * The pattern is an fnmatch() pattern for the requested file name (with any
+ * leading '/' removed); a rule without one applies to every file. The most
+ * specific prefix that has a rule matching the file decides, and rules for
+ * the same prefix are tried in file order. When no rule matches, the default
+ * applies (allow unless the file says otherwise). Prefixes are kept in a
+ * prefix_trie, so a check costs one walk down the trie however many rules
+ * were loaded.
+ */
+
+#ifndef ACL_H
+#define ACL_H
+
+#include "addrkey.h"
+
+enum acl_action {
+	ACL_ALLOW,
+	ACL_DENY
+};
+
+int acl_load( const char *path );
+enum acl_action acl_check( const client_key *key, const char *file_name );
+
+#endif
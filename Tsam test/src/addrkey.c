@@ -0,0 +1,66 @@
+/*!
+ * \file addrkey.c
+ * \brief Conversion between socket addresses and client keys.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "addrkey.h"
+
+// Prefix of an IPv4-mapped IPv6 address (::ffff:0:0/96).
+static const uint8_t v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+
+//! Fills in key from a socket address. Returns 0 on success, -1 for an unsupported family.
+int client_key_from_sockaddr( client_key *key, const struct sockaddr *address )
+{
+	memset( key, 0, sizeof(*key) );
+
+	if( address->sa_family == AF_INET ) {
+		const struct sockaddr_in *in4 = (const struct sockaddr_in *)address;
+
+		key->family  = FAMILY_V4;
+		key->port    = in4->sin_port;
+		key->addr.v4 = in4->sin_addr.s_addr;
+		return 0;
+	}
+
+	if( address->sa_family == AF_INET6 ) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+
+		key->port = in6->sin6_port;
+
+		// A dual-stack socket hands us IPv4 clients as ::ffff:a.b.c.d; key them as IPv4.
+		if( memcmp( in6->sin6_addr.s6_addr, v4_mapped_prefix, sizeof(v4_mapped_prefix) ) == 0 ) {
+			key->family = FAMILY_V4;
+			memcpy( &key->addr.v4, &in6->sin6_addr.s6_addr[12], 4 );
+		}
+		else {
+			key->family = FAMILY_V6;
+			memcpy( key->addr.v6, in6->sin6_addr.s6_addr, 16 );
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+
+//! Writes "address:port" (or "[address]:port" for IPv6) into buffer.
+void client_key_format( const client_key *key, char *buffer, size_t length )
+{
+	char address[INET6_ADDRSTRLEN];
+
+	if( key->family == FAMILY_V4 ) {
+		inet_ntop( AF_INET, &key->addr.v4, address, sizeof(address) );
+		snprintf( buffer, length, "%s:%u", address, (unsigned)ntohs( key->port ) );
+	}
+	else {
+		inet_ntop( AF_INET6, key->addr.v6, address, sizeof(address) );
+		snprintf( buffer, length, "[%s]:%u", address, (unsigned)ntohs( key->port ) );
+	}
+}
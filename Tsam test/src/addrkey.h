@@ -0,0 +1,72 @@
+/*!
+ * \file addrkey.h
+ * \brief Compact keys for client addresses.
+ *
+ * Every client is reduced to a client_key before it is hashed or compared.
+ * IPv4 clients (including IPv4-mapped IPv6 addresses) collapse to a single
+ * 32-bit word, so the common PXE case never touches a 128-bit address.
+ */
+
+#ifndef ADDRKEY_H
+#define ADDRKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+// Address families we count and key separately.
+enum address_family {
+	FAMILY_V4 = 0,
+	FAMILY_V6 = 1,
+	FAMILY_COUNT
+};
+
+typedef struct {
+	uint8_t  family;  // FAMILY_V4 or FAMILY_V6.
+	uint16_t port;    // Client port in network byte order.
+	union {
+		uint32_t v4;      // IPv4 address in network byte order.
+		uint8_t  v6[16];  // IPv6 address.
+	} addr;
+} client_key;
+
+// Longest textual form of a key: "[v6-address]:port".
+#define CLIENT_KEY_STRING_LENGTH 56
+
+int  client_key_from_sockaddr( client_key *key, const struct sockaddr *address );
+void client_key_format( const client_key *key, char *buffer, size_t length );
+
+static inline uint32_t client_key_hash( const client_key *key )
+{
+	uint32_t hash;
+
+	if( key->family == FAMILY_V4 ) {
+		// One multiply over address and port; no 128-bit work at all.
+		uint64_t word = ((uint64_t)key->addr.v4 << 16) | key->port;
+		return (uint32_t)((word * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	// FNV-1a over the IPv6 address, then mix in the port.
+	hash = 2166136261u;
+	for( int i = 0; i < 16; ++i ) {
+		hash ^= key->addr.v6[i];
+		hash *= 16777619u;
+	}
+	hash ^= key->port;
+	return hash * 16777619u;
+}
+
+static inline int client_key_equal( const client_key *a, const client_key *b )
+{
+	if( a->family != b->family || a->port != b->port ) {
+		return 0;
+	}
+	if( a->family == FAMILY_V4 ) {
+		return a->addr.v4 == b->addr.v4;
+	}
+	return memcmp( a->addr.v6, b->addr.v6, 16 ) == 0;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*!
+ * \file batch.c
+ * \brief The batch size controller.
+ */
+
+#include "batch.h"
+
+
+void batch_init( struct batch_control *control, struct batch_stats *stats )
+{
+	control->size = 1;
+	control->item_ns = 0;
+	control->stats = stats;
+}
+
+
+//! Records a batch of count datagrams (out of control->size asked for) that took elapsed_ns to
+//! handle, and picks the size of the next one.
+void batch_update( struct batch_control *control, unsigned count, int64_t elapsed_ns )
+{
+	unsigned limit = BATCH_MAX;
+	int bucket = 0;
+
+	if( count == 0 ) {
+		control->size = control->size > 1 ? control->size / 2 : 1;
+		return;
+	}
+	// Bucketed by the size asked for, which is what the controller chooses; count is in items.
+	while( bucket < BATCH_BUCKETS - 1 && (control->size >> (bucket + 1)) != 0 ) {
+		++bucket;
+	}
+	if( control->stats != NULL ) {
+		atomic_fetch_add_explicit( &control->stats->batches, 1, memory_order_relaxed );
+		atomic_fetch_add_explicit( &control->stats->items, count, memory_order_relaxed );
+		atomic_fetch_add_explicit( &control->stats->sizes[bucket], 1, memory_order_relaxed );
+	}
+
+	// An exponentially weighted average, 1/8 new, as for the round-trip time.
+	if( control->item_ns == 0 ) {
+		control->item_ns = elapsed_ns / count + 1;
+	}
+	else {
+		control->item_ns += (elapsed_ns / count - control->item_ns) / 8;
+		if( control->item_ns < 1 ) {
+			control->item_ns = 1;
+		}
+	}
+	if( BATCH_BUDGET_NS / control->item_ns < limit ) {
+		limit = BATCH_BUDGET_NS / control->item_ns > 1 ? (unsigned)(BATCH_BUDGET_NS / control->item_ns) : 1;
+	}
+
+	if( count >= control->size ) {
+		control->size *= 2;
+	}
+	else if( count < control->size / 2 ) {
+		control->size /= 2;
+	}
+	if( control->size > limit ) {
+		control->size = limit;
+	}
+	if( control->size < 1 ) {
+		control->size = 1;
+	}
+}
+
+
+//! Prints the batches, datagrams, mean batch size and how often each size range was chosen.
+void batch_dump( FILE *stream, const char *name, struct batch_stats *stats )
+{
+	unsigned long batches = atomic_load_explicit( &stats->batches, memory_order_relaxed );
+	unsigned long items = atomic_load_explicit( &stats->items, memory_order_relaxed );
+
+	fprintf( stream, "batch %s: batches=%lu items=%lu mean=%.1f sizes", name, batches, items,
+	         batches != 0 ? (double)items / (double)batches : 0.0 );
+	for( int bucket = 0; bucket < BATCH_BUCKETS; ++bucket ) {
+		fprintf( stream, " %u:%lu", 1u << bucket, atomic_load_explicit( &stats->sizes[bucket], memory_order_relaxed ) );
+	}
+	fprintf( stream, "\n" );
+}
@@ -0,0 +1,43 @@
+/*!
+ * \file batch.h
+ * \brief Adaptive batch sizes for recvmmsg() and sendmmsg().
+ *
+ * A loop that moves datagrams in batches asks its controller how many to
+ * take, moves up to that many and reports back how many it found and how
+ * long handling them took. The size doubles while batches come back full
+ * (there is a queue, so bigger batches save system calls) and halves when
+ * they come back less than half full (little load, where a big batch only
+ * adds latency). It never exceeds BATCH_MAX, nor the number of datagrams
+ * that can be handled within the latency budget at the measured cost per
+ * datagram, so one batch cannot hold up the rest of the loop for long.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BATCH_MAX        64
+#define BATCH_BUCKETS    7       // Sizes 1, 2-3, 4-7, ... 64 in the statistics.
+#define BATCH_BUDGET_NS  200000  // Longest a batch should take to handle.
+
+// Shared counters for one kind of batch (see stats.h).
+struct batch_stats {
+	atomic_ulong batches;
+	atomic_ulong items;
+	atomic_ulong sizes[BATCH_BUCKETS];  // Batches by chosen size, in powers of two.
+};
+
+struct batch_control {
+	unsigned size;            // Current batch size.
+	int64_t item_ns;          // Smoothed cost of handling one datagram; 0 until measured.
+	struct batch_stats *stats;  // Where to count batches; may be NULL.
+};
+
+void batch_init( struct batch_control *control, struct batch_stats *stats );
+void batch_update( struct batch_control *control, unsigned count, int64_t elapsed_ns );
+void batch_dump( FILE *stream, const char *name, struct batch_stats *stats );
+
+#endif
@@ -0,0 +1,197 @@
+/*!
+ * \file bench.c
+ * \brief Running the benchmarks and reporting the results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "bench.h"
+
+#define DEFAULT_MIN_TIME 0.5
+#define MAX_ITERATIONS   1000000000ULL
+
+struct bench_result {
+	uint64_t iterations;
+	double real_ns;  // Per iteration.
+	double cpu_ns;
+	double bytes_per_second;
+	double items_per_second;
+};
+
+static volatile uint64_t sink;
+
+
+void bench_do_not_optimize_pointer( const void *pointer )
+{
+	sink = (uint64_t)(uintptr_t)pointer;
+}
+
+
+void bench_do_not_optimize_value( uint64_t value )
+{
+	sink = value;
+}
+
+
+static double seconds( clockid_t clock )
+{
+	struct timespec now;
+
+	clock_gettime( clock, &now );
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+
+// Runs one benchmark with more and more iterations until a run lasts min_time.
+static void run_case( const struct bench_case *bench, double min_time, struct bench_result *result )
+{
+	uint64_t iterations = 1;
+
+	while( 1 ) {
+		struct bench_state state = { iterations, iterations, 0, 0 };
+		double real_start = seconds( CLOCK_MONOTONIC );
+		double cpu_start = seconds( CLOCK_PROCESS_CPUTIME_ID );
+		double real;
+		double cpu;
+		double factor;
+
+		bench->run( &state );
+		real = seconds( CLOCK_MONOTONIC ) - real_start;
+		cpu = seconds( CLOCK_PROCESS_CPUTIME_ID ) - cpu_start;
+
+		if( real >= min_time || iterations >= MAX_ITERATIONS ) {
+			result->iterations = iterations;
+			result->real_ns = real * 1e9 / (double)iterations;
+			result->cpu_ns = cpu * 1e9 / (double)iterations;
+			result->bytes_per_second = real > 0 ? (double)state.bytes_processed / real : 0;
+			result->items_per_second = real > 0 ? (double)state.items_processed / real : 0;
+			return;
+		}
+
+		// Aim a little past min_time, but grow at most tenfold on the strength of one run.
+		factor = real > 0 ? min_time * 1.4 / real : 10;
+		if( factor > 10 ) {
+			factor = 10;
+		}
+		if( factor < 2 ) {
+			factor = 2;
+		}
+		iterations = (uint64_t)((double)iterations * factor);
+		if( iterations > MAX_ITERATIONS ) {
+			iterations = MAX_ITERATIONS;
+		}
+	}
+}
+
+
+static void print_context( FILE *stream, const char *executable )
+{
+	char host[256] = "";
+	char date[64] = "";
+	time_t now = time( NULL );
+	struct tm local;
+
+	gethostname( host, sizeof(host) - 1 );
+	if( localtime_r( &now, &local ) != NULL ) {
+		strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &local );
+	}
+	fprintf( stream, "{\n  \"context\": {\n" );
+	fprintf( stream, "    \"date\": \"%s\",\n", date );
+	fprintf( stream, "    \"host_name\": \"%s\",\n", host );
+	fprintf( stream, "    \"executable\": \"%s\",\n", executable );
+	fprintf( stream, "    \"num_cpus\": %ld,\n", sysconf( _SC_NPROCESSORS_ONLN ) );
+	fprintf( stream, "    \"library_build_type\": \"release\"\n" );
+	fprintf( stream, "  },\n  \"benchmarks\": [" );
+}
+
+
+static void print_json( FILE *stream, const char *name, const struct bench_result *result, int first )
+{
+	fprintf( stream, "%s\n    {\n", first ? "" : "," );
+	fprintf( stream, "      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n", name, name );
+	fprintf( stream, "      \"run_type\": \"iteration\",\n      \"repetitions\": 1,\n      \"repetition_index\": 0,\n" );
+	fprintf( stream, "      \"threads\": 1,\n      \"iterations\": %llu,\n", (unsigned long long)result->iterations );
+	fprintf( stream, "      \"real_time\": %.4f,\n      \"cpu_time\": %.4f,\n", result->real_ns, result->cpu_ns );
+	if( result->bytes_per_second > 0 ) {
+		fprintf( stream, "      \"bytes_per_second\": %.1f,\n", result->bytes_per_second );
+	}
+	if( result->items_per_second > 0 ) {
+		fprintf( stream, "      \"items_per_second\": %.1f,\n", result->items_per_second );
+	}
+	fprintf( stream, "      \"time_unit\": \"ns\"\n    }" );
+}
+
+
+static void print_console( FILE *stream, const char *name, const struct bench_result *result )
+{
+	fprintf( stream, "%-32s %12.1f ns %12.1f ns %12llu", name, result->real_ns, result->cpu_ns,
+	         (unsigned long long)result->iterations );
+	if( result->bytes_per_second > 0 ) {
+		fprintf( stream, "  %.1f MB/s", result->bytes_per_second / 1e6 );
+	}
+	if( result->items_per_second > 0 ) {
+		fprintf( stream, "  %.1f M items/s", result->items_per_second / 1e6 );
+	}
+	fputc( '\n', stream );
+}
+
+
+//! Runs the cases selected by the command line: [--filter=SUBSTRING] [--min-time=SECONDS] [--format=console|json].
+int bench_main( int argc, char **argv, const struct bench_case *cases, size_t count )
+{
+	const char *filter = "";
+	double min_time = DEFAULT_MIN_TIME;
+	int json = 0;
+	int first = 1;
+
+	for( int i = 1; i < argc; ++i ) {
+		if( strncmp( argv[i], "--filter=", 9 ) == 0 ) {
+			filter = argv[i] + 9;
+		}
+		else if( strncmp( argv[i], "--min-time=", 11 ) == 0 ) {
+			min_time = atof( argv[i] + 11 );
+		}
+		else if( strcmp( argv[i], "--format=json" ) == 0 ) {
+			json = 1;
+		}
+		else if( strcmp( argv[i], "--format=console" ) == 0 ) {
+			json = 0;
+		}
+		else {
+			fprintf( stderr, "Usage: %s [--filter=SUBSTRING] [--min-time=SECONDS] [--format=console|json]\n", argv[0] );
+			return EXIT_FAILURE;
+		}
+	}
+
+	if( json ) {
+		print_context( stdout, argv[0] );
+	}
+	else {
+		printf( "%-32s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations" );
+	}
+	for( size_t i = 0; i < count; ++i ) {
+		struct bench_result result;
+
+		if( strstr( cases[i].name, filter ) == NULL ) {
+			continue;
+		}
+		run_case( &cases[i], min_time, &result );
+		if( json ) {
+			print_json( stdout, cases[i].name, &result, first );
+		}
+		else {
+			print_console( stdout, cases[i].name, &result );
+		}
+		first = 0;
+		fflush( stdout );
+	}
+	if( json ) {
+		printf( "\n  ]\n}\n" );
+	}
+	return EXIT_SUCCESS;
+}
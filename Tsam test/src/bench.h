@@ -0,0 +1,68 @@
+/*!
+ * \file bench.h
+ * \brief A small microbenchmark harness in the manner of Google Benchmark.
+ *
+ * A benchmark is a function that does its setup, then repeats the code to be
+ * timed for as long as bench_keep_running() says so:
+ *
+ *     static void bench_something( struct bench_state *state )
+ *     {
+ *         ...setup...
+ *         while( bench_keep_running( state ) ) {
+ *             bench_do_not_optimize( work( ) );
+ *         }
+ *         bench_set_bytes_processed( state, ... );
+ *     }
+ *
+ * bench_main() runs each one with a growing iteration count until a run
+ * takes at least the minimum time, and reports the time per iteration. With
+ * --format=json the report uses Google Benchmark's JSON layout, so its
+ * comparison tools (compare.py) can track results between builds.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct bench_state {
+	uint64_t iterations;       // Iterations in this run.
+	uint64_t remaining;
+	uint64_t bytes_processed;  // Totals for the run, if the benchmark reports them.
+	uint64_t items_processed;
+};
+
+struct bench_case {
+	const char *name;
+	void (*run)( struct bench_state *state );
+};
+
+static inline int bench_keep_running( struct bench_state *state )
+{
+	if( state->remaining == 0 ) {
+		return 0;
+	}
+	state->remaining--;
+	return 1;
+}
+
+static inline void bench_set_bytes_processed( struct bench_state *state, uint64_t bytes )
+{
+	state->bytes_processed = bytes;
+}
+
+static inline void bench_set_items_processed( struct bench_state *state, uint64_t items )
+{
+	state->items_processed = items;
+}
+
+void bench_do_not_optimize_pointer( const void *pointer );
+void bench_do_not_optimize_value( uint64_t value );
+
+// Keeps the compiler from discarding a result that is otherwise unused.
+#define bench_do_not_optimize(x) bench_do_not_optimize_value( (uint64_t)(x) )
+
+int bench_main( int argc, char **argv, const struct bench_case *cases, size_t count );
+
+#endif
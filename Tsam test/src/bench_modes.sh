@@ -0,0 +1,67 @@
+#!/bin/sh
+# End-to-end comparison of the server's transfer modes over loopback.
+#
+# Usage: ./bench_modes.sh
+#
+# For every mode, data file and client count it starts a fresh tftpd,
+# runs tftpload against it once and prints a row of the table:
+# throughput, server CPU seconds per GB sent and the 99th percentile
+# transfer latency. The sweep is set by the environment:
+#
+#   MODES      Values for tftpd -m            (default "fork event")
+#   CLIENTS    Concurrent clients per run     (default "1 10 100 1000 10000")
+#   FILES      Files from DATA to fetch       (default "example_data1 example_data2 example_data3")
+#   TRANSFERS  Downloads per client           (default 1)
+#   LOAD_FLAGS Extra tftpload flags, e.g. "-b 1428 -w 8"
+#   DATA       Directory served               (default ../data)
+#   PORT       Port to use                    (default 16969)
+#
+# Large client counts need a high open file limit (ulimit -n) on both
+# sides; 10000 clients of example_data3 move about 44 GB.
+
+MODES=${MODES:-"fork event"}
+CLIENTS=${CLIENTS:-"1 10 100 1000 10000"}
+FILES=${FILES:-"example_data1 example_data2 example_data3"}
+TRANSFERS=${TRANSFERS:-1}
+DATA=${DATA:-../data}
+PORT=${PORT:-16969}
+TICKS=$(getconf CLK_TCK)
+
+cd "$(dirname "$0")" || exit 1
+make -s tftpd tftpload || exit 1
+
+# CPU time of the server and the transfer processes it has reaped, in clock ticks.
+server_ticks() {
+	awk '{ print $14 + $15 + $16 + $17 }' "/proc/$1/stat"
+}
+
+# Prints the value of name=value from a tftpload result line.
+field() {
+	echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+printf '%-6s %-14s %7s %9s %8s %10s %10s %9s\n' mode file clients transfers failed MB/s cpu_s/GB p99_ms
+for mode in $MODES; do
+	for file in $FILES; do
+		for clients in $CLIENTS; do
+			./tftpd -m "$mode" "$PORT" "$DATA" > /dev/null &
+			server=$!
+			sleep 0.2
+			before=$(server_ticks $server)
+			result=$(./tftpload -c "$clients" -n "$TRANSFERS" $LOAD_FLAGS 127.0.0.1 "$PORT" "$file")
+			sleep 0.2
+			after=$(server_ticks $server)
+			kill $server
+			wait $server 2> /dev/null
+
+			bytes=$(field bytes "$result")
+			awk -v mode="$mode" -v file="$file" -v clients="$clients" -v ticks=$((after - before)) \
+			    -v hz="$TICKS" -v bytes="${bytes:-0}" -v transfers="$(field transfers "$result")" \
+			    -v failed="$(field failed "$result")" -v rate="$(field mb_per_s "$result")" \
+			    -v p99="$(field p99_ms "$result")" 'BEGIN {
+				cpu_per_gb = bytes > 0 ? ticks / hz / (bytes / 1e9) : 0
+				printf "%-6s %-14s %7d %9d %8d %10.1f %10.2f %9.2f\n", mode, file, clients, transfers, failed, rate, cpu_per_gb, p99
+			}'
+		done
+	done
+done
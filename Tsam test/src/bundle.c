@@ -0,0 +1,174 @@
+/*!
+ * \file bundle.c
+ * \brief Mapping a bundle, checking it, and looking names up in its index.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+
+
+//! The hash both mkbundle and the server place a name by: FNV-1a, then the finaliser of SplitMix64 so that the
+//! high and low halves are both usable.
+uint64_t bundle_hash( const char *name, size_t length )
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for( size_t i = 0; i < length; ++i ) {
+		hash ^= (unsigned char)name[i];
+		hash *= 1099511628211ULL;
+	}
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+
+//! The bucket of a name, from the high half of its hash.
+uint32_t bundle_bucket( uint64_t hash, uint32_t bucket_count )
+{
+	return (uint32_t)((hash >> 32) % bucket_count);
+}
+
+
+//! The record of a name, given its bucket's displacement.
+uint32_t bundle_slot( uint64_t hash, uint32_t displacement, uint32_t file_count )
+{
+	uint64_t mixed = hash + (uint64_t)displacement * 0x9e3779b97f4a7c15ULL;
+
+	mixed = (mixed ^ (mixed >> 33)) * 0xff51afd7ed558ccdULL;
+	mixed ^= mixed >> 29;
+	return (uint32_t)(mixed % file_count);
+}
+
+
+//! Where the records start: after the header and the displacements, on an 8-byte boundary.
+size_t bundle_records_offset( uint32_t bucket_count )
+{
+	size_t offset = sizeof(struct bundle_header) + (size_t)bucket_count * sizeof(uint32_t);
+
+	return (offset + 7) & ~(size_t)7;
+}
+
+
+// Checks that the header and every record stay inside the bundle, so that lookups and transfers need not.
+static int bundle_valid( const struct bundle *bundle )
+{
+	const struct bundle_header *header = bundle->header;
+	uint64_t records_end;
+
+	if( bundle->length < sizeof(*header) || memcmp( header->magic, BUNDLE_MAGIC, sizeof(header->magic) ) != 0 ||
+	    header->length != bundle->length || (header->file_count != 0 && header->bucket_count == 0) ) {
+		return 0;
+	}
+	records_end = bundle_records_offset( header->bucket_count ) +
+	              (uint64_t)header->file_count * sizeof(struct bundle_record);
+	if( records_end > header->names_offset || header->names_offset > bundle->length ||
+	    header->names_length > bundle->length - header->names_offset ) {
+		return 0;
+	}
+	for( uint32_t i = 0; i < header->file_count; ++i ) {
+		const struct bundle_record *record = &bundle->records[i];
+
+		if( (uint64_t)record->name + record->name_length > header->names_length ||
+		    record->offset > bundle->length || record->size > bundle->length - record->offset ||
+		    (record->netascii_offset != 0 && (record->netascii_offset > bundle->length ||
+		                                      record->netascii_size > bundle->length - record->netascii_offset)) ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+//! Maps the bundle file_name and checks it. Returns it, or NULL with errno set (EINVAL if it is not a bundle).
+struct bundle *bundle_open( const char *file_name )
+{
+	struct bundle *bundle;
+	struct stat status;
+	void *map = MAP_FAILED;
+	int file;
+
+	if( (file = open( file_name, O_RDONLY )) == -1 ) {
+		return NULL;
+	}
+	if( fstat( file, &status ) == 0 ) {
+		if( (size_t)status.st_size < sizeof(struct bundle_header) ) {
+			errno = EINVAL;
+		}
+		else {
+			map = mmap( NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0 );
+		}
+	}
+	close( file );
+	if( map == MAP_FAILED ) {
+		return NULL;
+	}
+	if( (bundle = malloc( sizeof(*bundle) )) == NULL ) {
+		munmap( map, (size_t)status.st_size );
+		return NULL;
+	}
+
+	bundle->map = map;
+	bundle->length = (size_t)status.st_size;
+	bundle->header = map;
+	bundle->displacements = (const uint32_t *)(bundle->map + sizeof(struct bundle_header));
+	bundle->records = (const struct bundle_record *)(bundle->map + bundle_records_offset( bundle->header->bucket_count ));
+	bundle->names = (const char *)bundle->map + bundle->header->names_offset;
+	if( bundle->header->bucket_count > (bundle->length - sizeof(struct bundle_header)) / sizeof(uint32_t) ||
+	    !bundle_valid( bundle ) ) {
+		munmap( map, bundle->length );
+		free( bundle );
+		errno = EINVAL;
+		return NULL;
+	}
+	return bundle;
+}
+
+
+//! Returns the record of file_name, or NULL if the bundle does not have it. Like open_in_root(), takes every name
+//! as relative to the root.
+const struct bundle_record *bundle_find( const struct bundle *bundle, const char *file_name )
+{
+	const struct bundle_header *header = bundle->header;
+	const struct bundle_record *record;
+	size_t length;
+	uint64_t hash;
+
+	while( *file_name == '/' ) {
+		++file_name;
+	}
+	if( header->file_count == 0 || (length = strlen( file_name )) == 0 ) {
+		return NULL;
+	}
+	hash = bundle_hash( file_name, length );
+	record = &bundle->records[bundle_slot( hash, bundle->displacements[bundle_bucket( hash, header->bucket_count )],
+	                                       header->file_count )];
+	if( record->name_length != length || memcmp( bundle->names + record->name, file_name, length ) != 0 ) {
+		return NULL;
+	}
+	return record;
+}
+
+
+//! Asks the kernel to start paging in the contents of file_name, if the bundle has it.
+void bundle_will_need( const struct bundle *bundle, const char *file_name )
+{
+	const struct bundle_record *record = bundle_find( bundle, file_name );
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	size_t start;
+
+	if( record == NULL || record->size == 0 ) {
+		return;
+	}
+	// Files start on a BUNDLE_ALIGN boundary, which is less than a page where pages are 16 or 64 KiB.
+	start = (size_t)record->offset / page * page;
+	posix_madvise( (void *)(bundle->map + start), (size_t)(record->offset + record->size) - start, POSIX_MADV_WILLNEED );
+}
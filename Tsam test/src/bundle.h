@@ -0,0 +1,79 @@
+/*!
+ * \file bundle.h
+ * \brief A whole TFTP root packed into one file, served from memory (bundle=FILE).
+ *
+ * Boot roots rarely change, yet every request for one costs an openat(), an
+ * fstat() and reads. mkbundle packs a directory tree into a single bundle
+ * file, and a policy with bundle=FILE maps that file once at startup and
+ * serves every request from the mapping: looking up a name is a hash, a
+ * probe into the index and one comparison, with no system call, and the
+ * blocks of the file are copied straight from the mapped pages.
+ *
+ * The index is a minimal perfect hash of the names (hash and displace, as
+ * in Belazzougui, Botelho and Dietzfelbinger, "Hash, displace, and
+ * compress", 2009): a name's 64-bit hash picks one of bucket_count
+ * buckets, and the bucket's displacement, chosen by mkbundle so that no
+ * two names collide, turns the same hash into the name's record among
+ * file_count. Names that are not in the bundle land on some other name's
+ * record, and fail the comparison.
+ *
+ * Layout, all integers in host order:
+ *
+ *     struct bundle_header
+ *     uint32_t displacements[bucket_count], padded to 8 bytes
+ *     struct bundle_record records[file_count]
+ *     names, each without a terminator
+ *     file contents, each starting on a BUNDLE_ALIGN boundary
+ *
+ * Every record carries the length the file has in netascii. With mkbundle
+ * -n, a translated copy of each file follows it, so netascii transfers are
+ * copies too; without, they are translated from the mapping as they are
+ * sent.
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC       "TFTPBDL1"
+#define BUNDLE_ALIGN       4096  // File contents start on this boundary, so each can be paged in or advised alone.
+#define BUNDLE_BUCKET_SIZE 4     // Names per bucket, on average, when mkbundle builds the index.
+
+struct bundle_header {
+	char magic[8];            // BUNDLE_MAGIC, without its NUL.
+	uint32_t file_count;
+	uint32_t bucket_count;
+	uint64_t names_offset;
+	uint64_t names_length;
+	uint64_t length;          // Of the whole bundle, to catch one that was cut short.
+};
+
+struct bundle_record {
+	uint64_t offset;          // Of the contents, from the start of the bundle.
+	uint64_t size;
+	uint64_t netascii_offset; // Of the translated copy; 0 if there is none.
+	uint64_t netascii_size;   // Length in netascii, whether or not a copy is included.
+	uint32_t name;            // Offset into the names.
+	uint32_t name_length;
+};
+
+struct bundle {
+	const unsigned char *map;
+	size_t length;
+	const struct bundle_header *header;
+	const uint32_t *displacements;
+	const struct bundle_record *records;
+	const char *names;
+};
+
+uint64_t bundle_hash( const char *name, size_t length );
+uint32_t bundle_bucket( uint64_t hash, uint32_t bucket_count );
+uint32_t bundle_slot( uint64_t hash, uint32_t displacement, uint32_t file_count );
+size_t   bundle_records_offset( uint32_t bucket_count );
+struct bundle *bundle_open( const char *file_name );
+const struct bundle_record *bundle_find( const struct bundle *bundle, const char *file_name );
+void     bundle_will_need( const struct bundle *bundle, const char *file_name );
+
+#endif
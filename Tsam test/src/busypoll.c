@@ -0,0 +1,99 @@
+/*!
+ * \file busypoll.c
+ * \brief The spin before blocking, and the socket options for kernel busy polling.
+ */
+
+#define _DEFAULT_SOURCE  // SO_BUSY_POLL and SO_PREFER_BUSY_POLL.
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "busypoll.h"
+#include "stats.h"
+
+volatile sig_atomic_t busypoll_interrupted;
+
+
+static int64_t now_ns( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+//! Asks the kernel to busy poll for up to budget_us when handle is read with nothing queued, in
+//! preference to interrupts. Returns 0, or -1 if the system does not support it or refuses (raising
+//! the value above net.core.busy_read needs CAP_NET_ADMIN); the spin in busypoll_wait() works regardless.
+int busypoll_enable( int handle, unsigned budget_us )
+{
+#ifdef SO_BUSY_POLL
+	int value = (int)budget_us;
+
+	if( setsockopt( handle, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value) ) == -1 ) {
+		return -1;
+	}
+#ifdef SO_PREFER_BUSY_POLL
+	value = 1;
+	setsockopt( handle, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value) );
+#endif
+	return 0;
+#else
+	(void)handle;
+	(void)budget_us;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+//! Like poll(), but first checks the set without blocking for up to budget_us (never longer than
+//! timeout), and only then blocks for what is left of the timeout.
+int busypoll_wait( struct pollfd *poll_set, nfds_t count, int timeout, unsigned budget_us )
+{
+	int64_t start, end, now;
+	int ready;
+
+	if( budget_us == 0 || timeout == 0 ) {
+		return poll( poll_set, count, timeout );
+	}
+
+	start = now_ns( );
+	end = start + (int64_t)budget_us * 1000;
+	if( timeout > 0 && start + (int64_t)timeout * 1000000 < end ) {
+		end = start + (int64_t)timeout * 1000000;
+	}
+	STATS_INC( busy_poll.spins );
+	do {
+		// A signal ends the spin as it would end poll(), whether it arrived in poll() or between calls.
+		if( busypoll_interrupted ) {
+			busypoll_interrupted = 0;
+			errno = EINTR;
+			ready = -1;
+		}
+		else {
+			ready = poll( poll_set, count, 0 );
+		}
+		if( ready != 0 ) {
+			if( ready > 0 ) {
+				STATS_INC( busy_poll.hits );
+			}
+			STATS_ADD( busy_poll.spin_us, (unsigned long)((now_ns( ) - start) / 1000) );
+			return ready;
+		}
+		now = now_ns( );
+	} while( now < end );
+	STATS_ADD( busy_poll.spin_us, (unsigned long)((now - start) / 1000) );
+
+	if( timeout > 0 ) {
+		timeout -= (int)((now - start) / 1000000);
+		if( timeout < 0 ) {
+			timeout = 0;
+		}
+	}
+	return poll( poll_set, count, timeout );
+}
@@ -0,0 +1,29 @@
+/*!
+ * \file busypoll.h
+ * \brief Optional busy polling for the event loop (-b), trading CPU for latency.
+ *
+ * With a budget set, the event loop does not go to sleep in poll() as soon
+ * as nothing is ready: it first checks its sockets without blocking, over
+ * and over, for up to the budget. An ACK that arrives meanwhile is handled
+ * without the wake-up latency of a sleeping process, which is what limits
+ * lock-step (windowsize 1) transfers of small blocks. Sockets are also
+ * marked for the kernel's own busy polling (SO_BUSY_POLL and
+ * SO_PREFER_BUSY_POLL), which polls the network device's receive queue
+ * directly where the driver supports it and the net.core.busy_poll sysctl
+ * allows it. SIGUSR1 reports how often spinning found work.
+ */
+
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <signal.h>
+
+#include <poll.h>
+
+// Signal handlers set this so that a spin ends as promptly as poll() would return with EINTR.
+extern volatile sig_atomic_t busypoll_interrupted;
+
+int busypoll_enable( int handle, unsigned budget_us );
+int busypoll_wait( struct pollfd *poll_set, nfds_t count, int timeout, unsigned budget_us );
+
+#endif
@@ -0,0 +1,767 @@
+/*!
+ * \file cache.c
+ * \brief The index of cached files, the thread that reads them in when the policy admits them, and the snapshot.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "netascii.h"
+#include "stats.h"
+
+// A netascii size, and the version of the file it was measured on.
+struct known_size {
+	struct cache_identity identity;
+	off_t netascii_size;  // -1 if the slot is free.
+};
+
+// A restored snapshot, kept mapped while its files are loaded back.
+struct snapshot {
+	void *map;
+	size_t length;
+	const struct cache_record *records;
+	uint32_t record_count;
+	const char *paths;
+	uint64_t paths_length;
+};
+
+// An admitted file waiting for the loader, with a descriptor of its own.
+struct pending_load {
+	struct cache_entry *entry;
+	int file;
+	struct pending_load *next;
+};
+
+// A snapshot taken under cache_lock, to be written out without it.
+struct snapshot_copy {
+	char *file_name;
+	struct cache_snapshot_header header;
+	struct cache_record *records;
+	uint8_t *sketch;
+	size_t sketch_length;
+	char *paths;
+};
+
+// Sessions on several worker threads, and several acceptors, use the cache at once.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tinylfu policy;
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct known_size known[CACHE_KNOWN];  // Direct-mapped by identity.
+static size_t cache_capacity;  // 0 without -C.
+
+// The loader's queue, oldest first, under cache_lock.
+static pthread_cond_t load_ready = PTHREAD_COND_INITIALIZER;
+static struct pending_load *loads_head;
+static struct pending_load *loads_tail;
+static unsigned loads_pending;
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;  // Held while a snapshot is being written.
+static atomic_int saving;  // Set while a background save is under way.
+
+static void *loader( void *argument );
+
+
+// Starts run( argument ) on a detached thread with every signal blocked, so that signals go to the main thread.
+// Returns 0, or -1 with errno set.
+static int start_thread( void *(*run)( void * ), void *argument )
+{
+	sigset_t all, previous;
+	pthread_t thread;
+
+	sigfillset( &all );
+	pthread_sigmask( SIG_BLOCK, &all, &previous );
+	errno = pthread_create( &thread, NULL, run, argument );
+	pthread_sigmask( SIG_SETMASK, &previous, NULL );
+	if( errno != 0 ) {
+		return -1;
+	}
+	pthread_detach( thread );
+	return 0;
+}
+
+
+//! Sets up a cache of capacity bytes and starts its loader. Returns 0, or -1 with errno set.
+int cache_init( size_t capacity )
+{
+	if( cache_policy_init( &policy, capacity ) == -1 ) {
+		return -1;
+	}
+	for( size_t i = 0; i < CACHE_KNOWN; ++i ) {
+		known[i].netascii_size = -1;
+	}
+	if( start_thread( loader, NULL ) == -1 ) {
+		return -1;
+	}
+	cache_capacity = capacity;
+	return 0;
+}
+
+
+static void identity_from_stat( struct cache_identity *identity, const struct stat *status )
+{
+	identity->device = (uint64_t)status->st_dev;
+	identity->inode = (uint64_t)status->st_ino;
+	identity->modified_sec = (int64_t)status->st_mtim.tv_sec;
+	identity->modified_nsec = (int64_t)status->st_mtim.tv_nsec;
+	identity->size = (int64_t)status->st_size;
+}
+
+
+static int identity_equal( const struct cache_identity *a, const struct cache_identity *b )
+{
+	return a->device == b->device && a->inode == b->inode && a->modified_sec == b->modified_sec &&
+	       a->modified_nsec == b->modified_nsec && a->size == b->size;
+}
+
+
+// Mixes an identity into one word (the finaliser of SplitMix64 after each part).
+static uint64_t identity_hash( const struct cache_identity *identity )
+{
+	uint64_t parts[] = { identity->device, identity->inode, (uint64_t)identity->modified_sec,
+	                     (uint64_t)identity->modified_nsec, (uint64_t)identity->size };
+	uint64_t hash = 0;
+
+	for( size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i ) {
+		hash = (hash ^ parts[i]) + 0x9e3779b97f4a7c15ULL;
+		hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+		hash ^= hash >> 31;
+	}
+	return hash;
+}
+
+
+static void entry_free( struct cache_entry *entry )
+{
+	free( entry->path );
+	free( entry->data );
+	free( entry );
+}
+
+
+// Takes an entry out of the index. The caller holds cache_lock.
+static void unindex( struct cache_entry *entry )
+{
+	struct cache_entry **link = &buckets[entry->policy.hash & (CACHE_BUCKETS - 1)];
+
+	while( *link != entry ) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+	entry->evicted = 1;
+	atomic_fetch_sub_explicit( &stats->cache.bytes, entry->policy.size, memory_order_relaxed );
+	if( entry->references == 0 ) {
+		entry_free( entry );
+	}
+}
+
+
+// Called by the policy for each entry it drops.
+static void evict( struct tinylfu_entry *dropped, void *context )
+{
+	(void)context;
+	STATS_INC( cache.evicted );
+	unindex( (struct cache_entry *)dropped );
+}
+
+
+// The entry for identity in the index, or NULL. The caller holds cache_lock.
+static struct cache_entry *find( const struct cache_identity *identity, uint64_t hash )
+{
+	struct cache_entry *entry;
+
+	for( entry = buckets[hash & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next ) {
+		if( entry->policy.hash == hash && identity_equal( &entry->identity, identity ) ) {
+			break;
+		}
+	}
+	return entry;
+}
+
+
+// Offers a new entry to the policy, or with a segment other than TINYLFU_NONE places it there, and indexes it
+// if it gets in. Returns it, loading and with a reference for the caller to load it, or NULL. The caller holds
+// cache_lock.
+static struct cache_entry *add( const struct cache_identity *identity, uint64_t hash, enum tinylfu_segment segment )
+{
+	struct cache_entry *entry;
+
+	if( !cache_fits( cache_capacity, (uint64_t)identity->size ) ) {
+		if( segment == TINYLFU_NONE ) {
+			STATS_INC( cache.rejected );
+		}
+		return NULL;
+	}
+	if( (entry = calloc( 1, sizeof(*entry) )) == NULL ) {
+		return NULL;
+	}
+	entry->policy.hash = hash;
+	entry->policy.size = (size_t)identity->size;
+	entry->identity = *identity;
+	if( segment == TINYLFU_NONE ? tinylfu_insert( &policy, &entry->policy, evict, NULL ) == -1
+	                            : tinylfu_place( &policy, &entry->policy, segment ) == -1 ) {
+		if( segment == TINYLFU_NONE ) {
+			STATS_INC( cache.rejected );
+		}
+		free( entry );
+		return NULL;
+	}
+	entry->loading = 1;
+	entry->references = 1;
+	entry->next = buckets[hash & (CACHE_BUCKETS - 1)];
+	buckets[hash & (CACHE_BUCKETS - 1)] = entry;
+	STATS_INC( cache.admitted );
+	STATS_ADD( cache.bytes, entry->policy.size );
+	return entry;
+}
+
+
+// Reads all of file into entry->data. Returns 0, or -1 with errno set.
+static int load( struct cache_entry *entry, int file )
+{
+	size_t done = 0;
+
+	if( (entry->data = malloc( entry->policy.size )) == NULL ) {
+		return -1;
+	}
+	while( done < entry->policy.size ) {
+		ssize_t count = pread( file, entry->data + done, entry->policy.size - done, (off_t)done );
+
+		if( count == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( count <= 0 ) {
+			if( count == 0 ) {
+				errno = EIO;  // It shrank since fstat().
+			}
+			return -1;
+		}
+		done += (size_t)count;
+	}
+	return 0;
+}
+
+
+// The path an open file was opened by, as the kernel has it; NULL if unknown.
+static char *file_path( int file )
+{
+	char link[64];
+	char path[PATH_MAX];
+	ssize_t length;
+
+	snprintf( link, sizeof(link), "/proc/self/fd/%d", file );
+	if( (length = readlink( link, path, sizeof(path) - 1 )) <= 0 ) {
+		return NULL;
+	}
+	path[length] = '\0';
+	return strdup( path );
+}
+
+
+// Reads in an entry from add(), outside cache_lock, and makes it available. Returns it, still with the
+// reference, or NULL if it could not be read (and it is dropped). Runs on the loader or the warming thread.
+static struct cache_entry *finish_load( struct cache_entry *entry, int file, const char *path )
+{
+	int loaded = load( entry, file );
+	char *copy = path != NULL ? strdup( path ) : file_path( file );
+
+	pthread_mutex_lock( &cache_lock );
+	entry->loading = 0;
+	entry->path = copy;
+	if( loaded == -1 && !entry->evicted ) {
+		tinylfu_remove( &policy, &entry->policy );
+		unindex( entry );
+	}
+	pthread_mutex_unlock( &cache_lock );
+	if( loaded == -1 ) {
+		cache_release( entry );
+		return NULL;
+	}
+	return entry;
+}
+
+
+// Reads in the admitted files queued by cache_get(), one at a time, for as long as the server runs.
+static void *loader( void *argument )
+{
+	(void)argument;
+	for( ;; ) {
+		struct pending_load *load;
+		struct cache_entry *entry;
+
+		pthread_mutex_lock( &cache_lock );
+		while( loads_head == NULL ) {
+			pthread_cond_wait( &load_ready, &cache_lock );
+		}
+		load = loads_head;
+		if( (loads_head = load->next) == NULL ) {
+			loads_tail = NULL;
+		}
+		pthread_mutex_unlock( &cache_lock );
+
+		if( (entry = finish_load( load->entry, load->file, NULL )) != NULL ) {
+			cache_release( entry );
+		}
+		close( load->file );
+		free( load );
+		pthread_mutex_lock( &cache_lock );
+		loads_pending--;
+		pthread_mutex_unlock( &cache_lock );
+	}
+	return NULL;
+}
+
+
+// Hands an entry from add() to the loader, with a duplicate of file since the request's own is closed when its
+// transfer ends. If it cannot be queued the entry is dropped. The caller holds cache_lock.
+static void queue_load( struct cache_entry *entry, int file )
+{
+	struct pending_load *load = malloc( sizeof(*load) );
+
+	if( load == NULL || (load->file = fcntl( file, F_DUPFD_CLOEXEC, 0 )) == -1 ) {
+		free( load );
+		if( !entry->evicted ) {
+			tinylfu_remove( &policy, &entry->policy );
+			unindex( entry );
+		}
+		// Nobody else has a reference to an entry still loading.
+		entry->references = 0;
+		entry_free( entry );
+		return;
+	}
+	load->entry = entry;
+	load->next = NULL;
+	if( loads_tail != NULL ) {
+		loads_tail->next = load;
+	}
+	else {
+		loads_head = load;
+	}
+	loads_tail = load;
+	loads_pending++;
+	pthread_cond_signal( &load_ready );
+}
+
+
+//! Returns the cached contents of the open regular file, with a reference the caller gives back with
+//! cache_release(); or NULL if they are not in the cache (or there is none). A miss the policy admits is queued
+//! for the loader, and this request reads the file itself.
+struct cache_entry *cache_get( int file )
+{
+	struct cache_identity identity;
+	struct cache_entry *entry;
+	struct stat status;
+	uint64_t hash;
+
+	if( cache_capacity == 0 || fstat( file, &status ) == -1 || !S_ISREG( status.st_mode ) || status.st_size == 0 ) {
+		return NULL;
+	}
+	identity_from_stat( &identity, &status );
+	hash = identity_hash( &identity );
+
+	pthread_mutex_lock( &cache_lock );
+	tinylfu_record( &policy, hash );
+	entry = find( &identity, hash );
+	if( entry != NULL && !entry->loading ) {
+		tinylfu_touch( &policy, &entry->policy );
+		entry->references++;
+		pthread_mutex_unlock( &cache_lock );
+		STATS_INC( cache.hits );
+		STATS_ADD( cache.hit_bytes, (unsigned long)status.st_size );
+		return entry;
+	}
+	STATS_INC( cache.misses );
+	STATS_ADD( cache.miss_bytes, (unsigned long)status.st_size );
+	// Requests for the file read it themselves until it is in, this one included.
+	if( entry == NULL && loads_pending < CACHE_PENDING && (entry = add( &identity, hash, TINYLFU_NONE )) != NULL ) {
+		queue_load( entry, file );
+	}
+	pthread_mutex_unlock( &cache_lock );
+	return NULL;
+}
+
+
+//! Gives back a reference from cache_get(). entry may be NULL.
+void cache_release( struct cache_entry *entry )
+{
+	int last;
+
+	if( entry == NULL ) {
+		return;
+	}
+	pthread_mutex_lock( &cache_lock );
+	last = --entry->references == 0 && entry->evicted;
+	pthread_mutex_unlock( &cache_lock );
+	if( last ) {
+		entry_free( entry );
+	}
+}
+
+
+//! Returns the length the open file will have once translated to netascii (see netascii_size()), measuring it
+//! only if the cache has not seen this version of the file before.
+off_t cache_netascii_size( int file )
+{
+	struct cache_identity identity;
+	struct known_size *slot;
+	struct stat status;
+	off_t size = -1;
+
+	if( cache_capacity == 0 || fstat( file, &status ) == -1 ) {
+		return netascii_size( file );
+	}
+	identity_from_stat( &identity, &status );
+	slot = &known[identity_hash( &identity ) & (CACHE_KNOWN - 1)];
+
+	pthread_mutex_lock( &cache_lock );
+	if( slot->netascii_size >= 0 && identity_equal( &slot->identity, &identity ) ) {
+		size = slot->netascii_size;
+	}
+	pthread_mutex_unlock( &cache_lock );
+	if( size >= 0 ) {
+		STATS_INC( cache.netascii_hits );
+		return size;
+	}
+
+	if( (size = netascii_size( file )) >= 0 ) {
+		pthread_mutex_lock( &cache_lock );
+		slot->identity = identity;
+		slot->netascii_size = size;
+		pthread_mutex_unlock( &cache_lock );
+	}
+	return size;
+}
+
+
+// Fills in the record of a cached entry. The caller holds cache_lock.
+static void record_entry( struct cache_record *record, const struct cache_entry *entry, char *paths,
+                          uint64_t *paths_length )
+{
+	const struct known_size *slot = &known[entry->policy.hash & (CACHE_KNOWN - 1)];
+
+	memset( record, 0, sizeof(*record) );
+	record->identity = entry->identity;
+	record->netascii_size = slot->netascii_size >= 0 && identity_equal( &slot->identity, &entry->identity )
+	                      ? slot->netascii_size : -1;
+	record->segment = entry->policy.segment;
+	record->path = UINT32_MAX;
+	if( entry->path != NULL ) {
+		size_t length = strlen( entry->path ) + 1;
+
+		memcpy( paths + *paths_length, entry->path, length );
+		record->path = (uint32_t)*paths_length;
+		*paths_length += length;
+	}
+}
+
+
+static void free_snapshot_copy( struct snapshot_copy *copy )
+{
+	free( copy->file_name );
+	free( copy->records );
+	free( copy->paths );
+	free( copy->sketch );
+	free( copy );
+}
+
+
+static int write_all( int file, const void *data, size_t length )
+{
+	const char *next = data;
+
+	while( length > 0 ) {
+		ssize_t count = write( file, next, length );
+
+		if( count == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		next += count;
+		length -= (size_t)count;
+	}
+	return 0;
+}
+
+
+// Takes a copy of what the cache knows, to be written to file_name. Returns it, or NULL with errno set.
+static struct snapshot_copy *copy_snapshot( const char *file_name )
+{
+	struct snapshot_copy *copy = calloc( 1, sizeof(*copy) );
+	uint64_t paths_length = 0;
+	size_t count = 0;
+
+	if( copy == NULL || (copy->file_name = strdup( file_name )) == NULL ) {
+		free( copy );
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_lock( &cache_lock );
+	copy->sketch_length = TINYLFU_SKETCH_ROWS * policy.width;
+	for( int segment = TINYLFU_WINDOW; segment < TINYLFU_SEGMENTS; ++segment ) {
+		for( struct tinylfu_entry *entry = policy.segments[segment].tail; entry != NULL; entry = entry->prev ) {
+			const struct cache_entry *cached = (const struct cache_entry *)entry;
+
+			paths_length += cached->path != NULL ? strlen( cached->path ) + 1 : 0;
+			count++;
+		}
+	}
+	for( size_t i = 0; i < CACHE_KNOWN; ++i ) {
+		count += known[i].netascii_size >= 0;
+	}
+	copy->records = malloc( (count != 0 ? count : 1) * sizeof(*copy->records) );
+	copy->paths = malloc( paths_length != 0 ? paths_length : 1 );
+	copy->sketch = malloc( copy->sketch_length );
+	if( copy->records == NULL || copy->paths == NULL || copy->sketch == NULL ) {
+		pthread_mutex_unlock( &cache_lock );
+		free_snapshot_copy( copy );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Least recently used first in each segment, so that a restore placing them in order ends up the same.
+	count = 0;
+	paths_length = 0;
+	for( int segment = TINYLFU_WINDOW; segment < TINYLFU_SEGMENTS; ++segment ) {
+		for( struct tinylfu_entry *entry = policy.segments[segment].tail; entry != NULL; entry = entry->prev ) {
+			record_entry( &copy->records[count++], (const struct cache_entry *)entry, copy->paths, &paths_length );
+		}
+	}
+	for( size_t i = 0; i < CACHE_KNOWN; ++i ) {
+		if( known[i].netascii_size >= 0 ) {
+			struct cache_record *record = &copy->records[count++];
+
+			memset( record, 0, sizeof(*record) );
+			record->identity = known[i].identity;
+			record->netascii_size = known[i].netascii_size;
+			record->path = UINT32_MAX;
+			record->segment = TINYLFU_NONE;
+		}
+	}
+	memcpy( copy->sketch, policy.sketch, copy->sketch_length );
+	copy->header.sketch_width = (uint32_t)policy.width;
+	pthread_mutex_unlock( &cache_lock );
+
+	memcpy( copy->header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(copy->header.magic) );
+	copy->header.record_count = (uint32_t)count;
+	copy->header.paths_length = paths_length;
+	return copy;
+}
+
+
+// Writes a copy to its file, by way of a new file renamed over it, and frees it. Returns 0, or -1 with errno set.
+static int write_snapshot( struct snapshot_copy *copy )
+{
+	char new_name[PATH_MAX];
+	int file;
+	int result;
+
+	// A save at shutdown waits for one still being written in the background, which has the same new_name.
+	pthread_mutex_lock( &save_lock );
+	snprintf( new_name, sizeof(new_name), "%s.new", copy->file_name );
+	if( (file = open( new_name, O_WRONLY | O_CREAT | O_TRUNC, 0644 )) == -1 ) {
+		result = -1;
+	}
+	else {
+		result = write_all( file, &copy->header, sizeof(copy->header) ) == -1 ||
+		         write_all( file, copy->records, copy->header.record_count * sizeof(*copy->records) ) == -1 ||
+		         write_all( file, copy->sketch, copy->sketch_length ) == -1 ||
+		         write_all( file, copy->paths, copy->header.paths_length ) == -1 || fsync( file ) == -1 ? -1 : 0;
+		close( file );
+		if( result == 0 && rename( new_name, copy->file_name ) == -1 ) {
+			result = -1;
+		}
+		if( result == -1 ) {
+			int error = errno;
+
+			unlink( new_name );
+			errno = error;
+		}
+	}
+	pthread_mutex_unlock( &save_lock );
+	free_snapshot_copy( copy );
+	return result;
+}
+
+
+// Writes a copy from cache_save_background(); runs on a thread of its own.
+static void *write_in_background( void *argument )
+{
+	struct snapshot_copy *copy = argument;
+	char file_name[PATH_MAX];
+
+	snprintf( file_name, sizeof(file_name), "%s", copy->file_name );
+	if( write_snapshot( copy ) == -1 ) {
+		fprintf( stderr, "Unable to save cache snapshot %s: %s\n", file_name, strerror( errno ) );
+	}
+	atomic_store( &saving, 0 );
+	return NULL;
+}
+
+
+//! Writes what the cache knows to the snapshot file_name, by way of a new file renamed over it. Returns 0, or -1
+//! with errno set.
+int cache_save( const char *file_name )
+{
+	struct snapshot_copy *copy = copy_snapshot( file_name );
+
+	return copy != NULL ? write_snapshot( copy ) : -1;
+}
+
+
+//! Like cache_save(), but only the copy is taken on the calling thread; the file is written, flushed and renamed
+//! on a thread of its own, which reports its own errors. A save still being written is left to finish, and this
+//! one skipped. Returns 0, or -1 with errno set if the copy could not be taken or handed over.
+int cache_save_background( const char *file_name )
+{
+	struct snapshot_copy *copy;
+
+	if( atomic_exchange( &saving, 1 ) ) {
+		return 0;
+	}
+	if( (copy = copy_snapshot( file_name )) == NULL ) {
+		atomic_store( &saving, 0 );
+		return -1;
+	}
+	if( start_thread( write_in_background, copy ) == -1 ) {
+		int error = errno;
+
+		free_snapshot_copy( copy );
+		atomic_store( &saving, 0 );
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+
+// Loads the files that were cached back into their segments, for as long as they are what they were; runs on a
+// thread of its own.
+static void *warm( void *argument )
+{
+	struct snapshot *snapshot = argument;
+
+	for( uint32_t i = 0; i < snapshot->record_count; ++i ) {
+		const struct cache_record *record = &snapshot->records[i];
+		struct cache_identity identity;
+		struct cache_entry *entry = NULL;
+		struct stat status;
+		uint64_t hash;
+		int file;
+
+		if( record->segment == TINYLFU_NONE || record->segment >= TINYLFU_SEGMENTS ||
+		    record->path >= snapshot->paths_length ||
+		    (file = open( snapshot->paths + record->path, O_RDONLY )) == -1 ) {
+			continue;
+		}
+		if( fstat( file, &status ) == 0 && S_ISREG( status.st_mode ) ) {
+			identity_from_stat( &identity, &status );
+			hash = identity_hash( &identity );
+			if( identity_equal( &identity, &record->identity ) ) {
+				pthread_mutex_lock( &cache_lock );
+				if( find( &identity, hash ) == NULL ) {
+					entry = add( &identity, hash, (enum tinylfu_segment)record->segment );
+				}
+				pthread_mutex_unlock( &cache_lock );
+			}
+		}
+		if( entry != NULL && (entry = finish_load( entry, file, snapshot->paths + record->path )) != NULL ) {
+			STATS_INC( cache.warmed );
+			cache_release( entry );
+		}
+		close( file );
+	}
+	munmap( snapshot->map, snapshot->length );
+	free( snapshot );
+	return NULL;
+}
+
+
+//! Picks up the snapshot file_name: the sketch and the netascii sizes right away, the cached files on a thread
+//! of their own. A missing snapshot is a cold start. Returns 0, or -1 with errno set if it could not be used.
+int cache_restore( const char *file_name )
+{
+	const struct cache_snapshot_header *header;
+	struct snapshot *snapshot;
+	struct stat status;
+	size_t sketch_length;
+	const uint8_t *sketch;
+	int warm_count = 0;
+	void *map;
+	int file;
+
+	if( (file = open( file_name, O_RDONLY )) == -1 ) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if( fstat( file, &status ) == -1 ) {
+		map = MAP_FAILED;
+	}
+	else if( (size_t)status.st_size < sizeof(*header) ) {
+		errno = EINVAL;
+		map = MAP_FAILED;
+	}
+	else {
+		map = mmap( NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+	}
+	close( file );
+	if( map == MAP_FAILED ) {
+		return -1;
+	}
+
+	// Everything must be where the header says, and the paths must end in a NUL.
+	header = map;
+	sketch_length = TINYLFU_SKETCH_ROWS * (size_t)header->sketch_width;
+	if( memcmp( header->magic, CACHE_SNAPSHOT_MAGIC, sizeof(header->magic) ) != 0 ||
+	    sizeof(*header) + (uint64_t)header->record_count * sizeof(struct cache_record) + sketch_length +
+	    header->paths_length != (uint64_t)status.st_size ||
+	    (header->paths_length != 0 && ((const char *)map)[status.st_size - 1] != '\0') ||
+	    (snapshot = malloc( sizeof(*snapshot) )) == NULL ) {
+		munmap( map, (size_t)status.st_size );
+		errno = EINVAL;
+		return -1;
+	}
+	snapshot->map = map;
+	snapshot->length = (size_t)status.st_size;
+	snapshot->records = (const struct cache_record *)(header + 1);
+	snapshot->record_count = header->record_count;
+	sketch = (const uint8_t *)(snapshot->records + snapshot->record_count);
+	snapshot->paths = (const char *)(sketch + sketch_length);
+	snapshot->paths_length = header->paths_length;
+
+	pthread_mutex_lock( &cache_lock );
+	if( header->sketch_width == policy.width ) {
+		memcpy( policy.sketch, sketch, sketch_length );
+	}
+	for( uint32_t i = 0; i < snapshot->record_count; ++i ) {
+		const struct cache_record *record = &snapshot->records[i];
+
+		if( record->netascii_size >= 0 ) {
+			struct known_size *slot = &known[identity_hash( &record->identity ) & (CACHE_KNOWN - 1)];
+
+			slot->identity = record->identity;
+			slot->netascii_size = (off_t)record->netascii_size;
+		}
+		warm_count += record->segment != TINYLFU_NONE;
+	}
+	pthread_mutex_unlock( &cache_lock );
+
+	if( warm_count != 0 && start_thread( warm, snapshot ) == 0 ) {
+		return 0;
+	}
+	munmap( snapshot->map, snapshot->length );
+	free( snapshot );
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*!
+ * \file cache.h
+ * \brief Contents of popular files kept in memory for -m event (-C megabytes).
+ *
+ * With -C N, an octet transfer of a file the cache holds copies its blocks
+ * out of memory instead of reading the file. The cache knows a file by its
+ * device, inode, modification time and size, so a file that is replaced or
+ * changed on disk is simply a new entry, and the old one ages out.
+ *
+ * What is kept is decided by a size-aware W-TinyLFU policy (tinylfu.h)
+ * rather than by recency alone: under LRU, every download of a large image
+ * flushes out the boot files that a room of clients asks for a minute
+ * later. A file the policy admits is read in whole by a loader thread of
+ * the cache's own, never by the event loop or an acceptor: the request that
+ * let it in, and any others until it is in, are served from the file as if
+ * it were not cached. The policy only lets in files that are asked for
+ * often enough to pay that back, and none larger than a CACHE_ENTRY_SHARE-th
+ * of the capacity, so one image cannot take the place of everything else.
+ * cachesim replays the server's request log against both policies to
+ * compare them for a given capacity.
+ *
+ * Entries in use by a session stay in memory until it is done with them,
+ * even if they have been evicted in the meantime. SIGUSR1 prints the hit
+ * ratio, by requests and by bytes, along with admissions and evictions.
+ *
+ * The cache also remembers the translated size of netascii files, which
+ * otherwise means reading the whole file for every tsize request. With -S,
+ * what the cache knows is saved to a snapshot file every
+ * CACHE_SNAPSHOT_SECONDS, by a thread of its own so that the loop does not
+ * wait for the disk, and when the server is stopped: the sketch of
+ * recent requests, and a record for each cached file (its identity, path
+ * and segment) and each known netascii size. The snapshot is laid out to be
+ * used straight from mmap(): a header, the fixed-size records, the sketch,
+ * then the paths.
+ *
+ * Restoring it at startup costs no file I/O: the sketch picks up where it
+ * left off, and netascii sizes are only used once a file opened for a
+ * request turns out to have the identity they were recorded for, so a file
+ * that changed while the server was down is measured again. A thread then
+ * reopens the files that were cached, in the background, and loads each
+ * one whose identity still matches back into the segment it was in.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "tinylfu.h"
+
+#define CACHE_BUCKETS      4096   // Index hash chains; a power of two.
+#define CACHE_MEAN_ENTRY   65536  // Bytes per entry assumed when sizing the sketch.
+#define CACHE_KNOWN        16384  // Netascii sizes remembered; a power of two.
+#define CACHE_ENTRY_SHARE  8      // No file larger than the capacity / CACHE_ENTRY_SHARE is cached.
+#define CACHE_PENDING      64     // Most admitted files waiting for the loader; others stay out for now.
+#define CACHE_SNAPSHOT_SECONDS 300
+#define CACHE_SNAPSHOT_MAGIC   "TFTPCIX1"
+
+// Which version of which file: all the cache knows a file by.
+struct cache_identity {
+	uint64_t device;
+	uint64_t inode;
+	int64_t modified_sec;
+	int64_t modified_nsec;
+	int64_t size;
+};
+
+struct cache_entry {
+	struct tinylfu_entry policy;  // First: the policy hands these back.
+	struct cache_identity identity;
+	char *path;                   // Where it was opened, for the snapshot; NULL if unknown.
+	int loading;                  // Being read in; not served until it is done.
+	int evicted;                  // Out of the index; freed with its last reference.
+	unsigned references;
+	struct cache_entry *next;     // In its index bucket.
+	unsigned char *data;          // policy.size bytes.
+};
+
+struct cache_stats {
+	atomic_ulong hits;
+	atomic_ulong misses;
+	atomic_ulong hit_bytes;   // File sizes of the hits and misses, for the byte hit ratio.
+	atomic_ulong miss_bytes;
+	atomic_ulong admitted;
+	atomic_ulong rejected;    // Misses the policy did not let in.
+	atomic_ulong evicted;
+	atomic_ulong bytes;       // Held by entries in the index.
+	atomic_ulong netascii_hits;  // Netascii sizes that did not have to be measured.
+	atomic_ulong warmed;      // Files loaded back from the snapshot.
+};
+
+// The snapshot file. Records and the sketch follow the header; the paths, each ending in NUL, come last.
+struct cache_snapshot_header {
+	char magic[8];            // CACHE_SNAPSHOT_MAGIC, without its NUL.
+	uint32_t record_count;
+	uint32_t sketch_width;    // Counters per row; the sketch is left out of a restore if it does not match.
+	uint64_t paths_length;
+	uint64_t reserved;
+};
+
+struct cache_record {
+	struct cache_identity identity;
+	int64_t netascii_size;    // -1 if not known.
+	uint32_t path;            // Offset into the paths; UINT32_MAX for none.
+	uint8_t segment;          // enum tinylfu_segment of a cached file; TINYLFU_NONE for a netascii size only.
+	uint8_t reserved[3];
+};
+
+// The policy and admission limit of a cache of capacity bytes, shared with cachesim so that it admits what the
+// server would.
+static inline int cache_policy_init( struct tinylfu *policy, size_t capacity )
+{
+	return tinylfu_init( policy, capacity, capacity / CACHE_MEAN_ENTRY );
+}
+
+
+static inline int cache_fits( size_t capacity, uint64_t size )
+{
+	return size <= capacity / CACHE_ENTRY_SHARE;
+}
+
+
+int  cache_init( size_t capacity );
+struct cache_entry *cache_get( int file );
+void cache_release( struct cache_entry *entry );
+off_t cache_netascii_size( int file );
+int  cache_save( const char *file_name );
+int  cache_save_background( const char *file_name );
+int  cache_restore( const char *file_name );
+
+#endif
@@ -0,0 +1,275 @@
+/*!
+ * \file cachesim.c
+ * \brief Trace-driven comparison of the content cache's W-TinyLFU policy with plain LRU.
+ *
+ * Usage: ./cachesim [-C megabytes] [directory] < trace
+ *
+ * The trace is the server's own output: every line of the form
+ *
+ *     file "pxelinux.0" requested from 192.0.2.7:2070
+ *
+ * is a request, and the size of the file is looked up under directory as it
+ * is now. Lines of the form "size name" (a size in bytes, a space, and the
+ * name) are requests for a file of that size, for traces that were recorded
+ * elsewhere; other lines are skipped. Each request is replayed against a
+ * W-TinyLFU cache (tinylfu.h, sized and capped as -C sizes it) and an LRU
+ * cache of the same capacity, both in bytes, and the result is one line per
+ * policy:
+ *
+ *     policy=wtinylfu capacity_mb=64 requests=... hit_ratio=... byte_hit_ratio=...
+ *     policy=lru capacity_mb=64 requests=... hit_ratio=... byte_hit_ratio=...
+ *
+ * A miss either policy admits is in the cache from the next request on. The
+ * server's loader thread takes a while to read an admitted file, and the
+ * requests that come in meanwhile read the file as misses, so a burst of
+ * requests for a new file scores better here than it does in the server.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "packet.h"
+#include "tinylfu.h"
+
+#define SIM_FILES 65536  // Distinct names the replay can tell apart; a power of two.
+
+// A file in the trace, and its place in both caches.
+struct sim_file {
+	char *name;  // NULL if the slot is free.
+	struct tinylfu_entry policy;
+	int in_lru;
+	struct sim_file *lru_prev;  // Towards the most recently used end.
+	struct sim_file *lru_next;
+};
+
+struct sim_result {
+	unsigned long hits;
+	unsigned long long hit_bytes;
+};
+
+static struct sim_file files[SIM_FILES];
+static size_t file_count;
+static struct sim_file *lru_head;
+static struct sim_file *lru_tail;
+static size_t lru_bytes;
+
+
+// FNV-1a.
+static uint64_t name_hash( const char *name )
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while( *name != '\0' ) {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+// Returns the file called name, adding it with size if it is new; NULL once the table is full.
+static struct sim_file *file_for( const char *name, size_t size )
+{
+	uint64_t hash = name_hash( name );
+	size_t slot = (size_t)hash & (SIM_FILES - 1);
+
+	while( files[slot].name != NULL ) {
+		if( files[slot].policy.hash == hash && strcmp( files[slot].name, name ) == 0 ) {
+			return &files[slot];
+		}
+		slot = (slot + 1) & (SIM_FILES - 1);
+	}
+	if( file_count == SIM_FILES - 1 || (files[slot].name = strdup( name )) == NULL ) {
+		return NULL;
+	}
+	files[slot].policy.hash = hash;
+	files[slot].policy.size = size;
+	file_count++;
+	return &files[slot];
+}
+
+
+// The policy's entries need no freeing here: one that is evicted is just out of the cache.
+static void evict( struct tinylfu_entry *entry, void *context )
+{
+	(void)entry;
+	(void)context;
+}
+
+
+static void lru_unlink( struct sim_file *file )
+{
+	if( file->lru_prev != NULL ) {
+		file->lru_prev->lru_next = file->lru_next;
+	}
+	else {
+		lru_head = file->lru_next;
+	}
+	if( file->lru_next != NULL ) {
+		file->lru_next->lru_prev = file->lru_prev;
+	}
+	else {
+		lru_tail = file->lru_prev;
+	}
+	file->in_lru = 0;
+	lru_bytes -= file->policy.size;
+}
+
+
+// Replays one request against LRU. Returns 1 on a hit.
+static int lru_request( struct sim_file *file, size_t capacity )
+{
+	int hit = file->in_lru;
+
+	if( hit ) {
+		lru_unlink( file );
+	}
+	else if( file->policy.size > capacity ) {
+		return 0;
+	}
+	file->in_lru = 1;
+	file->lru_prev = NULL;
+	file->lru_next = lru_head;
+	if( lru_head != NULL ) {
+		lru_head->lru_prev = file;
+	}
+	else {
+		lru_tail = file;
+	}
+	lru_head = file;
+	lru_bytes += file->policy.size;
+	while( lru_bytes > capacity ) {
+		lru_unlink( lru_tail );
+	}
+	return hit;
+}
+
+
+// Replays one request against W-TinyLFU, the way cache_get() drives it. Returns 1 on a hit.
+static int tinylfu_request( struct tinylfu *policy, struct sim_file *file )
+{
+	tinylfu_record( policy, file->policy.hash );
+	if( file->policy.segment != TINYLFU_NONE ) {
+		tinylfu_touch( policy, &file->policy );
+		return 1;
+	}
+	if( cache_fits( policy->capacity, file->policy.size ) ) {
+		tinylfu_insert( policy, &file->policy, evict, NULL );
+	}
+	return 0;
+}
+
+
+// Picks the request out of a line of the trace. Returns 0 with name and size filled in, or -1 to skip the line.
+static int parse_line( char *line, const char *directory, char *name, size_t *size )
+{
+	char *start = strstr( line, "file \"" );
+	char *end = strstr( line, "\" requested from " );
+	unsigned long long bytes;
+	int length;
+
+	if( start != NULL && end != NULL && end > start + 6 ) {
+		char path[4096];
+		struct stat status;
+
+		*end = '\0';
+		snprintf( name, TFTP_MAX_REQUEST, "%s", start + 6 );
+		snprintf( path, sizeof(path), "%s/%s", directory, name );
+		if( stat( path, &status ) == -1 || !S_ISREG( status.st_mode ) ) {
+			return -1;
+		}
+		*size = (size_t)status.st_size;
+		return 0;
+	}
+	if( sscanf( line, "%llu %n", &bytes, &length ) == 1 && line[length] != '\0' ) {
+		line[strcspn( line, "\r\n" )] = '\0';
+		snprintf( name, TFTP_MAX_REQUEST, "%s", line + length );
+		*size = (size_t)bytes;
+		return 0;
+	}
+	return -1;
+}
+
+
+static void report( const char *name, unsigned long megabytes, unsigned long requests, unsigned long long bytes,
+                    const struct sim_result *result )
+{
+	printf( "policy=%s capacity_mb=%lu requests=%lu hit_ratio=%.4f byte_hit_ratio=%.4f\n", name, megabytes, requests,
+	        requests != 0 ? (double)result->hits / (double)requests : 0.0,
+	        bytes != 0 ? (double)result->hit_bytes / (double)bytes : 0.0 );
+}
+
+
+static void usage( const char *program )
+{
+	fprintf( stderr, "Usage: %s [-C megabytes] [directory] < trace\n", program );
+}
+
+
+int main( int argc, char **argv )
+{
+	unsigned long megabytes = 64;
+	const char *directory = ".";
+	struct tinylfu policy;
+	struct sim_result tinylfu_result = { 0, 0 };
+	struct sim_result lru_result = { 0, 0 };
+	unsigned long requests = 0;
+	unsigned long long bytes = 0;
+	char line[4096];
+	size_t capacity;
+	int option;
+
+	while( (option = getopt( argc, argv, "C:" )) != -1 ) {
+		switch( option ) {
+		case 'C':
+			megabytes = strtoul( optarg, NULL, 10 );
+			break;
+		default:
+			usage( argv[0] );
+			return EXIT_FAILURE;
+		}
+	}
+	if( argc - optind > 1 || megabytes == 0 ) {
+		usage( argv[0] );
+		return EXIT_FAILURE;
+	}
+	if( optind < argc ) {
+		directory = argv[optind];
+	}
+	capacity = (size_t)megabytes << 20;
+	if( cache_policy_init( &policy, capacity ) == -1 ) {
+		perror( "Unable to allocate the sketch" );
+		return EXIT_FAILURE;
+	}
+
+	while( fgets( line, sizeof(line), stdin ) != NULL ) {
+		char name[TFTP_MAX_REQUEST];
+		struct sim_file *file;
+		size_t size;
+
+		if( parse_line( line, directory, name, &size ) == -1 || size == 0 || (file = file_for( name, size )) == NULL ) {
+			continue;
+		}
+		requests++;
+		bytes += file->policy.size;
+		if( tinylfu_request( &policy, file ) ) {
+			tinylfu_result.hits++;
+			tinylfu_result.hit_bytes += file->policy.size;
+		}
+		if( lru_request( file, capacity ) ) {
+			lru_result.hits++;
+			lru_result.hit_bytes += file->policy.size;
+		}
+	}
+
+	report( "wtinylfu", megabytes, requests, bytes, &tinylfu_result );
+	report( "lru", megabytes, requests, bytes, &lru_result );
+	tinylfu_destroy( &policy );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*!
+ * \file classifier.c
+ * \brief Loading the class file and matching clients against it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "classifier.h"
+#include "prefix_trie.h"
+
+static struct prefix_trie classes;
+static int loaded;
+
+
+//! Reads the class file at path. Returns 0, or -1 after reporting the problem on stderr.
+int classifier_load( const char *path, const char *default_root )
+{
+	char line[1024];
+	unsigned line_number = 0;
+	FILE *file;
+
+	if( (file = fopen( path, "r" )) == NULL ) {
+		fprintf( stderr, "Unable to open class file %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+	if( !loaded ) {
+		if( prefix_trie_init( &classes ) == -1 ) {
+			fclose( file );
+			return -1;
+		}
+		loaded = 1;
+	}
+
+	while( fgets( line, sizeof(line), file ) != NULL ) {
+		char *copy;
+		char *field;
+		char *save;
+		struct policy *policy;
+		uint8_t address[16];
+		unsigned length;
+		int family;
+
+		++line_number;
+		if( (field = strtok_r( line, " \t\r\n", &save )) == NULL || field[0] == '#' ) {
+			continue;
+		}
+		if( prefix_parse( field, &family, address, &length ) == -1 ) {
+			fprintf( stderr, "%s:%u: bad prefix \"%s\"\n", path, line_number, field );
+			fclose( file );
+			return -1;
+		}
+		if( (policy = policy_create( default_root )) == NULL ) {
+			fclose( file );
+			return -1;
+		}
+
+		// Settings keep pointers to their values (root=), so they need storage that outlives the line.
+		while( (field = strtok_r( NULL, " \t\r\n", &save )) != NULL ) {
+			if( (copy = strdup( field )) == NULL || policy_set( policy, copy ) == -1 ) {
+				fprintf( stderr, "%s:%u: bad setting \"%s\"\n", path, line_number, field );
+				free( copy );
+				fclose( file );
+				return -1;
+			}
+		}
+
+		if( policy_open_root( policy ) == -1 ) {
+			fprintf( stderr, "%s:%u: unable to open %s: %s\n", path, line_number, policy_source( policy ),
+			         strerror( errno ) );
+			fclose( file );
+			return -1;
+		}
+		if( prefix_trie_insert( &classes, family, address, length, policy ) == -1 ) {
+			fclose( file );
+			return -1;
+		}
+	}
+
+	fclose( file );
+	return 0;
+}
+
+
+//! Returns the policy of the most specific class containing the client, or NULL if none does.
+struct policy *classifier_lookup( const client_key *key )
+{
+	if( !loaded ) {
+		return NULL;
+	}
+	return prefix_trie_lookup( &classes, key );
+}
@@ -0,0 +1,25 @@
+/*!
+ * \file classifier.h
+ * \brief Client classes: per source-prefix policies that override the listener's.
+ *
+ * A class file has one class per line: a prefix followed by policy settings,
+ *
+ *     10.20.0.0/16     root=/srv/tftp/phones blksize=1428 rate=2000000
+ *     2001:db8::/32    windowsize=16 max=50
+ *
+ * Blank lines and lines starting with '#' are ignored. Settings a class does
+ * not give take the server defaults (the directory from the command line and
+ * no limits). The prefixes are compiled into a prefix_trie, so the one lookup
+ * made per request is a longest-prefix match whatever the number of classes.
+ */
+
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include "addrkey.h"
+#include "policy.h"
+
+int classifier_load( const char *path, const char *default_root );
+struct policy *classifier_lookup( const client_key *key );
+
+#endif
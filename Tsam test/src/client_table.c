@@ -0,0 +1,132 @@
+/*!
+ * \file client_table.c
+ * \brief Linear-probing hash table keyed by client_key.
+ *
+ * Deletion uses backward shifting instead of tombstones so that probe
+ * sequences stay short however many transfers come and go.
+ */
+
+#include <stdlib.h>
+
+#include "client_table.h"
+
+// Keep the load factor at or below 3/4.
+#define MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+
+int client_table_init( struct client_table *table, size_t capacity )
+{
+	size_t size = 16;
+
+	// Round up so that MAX_LOAD(size) >= capacity.
+	while( MAX_LOAD( size ) < capacity ) {
+		size *= 2;
+	}
+
+	table->entries = calloc( size, sizeof(struct client_entry) );
+	if( table->entries == NULL ) {
+		return -1;
+	}
+	table->capacity = size;
+	table->count = 0;
+	return 0;
+}
+
+
+void client_table_destroy( struct client_table *table )
+{
+	free( table->entries );
+	table->entries = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}
+
+
+struct client_entry *client_table_find( struct client_table *table, const client_key *key )
+{
+	size_t mask = table->capacity - 1;
+	size_t slot = client_key_hash( key ) & mask;
+
+	while( table->entries[slot].used ) {
+		if( client_key_equal( &table->entries[slot].key, key ) ) {
+			return &table->entries[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+
+//! Adds or updates key. Returns 0 on success, -1 if the table is full.
+int client_table_insert( struct client_table *table, const client_key *key, int owner, int group )
+{
+	size_t mask = table->capacity - 1;
+	size_t slot = client_key_hash( key ) & mask;
+
+	while( table->entries[slot].used ) {
+		if( client_key_equal( &table->entries[slot].key, key ) ) {
+			table->entries[slot].owner = owner;
+			table->entries[slot].group = group;
+			return 0;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if( table->count >= MAX_LOAD( table->capacity ) ) {
+		return -1;
+	}
+	table->entries[slot].key = *key;
+	table->entries[slot].owner = owner;
+	table->entries[slot].group = group;
+	table->entries[slot].used = 1;
+	table->count++;
+	return 0;
+}
+
+
+// Empties slot and pulls later members of its probe chain back into the gap.
+static void remove_slot( struct client_table *table, size_t slot )
+{
+	size_t mask = table->capacity - 1;
+	size_t next = (slot + 1) & mask;
+
+	while( table->entries[next].used ) {
+		size_t home = client_key_hash( &table->entries[next].key ) & mask;
+
+		// Move the entry back if its home slot does not lie in (slot, next].
+		if( ((next - home) & mask) >= ((next - slot) & mask) ) {
+			table->entries[slot] = table->entries[next];
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+	table->entries[slot].used = 0;
+	table->count--;
+}
+
+
+//! Removes key. Returns 0 if it was present, -1 otherwise.
+int client_table_remove( struct client_table *table, const client_key *key )
+{
+	struct client_entry *entry = client_table_find( table, key );
+
+	if( entry == NULL ) {
+		return -1;
+	}
+	remove_slot( table, (size_t)(entry - table->entries) );
+	return 0;
+}
+
+
+//! Removes the entry owned by owner and reports its group. Linear in capacity; used when reaping children.
+int client_table_remove_owner( struct client_table *table, int owner, int *group )
+{
+	for( size_t slot = 0; slot < table->capacity; ++slot ) {
+		if( table->entries[slot].used && table->entries[slot].owner == owner ) {
+			*group = table->entries[slot].group;
+			remove_slot( table, slot );
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,38 @@
+/*!
+ * \file client_table.h
+ * \brief Open-addressing hash table from client keys to an owner id.
+ *
+ * The server uses it to remember which client endpoints already have a
+ * transfer running (and who is running it), so that a retransmitted request
+ * does not start a second transfer.
+ */
+
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include <stddef.h>
+
+#include "addrkey.h"
+
+struct client_entry {
+	client_key key;
+	int        owner;  // Process or session that serves this client.
+	int        group;  // Policy the transfer is charged to.
+	int        used;
+};
+
+struct client_table {
+	struct client_entry *entries;
+	size_t capacity;  // Always a power of two.
+	size_t count;
+};
+
+int  client_table_init( struct client_table *table, size_t capacity );
+void client_table_destroy( struct client_table *table );
+
+struct client_entry *client_table_find( struct client_table *table, const client_key *key );
+int  client_table_insert( struct client_table *table, const client_key *key, int owner, int group );
+int  client_table_remove( struct client_table *table, const client_key *key );
+int  client_table_remove_owner( struct client_table *table, int owner, int *group );
+
+#endif
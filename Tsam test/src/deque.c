@@ -0,0 +1,98 @@
+/*!
+ * \file deque.c
+ * \brief Chase-Lev work-stealing deque of pointers, with a fixed capacity.
+ */
+
+#include <stddef.h>
+
+#include "deque.h"
+
+#define MASK (DEQUE_SIZE - 1)
+
+
+void deque_init( struct deque *deque )
+{
+	atomic_init( &deque->top, 0 );
+	atomic_init( &deque->bottom, 0 );
+	for( size_t i = 0; i < DEQUE_SIZE; ++i ) {
+		atomic_init( &deque->items[i], NULL );
+	}
+}
+
+
+//! Owner only: adds item at the bottom. Returns 0, or -1 if the deque is full.
+int deque_push( struct deque *deque, void *item )
+{
+	long bottom = atomic_load_explicit( &deque->bottom, memory_order_relaxed );
+	long top = atomic_load_explicit( &deque->top, memory_order_acquire );
+
+	if( bottom - top >= DEQUE_SIZE ) {
+		return -1;
+	}
+	atomic_store_explicit( &deque->items[bottom & MASK], item, memory_order_relaxed );
+	// The item must be visible before a thief can see the new bottom.
+	atomic_thread_fence( memory_order_release );
+	atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+	return 0;
+}
+
+
+//! Owner only: takes the item pushed last. Returns NULL if the deque is empty or a thief took the last item.
+void *deque_pop( struct deque *deque )
+{
+	long bottom = atomic_load_explicit( &deque->bottom, memory_order_relaxed ) - 1;
+	long top;
+	void *item = NULL;
+
+	// Claim the bottom slot first, then look at top: a thief doing the opposite sees the claim.
+	atomic_store_explicit( &deque->bottom, bottom, memory_order_relaxed );
+	atomic_thread_fence( memory_order_seq_cst );
+	top = atomic_load_explicit( &deque->top, memory_order_relaxed );
+
+	if( top <= bottom ) {
+		item = atomic_load_explicit( &deque->items[bottom & MASK], memory_order_relaxed );
+		if( top == bottom ) {
+			// The last item: race any thief for it through top.
+			if( !atomic_compare_exchange_strong_explicit( &deque->top, &top, top + 1, memory_order_seq_cst,
+			                                              memory_order_relaxed ) ) {
+				item = NULL;
+			}
+			atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+		}
+	}
+	else {
+		atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+	}
+	return item;
+}
+
+
+//! Any thread: takes the oldest item. Returns NULL if the deque is empty or another thread got there first.
+void *deque_steal( struct deque *deque )
+{
+	long top = atomic_load_explicit( &deque->top, memory_order_acquire );
+	long bottom;
+	void *item;
+
+	atomic_thread_fence( memory_order_seq_cst );
+	bottom = atomic_load_explicit( &deque->bottom, memory_order_acquire );
+	if( top >= bottom ) {
+		return NULL;
+	}
+	item = atomic_load_explicit( &deque->items[top & MASK], memory_order_relaxed );
+	if( !atomic_compare_exchange_strong_explicit( &deque->top, &top, top + 1, memory_order_seq_cst,
+	                                              memory_order_relaxed ) ) {
+		return NULL;
+	}
+	return item;
+}
+
+
+//! Any thread: the number of items, which may already be out of date.
+long deque_size( struct deque *deque )
+{
+	long size = atomic_load_explicit( &deque->bottom, memory_order_relaxed ) -
+	            atomic_load_explicit( &deque->top, memory_order_relaxed );
+
+	return size > 0 ? size : 0;
+}
@@ -0,0 +1,32 @@
+/*!
+ * \file deque.h
+ * \brief Chase-Lev work-stealing deque of pointers, with a fixed capacity.
+ *
+ * One thread, the owner, pushes and pops at the bottom; any other thread may
+ * steal from the top. No side takes a lock: the owner only contends with
+ * thieves for the last item, and thieves with each other, through a
+ * compare-and-swap on top. This is the C11 version of the deque given by Le,
+ * Pop, Cohen and Zappa Nardelli ("Correct and efficient work-stealing for
+ * weak memory models", PPoPP 2013), without growing the array.
+ */
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+
+#define DEQUE_SIZE 64  // A power of two.
+
+struct deque {
+	_Alignas(64) atomic_long top;     // Next item to steal.
+	_Alignas(64) atomic_long bottom;  // Next free slot; written by the owner only.
+	_Atomic(void *) items[DEQUE_SIZE];
+};
+
+void  deque_init( struct deque *deque );
+int   deque_push( struct deque *deque, void *item );
+void *deque_pop( struct deque *deque );
+void *deque_steal( struct deque *deque );
+long  deque_size( struct deque *deque );
+
+#endif
@@ -0,0 +1,43 @@
+/*!
+ * \file flight.c
+ * \brief Printing a flight recorder.
+ */
+
+#include <stdlib.h>
+
+#include "flight.h"
+
+static const char *kind_names[] = {
+	"start", "send", "ack", "ignored_ack", "go_back", "timeout", "rto", "peer_error", "local_error", "stray"
+};
+
+
+//! Writes the heading and the recorded events, oldest first, in a single write so that dumps do not interleave.
+void flight_dump( const struct flight_recorder *recorder, FILE *stream, const char *heading )
+{
+	uint32_t first = recorder->count > FLIGHT_EVENTS ? recorder->count - FLIGHT_EVENTS : 0;
+	char *text = NULL;
+	size_t length = 0;
+	FILE *buffer = open_memstream( &text, &length );
+
+	// Without memory for the buffer, write piecemeal rather than not at all.
+	if( buffer == NULL ) {
+		buffer = stream;
+	}
+	fprintf( buffer, "%s (%u events, last %u shown)\n", heading, (unsigned)recorder->count,
+	         (unsigned)(recorder->count - first) );
+	for( uint32_t i = first; i < recorder->count; ++i ) {
+		const struct flight_event *event = &recorder->events[i & (FLIGHT_EVENTS - 1)];
+
+		fprintf( buffer, "  +%u.%06u %-11s block=%u value=%u\n", (unsigned)(event->time_us / 1000000),
+		         (unsigned)(event->time_us % 1000000), kind_names[event->kind], (unsigned)event->block,
+		         (unsigned)event->value );
+	}
+
+	if( buffer != stream ) {
+		fclose( buffer );
+		fwrite( text, 1, length, stream );
+		free( text );
+	}
+	fflush( stream );
+}
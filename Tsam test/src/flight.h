@@ -0,0 +1,80 @@
+/*!
+ * \file flight.h
+ * \brief A per-transfer flight recorder: the last events of a transfer, for post-mortems.
+ *
+ * Every transfer carries a ring of the last FLIGHT_EVENTS events (sends,
+ * ACKs, go-backs, timeouts, RTO changes, errors), stored inside struct
+ * transfer so that recording never allocates. A record is a clock read and
+ * four stores, cheap enough to leave on. The ring is thrown away when a
+ * transfer succeeds, printed to stderr when it fails, and printed for every
+ * running transfer on SIGUSR2.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define FLIGHT_EVENTS 64  // A power of two.
+
+enum flight_kind {
+	FLIGHT_START,        // block: windowsize, value: blksize.
+	FLIGHT_SEND,         // A DATA packet, or the OACK as block 0. value: datagram length.
+	FLIGHT_ACK,          // An ACK that moved the window; value: round-trip sample in microseconds, or 0.
+	FLIGHT_IGNORED_ACK,  // An ACK outside the window (block as sent, 16 bits).
+	FLIGHT_GO_BACK,      // Resending from block; value: blocks outstanding.
+	FLIGHT_TIMEOUT,      // No ACK for block in time; value: retries so far.
+	FLIGHT_RTO,          // New retransmission timeout; value: milliseconds.
+	FLIGHT_PEER_ERROR,   // The client sent ERROR; value: its error code.
+	FLIGHT_LOCAL_ERROR,  // The server gave up; value: the error code sent.
+	FLIGHT_STRAY         // A datagram from another address or port; value: its port.
+};
+
+struct flight_event {
+	uint32_t time_us;  // Since the transfer started.
+	uint32_t block;
+	uint32_t value;
+	uint8_t kind;
+};
+
+struct flight_recorder {
+	int64_t start_ns;
+	uint32_t count;  // Events ever recorded; the ring holds the last FLIGHT_EVENTS.
+	struct flight_event events[FLIGHT_EVENTS];
+};
+
+static inline int64_t flight_clock( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline void flight_start( struct flight_recorder *recorder )
+{
+	recorder->start_ns = flight_clock( );
+	recorder->count = 0;
+}
+
+static inline void flight_record_at( struct flight_recorder *recorder, int64_t now, enum flight_kind kind,
+                                     uint32_t block, uint32_t value )
+{
+	struct flight_event *event = &recorder->events[recorder->count++ & (FLIGHT_EVENTS - 1)];
+
+	event->time_us = (uint32_t)((now - recorder->start_ns) / 1000);
+	event->block = block;
+	event->value = value;
+	event->kind = (uint8_t)kind;
+}
+
+static inline void flight_record( struct flight_recorder *recorder, enum flight_kind kind, uint32_t block, uint32_t value )
+{
+	flight_record_at( recorder, flight_clock( ), kind, block, value );
+}
+
+void flight_dump( const struct flight_recorder *recorder, FILE *stream, const char *heading );
+
+#endif
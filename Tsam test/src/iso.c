@@ -0,0 +1,614 @@
+/*!
+ * \file iso.c
+ * \brief Reading the volume descriptors and directories of a mapped ISO 9660 image, and the index of its files.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "iso.h"
+
+#define PATH_LENGTH     4096  // Longest path indexed; deeper names are skipped.
+#define NAME_LENGTH     1024  // Longest single name, once Rock Ridge continuations are joined.
+#define MAX_CONTINUATIONS 16  // CE areas followed for one directory record.
+
+// Directory record fields (ECMA-119 9.1).
+#define RECORD_MIN_LENGTH 34
+#define RECORD_EXTENT     2
+#define RECORD_SIZE       10
+#define RECORD_FLAGS      25
+#define RECORD_NAME_LENGTH 32
+#define RECORD_NAME       33
+
+#define FLAG_DIRECTORY   0x02
+#define FLAG_ASSOCIATED  0x04
+#define FLAG_MULTIEXTENT 0x80
+
+// How one image is being read.
+struct walk {
+	struct iso_image *image;
+	unsigned block_size;
+	unsigned susp_skip;  // Bytes before the SUSP entries of each record, from the SP entry; with Rock Ridge only.
+	uint64_t *walked;    // Open addressing over the directories read so far: start + 1, or 0 for a free slot.
+	size_t walked_count;
+	size_t walked_mask;
+	int error;           // Set to an errno value to stop the walk: EINVAL for a directory reached twice, ENOMEM.
+};
+
+// What the Rock Ridge entries of a directory record say.
+struct rock_ridge {
+	char name[NAME_LENGTH];
+	size_t name_length;
+	int has_name;
+	int symbolic_link;
+	int relocated;           // RE: a directory that has been moved here, and is reached through its CL.
+	uint32_t child_location; // CL: this file stands for the directory at that block; 0 if none.
+};
+
+
+static uint32_t le32( const unsigned char *p )
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+// FNV-1a.
+static uint64_t name_hash( const char *name, size_t length )
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for( size_t i = 0; i < length; ++i ) {
+		hash ^= (unsigned char)name[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+// Returns non-zero if length bytes at offset are inside the image.
+static int in_image( const struct iso_image *image, uint64_t offset, uint64_t length )
+{
+	return offset <= image->length && length <= image->length - offset;
+}
+
+
+static int add_file( struct iso_image *image, const char *name, uint64_t offset, uint64_t size )
+{
+	struct iso_file *file;
+
+	if( image->file_count == image->file_capacity ) {
+		size_t capacity = image->file_capacity == 0 ? 256 : image->file_capacity * 2;
+		struct iso_file *grown = realloc( image->files, capacity * sizeof(*grown) );
+
+		if( grown == NULL ) {
+			return -1;
+		}
+		image->files = grown;
+		image->file_capacity = capacity;
+	}
+	file = &image->files[image->file_count];
+	if( (file->name = strdup( name )) == NULL ) {
+		return -1;
+	}
+	file->hash = name_hash( name, strlen( name ) );
+	file->offset = offset;
+	file->size = size;
+	image->file_count++;
+	return 0;
+}
+
+
+// Reads the SUSP entries of a record, following CE continuation areas.
+static void read_rock_ridge( const struct walk *walk, const unsigned char *entries, size_t length,
+                             struct rock_ridge *rock_ridge )
+{
+	const struct iso_image *image = walk->image;
+	int continuations = 0;
+
+	rock_ridge->name_length = 0;
+	rock_ridge->has_name = 0;
+	rock_ridge->symbolic_link = 0;
+	rock_ridge->relocated = 0;
+	rock_ridge->child_location = 0;
+
+	while( length >= 4 ) {
+		const unsigned char *next_entries = NULL;
+		size_t next_length = 0;
+
+		for( size_t at = 0; at + 4 <= length; ) {
+			const unsigned char *entry = entries + at;
+			size_t entry_length = entry[2];
+
+			if( entry_length < 4 || at + entry_length > length || (entry[0] == 'S' && entry[1] == 'T') ) {
+				break;
+			}
+			if( entry[0] == 'N' && entry[1] == 'M' && entry_length >= 5 && (entry[4] & 0x06) == 0 ) {
+				size_t part = entry_length - 5;
+
+				if( rock_ridge->name_length + part < sizeof(rock_ridge->name) ) {
+					memcpy( rock_ridge->name + rock_ridge->name_length, entry + 5, part );
+					rock_ridge->name_length += part;
+					rock_ridge->has_name = 1;
+				}
+			}
+			else if( entry[0] == 'S' && entry[1] == 'L' ) {
+				rock_ridge->symbolic_link = 1;
+			}
+			else if( entry[0] == 'R' && entry[1] == 'E' ) {
+				rock_ridge->relocated = 1;
+			}
+			else if( entry[0] == 'C' && entry[1] == 'L' && entry_length >= 12 ) {
+				rock_ridge->child_location = le32( entry + 4 );
+			}
+			else if( entry[0] == 'C' && entry[1] == 'E' && entry_length >= 28 ) {
+				uint64_t offset = (uint64_t)le32( entry + 4 ) * walk->block_size + le32( entry + 12 );
+
+				if( in_image( image, offset, le32( entry + 20 ) ) ) {
+					next_entries = image->map + offset;
+					next_length = le32( entry + 20 );
+				}
+			}
+			at += entry_length;
+		}
+		if( next_entries == NULL || ++continuations > MAX_CONTINUATIONS ) {
+			break;
+		}
+		entries = next_entries;
+		length = next_length;
+	}
+	rock_ridge->name[rock_ridge->name_length] = '\0';
+}
+
+
+// Turns a Joliet identifier (UCS-2, big-endian) into UTF-8 in name. Returns the length, or 0 if it does not fit.
+static size_t joliet_name( const unsigned char *identifier, size_t length, char *name, size_t size )
+{
+	size_t written = 0;
+
+	for( size_t i = 0; i + 1 < length; i += 2 ) {
+		uint32_t c = (uint32_t)identifier[i] << 8 | identifier[i + 1];
+
+		if( c >= 0xd800 && c < 0xdc00 && i + 3 < length ) {
+			uint32_t low = (uint32_t)identifier[i + 2] << 8 | identifier[i + 3];
+
+			if( low >= 0xdc00 && low < 0xe000 ) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				i += 2;
+			}
+		}
+		if( written + 5 > size ) {
+			return 0;
+		}
+		if( c < 0x80 ) {
+			name[written++] = (char)c;
+		}
+		else if( c < 0x800 ) {
+			name[written++] = (char)(0xc0 | c >> 6);
+			name[written++] = (char)(0x80 | (c & 0x3f));
+		}
+		else if( c < 0x10000 ) {
+			name[written++] = (char)(0xe0 | c >> 12);
+			name[written++] = (char)(0x80 | (c >> 6 & 0x3f));
+			name[written++] = (char)(0x80 | (c & 0x3f));
+		}
+		else {
+			name[written++] = (char)(0xf0 | c >> 18);
+			name[written++] = (char)(0x80 | (c >> 12 & 0x3f));
+			name[written++] = (char)(0x80 | (c >> 6 & 0x3f));
+			name[written++] = (char)(0x80 | (c & 0x3f));
+		}
+	}
+	name[written] = '\0';
+	return written;
+}
+
+
+// The name of a record as clients see it: from Rock Ridge if it has one, otherwise from the identifier, without
+// its version and, for plain ISO 9660, in lower case. Returns the length, or 0 to skip the record.
+static size_t record_name( const struct walk *walk, const unsigned char *record, const struct rock_ridge *rock_ridge,
+                           char *name, size_t size )
+{
+	const unsigned char *identifier = record + RECORD_NAME;
+	size_t length = record[RECORD_NAME_LENGTH];
+	char *version;
+
+	if( rock_ridge != NULL && rock_ridge->has_name ) {
+		if( rock_ridge->name_length >= size ) {
+			return 0;
+		}
+		memcpy( name, rock_ridge->name, rock_ridge->name_length + 1 );
+		return rock_ridge->name_length;
+	}
+	if( walk->image->names == ISO_NAMES_JOLIET ) {
+		length = joliet_name( identifier, length, name, size );
+	}
+	else {
+		if( length >= size ) {
+			return 0;
+		}
+		for( size_t i = 0; i < length; ++i ) {
+			name[i] = (char)tolower( identifier[i] );
+		}
+		name[length] = '\0';
+	}
+	if( (version = strrchr( name, ';' )) != NULL ) {
+		*version = '\0';
+		length = (size_t)(version - name);
+	}
+	if( walk->image->names != ISO_NAMES_JOLIET && length > 1 && name[length - 1] == '.' ) {
+		name[--length] = '\0';
+	}
+	return length;
+}
+
+
+static void walk_directory( struct walk *walk, uint64_t start, uint64_t size, char *path, size_t path_length, int depth );
+
+
+// Remembers that the directory at start is being read. Returns 0, or -1 with walk->error set if it has been read
+// already (a directory record in a damaged image leads back to it, and reading on could go round forever).
+static int mark_walked( struct walk *walk, uint64_t start )
+{
+	size_t slot;
+
+	if( 2 * (walk->walked_count + 1) > walk->walked_mask + 1 ) {
+		size_t slots = walk->walked_mask == 0 ? 64 : 2 * (walk->walked_mask + 1);
+		uint64_t *grown = calloc( slots, sizeof(*grown) );
+
+		if( grown == NULL ) {
+			walk->error = ENOMEM;
+			return -1;
+		}
+		for( size_t i = 0; walk->walked_mask != 0 && i <= walk->walked_mask; ++i ) {
+			if( walk->walked[i] != 0 ) {
+				for( slot = (size_t)name_hash( (const char *)&walk->walked[i], sizeof(uint64_t) ) & (slots - 1);
+				     grown[slot] != 0; slot = (slot + 1) & (slots - 1) ) {
+				}
+				grown[slot] = walk->walked[i];
+			}
+		}
+		free( walk->walked );
+		walk->walked = grown;
+		walk->walked_mask = slots - 1;
+	}
+	start += 1;
+	for( slot = (size_t)name_hash( (const char *)&start, sizeof(start) ) & walk->walked_mask; walk->walked[slot] != 0;
+	     slot = (slot + 1) & walk->walked_mask ) {
+		if( walk->walked[slot] == start ) {
+			walk->error = EINVAL;
+			return -1;
+		}
+	}
+	walk->walked[slot] = start;
+	walk->walked_count++;
+	return 0;
+}
+
+
+// Reads the directory whose first record (".") is at block, for Rock Ridge CL entries that only give the block.
+static void walk_relocated( struct walk *walk, uint32_t block, char *path, size_t path_length, int depth )
+{
+	uint64_t start = (uint64_t)block * walk->block_size;
+	const unsigned char *self;
+
+	if( !in_image( walk->image, start, RECORD_MIN_LENGTH ) ) {
+		return;
+	}
+	self = walk->image->map + start;
+	walk_directory( walk, start, le32( self + RECORD_SIZE ), path, path_length, depth );
+}
+
+
+// Indexes the files of the directory of size bytes at start, and of the directories below it. path holds the
+// directory's own path, with a trailing '/' unless it is the root.
+static void walk_directory( struct walk *walk, uint64_t start, uint64_t size, char *path, size_t path_length, int depth )
+{
+	struct iso_image *image = walk->image;
+	struct rock_ridge rock_ridge;
+	uint64_t end = start + size;
+	uint64_t split_offset = 0;  // Of a file whose further extents are still to come (FLAG_MULTIEXTENT).
+	uint64_t split_size = 0;
+	int split = 0;              // 1 while collecting one, -1 while skipping one whose extents are not contiguous.
+
+	if( walk->error != 0 || depth > ISO_MAX_DEPTH || !in_image( image, start, size ) ||
+	    mark_walked( walk, start ) == -1 ) {
+		return;
+	}
+	for( uint64_t at = start; at < end && walk->error == 0; ) {
+		const unsigned char *record = image->map + at;
+		size_t record_length = record[0];
+		size_t identifier_length;
+		struct rock_ridge *names = NULL;
+		uint64_t offset;
+		uint64_t data_size;
+		size_t name_length;
+
+		// Records do not cross sectors; a zero length pads to the next one.
+		if( record_length == 0 ) {
+			at = start + ((at - start) / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+			continue;
+		}
+		// Both lengths are checked before any other field is read, which could be past the end of the image.
+		if( record_length < RECORD_MIN_LENGTH || at + record_length > end ) {
+			break;
+		}
+		identifier_length = record[RECORD_NAME_LENGTH];
+		if( RECORD_NAME + identifier_length > record_length ) {
+			break;
+		}
+		at += record_length;
+		// "." and "..".
+		if( identifier_length == 1 && record[RECORD_NAME] <= 1 ) {
+			continue;
+		}
+		if( image->names == ISO_NAMES_ROCK_RIDGE ) {
+			size_t entries = RECORD_NAME + identifier_length + (identifier_length % 2 == 0) + walk->susp_skip;
+
+			if( entries < record_length ) {
+				read_rock_ridge( walk, record + entries, record_length - entries, &rock_ridge );
+				names = &rock_ridge;
+			}
+		}
+		if( (record[RECORD_FLAGS] & FLAG_ASSOCIATED) ||
+		    (names != NULL && (names->symbolic_link || names->relocated)) ||
+		    (name_length = record_name( walk, record, names, path + path_length, PATH_LENGTH - path_length - 1 )) == 0 ) {
+			continue;
+		}
+
+		offset = ((uint64_t)le32( record + RECORD_EXTENT ) + record[1]) * walk->block_size;
+		data_size = le32( record + RECORD_SIZE );
+		if( names != NULL && names->child_location != 0 ) {
+			path[path_length + name_length] = '/';
+			walk_relocated( walk, names->child_location, path, path_length + name_length + 1, depth + 1 );
+		}
+		else if( record[RECORD_FLAGS] & FLAG_DIRECTORY ) {
+			path[path_length + name_length] = '/';
+			walk_directory( walk, offset, data_size, path, path_length + name_length + 1, depth + 1 );
+		}
+		else {
+			// An empty file's extent means nothing, and some tools leave it pointing past the end.
+			offset = data_size != 0 ? offset : 0;
+			// The extents of a split file follow one another in the directory, all but the last flagged.
+			if( split == 1 && split_offset + split_size == offset ) {
+				split_size += data_size;
+			}
+			else if( split == 0 ) {
+				split_offset = offset;
+				split_size = data_size;
+				split = 1;
+			}
+			else {
+				split = -1;
+			}
+			if( !(record[RECORD_FLAGS] & FLAG_MULTIEXTENT) ) {
+				path[path_length + name_length] = '\0';
+				if( split == 1 && in_image( image, split_offset, split_size ) &&
+				    add_file( image, path, split_offset, split_size ) == -1 ) {
+					walk->error = ENOMEM;
+				}
+				split = 0;
+			}
+		}
+		path[path_length] = '\0';
+	}
+}
+
+
+// Puts every file in the hash table. The first of two with the same name wins. Returns 0, or -1 if out of memory.
+static int build_table( struct iso_image *image )
+{
+	size_t slots = 16;
+
+	while( slots < 2 * image->file_count ) {
+		slots <<= 1;
+	}
+	if( (image->slots = calloc( slots, sizeof(*image->slots) )) == NULL ) {
+		return -1;
+	}
+	image->slot_mask = slots - 1;
+	for( size_t i = 0; i < image->file_count; ++i ) {
+		size_t slot = (size_t)image->files[i].hash & image->slot_mask;
+
+		while( image->slots[slot] != 0 ) {
+			slot = (slot + 1) & image->slot_mask;
+		}
+		image->slots[slot] = (uint32_t)i + 1;
+	}
+	return 0;
+}
+
+
+// Returns non-zero if the root directory starting at start announces Rock Ridge with an SP entry in its first
+// record, and sets skip from it.
+static int has_rock_ridge( const struct iso_image *image, uint64_t start, unsigned *skip )
+{
+	const unsigned char *self = image->map + start;
+
+	if( !in_image( image, start, RECORD_MIN_LENGTH + 7 ) || self[0] < RECORD_MIN_LENGTH + 7 ||
+	    self[RECORD_NAME_LENGTH] != 1 || memcmp( self + 34, "SP", 2 ) != 0 || self[36] < 7 ||
+	    self[38] != 0xbe || self[39] != 0xef ) {
+		return 0;
+	}
+	*skip = self[40];
+	return 1;
+}
+
+
+// Finds the volume to read names from and indexes it. Returns 0, or -1 with errno set: EINVAL if this is not an
+// ISO 9660 image, or a damaged one whose directories loop.
+static int read_image( struct iso_image *image )
+{
+	const unsigned char *primary = NULL;
+	const unsigned char *joliet = NULL;
+	const unsigned char *root;
+	struct walk walk;
+	char path[PATH_LENGTH];
+
+	for( uint64_t sector = ISO_DESCRIPTOR_START; sector < ISO_DESCRIPTOR_START + 64; ++sector ) {
+		const unsigned char *descriptor = image->map + sector * ISO_SECTOR_SIZE;
+
+		if( !in_image( image, sector * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE ) || memcmp( descriptor + 1, "CD001", 5 ) != 0 ||
+		    descriptor[0] == 255 ) {
+			break;
+		}
+		if( descriptor[0] == 1 && primary == NULL ) {
+			primary = descriptor;
+		}
+		// A supplementary volume is Joliet if its escape sequence names UCS-2 level 1, 2 or 3.
+		else if( descriptor[0] == 2 && joliet == NULL && descriptor[88] == '%' && descriptor[89] == '/' &&
+		         (descriptor[90] == '@' || descriptor[90] == 'C' || descriptor[90] == 'E') ) {
+			joliet = descriptor;
+		}
+	}
+	if( primary == NULL ) {
+		errno = EINVAL;
+		return -1;
+	}
+	walk.image = image;
+	walk.block_size = (unsigned)primary[128] | (unsigned)primary[129] << 8;
+	walk.susp_skip = 0;
+	walk.walked = NULL;
+	walk.walked_count = 0;
+	walk.walked_mask = 0;
+	walk.error = 0;
+	if( walk.block_size != 512 && walk.block_size != 1024 && walk.block_size != 2048 ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Rock Ridge names are preferred to Joliet ones, as Linux does: they keep case, length and every character.
+	root = primary + 156;
+	if( has_rock_ridge( image, (uint64_t)le32( root + RECORD_EXTENT ) * walk.block_size, &walk.susp_skip ) ) {
+		image->names = ISO_NAMES_ROCK_RIDGE;
+	}
+	else if( joliet != NULL ) {
+		image->names = ISO_NAMES_JOLIET;
+		root = joliet + 156;
+	}
+	else {
+		image->names = ISO_NAMES_PLAIN;
+	}
+
+	path[0] = '\0';
+	walk_directory( &walk, (uint64_t)le32( root + RECORD_EXTENT ) * walk.block_size, le32( root + RECORD_SIZE ), path,
+	                0, 0 );
+	free( walk.walked );
+	if( walk.error != 0 ) {
+		errno = walk.error;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void iso_close( struct iso_image *image )
+{
+	for( size_t i = 0; i < image->file_count; ++i ) {
+		free( image->files[i].name );
+	}
+	free( image->files );
+	free( image->slots );
+	munmap( (void *)image->map, image->length );
+	free( image );
+}
+
+
+//! Maps the image file_name and indexes its files. Returns it, or NULL with errno set (EINVAL if it is not an
+//! ISO 9660 image, or is one whose directories lead back to themselves).
+struct iso_image *iso_open( const char *file_name )
+{
+	struct iso_image *image;
+	struct stat status;
+	void *map = MAP_FAILED;
+	int file;
+
+	if( (file = open( file_name, O_RDONLY )) == -1 ) {
+		return NULL;
+	}
+	if( fstat( file, &status ) == 0 ) {
+		if( !S_ISREG( status.st_mode ) || status.st_size < (ISO_DESCRIPTOR_START + 1) * ISO_SECTOR_SIZE ) {
+			errno = EINVAL;
+		}
+		else {
+			map = mmap( NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0 );
+		}
+	}
+	close( file );
+	if( map == MAP_FAILED ) {
+		return NULL;
+	}
+	if( (image = calloc( 1, sizeof(*image) )) == NULL ) {
+		munmap( map, (size_t)status.st_size );
+		return NULL;
+	}
+	image->map = map;
+	image->length = (size_t)status.st_size;
+	if( read_image( image ) == -1 ) {
+		int error = errno;
+
+		iso_close( image );
+		errno = error;
+		return NULL;
+	}
+	if( image->file_count > UINT32_MAX - 1 || build_table( image ) == -1 ) {
+		iso_close( image );
+		errno = ENOMEM;
+		return NULL;
+	}
+	return image;
+}
+
+
+//! Returns the file called file_name in the image, or NULL if there is none. Like open_in_root(), takes every name
+//! as relative to the root; plain ISO 9660 names match in any case.
+const struct iso_file *iso_find( const struct iso_image *image, const char *file_name )
+{
+	char folded[PATH_LENGTH];
+	size_t length;
+	uint64_t hash;
+
+	while( *file_name == '/' ) {
+		++file_name;
+	}
+	if( (length = strlen( file_name )) == 0 || length >= sizeof(folded) ) {
+		return NULL;
+	}
+	if( image->names == ISO_NAMES_PLAIN ) {
+		for( size_t i = 0; i <= length; ++i ) {
+			folded[i] = (char)tolower( (unsigned char)file_name[i] );
+		}
+		file_name = folded;
+	}
+	hash = name_hash( file_name, length );
+	for( size_t slot = (size_t)hash & image->slot_mask; image->slots[slot] != 0; slot = (slot + 1) & image->slot_mask ) {
+		const struct iso_file *file = &image->files[image->slots[slot] - 1];
+
+		if( file->hash == hash && strcmp( file->name, file_name ) == 0 ) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+
+//! Asks the kernel to start paging in the extent of file_name, if the image has it.
+void iso_will_need( const struct iso_image *image, const char *file_name )
+{
+	const struct iso_file *file = iso_find( image, file_name );
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	size_t start;
+
+	if( file == NULL || file->size == 0 ) {
+		return;
+	}
+	// Extents are only sector-aligned; the advice must start on a page.
+	start = (size_t)file->offset / page * page;
+	posix_madvise( (void *)(image->map + start), (size_t)(file->offset + file->size) - start, POSIX_MADV_WILLNEED );
+}
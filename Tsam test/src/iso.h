@@ -0,0 +1,65 @@
+/*!
+ * \file iso.h
+ * \brief Serving the files of an ISO 9660 image without mounting it (image=FILE).
+ *
+ * Installers come as ISO images, which used to be loop-mounted or unpacked
+ * to make a TFTP root. A policy with image=FILE maps the image read-only at
+ * startup, walks its directory tree once, and keeps every file's path and
+ * extent in a hash table. A request is then a lookup in that table, and
+ * its blocks are copied from the mapping at the extent's offset: a new
+ * image can be served as soon as its directories have been read, and
+ * nothing is copied or unpacked.
+ *
+ * Names are taken from Rock Ridge (NM entries, with directories relocated by
+ * RE and CL put back where they belong) if the image has it, otherwise from
+ * the Joliet volume (UCS-2, converted to UTF-8), otherwise from the plain
+ * ISO 9660 identifiers, which lose their ";1" version and are matched
+ * without regard to case, as Linux presents them. Symbolic links are left
+ * out, and so are files split into extents that are not contiguous in the
+ * image (ISO 9660 only splits files over 4 GiB, and mastering tools write
+ * the parts one after another).
+ *
+ * Every directory is read once. A damaged image whose directory records
+ * lead back to a directory already read is refused when it is opened,
+ * rather than walked round and round.
+ */
+
+#ifndef ISO_H
+#define ISO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ISO_SECTOR_SIZE      2048
+#define ISO_DESCRIPTOR_START 16  // Sector of the first volume descriptor.
+#define ISO_MAX_DEPTH        64  // Deeper directories are skipped, which bounds the recursion.
+
+enum iso_names {
+	ISO_NAMES_PLAIN,
+	ISO_NAMES_JOLIET,
+	ISO_NAMES_ROCK_RIDGE
+};
+
+struct iso_file {
+	char *name;       // Path from the root of the image, without a leading '/'.
+	uint64_t hash;
+	uint64_t offset;  // Of the contents, from the start of the image.
+	uint64_t size;
+};
+
+struct iso_image {
+	const unsigned char *map;
+	size_t length;
+	enum iso_names names;
+	struct iso_file *files;
+	size_t file_count;
+	size_t file_capacity;
+	uint32_t *slots;       // Open addressing over files: index + 1, or 0 for a free slot.
+	size_t slot_mask;      // Slots, less one; a power of two less one.
+};
+
+struct iso_image *iso_open( const char *file_name );
+const struct iso_file *iso_find( const struct iso_image *image, const char *file_name );
+void iso_will_need( const struct iso_image *image, const char *file_name );
+
+#endif
@@ -0,0 +1,92 @@
+/*!
+ * \file listener.c
+ * \brief Opening listening sockets and parsing listener specifications.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+
+//! Parses a -l argument in place, applying its settings to policy. Fields not given are left as they were.
+int listener_parse_spec( char *text, struct listener_spec *spec, struct policy *policy )
+{
+	char *field;
+	char *save;
+
+	if( (field = strtok_r( text, ",", &save )) == NULL ) {
+		return -1;
+	}
+	spec->address = field;
+
+	while( (field = strtok_r( NULL, ",", &save )) != NULL ) {
+		if( strncmp( field, "port=", 5 ) == 0 ) {
+			spec->port = (unsigned short)atoi( field + 5 );
+		}
+		else if( policy_set( policy, field ) == -1 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+//! Binds a socket of the given family to address ("*" for any). Returns 0, or -1 with errno set.
+int listener_open( struct listener *listener, int family, const char *address, unsigned short port )
+{
+	int handle;
+
+	memset( listener, 0, sizeof(*listener) );
+	listener->family = family;
+	listener->wildcard = strcmp( address, "*" ) == 0;
+
+	if( family == AF_INET6 ) {
+		struct sockaddr_in6 *server_address = (struct sockaddr_in6 *)&listener->address;
+
+		server_address->sin6_family = AF_INET6;
+		server_address->sin6_port = htons( port );
+		server_address->sin6_addr = in6addr_any;
+		if( !listener->wildcard && inet_pton( AF_INET6, address, &server_address->sin6_addr ) != 1 ) {
+			return -1;
+		}
+		listener->address_length = sizeof(*server_address);
+	}
+	else {
+		struct sockaddr_in *server_address = (struct sockaddr_in *)&listener->address;
+
+		server_address->sin_family = AF_INET;
+		server_address->sin_port = htons( port );
+		server_address->sin_addr.s_addr = htonl( INADDR_ANY );
+		if( !listener->wildcard && inet_pton( AF_INET, address, &server_address->sin_addr ) != 1 ) {
+			return -1;
+		}
+		listener->address_length = sizeof(*server_address);
+	}
+
+	if( (handle = socket( family == AF_INET6 ? PF_INET6 : PF_INET, SOCK_DGRAM, 0 )) == -1 ) {
+		return -1;
+	}
+
+	if( family == AF_INET6 ) {
+		int v6_only = 1;
+
+		// IPv4 clients get their own socket, so keep this one from seeing them as mapped addresses.
+		if( setsockopt( handle, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only) ) == -1 ) {
+			close( handle );
+			return -1;
+		}
+	}
+
+	if( bind( handle, (struct sockaddr *)&listener->address, listener->address_length ) == -1 ) {
+		close( handle );
+		return -1;
+	}
+
+	listener->handle = handle;
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*!
+ * \file listener.h
+ * \brief Listening sockets and the command-line syntax that describes them.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <sys/socket.h>
+
+#include "policy.h"
+
+// A socket we accept requests on.
+struct listener {
+	int handle;  // Bound socket.
+	int family;  // AF_INET or AF_INET6.
+	struct sockaddr_storage address;  // Bound address. Transfer sockets reuse its IP.
+	socklen_t address_length;
+	int wildcard;                     // Bound to the any-address of its family.
+	struct policy *policy;
+};
+
+// One -l argument: "ADDRESS[,port=N][,SETTING]...". ADDRESS "*" means every address;
+// the settings are policy settings (see policy_set()).
+struct listener_spec {
+	const char *address;
+	unsigned short port;
+};
+
+int listener_parse_spec( char *text, struct listener_spec *spec, struct policy *policy );
+int listener_open( struct listener *listener, int family, const char *address, unsigned short port );
+
+#endif
@@ -0,0 +1,392 @@
+/*!
+ * \file mkbundle.c
+ * \brief Packs a directory tree into a bundle for bundle=FILE (see bundle.h).
+ *
+ * Usage: ./mkbundle [-n] directory bundle-file
+ *
+ * Every regular file under directory goes in, named by its path relative to
+ * it ("pxelinux.cfg/default"); symbolic links are not followed. -n adds a
+ * copy of each file already translated to netascii. The bundle is written
+ * to bundle-file.new and renamed over bundle-file once complete, so a server
+ * that has the old one mapped keeps serving it until it is restarted.
+ */
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "netascii.h"
+
+#define MAX_DISPLACEMENT (1u << 28)  // Tries for one bucket before giving up on the index.
+#define COPY_SIZE        65536
+
+struct input_file {
+	char *path;      // To open, as found under the directory.
+	char *name;      // Relative to the directory: what clients ask for.
+	uint64_t hash;
+	uint32_t bucket;
+};
+
+static struct input_file *files;
+static uint32_t file_count;
+static uint32_t file_capacity;
+static size_t prefix_length;  // Of the directory, with its '/'.
+
+
+// Adds each regular file nftw() finds.
+static int visit( const char *path, const struct stat *status, int type, struct FTW *position )
+{
+	struct input_file *file;
+
+	(void)position;
+	if( type != FTW_F || !S_ISREG( status->st_mode ) ) {
+		return 0;
+	}
+	if( file_count == file_capacity ) {
+		uint32_t capacity = file_capacity == 0 ? 256 : file_capacity * 2;
+		struct input_file *grown = realloc( files, capacity * sizeof(*grown) );
+
+		if( grown == NULL ) {
+			return -1;
+		}
+		files = grown;
+		file_capacity = capacity;
+	}
+	file = &files[file_count];
+	if( (file->path = strdup( path )) == NULL ) {
+		return -1;
+	}
+	file->name = file->path + prefix_length;
+	file->hash = bundle_hash( file->name, strlen( file->name ) );
+	file_count++;
+	return 0;
+}
+
+
+static int by_name( const void *a, const void *b )
+{
+	return strcmp( ((const struct input_file *)a)->name, ((const struct input_file *)b)->name );
+}
+
+
+// Bucket sizes, for sorting buckets largest first.
+static uint32_t *bucket_sizes;
+
+static int by_bucket_size( const void *a, const void *b )
+{
+	uint32_t left = *(const uint32_t *)a;
+	uint32_t right = *(const uint32_t *)b;
+
+	if( bucket_sizes[left] != bucket_sizes[right] ) {
+		return bucket_sizes[left] < bucket_sizes[right] ? 1 : -1;
+	}
+	return left < right ? -1 : left > right;
+}
+
+
+// Finds a displacement for every bucket so that no two names share a record, placing the biggest buckets while
+// there is most room. Fills in slots (the record of each file). Returns 0, or -1 if it could not.
+static int build_index( uint32_t bucket_count, uint32_t *displacements, uint32_t *slots )
+{
+	uint32_t *order = malloc( bucket_count * sizeof(*order) );
+	uint32_t *first = calloc( (size_t)bucket_count + 1, sizeof(*first) );  // Of each bucket's files in members.
+	uint32_t *members = malloc( file_count * sizeof(*members) );
+	uint32_t *filled = calloc( bucket_count, sizeof(*filled) );
+	unsigned char *taken = calloc( file_count, 1 );
+	uint32_t *tried = malloc( BUNDLE_BUCKET_SIZE * 8 * sizeof(*tried) );
+	int result = -1;
+
+	bucket_sizes = calloc( bucket_count, sizeof(*bucket_sizes) );
+	if( order == NULL || first == NULL || members == NULL || filled == NULL || taken == NULL || tried == NULL ||
+	    bucket_sizes == NULL ) {
+		goto done;
+	}
+	for( uint32_t i = 0; i < file_count; ++i ) {
+		files[i].bucket = bundle_bucket( files[i].hash, bucket_count );
+		bucket_sizes[files[i].bucket]++;
+	}
+	for( uint32_t b = 0; b < bucket_count; ++b ) {
+		first[b + 1] = first[b] + bucket_sizes[b];
+		order[b] = b;
+	}
+	for( uint32_t i = 0; i < file_count; ++i ) {
+		members[first[files[i].bucket] + filled[files[i].bucket]++] = i;
+	}
+	qsort( order, bucket_count, sizeof(*order), by_bucket_size );
+
+	for( uint32_t k = 0; k < bucket_count && bucket_sizes[order[k]] != 0; ++k ) {
+		uint32_t bucket = order[k];
+		uint32_t size = bucket_sizes[bucket];
+		uint32_t displacement;
+
+		if( size > BUNDLE_BUCKET_SIZE * 8 ) {
+			goto done;  // Far beyond what a decent hash gives; most likely names with equal hashes.
+		}
+		for( displacement = 0; displacement < MAX_DISPLACEMENT; ++displacement ) {
+			uint32_t placed = 0;
+
+			for( ; placed < size; ++placed ) {
+				uint32_t slot = bundle_slot( files[members[first[bucket] + placed]].hash, displacement, file_count );
+				uint32_t j = 0;
+
+				while( j < placed && tried[j] != slot ) {
+					++j;
+				}
+				if( taken[slot] || j < placed ) {
+					break;
+				}
+				tried[placed] = slot;
+			}
+			if( placed == size ) {
+				break;
+			}
+		}
+		if( displacement == MAX_DISPLACEMENT ) {
+			goto done;
+		}
+		displacements[bucket] = displacement;
+		for( uint32_t j = 0; j < size; ++j ) {
+			taken[tried[j]] = 1;
+			slots[members[first[bucket] + j]] = tried[j];
+		}
+	}
+	result = 0;
+
+done:
+	free( order );
+	free( first );
+	free( members );
+	free( filled );
+	free( taken );
+	free( tried );
+	free( bucket_sizes );
+	return result;
+}
+
+
+// Writes length bytes at the stream's position. Returns 0, or -1 on an error.
+static int write_out( FILE *stream, const void *data, size_t length )
+{
+	return fwrite( data, 1, length, stream ) == length ? 0 : -1;
+}
+
+
+// Copies the file at path to the stream, as it is or translated to netascii, and measures it in netascii.
+// Returns the bytes written, or -1 on an error.
+static off_t copy_file( const char *path, FILE *stream, int translate, uint64_t *netascii_size )
+{
+	static unsigned char input[COPY_SIZE];
+	static unsigned char output[2 * COPY_SIZE + 1];
+	FILE *file = fopen( path, "rb" );
+	int pending = -1;
+	off_t written = 0;
+	size_t count;
+
+	if( file == NULL ) {
+		return -1;
+	}
+	*netascii_size = 0;
+	while( (count = fread( input, 1, sizeof(input), file )) > 0 ) {
+		const unsigned char *data = input;
+		size_t length = count;
+
+		*netascii_size += count;
+		for( size_t i = 0; i < count; ++i ) {
+			*netascii_size += input[i] == '\n' || input[i] == '\r';
+		}
+		if( translate ) {
+			size_t consumed;
+
+			length = netascii_encode( input, count, &consumed, output, sizeof(output), &pending );
+			data = output;
+		}
+		if( write_out( stream, data, length ) == -1 ) {
+			fclose( file );
+			return -1;
+		}
+		written += (off_t)length;
+	}
+	if( ferror( file ) ) {
+		fclose( file );
+		return -1;
+	}
+	fclose( file );
+	return written;
+}
+
+
+static off_t align( off_t offset )
+{
+	return (offset + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+}
+
+
+// Writes the bundle. Returns 0, or -1 with a message printed.
+static int write_bundle( const char *bundle_name, int translate )
+{
+	uint32_t bucket_count = (file_count + BUNDLE_BUCKET_SIZE - 1) / BUNDLE_BUCKET_SIZE;
+	uint32_t *displacements;
+	uint32_t *slots = malloc( (file_count != 0 ? file_count : 1) * sizeof(*slots) );
+	uint32_t *in_slot = malloc( (file_count != 0 ? file_count : 1) * sizeof(*in_slot) );  // The file of each record.
+	struct bundle_record *records = calloc( file_count != 0 ? file_count : 1, sizeof(*records) );
+	struct bundle_header header;
+	uint64_t names_length = 0;
+	off_t end;
+	FILE *stream;
+
+	bucket_count = bucket_count != 0 ? bucket_count : 1;
+	displacements = calloc( bucket_count, sizeof(*displacements) );
+	if( slots == NULL || in_slot == NULL || records == NULL || displacements == NULL ) {
+		fprintf( stderr, "Out of memory\n" );
+		return -1;
+	}
+	if( build_index( bucket_count, displacements, slots ) == -1 ) {
+		fprintf( stderr, "Unable to build the index\n" );
+		return -1;
+	}
+	for( uint32_t i = 0; i < file_count; ++i ) {
+		in_slot[slots[i]] = i;
+	}
+
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, BUNDLE_MAGIC, sizeof(header.magic) );
+	header.file_count = file_count;
+	header.bucket_count = bucket_count;
+	header.names_offset = bundle_records_offset( bucket_count ) + (uint64_t)file_count * sizeof(*records);
+	for( uint32_t slot = 0; slot < file_count; ++slot ) {
+		records[slot].name = (uint32_t)names_length;
+		records[slot].name_length = (uint32_t)strlen( files[in_slot[slot]].name );
+		names_length += records[slot].name_length;
+	}
+	if( names_length > UINT32_MAX ) {
+		fprintf( stderr, "Too many names\n" );
+		return -1;
+	}
+	header.names_length = names_length;
+
+	if( (stream = fopen( bundle_name, "wb" )) == NULL ) {
+		fprintf( stderr, "Unable to create %s: %s\n", bundle_name, strerror( errno ) );
+		return -1;
+	}
+	// Contents first, leaving room for the index, which is only known once every file has been read.
+	end = (off_t)(header.names_offset + names_length);
+	for( uint32_t i = 0; i < file_count; ++i ) {
+		struct bundle_record *record = &records[slots[i]];
+		off_t size;
+
+		if( fseeko( stream, align( end ), SEEK_SET ) == -1 ||
+		    (size = copy_file( files[i].path, stream, 0, &record->netascii_size )) == -1 ) {
+			fprintf( stderr, "Unable to copy %s: %s\n", files[i].path, strerror( errno ) );
+			fclose( stream );
+			return -1;
+		}
+		record->offset = size != 0 ? (uint64_t)align( end ) : 0;
+		record->size = (uint64_t)size;
+		end = size != 0 ? align( end ) + size : end;
+		if( translate && record->netascii_size != 0 ) {
+			uint64_t ignored;
+
+			if( fseeko( stream, align( end ), SEEK_SET ) == -1 ||
+			    (size = copy_file( files[i].path, stream, 1, &ignored )) == -1 ) {
+				fprintf( stderr, "Unable to copy %s: %s\n", files[i].path, strerror( errno ) );
+				fclose( stream );
+				return -1;
+			}
+			record->netascii_offset = (uint64_t)align( end );
+			record->netascii_size = (uint64_t)size;
+			end = align( end ) + size;
+		}
+	}
+	header.length = (uint64_t)end;
+
+	if( fseeko( stream, 0, SEEK_SET ) == -1 || write_out( stream, &header, sizeof(header) ) == -1 ||
+	    write_out( stream, displacements, bucket_count * sizeof(*displacements) ) == -1 ||
+	    fseeko( stream, (off_t)bundle_records_offset( bucket_count ), SEEK_SET ) == -1 ||
+	    write_out( stream, records, file_count * sizeof(*records) ) == -1 ) {
+		fprintf( stderr, "Unable to write %s: %s\n", bundle_name, strerror( errno ) );
+		fclose( stream );
+		return -1;
+	}
+	for( uint32_t slot = 0; slot < file_count; ++slot ) {
+		if( write_out( stream, files[in_slot[slot]].name, records[slot].name_length ) == -1 ) {
+			fprintf( stderr, "Unable to write %s: %s\n", bundle_name, strerror( errno ) );
+			fclose( stream );
+			return -1;
+		}
+	}
+	if( fflush( stream ) == EOF || fsync( fileno( stream ) ) == -1 || fclose( stream ) == EOF ) {
+		fprintf( stderr, "Unable to write %s: %s\n", bundle_name, strerror( errno ) );
+		return -1;
+	}
+	free( displacements );
+	free( slots );
+	free( in_slot );
+	free( records );
+	return 0;
+}
+
+
+static void usage( const char *program )
+{
+	fprintf( stderr, "Usage: %s [-n] directory bundle-file\n", program );
+}
+
+
+int main( int argc, char **argv )
+{
+	int translate = 0;
+	char *temporary;
+	int option;
+
+	while( (option = getopt( argc, argv, "n" )) != -1 ) {
+		switch( option ) {
+		case 'n':
+			translate = 1;
+			break;
+		default:
+			usage( argv[0] );
+			return EXIT_FAILURE;
+		}
+	}
+	if( argc - optind != 2 ) {
+		usage( argv[0] );
+		return EXIT_FAILURE;
+	}
+
+	// Names start after the directory and its '/', however many the directory was given with.
+	prefix_length = strlen( argv[optind] );
+	while( prefix_length > 1 && argv[optind][prefix_length - 1] == '/' ) {
+		argv[optind][--prefix_length] = '\0';
+	}
+	prefix_length += argv[optind][prefix_length - 1] != '/';
+	if( nftw( argv[optind], visit, 64, FTW_PHYS ) != 0 ) {
+		perror( "Unable to read the directory" );
+		return EXIT_FAILURE;
+	}
+	qsort( files, file_count, sizeof(*files), by_name );
+
+	if( (temporary = malloc( strlen( argv[optind + 1] ) + sizeof(".new") )) == NULL ) {
+		perror( "Out of memory" );
+		return EXIT_FAILURE;
+	}
+	sprintf( temporary, "%s.new", argv[optind + 1] );
+	if( write_bundle( temporary, translate ) == -1 ) {
+		unlink( temporary );
+		return EXIT_FAILURE;
+	}
+	if( rename( temporary, argv[optind + 1] ) == -1 ) {
+		fprintf( stderr, "Unable to rename %s: %s\n", temporary, strerror( errno ) );
+		unlink( temporary );
+		return EXIT_FAILURE;
+	}
+	printf( "%u files, %u buckets\n", file_count, (file_count + BUNDLE_BUCKET_SIZE - 1) / BUNDLE_BUCKET_SIZE );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+/*!
+ * \file mkseekable.c
+ * \brief Compresses a file into independent frames for serving from any offset (see seekable.h).
+ *
+ * Usage: ./mkseekable [-f frame-kilobytes] [-l level] file [compressed-file]
+ *
+ * The compressed file defaults to file.tfz, which the server serves when
+ * file itself is not in the root; the original can then be removed. Frames
+ * are 256 KiB unless -f says otherwise (4 to 1024): smaller frames mean
+ * less to inflate for a block, larger ones compress better. -l is the zlib level (1-9,
+ * default 9). The file is written to compressed-file.new and renamed once
+ * complete. The result is one line, e.g.
+ *
+ *     frames=17 size=4417253 compressed=1250093 ratio=28.3%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "seekable.h"
+
+
+// Compresses input into stream, a frame at a time, recording where each starts in offsets and measuring the file
+// in netascii. Returns 0, or -1 with a message printed.
+static int write_frames( FILE *input, FILE *stream, struct seekable_header *header, uint64_t *offsets, int level )
+{
+	unsigned char *frame = malloc( header->frame_size );
+	uLong bound = compressBound( header->frame_size );
+	unsigned char *compressed = malloc( bound );
+	uint64_t at = offsets[0];
+	uint32_t index = 0;
+	size_t count;
+	int result = -1;
+
+	if( frame == NULL || compressed == NULL ) {
+		fprintf( stderr, "Out of memory\n" );
+		goto done;
+	}
+	header->size = 0;
+	header->netascii_size = 0;
+	while( (count = fread( frame, 1, header->frame_size, input )) > 0 ) {
+		uLongf length = bound;
+
+		if( index == header->frame_count ) {
+			fprintf( stderr, "The file grew while it was being compressed\n" );
+			goto done;
+		}
+		header->size += count;
+		header->netascii_size += count;
+		for( size_t i = 0; i < count; ++i ) {
+			header->netascii_size += frame[i] == '\n' || frame[i] == '\r';
+		}
+		if( compress2( compressed, &length, frame, count, level ) != Z_OK ) {
+			fprintf( stderr, "Unable to compress frame %u\n", index );
+			goto done;
+		}
+		if( fwrite( compressed, 1, length, stream ) != length ) {
+			perror( "Unable to write" );
+			goto done;
+		}
+		offsets[index++] = at;
+		at += length;
+	}
+	if( ferror( input ) || index != header->frame_count ) {
+		fprintf( stderr, ferror( input ) ? "Unable to read the file\n" : "The file shrank while it was being compressed\n" );
+		goto done;
+	}
+	offsets[index] = at;
+	result = 0;
+
+done:
+	free( frame );
+	free( compressed );
+	return result;
+}
+
+
+// Writes the compressed copy of input to name. Returns 0, or -1 with a message printed.
+static int write_seekable( FILE *input, const char *name, uint32_t frame_size, int level )
+{
+	struct seekable_header header;
+	uint64_t *offsets;
+	off_t size;
+	FILE *stream;
+
+	if( fseeko( input, 0, SEEK_END ) == -1 || (size = ftello( input )) == -1 || fseeko( input, 0, SEEK_SET ) == -1 ) {
+		perror( "Unable to size the file" );
+		return -1;
+	}
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, SEEKABLE_MAGIC, sizeof(header.magic) );
+	header.frame_size = frame_size;
+	if( ((uint64_t)size + frame_size - 1) / frame_size > UINT32_MAX - 1 ) {
+		fprintf( stderr, "Too many frames; use larger ones\n" );
+		return -1;
+	}
+	header.frame_count = (uint32_t)(((uint64_t)size + frame_size - 1) / frame_size);
+	if( (offsets = calloc( (size_t)header.frame_count + 1, sizeof(*offsets) )) == NULL ) {
+		fprintf( stderr, "Out of memory\n" );
+		return -1;
+	}
+	offsets[0] = sizeof(header) + ((uint64_t)header.frame_count + 1) * sizeof(*offsets);
+
+	if( (stream = fopen( name, "wb" )) == NULL ) {
+		fprintf( stderr, "Unable to create %s: %s\n", name, strerror( errno ) );
+		free( offsets );
+		return -1;
+	}
+	// The frames first; the header and index are only known once they are written.
+	if( fseeko( stream, (off_t)offsets[0], SEEK_SET ) == -1 || write_frames( input, stream, &header, offsets, level ) == -1 ||
+	    fseeko( stream, 0, SEEK_SET ) == -1 || fwrite( &header, sizeof(header), 1, stream ) != 1 ||
+	    fwrite( offsets, sizeof(*offsets), (size_t)header.frame_count + 1, stream ) != (size_t)header.frame_count + 1 ||
+	    fflush( stream ) == EOF || fsync( fileno( stream ) ) == -1 ) {
+		fprintf( stderr, "Unable to write %s\n", name );
+		fclose( stream );
+		free( offsets );
+		return -1;
+	}
+	if( fclose( stream ) == EOF ) {
+		fprintf( stderr, "Unable to write %s: %s\n", name, strerror( errno ) );
+		free( offsets );
+		return -1;
+	}
+	printf( "frames=%u size=%llu compressed=%llu ratio=%.1f%%\n", header.frame_count, (unsigned long long)header.size,
+	        (unsigned long long)offsets[header.frame_count],
+	        header.size != 0 ? 100.0 * (double)offsets[header.frame_count] / (double)header.size : 100.0 );
+	free( offsets );
+	return 0;
+}
+
+
+static void usage( const char *program )
+{
+	fprintf( stderr, "Usage: %s [-f frame-kilobytes] [-l level] file [compressed-file]\n", program );
+}
+
+
+int main( int argc, char **argv )
+{
+	unsigned long frame_kilobytes = SEEKABLE_FRAME_SIZE / 1024;
+	int level = 9;
+	char *output;
+	char *temporary;
+	size_t length;
+	FILE *input;
+	int option;
+
+	while( (option = getopt( argc, argv, "f:l:" )) != -1 ) {
+		switch( option ) {
+		case 'f':
+			frame_kilobytes = strtoul( optarg, NULL, 10 );
+			break;
+		case 'l':
+			level = atoi( optarg );
+			break;
+		default:
+			usage( argv[0] );
+			return EXIT_FAILURE;
+		}
+	}
+	if( argc - optind < 1 || argc - optind > 2 || frame_kilobytes * 1024 < SEEKABLE_MIN_FRAME_SIZE ||
+	    frame_kilobytes * 1024 > SEEKABLE_MAX_FRAME_SIZE || level < 1 || level > 9 ) {
+		usage( argv[0] );
+		return EXIT_FAILURE;
+	}
+
+	if( (input = fopen( argv[optind], "rb" )) == NULL ) {
+		fprintf( stderr, "Unable to open %s: %s\n", argv[optind], strerror( errno ) );
+		return EXIT_FAILURE;
+	}
+	length = strlen( argv[argc - 1] ) + sizeof(SEEKABLE_SUFFIX ".new");
+	if( (output = malloc( length )) == NULL || (temporary = malloc( length )) == NULL ) {
+		perror( "Out of memory" );
+		return EXIT_FAILURE;
+	}
+	if( argc - optind == 2 ) {
+		strcpy( output, argv[optind + 1] );
+	}
+	else {
+		sprintf( output, "%s" SEEKABLE_SUFFIX, argv[optind] );
+	}
+	sprintf( temporary, "%s.new", output );
+	if( write_seekable( input, temporary, (uint32_t)(frame_kilobytes * 1024), level ) == -1 ) {
+		unlink( temporary );
+		return EXIT_FAILURE;
+	}
+	if( rename( temporary, output ) == -1 ) {
+		fprintf( stderr, "Unable to rename %s: %s\n", temporary, strerror( errno ) );
+		unlink( temporary );
+		return EXIT_FAILURE;
+	}
+	fclose( input );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+/*!
+ * \file mpsc.c
+ * \brief Bounded lock-free ring of fixed-size items for many producers and one consumer.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpsc.h"
+
+
+//! Allocates a ring of capacity (a power of two) items of item_size bytes. Returns 0, or -1 if out of memory.
+int mpsc_init( struct mpsc *ring, size_t capacity, size_t item_size )
+{
+	if( (ring->sequence = malloc( capacity * sizeof(*ring->sequence) )) == NULL ) {
+		return -1;
+	}
+	if( (ring->items = malloc( capacity * item_size )) == NULL ) {
+		free( ring->sequence );
+		return -1;
+	}
+	for( size_t i = 0; i < capacity; ++i ) {
+		atomic_init( &ring->sequence[i], i );
+	}
+	atomic_init( &ring->tail, 0 );
+	ring->head = 0;
+	ring->capacity = capacity;
+	ring->item_size = item_size;
+	return 0;
+}
+
+
+//! Any thread: copies item into the ring. Returns 0, or -1 if the ring is full.
+int mpsc_push( struct mpsc *ring, const void *item )
+{
+	size_t mask = ring->capacity - 1;
+	size_t position = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+	size_t sequence;
+
+	while( 1 ) {
+		intptr_t lag;
+
+		sequence = atomic_load_explicit( &ring->sequence[position & mask], memory_order_acquire );
+		lag = (intptr_t)(sequence - position);
+		if( lag == 0 ) {
+			// The slot is free this lap: claim it, unless another producer got there first.
+			if( atomic_compare_exchange_weak_explicit( &ring->tail, &position, position + 1, memory_order_relaxed,
+			                                           memory_order_relaxed ) ) {
+				break;
+			}
+		}
+		else if( lag < 0 ) {
+			// Still holds the item from the last lap.
+			return -1;
+		}
+		else {
+			position = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+		}
+	}
+	memcpy( ring->items + (position & mask) * ring->item_size, item, ring->item_size );
+	atomic_store_explicit( &ring->sequence[position & mask], position + 1, memory_order_release );
+	return 0;
+}
+
+
+//! The consumer only: copies the oldest item out of the ring into item. Returns 0, or -1 if there is none; an
+//! item whose producer is still copying it counts as not there yet.
+int mpsc_pop( struct mpsc *ring, void *item )
+{
+	size_t mask = ring->capacity - 1;
+	size_t position = ring->head;
+
+	if( atomic_load_explicit( &ring->sequence[position & mask], memory_order_acquire ) != position + 1 ) {
+		return -1;
+	}
+	memcpy( item, ring->items + (position & mask) * ring->item_size, ring->item_size );
+	atomic_store_explicit( &ring->sequence[position & mask], position + ring->capacity, memory_order_release );
+	ring->head = position + 1;
+	return 0;
+}
+
+
+void mpsc_destroy( struct mpsc *ring )
+{
+	free( ring->sequence );
+	free( ring->items );
+}
@@ -0,0 +1,34 @@
+/*!
+ * \file mpsc.h
+ * \brief Bounded lock-free ring of fixed-size items for many producers and one consumer.
+ *
+ * Each slot carries a sequence number that says whose turn it is: a
+ * producer may fill slot i when its sequence equals the position it
+ * claimed, and the consumer may empty it when the sequence is one past
+ * that. Producers claim positions with a compare-and-swap on tail, and the
+ * consumer is the only one to move head, so neither side takes a lock and
+ * a producer never waits for another one to finish copying (Vyukov's
+ * bounded queue, with the consumer side made single-threaded).
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct mpsc {
+	_Alignas(64) atomic_size_t tail;  // Next position for a producer to claim.
+	_Alignas(64) size_t head;         // Next position to consume; the consumer's own.
+	size_t capacity;                  // A power of two.
+	size_t item_size;
+	atomic_size_t *sequence;          // One per slot.
+	unsigned char *items;
+};
+
+int  mpsc_init( struct mpsc *ring, size_t capacity, size_t item_size );
+int  mpsc_push( struct mpsc *ring, const void *item );
+int  mpsc_pop( struct mpsc *ring, void *item );
+void mpsc_destroy( struct mpsc *ring );
+
+#endif
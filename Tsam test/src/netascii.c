@@ -0,0 +1,187 @@
+/*!
+ * \file netascii.c
+ * \brief Streaming netascii encoder and decoder.
+ */
+
+#include <unistd.h>
+
+#include "netascii.h"
+
+
+//! Translates in[] into out[] until either is exhausted. Returns the number of bytes written.
+size_t netascii_encode( const unsigned char *in, size_t in_length, size_t *consumed,
+                        unsigned char *out, size_t out_size, int *pending )
+{
+	size_t written = 0;
+	size_t used = 0;
+
+	if( *pending >= 0 && written < out_size ) {
+		out[written++] = (unsigned char)*pending;
+		*pending = -1;
+	}
+
+	while( used < in_length && written < out_size ) {
+		unsigned char c = in[used++];
+
+		if( c == '\n' || c == '\r' ) {
+			out[written++] = '\r';
+			if( written < out_size ) {
+				out[written++] = c == '\n' ? '\n' : '\0';
+			}
+			else {
+				*pending = c == '\n' ? '\n' : '\0';
+			}
+		}
+		else {
+			out[written++] = c;
+		}
+	}
+
+	*consumed = used;
+	return written;
+}
+
+
+//! Translates netascii in[] back to local line ends. out must have room for in_length + 1 bytes.
+//! A CR at the end of in[] is held in *pending_cr (initially 0) until the next call shows what follows it.
+size_t netascii_decode( const unsigned char *in, size_t in_length, unsigned char *out, int *pending_cr )
+{
+	size_t written = 0;
+
+	for( size_t used = 0; used < in_length; ++used ) {
+		unsigned char c = in[used];
+
+		if( *pending_cr ) {
+			*pending_cr = 0;
+			// CR LF is a line end and CR NUL a carriage return; anything else after a CR is kept as sent.
+			if( c == '\n' ) {
+				out[written++] = '\n';
+				continue;
+			}
+			out[written++] = '\r';
+			if( c == '\0' ) {
+				continue;
+			}
+		}
+		if( c == '\r' ) {
+			*pending_cr = 1;
+		}
+		else {
+			out[written++] = c;
+		}
+	}
+	return written;
+}
+
+
+//! Returns the length the file will have once translated, or -1 on a read error.
+off_t netascii_size( int file_handle )
+{
+	unsigned char input[NETASCII_INPUT_SIZE];
+	off_t offset = 0;
+	off_t size = 0;
+	ssize_t count;
+
+	// Every CR and LF grows by one byte; nothing else changes length.
+	while( (count = pread( file_handle, input, sizeof(input), offset )) > 0 ) {
+		size += count;
+		for( ssize_t i = 0; i < count; ++i ) {
+			size += input[i] == '\n' || input[i] == '\r';
+		}
+		offset += count;
+	}
+	return count < 0 ? -1 : size;
+}
+
+
+//! Returns the length size bytes in memory will have once translated.
+off_t netascii_size_memory( const unsigned char *contents, off_t size )
+{
+	off_t translated = size;
+
+	for( off_t i = 0; i < size; ++i ) {
+		translated += contents[i] == '\n' || contents[i] == '\r';
+	}
+	return translated;
+}
+
+
+void netascii_reader_init( struct netascii_reader *reader, int file_handle )
+{
+	reader->file_handle = file_handle;
+	reader->contents = NULL;
+	reader->size = 0;
+	reader->read_from = NULL;
+	reader->context = NULL;
+	reader->offset = 0;
+	reader->source = reader->input;
+	reader->input_start = 0;
+	reader->input_end = 0;
+	reader->pending = -1;
+	reader->at_eof = 0;
+}
+
+
+//! Sets up a reader that translates size bytes already in memory, with no reads or copies.
+void netascii_reader_init_memory( struct netascii_reader *reader, const unsigned char *contents, off_t size )
+{
+	netascii_reader_init( reader, -1 );
+	reader->contents = contents;
+	reader->size = size;
+}
+
+
+//! Sets up a reader that gets the file through read_from(context, ...).
+void netascii_reader_init_source( struct netascii_reader *reader, netascii_read_fn *read_from, void *context )
+{
+	netascii_reader_init( reader, -1 );
+	reader->read_from = read_from;
+	reader->context = context;
+}
+
+
+//! Fills out with up to size translated bytes. Short only at end of file; -1 on a read error.
+ssize_t netascii_read( struct netascii_reader *reader, unsigned char *out, size_t size )
+{
+	size_t written = 0;
+
+	while( written < size ) {
+		size_t consumed;
+
+		if( reader->input_start == reader->input_end && reader->pending < 0 ) {
+			ssize_t count;
+
+			if( reader->at_eof ) {
+				break;
+			}
+			if( reader->contents != NULL ) {
+				count = reader->size - reader->offset < NETASCII_INPUT_SIZE ? reader->size - reader->offset
+				                                                            : NETASCII_INPUT_SIZE;
+				reader->source = reader->contents + reader->offset;
+			}
+			else if( reader->read_from != NULL ) {
+				count = reader->read_from( reader->context, reader->input, sizeof(reader->input), reader->offset );
+			}
+			else {
+				count = pread( reader->file_handle, reader->input, sizeof(reader->input), reader->offset );
+			}
+			if( count < 0 ) {
+				return -1;
+			}
+			if( count == 0 ) {
+				reader->at_eof = 1;
+				break;
+			}
+			reader->offset += count;
+			reader->input_start = 0;
+			reader->input_end = (size_t)count;
+		}
+
+		written += netascii_encode( &reader->source[reader->input_start],
+		                            reader->input_end - reader->input_start, &consumed,
+		                            &out[written], size - written, &reader->pending );
+		reader->input_start += consumed;
+	}
+
+	return (ssize_t)written;
+}
@@ -0,0 +1,49 @@
+/*!
+ * \file netascii.h
+ * \brief Translation of local text files to netascii while they are sent.
+ *
+ * Line feeds become CR LF and a bare carriage return becomes CR NUL. Since a
+ * translation can straddle a block boundary, the second byte of an expansion
+ * that did not fit is carried over to the next call. Decoding, the reverse, is
+ * not needed by the server itself but is used to check what it sends.
+ */
+
+#ifndef NETASCII_H
+#define NETASCII_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define NETASCII_INPUT_SIZE 8192
+
+// Reads like pread() from a file that is not simply a file handle, such as a compressed one.
+typedef ssize_t netascii_read_fn( void *context, unsigned char *buffer, size_t size, off_t offset );
+
+struct netascii_reader {
+	int file_handle;
+	const unsigned char *contents;  // The file in memory, or NULL to read file_handle.
+	off_t size;                     // Of contents.
+	netascii_read_fn *read_from;    // Used instead of pread() on file_handle if set, with context.
+	void *context;
+	off_t offset;     // File offset of the next read.
+	unsigned char input[NETASCII_INPUT_SIZE];
+	const unsigned char *source;    // What input_start and input_end index: input, or part of contents.
+	size_t input_start;
+	size_t input_end;
+	int pending;      // Byte still owed from a split expansion, or -1.
+	int at_eof;
+};
+
+size_t netascii_encode( const unsigned char *in, size_t in_length, size_t *consumed,
+                        unsigned char *out, size_t out_size, int *pending );
+
+size_t netascii_decode( const unsigned char *in, size_t in_length, unsigned char *out, int *pending_cr );
+
+off_t   netascii_size( int file_handle );
+off_t   netascii_size_memory( const unsigned char *contents, off_t size );
+void    netascii_reader_init( struct netascii_reader *reader, int file_handle );
+void    netascii_reader_init_memory( struct netascii_reader *reader, const unsigned char *contents, off_t size );
+void    netascii_reader_init_source( struct netascii_reader *reader, netascii_read_fn *read_from, void *context );
+ssize_t netascii_read( struct netascii_reader *reader, unsigned char *out, size_t size );
+
+#endif
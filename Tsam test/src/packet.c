@@ -0,0 +1,200 @@
+/*!
+ * \file packet.c
+ * \brief Parsing of request datagrams and construction of ERROR datagrams.
+ *
+ * Modes: RFC 1350 defines "netascii", "octet" and "mail". octet is sent as is.
+ * netascii is translated to the network standard (CR LF line ends, a bare CR
+ * sent as CR NUL) while the file is read. mail only makes sense for writes,
+ * which this server does not accept, so it is rejected along with anything
+ * else. Mode names are compared without regard to case, as the RFC requires.
+ *
+ * Besides the RFC 2347 family (blksize, windowsize, timeout, tsize) the
+ * parser recognizes "offset", our own option for resuming a download: its
+ * value is the byte at which the client wants the data to start. Standard
+ * clients never send it, so they are unaffected.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "packet.h"
+
+
+// Returns the length of the NUL-terminated string at start, or -1 if it runs past end.
+static long string_length( const unsigned char *start, const unsigned char *end )
+{
+	const unsigned char *nul = memchr( start, '\0', (size_t)(end - start) );
+
+	return nul == NULL ? -1 : (long)(nul - start);
+}
+
+
+// Parses a decimal option value. Returns -1 if it is not a plain number.
+static int option_value( const char *text, unsigned long long *value )
+{
+	char *end;
+
+	if( *text < '0' || *text > '9' ) {
+		return -1;
+	}
+	errno = 0;
+	*value = strtoull( text, &end, 10 );
+	return *end != '\0' || errno == ERANGE ? -1 : 0;
+}
+
+
+// Records the options after the mode. Unknown options, and ones with unusable values, are ignored.
+static void parse_options( const unsigned char *cursor, const unsigned char *end, struct tftp_request *request )
+{
+	while( cursor < end ) {
+		const char *name = (const char *)cursor;
+		const char *text;
+		long name_length;
+		long value_length;
+		unsigned long long value;
+
+		if( (name_length = string_length( cursor, end )) < 0 ) {
+			return;
+		}
+		cursor += name_length + 1;
+		if( cursor >= end || (value_length = string_length( cursor, end )) < 0 ) {
+			return;
+		}
+		text = (const char *)cursor;
+		cursor += value_length + 1;
+
+		if( option_value( text, &value ) == -1 ) {
+			continue;
+		}
+		if( strcasecmp( name, "blksize" ) == 0 && value >= TFTP_MIN_BLKSIZE ) {
+			request->blksize = value > TFTP_MAX_BLKSIZE ? TFTP_MAX_BLKSIZE : (unsigned)value;
+		}
+		else if( strcasecmp( name, "windowsize" ) == 0 && value >= 1 ) {
+			request->windowsize = value > TFTP_MAX_WINDOWSIZE ? TFTP_MAX_WINDOWSIZE : (unsigned)value;
+		}
+		else if( strcasecmp( name, "timeout" ) == 0 && value >= 1 && value <= 255 ) {
+			request->timeout = (unsigned)value;
+		}
+		else if( strcasecmp( name, "tsize" ) == 0 ) {
+			request->tsize = 1;
+		}
+		else if( strcasecmp( name, "offset" ) == 0 ) {
+			request->has_offset = 1;
+			request->offset = value;
+		}
+	}
+}
+
+
+static int fail( struct tftp_request *request, int error_code, const char *message )
+{
+	request->error_code = error_code;
+	request->error_message = message;
+	return -1;
+}
+
+
+//! Parses an RRQ or WRQ. Returns 0 on success; on failure fills in the error to report and returns -1.
+int packet_parse_request( unsigned char *buffer, size_t length, struct tftp_request *request )
+{
+	const unsigned char *end = buffer + length;
+	const unsigned char *cursor;
+	long name_length;
+	long mode_length;
+
+	memset( request, 0, sizeof(*request) );
+
+	if( length < TFTP_HEADER_LENGTH ) {
+		return fail( request, ERR_ILLEGAL, "Malformed request" );
+	}
+
+	request->opcode = (int)packet_opcode( buffer );
+	if( request->opcode != OP_RRQ && request->opcode != OP_WRQ ) {
+		return fail( request, ERR_ILLEGAL, "Illegal TFTP operation" );
+	}
+
+	cursor = buffer + 2;
+	if( (name_length = string_length( cursor, end )) <= 0 ) {
+		return fail( request, ERR_ILLEGAL, "Malformed file name" );
+	}
+	request->file_name = (const char *)cursor;
+	cursor += name_length + 1;
+
+	if( cursor >= end || (mode_length = string_length( cursor, end )) <= 0 ) {
+		return fail( request, ERR_ILLEGAL, "Malformed transfer mode" );
+	}
+	request->mode_name = (const char *)cursor;
+	parse_options( cursor + mode_length + 1, end, request );
+
+	if( strcasecmp( request->mode_name, "octet" ) == 0 ) {
+		request->mode = MODE_OCTET;
+	}
+	else if( strcasecmp( request->mode_name, "netascii" ) == 0 ) {
+		request->mode = MODE_NETASCII;
+	}
+	else {
+		return fail( request, ERR_ILLEGAL, "Unsupported transfer mode" );
+	}
+
+	if( request->opcode == OP_WRQ ) {
+		return fail( request, ERR_ACCESS, "Uploading is not allowed" );
+	}
+	return 0;
+}
+
+
+//! Chooses the ERROR to send when a file could not be opened with errno error_number.
+int packet_error_for_errno( int error_number, const char **message )
+{
+	switch( error_number ) {
+	case ENOENT:
+	case ENOTDIR:
+		*message = "File not found";
+		return ERR_NOT_FOUND;
+	case ENFILE:
+	case EMFILE:
+	case ENOMEM:
+		*message = "Server busy, try again later";
+		return ERR_UNDEFINED;
+	default:
+		*message = "Access violation";
+		return ERR_ACCESS;
+	}
+}
+
+
+//! Writes an ERROR datagram into buffer and returns its length.
+size_t packet_build_error( unsigned char *buffer, size_t size, int error_code, const char *message )
+{
+	size_t message_length = strlen( message );
+
+	// Truncate rather than overflow; the message must stay NUL terminated.
+	if( message_length > size - TFTP_HEADER_LENGTH - 1 ) {
+		message_length = size - TFTP_HEADER_LENGTH - 1;
+	}
+
+	packet_put_header( buffer, OP_ERROR, (unsigned)error_code );
+	memcpy( &buffer[TFTP_HEADER_LENGTH], message, message_length );
+	buffer[TFTP_HEADER_LENGTH + message_length] = '\0';
+	return TFTP_HEADER_LENGTH + message_length + 1;
+}
+
+
+//! Appends "name\0value\0" at buffer[length]. Returns the new length, unchanged if it does not fit.
+size_t packet_put_option( unsigned char *buffer, size_t length, size_t size, const char *name, unsigned long value )
+{
+	char text[24];
+	size_t name_length = strlen( name );
+	size_t text_length = (size_t)snprintf( text, sizeof(text), "%lu", value );
+
+	if( length + name_length + text_length + 2 > size ) {
+		return length;
+	}
+	memcpy( &buffer[length], name, name_length + 1 );
+	length += name_length + 1;
+	memcpy( &buffer[length], text, text_length + 1 );
+	return length + text_length + 1;
+}
@@ -0,0 +1,88 @@
+/*!
+ * \file packet.h
+ * \brief TFTP packet layouts (RFC 1350, options per RFC 2347) and the helpers that read and write them.
+ */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TFTP_HEADER_LENGTH  4      // Opcode plus block number or error code.
+#define TFTP_BLOCK_SIZE     512    // Data bytes per block without options.
+#define TFTP_MAX_REQUEST    512    // Largest request datagram we accept.
+#define TFTP_MIN_BLKSIZE    8      // RFC 2348 limits.
+#define TFTP_MAX_BLKSIZE    65464
+#define TFTP_MAX_WINDOWSIZE 65535  // RFC 7440 limit.
+
+enum tftp_opcode {
+	OP_RRQ   = 1,
+	OP_WRQ   = 2,
+	OP_DATA  = 3,
+	OP_ACK   = 4,
+	OP_ERROR = 5,
+	OP_OACK  = 6
+};
+
+enum tftp_error {
+	ERR_UNDEFINED   = 0,
+	ERR_NOT_FOUND   = 1,
+	ERR_ACCESS      = 2,
+	ERR_DISK_FULL   = 3,
+	ERR_ILLEGAL     = 4,
+	ERR_UNKNOWN_TID = 5,
+	ERR_EXISTS      = 6,
+	ERR_NO_USER     = 7,
+	ERR_OPTION      = 8
+};
+
+enum tftp_mode {
+	MODE_OCTET,
+	MODE_NETASCII
+};
+
+// A parsed RRQ or WRQ. The strings point into the request buffer.
+struct tftp_request {
+	int opcode;
+	const char *file_name;
+	const char *mode_name;
+	enum tftp_mode mode;
+
+	// Options the client asked for; zero when absent. Values are already clamped to the RFC ranges.
+	unsigned blksize;     // RFC 2348.
+	unsigned windowsize;  // RFC 7440.
+	unsigned timeout;     // RFC 2349, in seconds.
+	int tsize;            // RFC 2349: non-zero if the client wants the file size.
+	int has_offset;       // Non-standard "offset": resume the file from this byte.
+	unsigned long long offset;
+
+	// Set when parsing fails: what to send back to the client.
+	int error_code;
+	const char *error_message;
+};
+
+int packet_parse_request( unsigned char *buffer, size_t length, struct tftp_request *request );
+int packet_error_for_errno( int error_number, const char **message );
+size_t packet_build_error( unsigned char *buffer, size_t size, int error_code, const char *message );
+size_t packet_put_option( unsigned char *buffer, size_t length, size_t size, const char *name, unsigned long value );
+
+static inline void packet_put_header( unsigned char *buffer, int opcode, unsigned value )
+{
+	buffer[0] = (unsigned char)(opcode >> 8);
+	buffer[1] = (unsigned char)opcode;
+	buffer[2] = (unsigned char)(value >> 8);
+	buffer[3] = (unsigned char)value;
+}
+
+static inline unsigned packet_opcode( const unsigned char *buffer )
+{
+	return ((unsigned)buffer[0] << 8) | buffer[1];
+}
+
+static inline unsigned packet_block( const unsigned char *buffer )
+{
+	return ((unsigned)buffer[2] << 8) | buffer[3];
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*!
+ * \file policy.c
+ * \brief The registry of policies and the "name=value" settings that fill them in.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "bundle.h"
+#include "iso.h"
+#include "packet.h"
+#include "policy.h"
+
+// Policies are never freed, so the pointers handed out stay valid.
+static struct policy **registry;
+static int registry_count;
+static int registry_capacity;
+
+
+//! Creates a policy with default limits serving root. Returns NULL if out of memory.
+struct policy *policy_create( const char *root )
+{
+	struct policy *policy;
+
+	if( registry_count == registry_capacity ) {
+		int capacity = registry_capacity == 0 ? 16 : registry_capacity * 2;
+		struct policy **grown = realloc( registry, (size_t)capacity * sizeof(*grown) );
+
+		if( grown == NULL ) {
+			return NULL;
+		}
+		registry = grown;
+		registry_capacity = capacity;
+	}
+
+	if( (policy = calloc( 1, sizeof(*policy) )) == NULL ) {
+		return NULL;
+	}
+	policy->id = registry_count;
+	policy->root = root;
+	policy->root_handle = -1;
+	policy->max_blksize = TFTP_MAX_BLKSIZE;
+	policy->max_windowsize = POLICY_WINDOWSIZE_LIMIT;
+	registry[registry_count++] = policy;
+	return policy;
+}
+
+
+struct policy *policy_lookup( int id )
+{
+	return id >= 0 && id < registry_count ? registry[id] : NULL;
+}
+
+
+//! Applies one "name=value" setting. Returns 0, or -1 if the name or value is not valid.
+int policy_set( struct policy *policy, const char *setting )
+{
+	const char *value = strchr( setting, '=' );
+	size_t name_length;
+	char *end;
+	unsigned long number;
+
+	if( value == NULL ) {
+		return -1;
+	}
+	name_length = (size_t)(value - setting);
+	++value;
+
+	if( name_length == 4 && strncmp( setting, "root", 4 ) == 0 ) {
+		policy->root = value;
+		return 0;
+	}
+	if( name_length == 6 && strncmp( setting, "bundle", 6 ) == 0 ) {
+		policy->bundle_path = value;
+		return 0;
+	}
+	if( name_length == 5 && strncmp( setting, "image", 5 ) == 0 ) {
+		policy->image_path = value;
+		return 0;
+	}
+
+	number = strtoul( value, &end, 10 );
+	if( *end != '\0' || end == value ) {
+		return -1;
+	}
+
+	if( name_length == 3 && strncmp( setting, "max", 3 ) == 0 ) {
+		policy->max_transfers = (unsigned)number;
+	}
+	else if( name_length == 7 && strncmp( setting, "blksize", 7 ) == 0 ) {
+		if( number < TFTP_MIN_BLKSIZE || number > TFTP_MAX_BLKSIZE ) {
+			return -1;
+		}
+		policy->max_blksize = (unsigned)number;
+	}
+	else if( name_length == 10 && strncmp( setting, "windowsize", 10 ) == 0 ) {
+		if( number < 1 || number > POLICY_WINDOWSIZE_LIMIT ) {
+			return -1;
+		}
+		policy->max_windowsize = (unsigned)number;
+	}
+	else if( name_length == 4 && strncmp( setting, "rate", 4 ) == 0 ) {
+		policy->rate_limit = number;
+	}
+	else if( name_length == 8 && strncmp( setting, "prefetch", 8 ) == 0 ) {
+		if( number > 100 ) {
+			return -1;
+		}
+		policy->prefetch_percent = (unsigned)number;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+
+//! Opens the policy's root directory, or maps its bundle or image if it has one. Returns 0, or -1 with errno set
+//! (EINVAL if it has both).
+int policy_open_root( struct policy *policy )
+{
+	if( policy->bundle_path != NULL && policy->image_path != NULL ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( policy->bundle_path != NULL ) {
+		return (policy->bundle = bundle_open( policy->bundle_path )) != NULL ? 0 : -1;
+	}
+	if( policy->image_path != NULL ) {
+		return (policy->image = iso_open( policy->image_path )) != NULL ? 0 : -1;
+	}
+	if( (policy->root_handle = open( policy->root, O_RDONLY | O_DIRECTORY )) == -1 ) {
+		return -1;
+	}
+	return 0;
+}
+
+
+//! What the policy serves, for messages: its bundle, its image or its root directory.
+const char *policy_source( const struct policy *policy )
+{
+	if( policy->bundle_path != NULL ) {
+		return policy->bundle_path;
+	}
+	return policy->image_path != NULL ? policy->image_path : policy->root;
+}
@@ -0,0 +1,38 @@
+/*!
+ * \file policy.h
+ * \brief What a request is allowed to do, decided by where it arrived and who sent it.
+ *
+ * Every listener points at one policy, and every client class (see
+ * classifier.h) has its own. The request loop picks the policy once, when the
+ * request is received, and everything downstream (admission, path
+ * resolution, option negotiation, pacing) consults only that object.
+ */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#define POLICY_WINDOWSIZE_LIMIT 64  // Largest window any policy may allow; each block in it is buffered.
+
+struct policy {
+	int id;                     // Index in the registry; see policy_lookup().
+	const char *root;           // Directory served, as given on the command line.
+	int root_handle;            // Open handle on root; file names are resolved with openat(). -1 with a bundle.
+	const char *bundle_path;    // Bundle served instead of root (see bundle.h), or NULL.
+	struct bundle *bundle;      // The mapped bundle_path; file names are looked up in its index.
+	const char *image_path;     // ISO 9660 image served instead of root (see iso.h), or NULL.
+	struct iso_image *image;    // The mapped image_path; file names are looked up in its index.
+	unsigned max_transfers;     // Concurrent transfers allowed; 0 for no limit.
+	unsigned active_transfers;  // Transfers running now. Maintained by the listening process, and with -t by the worker threads.
+	unsigned max_blksize;       // Largest block size a client may negotiate.
+	unsigned max_windowsize;    // Largest window a client may negotiate.
+	unsigned long rate_limit;   // Bytes per second for each transfer; 0 for no limit.
+	unsigned prefetch_percent;  // Prefetch files that follow a request this often or more (see prefetch.h); 0 not to.
+};
+
+struct policy *policy_create( const char *root );
+struct policy *policy_lookup( int id );
+int policy_set( struct policy *policy, const char *setting );
+int policy_open_root( struct policy *policy );
+const char *policy_source( const struct policy *policy );
+
+#endif
@@ -0,0 +1,262 @@
+/*!
+ * \file prefetch.c
+ * \brief Per-policy Markov models of request chains, and the prefetches they predict.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "bundle.h"
+#include "iso.h"
+#include "packet.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "transfer.h"
+
+#define NO_FILE UINT32_MAX
+
+// A successor of a file: a slot in the same model, and the hash of the name it held, in case it was reused.
+struct successor {
+	uint32_t file;
+	uint64_t hash;
+	unsigned count;
+};
+
+struct file_node {
+	char *name;  // NULL if the slot is free.
+	uint64_t hash;
+	unsigned total;  // Transitions counted from this file.
+	struct successor next[PREFETCH_NEXT];
+};
+
+// One policy's model: an open-addressed table of file names.
+struct model {
+	struct file_node files[PREFETCH_FILES];
+	size_t count;
+};
+
+// The last request seen from a client, and what it made us prefetch. Clients that hash alike share an entry.
+struct client_state {
+	client_key key;
+	int used;
+	int policy_id;
+	uint32_t file;
+	uint64_t hash;
+	int64_t when;
+	uint64_t predicted[PREFETCH_NEXT];  // Name hashes.
+	unsigned predicted_count;
+};
+
+// Requests may come from several acceptor threads at once.
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct model **models;  // Indexed by policy id; allocated on first use.
+static int model_count;
+static struct client_state clients[PREFETCH_CLIENTS];
+
+
+static int64_t now_ns( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// FNV-1a.
+static uint64_t name_hash( const char *name )
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while( *name != '\0' ) {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+static struct model *model_for( int policy_id )
+{
+	if( policy_id >= model_count ) {
+		int count = policy_id + 1;
+		struct model **grown = realloc( models, (size_t)count * sizeof(*grown) );
+
+		if( grown == NULL ) {
+			return NULL;
+		}
+		memset( grown + model_count, 0, (size_t)(count - model_count) * sizeof(*grown) );
+		models = grown;
+		model_count = count;
+	}
+	if( models[policy_id] == NULL ) {
+		models[policy_id] = calloc( 1, sizeof(struct model) );
+	}
+	return models[policy_id];
+}
+
+
+static void model_clear( struct model *model )
+{
+	for( size_t i = 0; i < PREFETCH_FILES; ++i ) {
+		free( model->files[i].name );
+	}
+	memset( model, 0, sizeof(*model) );
+}
+
+
+// Returns the slot of name in model, adding it if need be; NO_FILE if out of memory. A model three quarters full
+// is cleared first.
+static uint32_t model_intern( struct model *model, const char *name, uint64_t hash )
+{
+	size_t mask = PREFETCH_FILES - 1;
+	size_t slot = (size_t)hash & mask;
+
+	while( model->files[slot].name != NULL ) {
+		if( model->files[slot].hash == hash && strcmp( model->files[slot].name, name ) == 0 ) {
+			return (uint32_t)slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+	if( model->count >= PREFETCH_FILES / 4 * 3 ) {
+		model_clear( model );
+		slot = (size_t)hash & mask;
+	}
+	if( (model->files[slot].name = strdup( name )) == NULL ) {
+		return NO_FILE;
+	}
+	model->files[slot].hash = hash;
+	model->count++;
+	return (uint32_t)slot;
+}
+
+
+// Counts a request for file following one for from. A new successor takes the place of the least counted one,
+// inheriting its count plus one, so a file that keeps coming up gets in even when the list is full.
+static void model_learn( struct model *model, uint32_t from, uint32_t file, uint64_t hash )
+{
+	struct file_node *node = &model->files[from];
+	struct successor *least = &node->next[0];
+
+	for( int i = 0; i < PREFETCH_NEXT; ++i ) {
+		struct successor *next = &node->next[i];
+
+		if( next->count != 0 && next->file == file && next->hash == hash ) {
+			least = next;
+			break;
+		}
+		if( next->count < least->count ) {
+			least = next;
+		}
+	}
+	if( least->file != file || least->hash != hash || least->count == 0 ) {
+		least->file = file;
+		least->hash = hash;
+	}
+	least->count++;
+	if( ++node->total >= PREFETCH_AGE_AFTER ) {
+		node->total = 0;
+		for( int i = 0; i < PREFETCH_NEXT; ++i ) {
+			node->next[i].count /= 2;
+			node->total += node->next[i].count;
+		}
+	}
+}
+
+
+//! Learns from a request for file_name by the client with key under policy, and prefetches the files likely to
+//! be asked for next. Does nothing unless the policy sets prefetch=N.
+void prefetch_request( const struct policy *policy, const client_key *key, const char *file_name )
+{
+	char names[PREFETCH_NEXT][TFTP_MAX_REQUEST];
+	int name_count = 0;
+	client_key address = *key;
+	struct client_state *client;
+	uint64_t hash = name_hash( file_name );
+	int64_t now = now_ns( );
+	struct model *model;
+	struct file_node *node;
+	uint32_t file;
+
+	if( policy->prefetch_percent == 0 ) {
+		return;
+	}
+	// A client takes a new port for each transfer (its TID), so a chain is followed by address alone.
+	address.port = 0;
+	client = &clients[client_key_hash( &address ) & (PREFETCH_CLIENTS - 1)];
+
+	pthread_mutex_lock( &prefetch_lock );
+	if( (model = model_for( policy->id )) == NULL || (file = model_intern( model, file_name, hash )) == NO_FILE ) {
+		pthread_mutex_unlock( &prefetch_lock );
+		return;
+	}
+
+	// The next step of a chain this client is in: learn it, and see whether it was predicted.
+	if( client->used && client_key_equal( &client->key, &address ) && client->policy_id == policy->id &&
+	    now - client->when <= PREFETCH_GAP_NS ) {
+		for( unsigned i = 0; i < client->predicted_count; ++i ) {
+			if( client->predicted[i] == hash ) {
+				STATS_INC( prefetch.hits );
+				break;
+			}
+		}
+		if( model->files[client->file].name != NULL && model->files[client->file].hash == client->hash ) {
+			model_learn( model, client->file, file, hash );
+		}
+	}
+	client->key = address;
+	client->used = 1;
+	client->policy_id = policy->id;
+	client->file = file;
+	client->hash = hash;
+	client->when = now;
+	client->predicted_count = 0;
+
+	// Predict from what has followed this file before.
+	node = &model->files[file];
+	for( int i = 0; node->total >= PREFETCH_MIN_SEEN && i < PREFETCH_NEXT; ++i ) {
+		struct successor *next = &node->next[i];
+		struct file_node *target = &model->files[next->file];
+
+		if( next->count == 0 || target->name == NULL || target->hash != next->hash ||
+		    (unsigned long)next->count * 100 < (unsigned long)node->total * policy->prefetch_percent ) {
+			continue;
+		}
+		client->predicted[client->predicted_count++] = next->hash;
+		strcpy( names[name_count++], target->name );
+		STATS_INC( prefetch.issued );
+	}
+	pthread_mutex_unlock( &prefetch_lock );
+
+	// Opening the files is left until the models are free for other threads.
+	for( int i = 0; i < name_count; ++i ) {
+		int error_code;
+		const char *message;
+		int handle;
+
+		if( policy->bundle != NULL ) {
+			bundle_will_need( policy->bundle, names[i] );
+			continue;
+		}
+		if( policy->image != NULL ) {
+			iso_will_need( policy->image, names[i] );
+			continue;
+		}
+		// A file served from its compressed copy is advised as that.
+		if( (handle = open_in_root( policy->root_handle, names[i], &error_code, &message )) == -1 &&
+		    error_code == ERR_NOT_FOUND && strlen( names[i] ) + sizeof(SEEKABLE_SUFFIX) <= sizeof(names[i]) ) {
+			strcat( names[i], SEEKABLE_SUFFIX );
+			handle = open_in_root( policy->root_handle, names[i], &error_code, &message );
+		}
+		if( handle != -1 ) {
+			posix_fadvise( handle, 0, 0, POSIX_FADV_WILLNEED );
+			close( handle );
+		}
+	}
+}
@@ -0,0 +1,46 @@
+/*!
+ * \file prefetch.h
+ * \brief Prefetching of the file a client is likely to ask for next, learned per policy (prefetch=N).
+ *
+ * Network boot clients fetch the same chain of files in the same order:
+ * pxelinux.0, ldlinux.c32, a configuration file, then a kernel and an
+ * initrd. Each policy with prefetch=N set (so each client class, or each
+ * listener) learns its own first-order Markov model of that chain from the
+ * requests it serves: for every file name, how often each other name was
+ * the next request from the same client address, within PREFETCH_GAP_NS.
+ *
+ * When a request arrives, every file that has followed the requested one
+ * at least N percent of the time (out of at least PREFETCH_MIN_SEEN times)
+ * is opened and handed to posix_fadvise(POSIX_FADV_WILLNEED), so the kernel
+ * starts reading it into the page cache while the client is still busy with
+ * the current step. A prefetch is a hit if the client's next request is for
+ * the prefetched file; SIGUSR1 prints the prefetches issued and the hit rate.
+ *
+ * The models are small and bounded: a model that fills up with names is
+ * cleared and learns again, and counts are halved once a file has been
+ * followed PREFETCH_AGE_AFTER times, so a chain that changes is relearned.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdatomic.h>
+
+#include "addrkey.h"
+#include "policy.h"
+
+#define PREFETCH_FILES      1024   // File names per model; a power of two.
+#define PREFETCH_NEXT       4      // Successors remembered per file name.
+#define PREFETCH_CLIENTS    4096   // Clients whose last request is remembered; a power of two.
+#define PREFETCH_GAP_NS     60000000000LL  // Longest gap between two requests of one chain.
+#define PREFETCH_MIN_SEEN   3      // Times a file must have been followed before it predicts anything.
+#define PREFETCH_AGE_AFTER  1024   // Halve a file's counts when this many transitions from it have been seen.
+
+struct prefetch_stats {
+	atomic_ulong issued;  // Files prefetched.
+	atomic_ulong hits;    // Of those, files the client asked for next.
+};
+
+void prefetch_request( const struct policy *policy, const client_key *key, const char *file_name );
+
+#endif
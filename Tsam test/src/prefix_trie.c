@@ -0,0 +1,318 @@
+/*!
+ * \file prefix_trie.c
+ * \brief Path-compressed binary trie for longest-prefix match.
+ *
+ * Nodes are allocated from one growable array, so they must be re-fetched by
+ * index after anything that may allocate. Each family has a permanent root
+ * node of length zero; because that root can never be split, every split has
+ * a parent to re-link.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "prefix_trie.h"
+
+static const unsigned family_bits[FAMILY_COUNT] = { 32, 128 };
+
+
+static inline unsigned get_bit( const uint8_t *bits, unsigned index )
+{
+	return (bits[index >> 3] >> (7 - (index & 7))) & 1;
+}
+
+
+// Number of leading bits a and b share, at most limit.
+static unsigned common_length( const uint8_t *a, const uint8_t *b, unsigned limit )
+{
+	unsigned length = 0;
+
+	while( length < limit ) {
+		uint8_t difference = a[length >> 3] ^ b[length >> 3];
+
+		if( difference == 0 ) {
+			length = (length & ~7u) + 8;
+			continue;
+		}
+		while( !(difference & (0x80 >> (length & 7))) ) {
+			++length;
+		}
+		break;
+	}
+	return length < limit ? length : limit;
+}
+
+
+// Non-zero if the first node->length bits of bits equal the node's prefix.
+static inline int prefix_matches( const struct prefix_node *node, const uint8_t *bits )
+{
+	unsigned whole = node->length >> 3;
+	unsigned rest = node->length & 7;
+
+	if( memcmp( node->bits, bits, whole ) != 0 ) {
+		return 0;
+	}
+	return rest == 0 || ((node->bits[whole] ^ bits[whole]) & (uint8_t)(0xff00 >> rest)) == 0;
+}
+
+
+// Appends a node holding the first length bits of bits. Returns its index or PREFIX_TRIE_NONE.
+static uint32_t new_node( struct prefix_trie *trie, const uint8_t *bits, unsigned length )
+{
+	struct prefix_node *node;
+
+	if( trie->count == trie->capacity ) {
+		size_t capacity = trie->capacity * 2;
+		struct prefix_node *nodes = realloc( trie->nodes, capacity * sizeof(*nodes) );
+
+		if( nodes == NULL ) {
+			return PREFIX_TRIE_NONE;
+		}
+		trie->nodes = nodes;
+		trie->capacity = capacity;
+	}
+
+	node = &trie->nodes[trie->count];
+	memset( node, 0, sizeof(*node) );
+	memcpy( node->bits, bits, (length + 7) / 8 );
+	if( length & 7 ) {
+		node->bits[length >> 3] &= (uint8_t)(0xff00 >> (length & 7));
+	}
+	node->length = (uint8_t)length;
+	node->child[0] = PREFIX_TRIE_NONE;
+	node->child[1] = PREFIX_TRIE_NONE;
+	return (uint32_t)trie->count++;
+}
+
+
+int prefix_trie_init( struct prefix_trie *trie )
+{
+	static const uint8_t zero[16];
+
+	trie->capacity = 64;
+	trie->count = 0;
+	trie->prefixes = 0;
+	if( (trie->nodes = malloc( trie->capacity * sizeof(*trie->nodes) )) == NULL ) {
+		return -1;
+	}
+	for( int family = 0; family < FAMILY_COUNT; ++family ) {
+		trie->root[family] = new_node( trie, zero, 0 );
+	}
+	return 0;
+}
+
+
+void prefix_trie_destroy( struct prefix_trie *trie )
+{
+	free( trie->nodes );
+	trie->nodes = NULL;
+	trie->count = 0;
+	trie->capacity = 0;
+}
+
+
+//! Associates value with address/length, replacing any earlier value. Returns 0, or -1 if out of memory.
+int prefix_trie_insert( struct prefix_trie *trie, int family, const uint8_t *address, unsigned length, void *value )
+{
+	uint8_t bits[16] = { 0 };
+	uint32_t current = trie->root[family];
+	uint32_t parent = PREFIX_TRIE_NONE;
+	unsigned slot = 0;
+
+	if( length > family_bits[family] ) {
+		return -1;
+	}
+	memcpy( bits, address, family_bits[family] / 8 );
+
+	while( 1 ) {
+		struct prefix_node *node = &trie->nodes[current];
+		unsigned limit = node->length < length ? node->length : length;
+		unsigned common = common_length( node->bits, bits, limit );
+		uint32_t middle;
+		uint32_t leaf;
+		unsigned bit;
+
+		// The new prefix diverges inside this node's prefix: split it.
+		if( common < node->length ) {
+			unsigned old_bit = get_bit( node->bits, common );
+
+			if( (middle = new_node( trie, bits, common )) == PREFIX_TRIE_NONE ) {
+				return -1;
+			}
+			trie->nodes[middle].child[old_bit] = current;
+			trie->nodes[parent].child[slot] = middle;
+
+			if( common == length ) {
+				trie->nodes[middle].value = value;
+				trie->nodes[middle].has_value = 1;
+			}
+			else {
+				if( (leaf = new_node( trie, bits, length )) == PREFIX_TRIE_NONE ) {
+					return -1;
+				}
+				trie->nodes[leaf].value = value;
+				trie->nodes[leaf].has_value = 1;
+				trie->nodes[middle].child[get_bit( bits, common )] = leaf;
+			}
+			trie->prefixes++;
+			return 0;
+		}
+
+		if( node->length == length ) {
+			if( !node->has_value ) {
+				trie->prefixes++;
+			}
+			node->value = value;
+			node->has_value = 1;
+			return 0;
+		}
+
+		// This node's prefix covers the new one; descend on the next bit.
+		bit = get_bit( bits, node->length );
+		if( node->child[bit] == PREFIX_TRIE_NONE ) {
+			if( (leaf = new_node( trie, bits, length )) == PREFIX_TRIE_NONE ) {
+				return -1;
+			}
+			trie->nodes[leaf].value = value;
+			trie->nodes[leaf].has_value = 1;
+			trie->nodes[current].child[bit] = leaf;
+			trie->prefixes++;
+			return 0;
+		}
+		parent = current;
+		slot = bit;
+		current = node->child[bit];
+	}
+}
+
+
+static void key_bits( const client_key *key, uint8_t *bits )
+{
+	if( key->family == FAMILY_V4 ) {
+		memcpy( bits, &key->addr.v4, 4 );
+	}
+	else {
+		memcpy( bits, key->addr.v6, 16 );
+	}
+}
+
+
+//! Returns the value of the longest prefix containing the client's address, or NULL.
+void *prefix_trie_lookup( const struct prefix_trie *trie, const client_key *key )
+{
+	uint8_t bits[16];
+	unsigned limit = family_bits[key->family];
+	uint32_t current = trie->root[key->family];
+	void *best = NULL;
+
+	key_bits( key, bits );
+	while( current != PREFIX_TRIE_NONE ) {
+		const struct prefix_node *node = &trie->nodes[current];
+
+		if( !prefix_matches( node, bits ) ) {
+			break;
+		}
+		if( node->has_value ) {
+			best = node->value;
+		}
+		if( node->length >= limit ) {
+			break;
+		}
+		current = node->child[get_bit( bits, node->length )];
+	}
+	return best;
+}
+
+
+//! Stores the values of up to max prefixes containing the client, shortest first. Returns how many.
+size_t prefix_trie_matches( const struct prefix_trie *trie, const client_key *key, void **values, size_t max )
+{
+	uint8_t bits[16];
+	unsigned limit = family_bits[key->family];
+	uint32_t current = trie->root[key->family];
+	size_t count = 0;
+
+	key_bits( key, bits );
+	while( current != PREFIX_TRIE_NONE && count < max ) {
+		const struct prefix_node *node = &trie->nodes[current];
+
+		if( !prefix_matches( node, bits ) ) {
+			break;
+		}
+		if( node->has_value ) {
+			values[count++] = node->value;
+		}
+		if( node->length >= limit ) {
+			break;
+		}
+		current = node->child[get_bit( bits, node->length )];
+	}
+	return count;
+}
+
+
+//! Returns the value stored for exactly address/length, or NULL.
+void *prefix_trie_get( const struct prefix_trie *trie, int family, const uint8_t *address, unsigned length )
+{
+	uint8_t bits[16] = { 0 };
+	uint32_t current = trie->root[family];
+
+	if( length > family_bits[family] ) {
+		return NULL;
+	}
+	memcpy( bits, address, family_bits[family] / 8 );
+
+	while( current != PREFIX_TRIE_NONE ) {
+		const struct prefix_node *node = &trie->nodes[current];
+
+		if( node->length > length || !prefix_matches( node, bits ) ) {
+			return NULL;
+		}
+		if( node->length == length ) {
+			return node->has_value ? node->value : NULL;
+		}
+		current = node->child[get_bit( bits, node->length )];
+	}
+	return NULL;
+}
+
+
+//! Parses "address[/length]". Returns 0 on success, -1 if text is not a valid prefix.
+int prefix_parse( const char *text, int *family, uint8_t address[16], unsigned *length )
+{
+	char buffer[INET6_ADDRSTRLEN + 4];
+	char *slash;
+	char *end;
+
+	if( strlen( text ) >= sizeof(buffer) ) {
+		return -1;
+	}
+	strcpy( buffer, text );
+	if( (slash = strchr( buffer, '/' )) != NULL ) {
+		*slash = '\0';
+	}
+
+	memset( address, 0, 16 );
+	if( inet_pton( AF_INET, buffer, address ) == 1 ) {
+		*family = FAMILY_V4;
+	}
+	else if( inet_pton( AF_INET6, buffer, address ) == 1 ) {
+		*family = FAMILY_V6;
+	}
+	else {
+		return -1;
+	}
+
+	*length = family_bits[*family];
+	if( slash != NULL ) {
+		unsigned long value = strtoul( slash + 1, &end, 10 );
+
+		if( *end != '\0' || end == slash + 1 || value > family_bits[*family] ) {
+			return -1;
+		}
+		*length = (unsigned)value;
+	}
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*!
+ * \file prefix_trie.h
+ * \brief Longest-prefix match over IPv4 and IPv6 addresses.
+ *
+ * A path-compressed binary trie (one per address family) whose nodes live in
+ * a single array and refer to each other by index. A lookup visits at most
+ * one node per distinct prefix length on the path, so its cost depends on
+ * the address length and not on how many prefixes are stored.
+ */
+
+#ifndef PREFIX_TRIE_H
+#define PREFIX_TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addrkey.h"
+
+#define PREFIX_TRIE_NONE UINT32_MAX
+
+struct prefix_node {
+	uint8_t  bits[16];     // Prefix, left aligned; bits past length are zero.
+	uint8_t  length;       // Prefix length in bits (0 to 128).
+	uint8_t  has_value;
+	uint32_t child[2];     // Indices of the subtries for the next bit, or PREFIX_TRIE_NONE.
+	void    *value;
+};
+
+struct prefix_trie {
+	struct prefix_node *nodes;
+	size_t count;
+	size_t capacity;
+	uint32_t root[FAMILY_COUNT];  // A zero-length node per family.
+	size_t prefixes;              // Number of prefixes holding a value.
+};
+
+int    prefix_trie_init( struct prefix_trie *trie );
+void   prefix_trie_destroy( struct prefix_trie *trie );
+int    prefix_trie_insert( struct prefix_trie *trie, int family, const uint8_t *address, unsigned length, void *value );
+void  *prefix_trie_get( const struct prefix_trie *trie, int family, const uint8_t *address, unsigned length );
+void  *prefix_trie_lookup( const struct prefix_trie *trie, const client_key *key );
+size_t prefix_trie_matches( const struct prefix_trie *trie, const client_key *key, void **values, size_t max );
+
+int    prefix_parse( const char *text, int *family, uint8_t address[16], unsigned *length );
+
+#endif
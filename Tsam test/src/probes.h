@@ -0,0 +1,63 @@
+/*!
+ * \file probes.h
+ * \brief USDT static tracepoints on the life of a request and its transfer.
+ *
+ * Where <sys/sdt.h> (SystemTap's header, also used by bpftrace and perf) is
+ * available, each PROBE_ macro below plants a probe in provider "tftpd": a
+ * single NOP in the code plus a note in the ELF file, so it costs nothing
+ * until a tracer attaches. Elsewhere, or with -DTFTPD_NO_PROBES, the macros
+ * expand to nothing. List them with "bpftrace -l 'usdt:./tftpd:*'", e.g.
+ *
+ *     bpftrace -e 'usdt:./tftpd:tftpd:transfer__done { @bytes = hist(arg2); }'
+ *
+ * "id" is the transfer's process id, or its session id with -m event.
+ * Blocks are counted from 1 and do not wrap at 16 bits.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(__has_include) && !defined(TFTPD_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TFTPD_PROBES 1
+#endif
+#endif
+
+#ifdef TFTPD_PROBES
+
+// A datagram arrived on a listening socket: (address family, length).
+#define PROBE_REQUEST_RECEIVED(family, length) STAP_PROBE2( tftpd, request__received, family, length )
+// It parsed as a request: (opcode, file name, mode).
+#define PROBE_REQUEST_PARSED(opcode, file_name, mode) STAP_PROBE3( tftpd, request__parsed, opcode, file_name, mode )
+// A transfer was set up: (id, blksize, windowsize, file offset it starts at).
+#define PROBE_SESSION_CREATE(id, blksize, windowsize, offset) \
+	STAP_PROBE4( tftpd, session__create, id, blksize, windowsize, offset )
+// A DATA packet went out: (id, block, data bytes).
+#define PROBE_DATA_SEND(id, block, bytes) STAP_PROBE3( tftpd, data__send, id, block, bytes )
+// The server went back to resend: (id, first block, number of blocks).
+#define PROBE_DATA_RETRANSMIT(id, block, count) STAP_PROBE3( tftpd, data__retransmit, id, block, count )
+// An ACK moved the window: (id, block acknowledged, file bytes acknowledged so far).
+#define PROBE_ACK_RECEIVED(id, block, bytes) STAP_PROBE3( tftpd, ack__received, id, block, bytes )
+// No ACK came in time: (id, oldest unacknowledged block, retries so far).
+#define PROBE_TIMEOUT(id, block, retries) STAP_PROBE3( tftpd, timeout, id, block, retries )
+// The last block was acknowledged: (id, blocks, file bytes).
+#define PROBE_TRANSFER_DONE(id, blocks, bytes) STAP_PROBE3( tftpd, transfer__done, id, blocks, bytes )
+// The transfer was abandoned: (id, blocks acknowledged, file bytes acknowledged).
+#define PROBE_TRANSFER_ERROR(id, blocks, bytes) STAP_PROBE3( tftpd, transfer__error, id, blocks, bytes )
+
+#else
+
+#define PROBE_REQUEST_RECEIVED(family, length) ((void)0)
+#define PROBE_REQUEST_PARSED(opcode, file_name, mode) ((void)0)
+#define PROBE_SESSION_CREATE(id, blksize, windowsize, offset) ((void)0)
+#define PROBE_DATA_SEND(id, block, bytes) ((void)0)
+#define PROBE_DATA_RETRANSMIT(id, block, count) ((void)0)
+#define PROBE_ACK_RECEIVED(id, block, bytes) ((void)0)
+#define PROBE_TIMEOUT(id, block, retries) ((void)0)
+#define PROBE_TRANSFER_DONE(id, blocks, bytes) ((void)0)
+#define PROBE_TRANSFER_ERROR(id, blocks, bytes) ((void)0)
+
+#endif
+
+#endif
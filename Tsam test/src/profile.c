@@ -0,0 +1,52 @@
+/*!
+ * \file profile.c
+ * \brief Accumulating and printing the phase counters.
+ */
+
+#include "profile.h"
+#include "stats.h"
+
+static const char *phase_names[PHASE_COUNT] = {
+	"receive", "parse", "resolve", "open", "first_read", "send", "ack", "timer"
+};
+
+#ifdef PHASE_PROFILE
+
+void profile_add( enum phase phase, uint64_t elapsed )
+{
+	struct phase_stats *counters = &stats->phases[phase];
+	unsigned long max = atomic_load_explicit( &counters->max, memory_order_relaxed );
+
+	atomic_fetch_add_explicit( &counters->count, 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( &counters->total, (unsigned long)elapsed, memory_order_relaxed );
+	while( elapsed > max &&
+	       !atomic_compare_exchange_weak_explicit( &counters->max, &max, (unsigned long)elapsed,
+	                                               memory_order_relaxed, memory_order_relaxed ) ) {
+	}
+}
+
+#endif
+
+
+//! Prints count, total, mean and maximum of each phase that has been measured.
+void profile_dump( FILE *stream )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	const char *unit = "cycles";
+#else
+	const char *unit = "ns";
+#endif
+
+	for( int phase = 0; phase < PHASE_COUNT; ++phase ) {
+		struct phase_stats *counters = &stats->phases[phase];
+		unsigned long count = atomic_load_explicit( &counters->count, memory_order_relaxed );
+		unsigned long total = atomic_load_explicit( &counters->total, memory_order_relaxed );
+
+		if( count == 0 ) {
+			continue;
+		}
+		fprintf( stream, "phase %s: count=%lu total=%lu mean=%lu max=%lu (%s)\n", phase_names[phase], count, total,
+		         total / count, atomic_load_explicit( &counters->max, memory_order_relaxed ), unit );
+	}
+	fflush( stream );
+}
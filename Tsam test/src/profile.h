@@ -0,0 +1,68 @@
+/*!
+ * \file profile.h
+ * \brief Optional per-phase time accounting for request handling.
+ *
+ * Built with -DPHASE_PROFILE (make clean; make CPPFLAGS=-DPHASE_PROFILE),
+ * the server measures each phase below with the time stamp counter where
+ * there is one (x86) and CLOCK_MONOTONIC nanoseconds elsewhere, and adds it
+ * to counters in the shared stats block. Every process (the listener and
+ * each transfer process, or the single event loop) adds to the same
+ * counters, and SIGUSR1 prints them with the other statistics. Without the
+ * macro, PROFILE_START and PROFILE_END compile to nothing.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum phase {
+	PHASE_RECEIVE,     // recvmmsg() of requests on a listening socket.
+	PHASE_PARSE,       // packet_parse_request().
+	PHASE_RESOLVE,     // ACL, client class, duplicate and admission checks.
+	PHASE_OPEN,        // Creating the transfer socket and opening the file.
+	PHASE_FIRST_READ,  // Reading block 1.
+	PHASE_SEND,        // Each DATA sendto() or sendmmsg() batch.
+	PHASE_ACK,         // Handling an ACK once it has been received.
+	PHASE_TIMER,       // Handling an expired retransmission timer.
+	PHASE_COUNT
+};
+
+struct phase_stats {
+	atomic_ulong count;
+	atomic_ulong total;  // In profile_unit() units.
+	atomic_ulong max;
+};
+
+#ifdef PHASE_PROFILE
+
+static inline uint64_t profile_clock( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc( );
+#else
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void profile_add( enum phase phase, uint64_t elapsed );
+
+#define PROFILE_START(start) uint64_t start = profile_clock( )
+#define PROFILE_END(phase, start) profile_add( (phase), profile_clock( ) - (start) )
+
+#else
+
+#define PROFILE_START(start)
+#define PROFILE_END(phase, start) ((void)0)
+
+#endif
+
+void profile_dump( FILE *stream );
+
+#endif
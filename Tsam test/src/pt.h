@@ -0,0 +1,41 @@
+/*!
+ * \file pt.h
+ * \brief Stackless coroutines (protothreads) built on a switch statement.
+ *
+ * A protothread is an ordinary function whose body sits between PT_BEGIN and
+ * PT_END. PT_YIELD records the line it was reached on and returns; the next
+ * call jumps straight back to that line through the switch that PT_BEGIN
+ * opened. The whole state of a suspended protothread is that one line number,
+ * so a waiting transfer costs two bytes rather than a stack.
+ *
+ * Two rules follow from the switch. Local variables are not kept across a
+ * PT_YIELD (anything needed afterwards lives in the caller's struct, or is
+ * passed in again as an argument), and the body must not contain a switch
+ * statement of its own around a PT_YIELD.
+ */
+
+#ifndef PT_H
+#define PT_H
+
+#include <stdint.h>
+
+struct pt {
+	uint16_t line;  // Where the protothread resumes; 0 to start from the top.
+};
+
+#define PT_INIT(pt) ((pt)->line = 0)
+
+#define PT_BEGIN(pt) switch( (pt)->line ) { case 0:
+
+// Returns to the caller; the next call continues with the statement after it.
+#define PT_YIELD(pt) \
+	do { \
+		(pt)->line = __LINE__; \
+		return; \
+		case __LINE__:; \
+	} while( 0 )
+
+// Ends the protothread; calling it again starts it over.
+#define PT_END(pt) } (pt)->line = 0
+
+#endif
@@ -0,0 +1,272 @@
+/*!
+ * \file readahead.c
+ * \brief The I/O thread pool, and inline reads of what the page cache already holds.
+ */
+
+#define _GNU_SOURCE  // preadv2() and RWF_NOWAIT.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "readahead.h"
+#include "stats.h"
+
+// Extents waiting for an I/O thread, oldest first.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;
+static struct readahead_extent *pool_head;
+static struct readahead_extent *pool_tail;
+static unsigned pool_threads;
+
+
+static int64_t now_ns( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Reads the rest of the extent, blocking as long as it takes, up to READAHEAD_EXTENT bytes or the end of the file.
+static void read_rest( struct readahead_extent *extent )
+{
+	while( extent->length < READAHEAD_EXTENT ) {
+		off_t offset = extent->offset + (off_t)extent->length;
+		ssize_t count = extent->seekable != NULL
+		              ? seekable_pread( extent->seekable, extent->data + extent->length,
+		                                READAHEAD_EXTENT - extent->length, offset, 0 )
+		              : pread( extent->file, extent->data + extent->length, READAHEAD_EXTENT - extent->length, offset );
+
+		if( count == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( count == -1 ) {
+			extent->error = errno;
+			return;
+		}
+		if( count == 0 ) {
+			return;
+		}
+		extent->length += (size_t)count;
+	}
+}
+
+
+// Hands a finished extent back to its table, and wakes the table's loop unless a wake-up is already pending.
+// The owner may free the extent as soon as it is on the queue.
+static void report( struct readahead_extent *extent )
+{
+	struct readahead_queue *queue = extent->queue;
+	uint64_t one = 1;
+
+	// The queue has room for every extent its table can have in flight; this only waits out a burst.
+	while( mpsc_push( &queue->done, &extent ) == -1 ) {
+		sched_yield( );
+	}
+	if( !atomic_exchange( &queue->signalled, 1 ) && write( queue->event, &one, sizeof(one) ) == -1 ) {
+		perror( "Unable to signal a finished read" );
+	}
+}
+
+
+static void *run_reader( void *argument )
+{
+	(void)argument;
+	while( 1 ) {
+		struct readahead_extent *extent;
+
+		pthread_mutex_lock( &pool_lock );
+		while( pool_head == NULL ) {
+			pthread_cond_wait( &pool_ready, &pool_lock );
+		}
+		extent = pool_head;
+		if( (pool_head = extent->next) == NULL ) {
+			pool_tail = NULL;
+		}
+		pthread_mutex_unlock( &pool_lock );
+
+		read_rest( extent );
+		if( extent->seekable != NULL ) {
+			seekable_release( extent->seekable );
+		}
+		STATS_ADD( readahead.async_us, (unsigned long)((now_ns( ) - extent->queued) / 1000) );
+		atomic_store_explicit( &extent->state, EXTENT_READY, memory_order_release );
+		report( extent );
+	}
+	return NULL;
+}
+
+
+//! Starts threads I/O threads, with every signal blocked. Returns 0, or -1 if one could not be started.
+int readahead_start( unsigned threads )
+{
+	sigset_t all, previous;
+	int result = 0;
+
+	sigfillset( &all );
+	pthread_sigmask( SIG_BLOCK, &all, &previous );
+	for( unsigned i = 0; i < threads && result == 0; ++i ) {
+		pthread_t thread;
+
+		if( (errno = pthread_create( &thread, NULL, run_reader, NULL )) != 0 ) {
+			result = -1;
+		}
+		else {
+			++pool_threads;
+		}
+	}
+	pthread_sigmask( SIG_SETMASK, &previous, NULL );
+	return result;
+}
+
+
+//! Returns non-zero if there are I/O threads to read ahead with.
+int readahead_running( void )
+{
+	return pool_threads != 0;
+}
+
+
+//! Sets up a completion queue for up to capacity extents in flight at once. Returns 0, or -1 on failure.
+int readahead_queue_init( struct readahead_queue *queue, size_t capacity )
+{
+	size_t size = 1;
+
+	while( size < capacity ) {
+		size <<= 1;
+	}
+	if( (queue->event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) == -1 ) {
+		return -1;
+	}
+	if( mpsc_init( &queue->done, size, sizeof(struct readahead_extent *) ) == -1 ) {
+		close( queue->event );
+		return -1;
+	}
+	atomic_init( &queue->signalled, 0 );
+	return 0;
+}
+
+
+void readahead_queue_destroy( struct readahead_queue *queue )
+{
+	close( queue->event );
+	mpsc_destroy( &queue->done );
+}
+
+
+//! Returns a new, empty extent, or NULL if out of memory.
+struct readahead_extent *readahead_extent_create( void )
+{
+	struct readahead_extent *extent = malloc( sizeof(*extent) );
+	void *data;
+
+	if( extent == NULL ) {
+		return NULL;
+	}
+	// Page aligned, as the extent is in the file, so the kernel copies whole pages.
+	if( posix_memalign( &data, 4096, READAHEAD_EXTENT ) != 0 ) {
+		free( extent );
+		return NULL;
+	}
+	atomic_init( &extent->state, EXTENT_EMPTY );
+	extent->in_flight = 0;
+	extent->abandoned = 0;
+	extent->data = data;
+	return extent;
+}
+
+
+//! Frees the extent, or if an I/O thread still has it, leaves readahead_completed() to free it once it is back.
+void readahead_extent_release( struct readahead_extent *extent )
+{
+	if( extent->in_flight ) {
+		extent->abandoned = 1;
+		return;
+	}
+	free( extent->data );
+	free( extent );
+}
+
+
+//! Fills extent with file, or the compressed file seekable if that is not NULL, from offset, which is a multiple
+//! of READAHEAD_EXTENT: at once if the page cache (or the LRU of inflated frames) holds it up to the extent's end
+//! (or file_size), otherwise on an I/O thread, which reports it to queue for session id.
+void readahead_load( struct readahead_extent *extent, int file, struct seekable *seekable, off_t offset,
+                     off_t file_size, struct readahead_queue *queue, uint32_t id )
+{
+	size_t wanted = offset >= file_size ? 0 : file_size - offset < READAHEAD_EXTENT ? (size_t)(file_size - offset)
+	                                                                                 : READAHEAD_EXTENT;
+	struct iovec vector = { extent->data, READAHEAD_EXTENT };
+	ssize_t count;
+
+	extent->file = file;
+	extent->seekable = seekable;
+	extent->offset = offset;
+	extent->length = 0;
+	extent->error = 0;
+	extent->id = id;
+	extent->queue = queue;
+
+	// Anything but a full answer from the page cache, including a file system without RWF_NOWAIT, goes to a thread.
+	count = seekable != NULL ? seekable_pread( seekable, extent->data, READAHEAD_EXTENT, offset, SEEKABLE_NOWAIT )
+	                         : preadv2( file, &vector, 1, offset, RWF_NOWAIT );
+	if( count > 0 ) {
+		extent->length = (size_t)count;
+	}
+	if( count >= 0 && extent->length >= wanted ) {
+		STATS_INC( readahead.inline_reads );
+		atomic_store_explicit( &extent->state, EXTENT_READY, memory_order_relaxed );
+		return;
+	}
+
+	STATS_INC( readahead.async_reads );
+	atomic_store_explicit( &extent->state, EXTENT_READING, memory_order_relaxed );
+	extent->in_flight = 1;
+	if( seekable != NULL ) {
+		seekable_hold( seekable );
+	}
+	extent->queued = now_ns( );
+	extent->next = NULL;
+	pthread_mutex_lock( &pool_lock );
+	if( pool_tail != NULL ) {
+		pool_tail->next = extent;
+	}
+	else {
+		pool_head = extent;
+	}
+	pool_tail = extent;
+	pthread_cond_signal( &pool_ready );
+	pthread_mutex_unlock( &pool_lock );
+}
+
+
+//! Returns the next extent an I/O thread has finished for this queue's table, or NULL if there are no more for now.
+//! Extents whose session has ended are freed on the way.
+struct readahead_extent *readahead_completed( struct readahead_queue *queue )
+{
+	struct readahead_extent *extent;
+	uint64_t count;
+
+	if( atomic_load_explicit( &queue->signalled, memory_order_relaxed ) && atomic_exchange( &queue->signalled, 0 ) &&
+	    read( queue->event, &count, sizeof(count) ) == -1 && errno != EAGAIN ) {
+		perror( "Unable to read the completion event" );
+	}
+	while( mpsc_pop( &queue->done, &extent ) == 0 ) {
+		extent->in_flight = 0;
+		if( !extent->abandoned ) {
+			return extent;
+		}
+		readahead_extent_release( extent );
+	}
+	return NULL;
+}
@@ -0,0 +1,87 @@
+/*!
+ * \file readahead.h
+ * \brief Read-ahead of file extents for sessions, off the event loop (-i).
+ *
+ * A session in -m event used to read each block with pread() when it filled
+ * its window, so a file that was not in the page cache held up every other
+ * session on the loop until the disk (or the NFS server) answered. With -i
+ * N, an octet session instead copies its blocks out of two extents of
+ * READAHEAD_EXTENT bytes, aligned in the file: the one it is sending from
+ * and the one after it, which is read while the first is being sent.
+ *
+ * An extent is first read with preadv2(RWF_NOWAIT), which only returns what
+ * the page cache already holds, so a cached file is still read inline with
+ * one system call per extent. Whatever is left goes to a pool of N I/O
+ * threads that may block as long as they need to. When one finishes it
+ * reports the extent on the completion queue of the session table that
+ * asked for it, and wakes that table's event loop through an eventfd in its
+ * poll set.
+ *
+ * A compressed file (seekable.h) is read the same way, with the LRU of
+ * inflated frames standing in for the page cache: an extent whose frames
+ * are all inflated is copied at once, and one that needs a frame inflated
+ * goes to the I/O threads, which hold a reference on the file meanwhile.
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "mpsc.h"
+#include "seekable.h"
+
+#define READAHEAD_EXTENT  65536  // Bytes per extent; a multiple of the page size.
+#define READAHEAD_THREADS 64     // Most I/O threads -i may ask for.
+
+enum readahead_state {
+	EXTENT_EMPTY,
+	EXTENT_READING,  // Queued for, or being read by, an I/O thread.
+	EXTENT_READY     // length and error are final.
+};
+
+// Where I/O threads report finished extents to one session table.
+struct readahead_queue {
+	int event;                 // An eventfd; readable while completions may be waiting.
+	atomic_int signalled;      // Set while event has been written and not yet read.
+	struct mpsc done;          // Of struct readahead_extent *.
+};
+
+struct readahead_extent {
+	atomic_int state;          // enum readahead_state; written by an I/O thread while it has the extent.
+	int in_flight;             // Owner only: handed to an I/O thread and not yet back through the queue; not to be
+	                           // read from or loaded again until it is, even once its state is EXTENT_READY.
+	int abandoned;             // Owner only: its session ended while it was in flight; free it when it is back.
+	int file;
+	struct seekable *seekable;  // The compressed file read instead of file, or NULL.
+	off_t offset;              // File offset of data[0]: a multiple of READAHEAD_EXTENT.
+	size_t length;             // Bytes read: READAHEAD_EXTENT, or fewer at the end of the file.
+	int error;                 // errno of a failed read, else 0.
+	uint32_t id;               // Session that asked for it.
+	int64_t queued;            // When it went to the I/O threads.
+	struct readahead_queue *queue;
+	struct readahead_extent *next;  // In the I/O threads' queue.
+	unsigned char *data;
+};
+
+struct readahead_stats {
+	atomic_ulong inline_reads;  // Extents the page cache held in full.
+	atomic_ulong async_reads;   // Extents handed to an I/O thread.
+	atomic_ulong async_us;      // Time those waited for and spent in their thread.
+};
+
+int  readahead_start( unsigned threads );
+int  readahead_running( void );
+int  readahead_queue_init( struct readahead_queue *queue, size_t capacity );
+void readahead_queue_destroy( struct readahead_queue *queue );
+struct readahead_extent *readahead_extent_create( void );
+void readahead_extent_release( struct readahead_extent *extent );
+void readahead_load( struct readahead_extent *extent, int file, struct seekable *seekable, off_t offset,
+                     off_t file_size, struct readahead_queue *queue, uint32_t id );
+struct readahead_extent *readahead_completed( struct readahead_queue *queue );
+
+#endif
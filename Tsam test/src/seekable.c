@@ -0,0 +1,368 @@
+/*!
+ * \file seekable.c
+ * \brief Checking a compressed file's index, and the LRU of inflated frames.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "seekable.h"
+#include "stats.h"
+
+// The LRU, shared by every transfer of the process.
+static pthread_mutex_t frames_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct seekable_frame *frames_head;  // Most recently used.
+static struct seekable_frame *frames_tail;
+static unsigned frames_cached;
+
+
+static int identity_equal( const struct cache_identity *a, const struct cache_identity *b )
+{
+	return a->device == b->device && a->inode == b->inode && a->modified_sec == b->modified_sec &&
+	       a->modified_nsec == b->modified_nsec && a->size == b->size;
+}
+
+
+// Reads exactly size bytes at offset. Returns 0, or -1 (with errno EIO if the file is short).
+static int read_exactly( int file, void *buffer, size_t size, off_t offset )
+{
+	size_t done = 0;
+
+	while( done < size ) {
+		ssize_t count = pread( file, (unsigned char *)buffer + done, size - done, offset + (off_t)done );
+
+		if( count <= 0 ) {
+			if( count == 0 ) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		done += (size_t)count;
+	}
+	return 0;
+}
+
+
+//! Reads the header and index of the compressed file open on file_handle, which it duplicates. Returns the file
+//! with one reference, or NULL with errno set (EINVAL if it is not a valid compressed file).
+struct seekable *seekable_open( int file_handle )
+{
+	struct seekable *file;
+	struct stat status;
+	struct seekable_header *header;
+	uint64_t frames_start;
+
+	if( fstat( file_handle, &status ) == -1 || (file = calloc( 1, sizeof(*file) )) == NULL ) {
+		return NULL;
+	}
+	if( (file->file_handle = fcntl( file_handle, F_DUPFD_CLOEXEC, 0 )) == -1 ) {
+		free( file );
+		return NULL;
+	}
+	atomic_init( &file->references, 1 );
+	header = &file->header;
+	file->identity.device = (uint64_t)status.st_dev;
+	file->identity.inode = (uint64_t)status.st_ino;
+	file->identity.modified_sec = (int64_t)status.st_mtim.tv_sec;
+	file->identity.modified_nsec = (int64_t)status.st_mtim.tv_nsec;
+	file->identity.size = (int64_t)status.st_size;
+
+	// The frame count is checked without rounding size up, which would wrap for a size near UINT64_MAX.
+	if( read_exactly( file_handle, header, sizeof(*header), 0 ) == -1 ||
+	    memcmp( header->magic, SEEKABLE_MAGIC, sizeof(header->magic) ) != 0 ||
+	    header->frame_size < SEEKABLE_MIN_FRAME_SIZE || header->frame_size > SEEKABLE_MAX_FRAME_SIZE ||
+	    header->frame_count != header->size / header->frame_size + (header->size % header->frame_size != 0) ||
+	    header->frame_count > (uint64_t)status.st_size / sizeof(uint64_t) ) {
+		errno = EINVAL;
+		goto failed;
+	}
+	if( (file->offsets = malloc( ((size_t)header->frame_count + 1) * sizeof(*file->offsets) )) == NULL ) {
+		goto failed;
+	}
+	frames_start = sizeof(*header) + ((uint64_t)header->frame_count + 1) * sizeof(*file->offsets);
+	if( read_exactly( file_handle, file->offsets, ((size_t)header->frame_count + 1) * sizeof(*file->offsets),
+	                  sizeof(*header) ) == -1 || file->offsets[0] != frames_start ||
+	    file->offsets[header->frame_count] > (uint64_t)status.st_size ) {
+		goto invalid;
+	}
+	for( uint32_t i = 0; i < header->frame_count; ++i ) {
+		if( file->offsets[i + 1] < file->offsets[i] ||
+		    file->offsets[i + 1] - file->offsets[i] > compressBound( header->frame_size ) ) {
+			goto invalid;
+		}
+	}
+	STATS_INC( seekable.opened );
+	return file;
+
+invalid:
+	errno = EINVAL;
+failed:
+	close( file->file_handle );
+	free( file->offsets );
+	free( file );
+	return NULL;
+}
+
+
+static void unlink_frame( struct seekable_frame *frame )
+{
+	if( frame->prev != NULL ) {
+		frame->prev->next = frame->next;
+	}
+	else {
+		frames_head = frame->next;
+	}
+	if( frame->next != NULL ) {
+		frame->next->prev = frame->prev;
+	}
+	else {
+		frames_tail = frame->prev;
+	}
+	frames_cached--;
+}
+
+
+static void push_front( struct seekable_frame *frame )
+{
+	frame->prev = NULL;
+	frame->next = frames_head;
+	if( frames_head != NULL ) {
+		frames_head->prev = frame;
+	}
+	else {
+		frames_tail = frame;
+	}
+	frames_head = frame;
+	frames_cached++;
+}
+
+
+// Frees the least recently used frames nobody is reading until the LRU is back to its size. The caller holds
+// frames_lock.
+static void trim( void )
+{
+	struct seekable_frame *frame = frames_tail;
+
+	while( frames_cached > SEEKABLE_CACHED_FRAMES && frame != NULL ) {
+		struct seekable_frame *prev = frame->prev;
+
+		if( frame->references == 0 ) {
+			unlink_frame( frame );
+			free( frame->data );
+			free( frame );
+		}
+		frame = prev;
+	}
+}
+
+
+// Returns frame index of file from the LRU, with a reference, and moves it to the front. NULL if it is not
+// there. The caller holds frames_lock.
+static struct seekable_frame *find( const struct seekable *file, uint32_t index )
+{
+	for( struct seekable_frame *frame = frames_head; frame != NULL; frame = frame->next ) {
+		if( frame->index == index && identity_equal( &frame->identity, &file->identity ) ) {
+			frame->references++;
+			unlink_frame( frame );
+			push_front( frame );
+			return frame;
+		}
+	}
+	return NULL;
+}
+
+
+// Inflates frame index of file, outside frames_lock. Returns it, not yet in the LRU, or NULL with errno set.
+static struct seekable_frame *inflate_frame( const struct seekable *file, uint32_t index )
+{
+	const struct seekable_header *header = &file->header;
+	uint64_t start = (uint64_t)index * header->frame_size;
+	size_t compressed_length = (size_t)(file->offsets[index + 1] - file->offsets[index]);
+	struct seekable_frame *frame = calloc( 1, sizeof(*frame) );
+	unsigned char *compressed = malloc( compressed_length != 0 ? compressed_length : 1 );
+	uLongf length;
+
+	if( frame == NULL || compressed == NULL ) {
+		goto failed;
+	}
+	frame->identity = file->identity;
+	frame->index = index;
+	frame->references = 1;
+	frame->length = header->size - start < header->frame_size ? (size_t)(header->size - start) : header->frame_size;
+	if( (frame->data = malloc( frame->length )) == NULL ||
+	    read_exactly( file->file_handle, compressed, compressed_length, (off_t)file->offsets[index] ) == -1 ) {
+		goto failed;
+	}
+	length = (uLongf)frame->length;
+	if( uncompress( frame->data, &length, compressed, (uLong)compressed_length ) != Z_OK || length != frame->length ) {
+		errno = EIO;
+		goto failed;
+	}
+	free( compressed );
+	STATS_INC( seekable.misses );
+	STATS_ADD( seekable.inflated, (unsigned long)frame->length );
+	return frame;
+
+failed:
+	if( frame != NULL ) {
+		free( frame->data );
+	}
+	free( frame );
+	free( compressed );
+	return NULL;
+}
+
+
+// Returns frame index of file with a reference if it is in the LRU, or NULL with errno EAGAIN.
+static struct seekable_frame *cached_frame( const struct seekable *file, uint32_t index )
+{
+	struct seekable_frame *frame;
+
+	pthread_mutex_lock( &frames_lock );
+	frame = find( file, index );
+	pthread_mutex_unlock( &frames_lock );
+	if( frame == NULL ) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	STATS_INC( seekable.hits );
+	return frame;
+}
+
+
+// Returns frame index of file with a reference: from the LRU, or inflated and added to it. NULL with errno set
+// if it could not be read.
+static struct seekable_frame *get_frame( const struct seekable *file, uint32_t index )
+{
+	struct seekable_frame *frame;
+	struct seekable_frame *found;
+
+	if( (frame = cached_frame( file, index )) != NULL ) {
+		return frame;
+	}
+	if( (frame = inflate_frame( file, index )) == NULL ) {
+		return NULL;
+	}
+	// Another transfer may have inflated the same frame meanwhile; the first one in is kept.
+	pthread_mutex_lock( &frames_lock );
+	if( (found = find( file, index )) != NULL ) {
+		free( frame->data );
+		free( frame );
+		frame = found;
+	}
+	else {
+		push_front( frame );
+		trim( );
+	}
+	pthread_mutex_unlock( &frames_lock );
+	return frame;
+}
+
+
+static void release_frame( struct seekable_frame *frame )
+{
+	if( frame == NULL ) {
+		return;
+	}
+	pthread_mutex_lock( &frames_lock );
+	frame->references--;
+	trim( );
+	pthread_mutex_unlock( &frames_lock );
+}
+
+
+//! Copies up to size bytes of the uncompressed file from offset into buffer, like pread(). Returns the bytes
+//! copied (short only at the end of the file), or -1 with errno set.
+ssize_t seekable_read( struct seekable *file, unsigned char *buffer, size_t size, off_t offset )
+{
+	const struct seekable_header *header = &file->header;
+	size_t copied = 0;
+
+	while( copied < size && (uint64_t)offset + copied < header->size ) {
+		uint64_t at = (uint64_t)offset + copied;
+		uint32_t index = (uint32_t)(at / header->frame_size);
+		size_t start = (size_t)(at % header->frame_size);
+		size_t count;
+
+		if( file->frame == NULL || file->frame->index != index ) {
+			struct seekable_frame *frame = get_frame( file, index );
+
+			if( frame == NULL ) {
+				return -1;
+			}
+			release_frame( file->frame );
+			file->frame = frame;
+		}
+		count = file->frame->length - start < size - copied ? file->frame->length - start : size - copied;
+		memcpy( buffer + copied, file->frame->data + start, count );
+		copied += count;
+	}
+	return (ssize_t)copied;
+}
+
+
+//! Copies up to size bytes of the uncompressed file from offset into buffer, like pread(), without holding on to
+//! a frame: the I/O threads read extents of one file this way while its transfer has the file. With
+//! SEEKABLE_NOWAIT in flags, it stops at a frame that would have to be inflated, returning the bytes copied
+//! before it, or -1 with errno EAGAIN if there are none.
+ssize_t seekable_pread( struct seekable *file, unsigned char *buffer, size_t size, off_t offset, int flags )
+{
+	const struct seekable_header *header = &file->header;
+	size_t copied = 0;
+
+	while( copied < size && (uint64_t)offset + copied < header->size ) {
+		uint64_t at = (uint64_t)offset + copied;
+		uint32_t index = (uint32_t)(at / header->frame_size);
+		size_t start = (size_t)(at % header->frame_size);
+		struct seekable_frame *frame = flags & SEEKABLE_NOWAIT ? cached_frame( file, index ) : get_frame( file, index );
+		size_t count;
+
+		if( frame == NULL ) {
+			return copied != 0 ? (ssize_t)copied : -1;
+		}
+		count = frame->length - start < size - copied ? frame->length - start : size - copied;
+		memcpy( buffer + copied, frame->data + start, count );
+		copied += count;
+		release_frame( frame );
+	}
+	return (ssize_t)copied;
+}
+
+
+//! Takes another reference on file, for an extent handed to an I/O thread. Returns file.
+struct seekable *seekable_hold( struct seekable *file )
+{
+	atomic_fetch_add_explicit( &file->references, 1, memory_order_relaxed );
+	return file;
+}
+
+
+//! Lets go of a reference from seekable_hold(); the last one closes the file and frees the index.
+void seekable_release( struct seekable *file )
+{
+	if( atomic_fetch_sub_explicit( &file->references, 1, memory_order_acq_rel ) != 1 ) {
+		return;
+	}
+	close( file->file_handle );
+	free( file->offsets );
+	free( file );
+}
+
+
+//! Lets go of the transfer's reference, and of the frame it was reading. NULL is ignored.
+void seekable_close( struct seekable *file )
+{
+	if( file == NULL ) {
+		return;
+	}
+	release_frame( file->frame );
+	file->frame = NULL;
+	seekable_release( file );
+}
@@ -0,0 +1,97 @@
+/*!
+ * \file seekable.h
+ * \brief Files stored compressed in independent frames, served from any offset by inflating one frame.
+ *
+ * A file compressed as a single stream has to be inflated from its start
+ * to reach any byte, so resuming a transfer, or going back for a block the
+ * client lost, costs everything before that point. mkseekable compresses
+ * a file into frames of frame_size uncompressed bytes each, every frame a
+ * zlib stream of its own, and writes an index of where each frame starts.
+ * A block starting at byte b of the file is then in frame b / frame_size,
+ * found with one division and one lookup in the index, and costs at most
+ * the inflation of that frame (and of the next, for a block that straddles
+ * two).
+ *
+ * When a request names a file that is not there but FILE.tfz is, the server
+ * serves FILE from the compressed copy. Inflated frames go into a small LRU
+ * shared by the transfers of the process (SEEKABLE_CACHED_FRAMES frames),
+ * so clients fetching the same image together, or one going back a window,
+ * inflate each frame once. A transfer holds a reference on the frame it is
+ * reading, which is not evicted until it moves on.
+ *
+ * With -i, an octet session reads a compressed file through its read-ahead
+ * extents like any other: an extent whose frames are already inflated is
+ * copied at once, and one that needs a frame inflated goes to the I/O
+ * threads, so the event loop never waits for zlib. Netascii transfers, and
+ * transfers without -i, inflate frames as they go, which is why frames are
+ * kept to SEEKABLE_MAX_FRAME_SIZE.
+ *
+ * Layout, all integers in host order:
+ *
+ *     struct seekable_header
+ *     uint64_t offsets[frame_count + 1]  where each frame starts; the last is where the last one ends
+ *     frames, each a zlib stream of frame_size bytes (less for the last frame)
+ */
+
+#ifndef SEEKABLE_H
+#define SEEKABLE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define SEEKABLE_MAGIC          "TFTPSZ01"
+#define SEEKABLE_SUFFIX         ".tfz"
+#define SEEKABLE_FRAME_SIZE     262144      // Uncompressed bytes per frame unless mkseekable is told otherwise.
+#define SEEKABLE_MIN_FRAME_SIZE 4096
+#define SEEKABLE_MAX_FRAME_SIZE (1 << 20)  // Bounds what one block may cost to inflate where it is read.
+#define SEEKABLE_CACHED_FRAMES  64          // Inflated frames kept by the LRU, beyond those in use.
+#define SEEKABLE_NOWAIT         1           // seekable_pread(): stop at a frame that would have to be inflated.
+
+struct seekable_header {
+	char magic[8];            // SEEKABLE_MAGIC, without its NUL.
+	uint32_t frame_size;
+	uint32_t frame_count;
+	uint64_t size;            // Of the file uncompressed.
+	uint64_t netascii_size;   // Of the file uncompressed and translated, so that tsize costs nothing.
+};
+
+// An inflated frame in the LRU.
+struct seekable_frame {
+	struct cache_identity identity;  // Of the compressed file.
+	uint32_t index;
+	unsigned references;
+	size_t length;                   // frame_size, or less for the last frame.
+	struct seekable_frame *prev;     // Towards the most recently used end.
+	struct seekable_frame *next;
+	unsigned char *data;
+};
+
+// A compressed file being served.
+struct seekable {
+	int file_handle;                 // A duplicate of the one it was opened on, closed with the last reference.
+	atomic_uint references;          // The transfer's, and one for each extent being read by an I/O thread.
+	struct cache_identity identity;
+	struct seekable_header header;
+	uint64_t *offsets;
+	struct seekable_frame *frame;    // The frame last read from, with a reference; NULL before the first read.
+};
+
+struct seekable_stats {
+	atomic_ulong opened;      // Transfers served from a compressed file.
+	atomic_ulong hits;        // Frames found already inflated.
+	atomic_ulong misses;      // Frames inflated.
+	atomic_ulong inflated;    // Bytes inflated.
+};
+
+struct seekable *seekable_open( int file_handle );
+ssize_t seekable_read( struct seekable *file, unsigned char *buffer, size_t size, off_t offset );
+ssize_t seekable_pread( struct seekable *file, unsigned char *buffer, size_t size, off_t offset, int flags );
+struct seekable *seekable_hold( struct seekable *file );
+void    seekable_release( struct seekable *file );
+void    seekable_close( struct seekable *file );
+
+#endif
@@ -0,0 +1,685 @@
+/*!
+ * \file session.c
+ * \brief The session table and the non-blocking form of the DATA/ACK exchange.
+ *
+ * A session goes through the same steps as send_file() in transfer.c (OACK,
+ * windowed DATA, go-back on timeout or a partial ACK, pacing), written out
+ * the same way in run_session(), a protothread. Where send_file() blocks in
+ * poll() on its one socket, run_session() sets a deadline in the table and
+ * yields to the request loop, which resumes it when an ACK it waits for
+ * arrives or the deadline passes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "probes.h"
+#include "profile.h"
+#include "session.h"
+#include "sockfilter.h"
+#include "stats.h"
+#include "timestamp.h"
+
+#define NO_DEADLINE INT64_MAX
+#define SCAN_BATCH 256  // Due sessions collected per scan by session_run().
+
+// An ACK handed to a waiting session: the block it acknowledges and when the kernel received it.
+struct session_ack {
+	uint32_t block;
+	int64_t received;
+};
+
+
+int session_table_init( struct session_table *table, size_t capacity, size_t reserved, struct client_table *clients )
+{
+	memset( table, 0, sizeof(*table) );
+	table->capacity = capacity;
+	table->reserved = reserved + 1;  // One more for the read-ahead completions.
+	table->clients = clients;
+
+	table->state = calloc( capacity, sizeof(*table->state) );
+	table->deadline = malloc( capacity * sizeof(*table->deadline) );
+	table->inflight = calloc( capacity, sizeof(*table->inflight) );
+	table->poll_set = calloc( table->reserved + capacity, sizeof(*table->poll_set) );
+	table->sessions = calloc( capacity, sizeof(*table->sessions) );
+	table->free_ids = malloc( capacity * sizeof(*table->free_ids) );
+	if( table->state == NULL || table->deadline == NULL || table->inflight == NULL || table->poll_set == NULL ||
+	    table->sessions == NULL || table->free_ids == NULL ) {
+		session_table_destroy( table );
+		return -1;
+	}
+
+	// Ids are handed out lowest first, which keeps high_water, and so the scans, short.
+	for( size_t id = 0; id < capacity; ++id ) {
+		table->deadline[id] = NO_DEADLINE;
+		table->poll_set[table->reserved + id].fd = -1;
+		table->poll_set[table->reserved + id].events = POLLIN;
+		table->free_ids[capacity - 1 - id] = (uint32_t)id;
+	}
+	table->free_count = capacity;
+
+	// Room for two extents in flight per session; past that (extents of ended sessions still out), an I/O thread
+	// waits for the loop to make room.
+	table->poll_set[reserved].fd = -1;
+	table->poll_set[reserved].events = POLLIN;
+	if( readahead_running( ) ) {
+		if( readahead_queue_init( &table->reads, 2 * capacity ) == -1 ) {
+			session_table_destroy( table );
+			return -1;
+		}
+		table->read_ahead = 1;
+		table->poll_set[reserved].fd = table->reads.event;
+	}
+	atomic_init( &table->load, 0 );
+	batch_init( &table->send_batch, stats != NULL ? &stats->send_batch : NULL );
+	return 0;
+}
+
+
+void session_table_destroy( struct session_table *table )
+{
+	free( table->state );
+	free( table->deadline );
+	free( table->inflight );
+	free( table->poll_set );
+	free( table->sessions );
+	free( table->free_ids );
+	if( table->read_ahead ) {
+		readahead_queue_destroy( &table->reads );
+	}
+	memset( table, 0, sizeof(*table) );
+}
+
+
+//! The current CLOCK_MONOTONIC time in nanoseconds, the unit of every deadline.
+int64_t session_now( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+static int64_t timeout_ns( const struct session *session )
+{
+	return (int64_t)session->transfer.rto_ms * 1000000;
+}
+
+
+// Returns the session's id to the free list; whatever it holds is someone else's business by now.
+static void release( struct session_table *table, uint32_t id )
+{
+	atomic_fetch_sub_explicit( &table->load, table->sessions[id].bytes_left, memory_order_relaxed );
+	table->state[id] = SESSION_FREE;
+	table->deadline[id] = NO_DEADLINE;
+	table->inflight[id] = 0;
+	table->poll_set[table->reserved + id].fd = -1;
+	table->free_ids[table->free_count++] = id;
+	table->count--;
+	while( table->high_water > 0 && table->state[table->high_water - 1] == SESSION_FREE ) {
+		table->high_water--;
+	}
+}
+
+
+// Releases everything the session holds and returns its id to the free list.
+static void finish( struct session_table *table, uint32_t id, int completed )
+{
+	struct session *session = &table->sessions[id];
+	int family = session->transfer.family;
+	long drops;
+
+	if( completed ) {
+		STATS_INC( family[family].completed );
+		PROBE_TRANSFER_DONE( id, session->last, session->transfer.acknowledged );
+	}
+	else {
+		STATS_INC( family[family].failed );
+		PROBE_TRANSFER_ERROR( id, session->base - 1, session->transfer.acknowledged );
+		transfer_dump_flight( &session->transfer, stderr, "failed" );
+	}
+	if( (drops = sockfilter_drops( session->transfer.socket_handle )) > 0 ) {
+		STATS_ADD( family[family].session_drops, (unsigned long)drops );
+	}
+
+	transfer_close_file( &session->transfer );
+	close( session->transfer.socket_handle );
+	free( session->window );
+	free( session->reader );
+	for( int i = 0; i < 2; ++i ) {
+		if( session->ahead[i] != NULL ) {
+			readahead_extent_release( session->ahead[i] );
+		}
+	}
+	if( table->clients_lock != NULL ) {
+		pthread_mutex_lock( table->clients_lock );
+	}
+	client_table_remove( table->clients, &session->key );
+	session->policy->active_transfers--;
+	if( table->clients_lock != NULL ) {
+		pthread_mutex_unlock( table->clients_lock );
+	}
+	release( table, id );
+}
+
+
+// Sets up the two extents of an octet session and starts reading them (-i). If they cannot be allocated, the
+// session reads its blocks itself.
+static void start_read_ahead( struct session_table *table, uint32_t id )
+{
+	struct session *session = &table->sessions[id];
+	int file = session->transfer.file_handle;
+	struct seekable *seekable = session->transfer.seekable;
+	off_t first = session->offset - session->offset % READAHEAD_EXTENT;
+	struct stat status;
+
+	if( fstat( file, &status ) == -1 || (session->ahead[0] = readahead_extent_create( )) == NULL ) {
+		return;
+	}
+	if( (session->ahead[1] = readahead_extent_create( )) == NULL ) {
+		readahead_extent_release( session->ahead[0] );
+		session->ahead[0] = NULL;
+		return;
+	}
+	session->file_size = seekable != NULL ? (off_t)seekable->header.size : status.st_size;
+	readahead_load( session->ahead[0], file, seekable, first, session->file_size, &table->reads, id );
+	readahead_load( session->ahead[1], file, seekable, first + READAHEAD_EXTENT, session->file_size, &table->reads,
+	                id );
+}
+
+
+//! Takes over a negotiated transfer (its socket and file). Returns the session id, or SESSION_NONE if the table is full or out of memory.
+uint32_t session_start( struct session_table *table, const struct transfer *transfer, const client_key *key,
+                        struct policy *policy )
+{
+	struct session *session;
+	uint32_t id;
+
+	if( table->free_count == 0 ) {
+		return SESSION_NONE;
+	}
+	id = table->free_ids[table->free_count - 1];
+	session = &table->sessions[id];
+	memset( session, 0, sizeof(*session) );
+
+	session->transfer = *transfer;
+	session->transfer.id = (int)id;
+	memcpy( &session->client_address, transfer->client_address, transfer->client_length );
+	session->transfer.client_address = (struct sockaddr *)&session->client_address;
+	session->key = *key;
+	session->policy = policy;
+	session->base = 1;
+	session->filled = 1;
+	session->next_send = 1;
+	session->offset = transfer->offset;
+	session->bytes_left = transfer_bytes_left( transfer );
+	PT_INIT( &session->thread );
+
+	if( (session->window = malloc( (TFTP_HEADER_LENGTH + transfer->blksize) * transfer->windowsize )) == NULL ) {
+		return SESSION_NONE;
+	}
+	if( transfer->mode == MODE_NETASCII && !transfer->translated ) {
+		if( (session->reader = malloc( sizeof(*session->reader) )) == NULL ) {
+			free( session->window );
+			return SESSION_NONE;
+		}
+		transfer_init_reader( transfer, session->reader );
+	}
+	else if( table->read_ahead && transfer->contents == NULL ) {
+		start_read_ahead( table, id );
+	}
+	fcntl( transfer->socket_handle, F_SETFL, fcntl( transfer->socket_handle, F_GETFL ) | O_NONBLOCK );
+
+	table->free_count--;
+	table->count++;
+	if( id >= table->high_water ) {
+		table->high_water = id + 1;
+	}
+	table->poll_set[table->reserved + id].fd = transfer->socket_handle;
+	table->poll_set[table->reserved + id].events = 0;
+	table->state[id] = SESSION_STARTING;
+	table->deadline[id] = 0;  // The next pass of session_run() starts it.
+	table->inflight[id] = 0;
+	atomic_fetch_add_explicit( &table->load, session->bytes_left, memory_order_relaxed );
+	PROBE_SESSION_CREATE( id, transfer->blksize, transfer->windowsize, transfer->offset );
+	return id;
+}
+
+
+// Copies the block at the session's offset out of its extents into data. Returns the block's length, -1 if the
+// file could not be read, or -2 if part of the block is still being read. Once a block leaves the first extent,
+// the second takes its place and the first is loaded with the extent after that. An extent read by an I/O thread
+// is not used until its completion has come back through the queue, since only then may it be loaded again.
+static ssize_t copy_block( struct session_table *table, uint32_t id, unsigned char *data )
+{
+	struct session *session = &table->sessions[id];
+	size_t blksize = session->transfer.blksize;
+	size_t copied = 0;
+
+	for( int i = 0; i < 2 && copied < blksize; ++i ) {
+		struct readahead_extent *extent = session->ahead[i];
+		size_t start = (size_t)(session->offset + (off_t)copied - extent->offset);
+		size_t count;
+
+		if( atomic_load_explicit( &extent->state, memory_order_acquire ) != EXTENT_READY || extent->in_flight ) {
+			return -2;
+		}
+		if( extent->error != 0 ) {
+			errno = extent->error;
+			return -1;
+		}
+		if( start >= extent->length ) {
+			break;
+		}
+		count = extent->length - start < blksize - copied ? extent->length - start : blksize - copied;
+		memcpy( data + copied, extent->data + start, count );
+		copied += count;
+		// A short extent is the end of the file.
+		if( extent->length < READAHEAD_EXTENT ) {
+			break;
+		}
+	}
+
+	if( session->offset + (off_t)copied >= session->ahead[0]->offset + READAHEAD_EXTENT ) {
+		struct readahead_extent *spent = session->ahead[0];
+
+		session->ahead[0] = session->ahead[1];
+		session->ahead[1] = spent;
+		readahead_load( spent, session->transfer.file_handle, session->transfer.seekable,
+		                session->ahead[0]->offset + READAHEAD_EXTENT, session->file_size, &table->reads, id );
+	}
+	return (ssize_t)copied;
+}
+
+
+// Reads blocks into the window up to its end, or the end of the file. Returns 0, -1 if the file could not be
+// read, or 1 if it stopped at a block that an I/O thread has yet to read.
+static int fill_window( struct session_table *table, uint32_t id )
+{
+	struct session *session = &table->sessions[id];
+	size_t slot_size = TFTP_HEADER_LENGTH + session->transfer.blksize;
+
+	while( session->last == 0 && session->filled < session->base + session->transfer.windowsize ) {
+		size_t slot = session->filled % session->transfer.windowsize;
+		unsigned char *packet = &session->window[slot * slot_size];
+		PROFILE_START( read_start );
+		ssize_t count = session->ahead[0] != NULL ? copy_block( table, id, &packet[TFTP_HEADER_LENGTH] )
+		                                          : transfer_read_block( &session->transfer, session->reader, packet,
+		                                                                 session->offset );
+
+		if( count == -2 ) {
+			return 1;
+		}
+		if( session->filled == 1 ) {
+			PROFILE_END( PHASE_FIRST_READ, read_start );
+		}
+		if( count < 0 ) {
+			return -1;
+		}
+		packet_put_header( packet, OP_DATA, session->filled & 0xffff );
+		session->lengths[slot] = TFTP_HEADER_LENGTH + (size_t)count;
+		session->offset += count;
+		if( (size_t)count < session->transfer.blksize ) {
+			session->last = session->filled;
+		}
+		++session->filled;
+	}
+	return 0;
+}
+
+
+// Suspends the session in state until when, and polls its socket only in the states that wait for an ACK.
+static void suspend( struct session_table *table, uint32_t id, enum session_state state, int64_t when )
+{
+	struct session *session = &table->sessions[id];
+
+	table->state[id] = state;
+	table->deadline[id] = when;
+	table->inflight[id] = (uint16_t)(session->next_send - session->base);
+	table->poll_set[table->reserved + id].events = state == SESSION_OACK || state == SESSION_WAITING ? POLLIN : 0;
+}
+
+
+// The transfer itself, as a protothread. session_run() resumes it when its deadline passes, with ack NULL;
+// session_receive() resumes it with an ACK it is waiting for. It returns whenever it suspends, and for good once
+// it has finished the session. Locals are lost at each PT_YIELD; what has to last is kept in the session.
+static void run_session( struct session_table *table, uint32_t id, int64_t now, const struct session_ack *ack )
+{
+	struct session *session = &table->sessions[id];
+	struct transfer *transfer = &session->transfer;
+
+	PT_BEGIN( &session->thread );
+
+	// Offer the options until the client takes them with ACK 0.
+	while( transfer->options ) {
+		unsigned char packet[TFTP_MAX_REQUEST];
+		size_t length = transfer_build_oack( transfer, packet, sizeof(packet) );
+
+		transfer_send( transfer, packet, length, 0, now );
+		suspend( table, id, SESSION_OACK, now + timeout_ns( session ) );
+		PT_YIELD( &session->thread );
+
+		if( ack != NULL ) {
+			transfer_note_ack( transfer, 0, ack->received );
+			session->retries = 0;
+			break;
+		}
+		PROFILE_START( timer_start );
+		PROBE_TIMEOUT( id, session->base, session->retries );
+		transfer_note_timeout( transfer, 0, session->retries, now );
+		if( ++session->retries > TRANSFER_MAX_RETRIES ) {
+			finish( table, id, 0 );
+			return;
+		}
+		PROFILE_END( PHASE_TIMER, timer_start );
+	}
+
+	while( 1 ) {
+		int filling = fill_window( table, id );
+
+		if( filling == -1 ) {
+			send_error_message( transfer->socket_handle, transfer->client_address, transfer->client_length,
+			                    ERR_UNDEFINED, "Error reading file" );
+			flight_record_at( &transfer->flight, now, FLIGHT_LOCAL_ERROR, session->filled, ERR_UNDEFINED );
+			finish( table, id, 0 );
+			return;
+		}
+		// Everything read has been acknowledged, and the next block is still on its way from the disk.
+		if( filling == 1 && session->base == session->filled ) {
+			suspend( table, id, SESSION_READING, NO_DEADLINE );
+			PT_YIELD( &session->thread );
+			continue;
+		}
+
+		// Everything read and not yet sent goes out in batches, or one block at a time when paced.
+		while( session->next_send < session->filled ) {
+			uint32_t count = session->filled - session->next_send;
+
+			if( transfer->rate_limit != 0 ) {
+				// Idle time is not saved up as credit for a later burst.
+				if( session->next_send_time < now ) {
+					session->next_send_time = now;
+				}
+				else if( session->next_send_time > now ) {
+					suspend( table, id, SESSION_PACED, session->next_send_time );
+					PT_YIELD( &session->thread );
+					continue;
+				}
+				session->next_send_time += (int64_t)((unsigned long long)session->lengths[session->next_send %
+				                                     transfer->windowsize] * 1000000000ULL / transfer->rate_limit);
+				count = 1;
+			}
+			PROFILE_START( send_start );
+			session->next_send += transfer_send_blocks( transfer, &table->send_batch, session->window, session->lengths,
+			                                            session->next_send, count, now );
+			PROFILE_END( PHASE_SEND, send_start );
+		}
+
+		suspend( table, id, SESSION_WAITING, now + timeout_ns( session ) );
+		PT_YIELD( &session->thread );
+
+		if( ack == NULL ) {
+			PROFILE_START( timer_start );
+			PROBE_TIMEOUT( id, session->base, session->retries );
+			transfer_note_timeout( transfer, session->base, session->retries, now );
+			if( ++session->retries > TRANSFER_MAX_RETRIES ) {
+				finish( table, id, 0 );
+				return;
+			}
+			// Go back and resend everything not yet acknowledged.
+			STATS_ADD( family[transfer->family].retransmits, session->next_send - session->base );
+			PROBE_DATA_RETRANSMIT( id, session->base, session->next_send - session->base );
+			transfer_note_go_back( transfer, session->base, session->next_send - session->base, now );
+			session->next_send = session->base;
+			PROFILE_END( PHASE_TIMER, timer_start );
+			continue;
+		}
+
+		PROFILE_START( ack_start );
+		for( uint32_t block = session->base; block <= ack->block; ++block ) {
+			size_t bytes = session->lengths[block % transfer->windowsize] - TFTP_HEADER_LENGTH;
+
+			STATS_ADD( family[transfer->family].bytes_sent, bytes );
+			transfer->acknowledged += bytes;
+			if( bytes > session->bytes_left ) {
+				bytes = (size_t)session->bytes_left;
+			}
+			session->bytes_left -= bytes;
+			atomic_fetch_sub_explicit( &table->load, bytes, memory_order_relaxed );
+		}
+		PROBE_ACK_RECEIVED( id, ack->block, transfer->acknowledged );
+		transfer_note_ack( transfer, ack->block, ack->received );
+		session->retries = 0;
+		session->base = ack->block + 1;
+		if( session->last != 0 && session->base > session->last ) {
+			PROFILE_END( PHASE_ACK, ack_start );
+			finish( table, id, 1 );
+			return;
+		}
+		// An ACK inside the window means the client lost what followed it.
+		if( session->next_send > session->base ) {
+			PROBE_DATA_RETRANSMIT( id, session->base, session->next_send - session->base );
+			transfer_note_go_back( transfer, session->base, session->next_send - session->base, ack->received );
+			session->next_send = session->base;
+		}
+		PROFILE_END( PHASE_ACK, ack_start );
+	}
+
+	PT_END( &session->thread );
+}
+
+
+// Handles one datagram from the session's client, which arrived at received. An ACK the session is waiting for
+// resumes it; anything else, typically a duplicate ACK, is ignored.
+static void receive_datagram( struct session_table *table, uint32_t id, const unsigned char *reply, size_t length,
+                              int64_t received )
+{
+	struct session *session = &table->sessions[id];
+	struct session_ack ack;
+
+	if( length < TFTP_HEADER_LENGTH ) {
+		return;
+	}
+	if( packet_opcode( reply ) == OP_ERROR ) {
+		flight_record( &session->transfer.flight, FLIGHT_PEER_ERROR, session->base, packet_block( reply ) );
+		finish( table, id, 0 );
+		return;
+	}
+	if( packet_opcode( reply ) != OP_ACK ) {
+		return;
+	}
+
+	if( table->state[id] == SESSION_OACK ) {
+		if( packet_block( reply ) != 0 ) {
+			return;
+		}
+		ack.block = 0;
+	}
+	else {
+		// Map the 16-bit block number into the window.
+		// A go-back may have rewound next_send, so ACKs for blocks sent before it still count.
+		ack.block = session->base + ((packet_block( reply ) - session->base) & 0xffff);
+		if( ack.block >= session->filled ) {
+			flight_record( &session->transfer.flight, FLIGHT_IGNORED_ACK, packet_block( reply ), 0 );
+			return;
+		}
+	}
+	ack.received = received;
+	run_session( table, id, session_now( ), &ack );
+}
+
+
+//! Reads send stamps, then the datagrams waiting on the session's socket for as long as it waits for an ACK.
+void session_receive( struct session_table *table, uint32_t id )
+{
+	struct session *session = &table->sessions[id];
+	client_key sender;
+
+	// It finished, or went to another worker, after it was polled; or its copy may be in use elsewhere.
+	if( table->state[id] == SESSION_FREE || table->state[id] == SESSION_OFFERED ) {
+		return;
+	}
+	transfer_read_send_stamps( &session->transfer );
+	while( table->state[id] == SESSION_OACK || table->state[id] == SESSION_WAITING ) {
+		unsigned char reply[TFTP_MAX_REQUEST];
+		struct sockaddr_storage sender_address;
+		socklen_t sender_length = sizeof(sender_address);
+		int64_t received, queued;
+		ssize_t count = timestamp_recvfrom( session->transfer.socket_handle, reply, sizeof(reply),
+		                                    (struct sockaddr *)&sender_address, &sender_length, &received, &queued );
+
+		if( count < 0 ) {
+			return;
+		}
+		stats_add_delay( &stats->ack_queue, queued );
+		// Someone other than our client found our port; tell them and carry on.
+		if( client_key_from_sockaddr( &sender, (struct sockaddr *)&sender_address ) == -1 ||
+		    !client_key_equal( &sender, &session->key ) ) {
+			flight_record( &session->transfer.flight, FLIGHT_STRAY, count >= TFTP_HEADER_LENGTH ? packet_block( reply ) : 0,
+			               ntohs( sender.port ) );
+			send_error_message( session->transfer.socket_handle, (struct sockaddr *)&sender_address, sender_length,
+			                    ERR_UNKNOWN_TID, "Unknown transfer ID" );
+			continue;
+		}
+		receive_datagram( table, id, reply, (size_t)count, received );
+	}
+}
+
+
+//! Offers a session that is waiting for an ACK to other workers: marks it SESSION_OFFERED, so that it is neither
+//! run nor read from here, and returns a copy for another table to adopt. Returns NULL if it cannot be offered.
+struct session *session_offer( struct session_table *table, uint32_t id )
+{
+	struct session *moved;
+
+	// An extent in flight is reported to this table, so the session has to wait for it here.
+	for( int i = 0; i < 2; ++i ) {
+		if( table->sessions[id].ahead[i] != NULL && table->sessions[id].ahead[i]->in_flight ) {
+			return NULL;
+		}
+	}
+	if( table->state[id] != SESSION_WAITING || (moved = malloc( sizeof(*moved) )) == NULL ) {
+		return NULL;
+	}
+	// Send stamps read now are not left for the socket to wake the owner with.
+	transfer_read_send_stamps( &table->sessions[id].transfer );
+	*moved = table->sessions[id];
+	moved->moved_deadline = table->deadline[id];
+	table->state[id] = SESSION_OFFERED;
+	return moved;
+}
+
+
+//! Ends an offer: takes the session back, or if taken is set, gives up its id to the table that adopted the copy.
+void session_reclaim( struct session_table *table, uint32_t id, int taken )
+{
+	if( taken ) {
+		release( table, id );
+	}
+	else {
+		table->state[id] = SESSION_WAITING;
+	}
+}
+
+
+//! Adds a session offered by another table, where it waited for an ACK, to wait here instead. Returns its id here,
+//! or SESSION_NONE if the table is full.
+uint32_t session_adopt( struct session_table *table, const struct session *moved )
+{
+	struct session *session;
+	uint32_t id;
+
+	if( table->free_count == 0 ) {
+		return SESSION_NONE;
+	}
+	id = table->free_ids[--table->free_count];
+	session = &table->sessions[id];
+	*session = *moved;
+	session->transfer.id = (int)id;
+	session->transfer.client_address = (struct sockaddr *)&session->client_address;
+
+	table->count++;
+	if( id >= table->high_water ) {
+		table->high_water = id + 1;
+	}
+	table->poll_set[table->reserved + id].fd = session->transfer.socket_handle;
+	atomic_fetch_add_explicit( &table->load, session->bytes_left, memory_order_relaxed );
+	suspend( table, id, SESSION_WAITING, session->moved_deadline );
+	return id;
+}
+
+
+//! Collects up to max sessions from *cursor on whose deadline has passed, advancing *cursor.
+//! Lowers *next_deadline to the earliest deadline among the sessions passed over.
+size_t session_table_scan( const struct session_table *table, int64_t now, size_t *cursor, uint32_t *due, size_t max,
+                           int64_t *next_deadline )
+{
+	const int64_t *deadline = table->deadline;
+	size_t count = 0;
+	size_t id = *cursor;
+
+	for( ; id < table->high_water && count < max; ++id ) {
+		if( deadline[id] <= now ) {
+			due[count++] = (uint32_t)id;
+		}
+		else if( deadline[id] < *next_deadline ) {
+			*next_deadline = deadline[id];
+		}
+	}
+	*cursor = id;
+	return count;
+}
+
+
+//! Gives every session that is due a turn. Returns the earliest deadline left, NO_DEADLINE (INT64_MAX) if none.
+int64_t session_run( struct session_table *table )
+{
+	int64_t now = session_now( );
+	int64_t next_deadline = NO_DEADLINE;
+	uint32_t due[SCAN_BATCH];
+	size_t cursor = 0;
+	size_t count;
+	struct readahead_extent *extent;
+
+	// A session waiting for an extent that has come in is due now.
+	while( table->read_ahead && (extent = readahead_completed( &table->reads )) != NULL ) {
+		if( table->state[extent->id] == SESSION_READING ) {
+			table->deadline[extent->id] = 0;
+		}
+	}
+
+	while( (count = session_table_scan( table, now, &cursor, due, SCAN_BATCH, &next_deadline )) > 0 ) {
+		for( size_t i = 0; i < count; ++i ) {
+			uint32_t id = due[i];
+
+			if( table->state[id] != SESSION_OFFERED ) {
+				run_session( table, id, now, NULL );
+			}
+			if( table->state[id] != SESSION_FREE && table->deadline[id] < next_deadline ) {
+				next_deadline = table->deadline[id];
+			}
+		}
+	}
+	return next_deadline;
+}
+
+
+//! Prints the flight recorder of every running session.
+void session_dump_flights( const struct session_table *table, FILE *stream )
+{
+	for( size_t id = 0; id < table->high_water; ++id ) {
+		if( table->state[id] != SESSION_FREE ) {
+			transfer_dump_flight( &table->sessions[id].transfer, stream, "running" );
+		}
+	}
+}
@@ -0,0 +1,121 @@
+/*!
+ * \file session.h
+ * \brief Transfers run as state machines by the listening process (-m event).
+ *
+ * Instead of a process per transfer, every transfer is a session in one
+ * table, and the request loop drives them all: it polls their sockets along
+ * with the listeners, feeds arriving ACKs to session_receive(), and calls
+ * session_run() to start new sessions and to handle expired timers. Each
+ * session is a protothread (pt.h) that reads like send_file() and suspends
+ * wherever send_file() would block.
+ *
+ * The table is laid out as parallel arrays indexed by session id. The fields
+ * session_run() looks at for every session on every pass (state, deadline,
+ * blocks in flight) each have a dense array of their own, so a
+ * pass over 100k idle sessions reads a few hundred kilobytes rather than
+ * every session's full state. Everything only needed once a session has
+ * something to do (addresses, window buffer, file position) is kept in the
+ * cold struct session array and is not touched by the scan.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "addrkey.h"
+#include "batch.h"
+#include "client_table.h"
+#include "netascii.h"
+#include "policy.h"
+#include "pt.h"
+#include "readahead.h"
+#include "transfer.h"
+
+#define SESSION_NONE UINT32_MAX
+
+enum session_state {
+	SESSION_FREE,      // Slot not in use.
+	SESSION_STARTING,  // Not run yet; due at once.
+	SESSION_OACK,      // OACK sent; waiting for ACK 0.
+	SESSION_WAITING,   // Window sent; waiting for an ACK until the deadline.
+	SESSION_PACED,     // Held back by the rate limit until the deadline.
+	SESSION_READING,   // Nothing to send until an I/O thread has read the next extent (-i); no deadline.
+	SESSION_OFFERED    // Waiting for an ACK, and offered to other workers (see worker.h); not run here.
+};
+
+// Cold per-session state, touched only when the session has work to do.
+struct session {
+	struct pt thread;                        // Where run_session() resumes.
+	struct transfer transfer;                // Its client_address points at client_address below.
+	struct sockaddr_storage client_address;
+	client_key key;
+	struct policy *policy;                   // Charged for this transfer.
+	unsigned char *window;                   // windowsize packets, indexed by block % windowsize.
+	size_t lengths[POLICY_WINDOWSIZE_LIMIT]; // Datagram length of each slot.
+	struct netascii_reader *reader;          // Only for netascii transfers.
+	struct readahead_extent *ahead[2];       // With -i, octet transfers only: the extent blocks are copied from
+	                                         // and the one after it. Without, blocks are read with pread().
+	off_t file_size;                         // When the transfer started; bounds the reads done inline.
+	uint32_t base;       // Oldest unacknowledged block.
+	uint32_t filled;     // Next block to read into the window.
+	uint32_t next_send;  // Next block to put on the wire.
+	uint32_t last;       // Final block, once it has been read.
+	off_t offset;        // File offset of block filled.
+	unsigned retries;
+	int64_t next_send_time;  // Earliest time the rate limit allows the next block.
+	unsigned long long bytes_left;  // File bytes not yet acknowledged, counted in the table's load.
+	int64_t moved_deadline;  // Its deadline, while it moves to another table.
+};
+
+struct session_table {
+	size_t capacity;
+	size_t count;       // Sessions in use.
+	size_t high_water;  // No session id at or above this is in use.
+
+	// Hot: read for every session on every pass of session_run().
+	uint8_t  *state;     // enum session_state.
+	int64_t  *deadline;  // CLOCK_MONOTONIC nanoseconds of the next timer; INT64_MAX for none.
+	uint16_t *inflight;  // Blocks sent and not yet acknowledged.
+
+	// Indexed by reserved + id. The entries before reserved - 1 belong to the caller (the listeners); the one at
+	// reserved - 1 is the eventfd of reads, or -1 without -i.
+	struct pollfd *poll_set;
+	size_t reserved;
+
+	// Cold.
+	struct session *sessions;
+	uint32_t *free_ids;  // Stack of unused ids.
+	size_t free_count;
+
+	struct client_table *clients;  // Sessions remove their client from it when they end.
+	pthread_mutex_t *clients_lock;  // Held around clients and the policy counts when threads share them; else NULL.
+	struct batch_control send_batch;  // Sizes the sendmmsg() batches of every session.
+	atomic_ullong load;  // bytes_left of all its sessions; read by other workers.
+	int read_ahead;      // Non-zero if its sessions read through the I/O threads (-i).
+	struct readahead_queue reads;  // Where the I/O threads report the extents they have read for its sessions.
+};
+
+int  session_table_init( struct session_table *table, size_t capacity, size_t reserved, struct client_table *clients );
+void session_table_destroy( struct session_table *table );
+
+int64_t session_now( void );
+uint32_t session_start( struct session_table *table, const struct transfer *transfer, const client_key *key,
+                        struct policy *policy );
+void session_receive( struct session_table *table, uint32_t id );
+struct session *session_offer( struct session_table *table, uint32_t id );
+void session_reclaim( struct session_table *table, uint32_t id, int taken );
+uint32_t session_adopt( struct session_table *table, const struct session *moved );
+size_t session_table_scan( const struct session_table *table, int64_t now, size_t *cursor, uint32_t *due, size_t max,
+                           int64_t *next_deadline );
+int64_t session_run( struct session_table *table );
+void session_dump_flights( const struct session_table *table, FILE *stream );
+
+#endif
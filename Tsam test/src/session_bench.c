@@ -0,0 +1,109 @@
+/*!
+ * \file session_bench.c
+ * \brief Times the session_run() scan over a large table, against the same scan over whole session structs.
+ *
+ * Usage: ./session_bench [sessions [passes]]   (default 100000 sessions, 200 passes)
+ *
+ * Every session is made to wait for an ACK with a deadline in the future,
+ * except one in a hundred, which is due. The hot/cold layout of struct
+ * session_table is timed through session_table_scan() itself; the
+ * comparison keeps the same three hot fields inside each full struct session,
+ * as a single array of structs would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "session.h"
+
+#define DEFAULT_SESSIONS 100000
+#define DEFAULT_PASSES   200
+#define DUE_EVERY        100
+
+// The array-of-structs layout the table avoids.
+struct whole_session {
+	struct session cold;
+	int64_t deadline;
+	uint16_t inflight;
+	uint8_t state;
+};
+
+
+static size_t scan_whole( const struct whole_session *all, size_t count, int64_t now, uint32_t *due,
+                          int64_t *next_deadline )
+{
+	size_t found = 0;
+
+	for( size_t id = 0; id < count; ++id ) {
+		if( all[id].deadline <= now ) {
+			due[found++] = (uint32_t)id;
+		}
+		else if( all[id].deadline < *next_deadline ) {
+			*next_deadline = all[id].deadline;
+		}
+	}
+	return found;
+}
+
+
+int main( int argc, char **argv )
+{
+	size_t count = argc > 1 ? strtoul( argv[1], NULL, 10 ) : DEFAULT_SESSIONS;
+	int passes = argc > 2 ? atoi( argv[2] ) : DEFAULT_PASSES;
+	struct session_table table;
+	struct whole_session *all;
+	uint32_t *due;
+	int64_t now = session_now( );
+	int64_t start;
+	int64_t split_ns;
+	int64_t whole_ns;
+	size_t found = 0;
+
+	if( session_table_init( &table, count, 0, NULL ) == -1 ||
+	    (all = calloc( count, sizeof(*all) )) == NULL || (due = malloc( count * sizeof(*due) )) == NULL ) {
+		perror( "Unable to allocate sessions" );
+		return EXIT_FAILURE;
+	}
+
+	for( size_t id = 0; id < count; ++id ) {
+		int64_t deadline = id % DUE_EVERY == 0 ? now - 1 : now + 1000000000 + (int64_t)id;
+
+		table.state[id] = SESSION_WAITING;
+		table.deadline[id] = deadline;
+		table.inflight[id] = 8;
+		all[id].state = SESSION_WAITING;
+		all[id].deadline = deadline;
+		all[id].inflight = 8;
+	}
+	table.high_water = count;
+	table.count = count;
+
+	start = session_now( );
+	for( int pass = 0; pass < passes; ++pass ) {
+		int64_t next_deadline = INT64_MAX;
+		size_t cursor = 0;
+
+		found = session_table_scan( &table, now, &cursor, due, count, &next_deadline );
+	}
+	split_ns = session_now( ) - start;
+
+	start = session_now( );
+	for( int pass = 0; pass < passes; ++pass ) {
+		int64_t next_deadline = INT64_MAX;
+
+		found = scan_whole( all, count, now, due, &next_deadline );
+	}
+	whole_ns = session_now( ) - start;
+
+	printf( "%zu sessions, %zu due, %d passes\n", count, found, passes );
+	printf( "hot arrays:    %8.1f us/pass  %6.2f ns/session  (%zu bytes scanned)\n",
+	        split_ns / 1e3 / passes, (double)split_ns / passes / count,
+	        count * sizeof(*table.deadline) );
+	printf( "whole structs: %8.1f us/pass  %6.2f ns/session  (%zu bytes strided over)\n",
+	        whole_ns / 1e3 / passes, (double)whole_ns / passes / count, count * sizeof(*all) );
+
+	free( due );
+	free( all );
+	session_table_destroy( &table );
+	return EXIT_SUCCESS;
+}
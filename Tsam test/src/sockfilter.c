@@ -0,0 +1,112 @@
+/*!
+ * \file sockfilter.c
+ * \brief The BPF programs and their attachment.
+ *
+ * For a UDP socket the filter sees the datagram from the UDP header on, so
+ * the TFTP opcode is at offset 8 and "len" includes the 8 header bytes. A
+ * load beyond the end of the datagram makes the program return 0 (drop).
+ */
+
+#define _DEFAULT_SOURCE  // SO_ATTACH_FILTER and SO_MEMINFO.
+
+#include <errno.h>
+
+#include <sys/socket.h>
+
+#include "packet.h"
+#include "sockfilter.h"
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#define UDP_HEADER_LENGTH 8
+#define ACCEPT 0xffff  // Keep up to this many bytes, i.e. the whole datagram.
+
+// Opcode RRQ or WRQ, and between a bare header and a full request in length.
+static struct sock_filter request_program[] = {
+	BPF_STMT( BPF_LD  | BPF_H   | BPF_ABS, UDP_HEADER_LENGTH ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, OP_RRQ, 1, 0 ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, OP_WRQ, 0, 4 ),
+	BPF_STMT( BPF_LD  | BPF_W   | BPF_LEN, 0 ),
+	BPF_JUMP( BPF_JMP | BPF_JGE | BPF_K, UDP_HEADER_LENGTH + TFTP_HEADER_LENGTH, 0, 2 ),
+	BPF_JUMP( BPF_JMP | BPF_JGT | BPF_K, UDP_HEADER_LENGTH + TFTP_MAX_REQUEST, 1, 0 ),
+	BPF_STMT( BPF_RET | BPF_K, ACCEPT ),
+	BPF_STMT( BPF_RET | BPF_K, 0 ),
+};
+
+// Opcode ACK or ERROR, no longer than a request buffer.
+static struct sock_filter session_program[] = {
+	BPF_STMT( BPF_LD  | BPF_H   | BPF_ABS, UDP_HEADER_LENGTH ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, OP_ACK, 1, 0 ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, OP_ERROR, 0, 3 ),
+	BPF_STMT( BPF_LD  | BPF_W   | BPF_LEN, 0 ),
+	BPF_JUMP( BPF_JMP | BPF_JGT | BPF_K, UDP_HEADER_LENGTH + TFTP_MAX_REQUEST, 1, 0 ),
+	BPF_STMT( BPF_RET | BPF_K, ACCEPT ),
+	BPF_STMT( BPF_RET | BPF_K, 0 ),
+};
+
+
+static int attach( int handle, struct sock_filter *program, unsigned short length )
+{
+	struct sock_fprog filter = { length, program };
+
+	return setsockopt( handle, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter) );
+}
+
+
+//! Restricts a listening socket to plausible requests. Returns 0, or -1 with errno set.
+int sockfilter_attach_request( int handle )
+{
+	return attach( handle, request_program, sizeof(request_program) / sizeof(request_program[0]) );
+}
+
+
+//! Restricts a transfer socket to ACK and ERROR packets. Returns 0, or -1 with errno set.
+int sockfilter_attach_session( int handle )
+{
+	return attach( handle, session_program, sizeof(session_program) / sizeof(session_program[0]) );
+}
+
+
+//! Returns how many datagrams the kernel dropped on this socket (filtered or overflowed), or -1.
+long sockfilter_drops( int handle )
+{
+#ifdef SO_MEMINFO
+	unsigned int memory[SK_MEMINFO_VARS];
+	socklen_t length = sizeof(memory);
+
+	if( getsockopt( handle, SOL_SOCKET, SO_MEMINFO, memory, &length ) == 0 && length > SK_MEMINFO_DROPS * sizeof(memory[0]) ) {
+		return (long)memory[SK_MEMINFO_DROPS];
+	}
+#else
+	(void)handle;
+#endif
+	return -1;
+}
+
+#else
+
+int sockfilter_attach_request( int handle )
+{
+	(void)handle;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int sockfilter_attach_session( int handle )
+{
+	(void)handle;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+long sockfilter_drops( int handle )
+{
+	(void)handle;
+	return -1;
+}
+
+#endif
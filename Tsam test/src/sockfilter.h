@@ -0,0 +1,19 @@
+/*!
+ * \file sockfilter.h
+ * \brief Classic BPF socket filters that drop junk before it wakes the server.
+ *
+ * Listening sockets only accept datagrams that start with an RRQ or WRQ
+ * opcode and fit in a request buffer; transfer sockets only accept ACK and
+ * ERROR. Everything else is discarded by the kernel, which counts it as a
+ * socket drop. Where SO_ATTACH_FILTER is not available the calls fail and
+ * the server simply does the same checks in user space.
+ */
+
+#ifndef SOCKFILTER_H
+#define SOCKFILTER_H
+
+int sockfilter_attach_request( int handle );
+int sockfilter_attach_session( int handle );
+long sockfilter_drops( int handle );
+
+#endif
@@ -0,0 +1,125 @@
+/*!
+ * \file stats.c
+ * \brief Allocation and printing of the shared server counters.
+ */
+
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS.
+
+#include <stdio.h>
+
+#include <sys/mman.h>
+
+#include "stats.h"
+
+struct server_stats *stats;
+
+static const char *family_names[FAMILY_COUNT] = { "ipv4", "ipv6" };
+
+
+//! Maps the counters. Must be called before any child process is created.
+int stats_init( void )
+{
+	void *block = mmap( NULL, sizeof(struct server_stats), PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+
+	if( block == MAP_FAILED ) {
+		return -1;
+	}
+	// Fresh anonymous pages are zero filled, which is a valid initial state for the atomics.
+	stats = block;
+	return 0;
+}
+
+
+static unsigned long load( atomic_ulong *counter )
+{
+	return atomic_load_explicit( counter, memory_order_relaxed );
+}
+
+
+//! Adds a queueing delay in nanoseconds, as reported by timestamp_recvfrom(); a negative one is unknown and skipped.
+void stats_add_delay( struct delay_stats *delay, int64_t queued )
+{
+	unsigned long us = (unsigned long)(queued / 1000);
+	unsigned long max;
+
+	if( queued < 0 ) {
+		return;
+	}
+	max = atomic_load_explicit( &delay->max_us, memory_order_relaxed );
+	atomic_fetch_add_explicit( &delay->count, 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( &delay->total_us, us, memory_order_relaxed );
+	while( us > max &&
+	       !atomic_compare_exchange_weak_explicit( &delay->max_us, &max, us, memory_order_relaxed, memory_order_relaxed ) ) {
+	}
+}
+
+
+static void dump_delay( FILE *stream, const char *name, struct delay_stats *delay )
+{
+	unsigned long count = load( &delay->count );
+
+	fprintf( stream, "queue_delay %s: count=%lu mean_us=%lu max_us=%lu\n", name, count,
+	         count != 0 ? load( &delay->total_us ) / count : 0, load( &delay->max_us ) );
+}
+
+
+void stats_dump( FILE *stream )
+{
+	unsigned long spins = load( &stats->busy_poll.spins );
+	unsigned long hits = load( &stats->busy_poll.hits );
+	unsigned long async_reads = load( &stats->readahead.async_reads );
+	unsigned long issued = load( &stats->prefetch.issued );
+	unsigned long lookups = load( &stats->cache.hits ) + load( &stats->cache.misses );
+
+	for( int family = 0; family < FAMILY_COUNT; ++family ) {
+		struct family_stats *f = &stats->family[family];
+
+		fprintf( stream, "%s: requests=%lu duplicates=%lu errors=%lu denied=%lu completed=%lu failed=%lu "
+		         "retransmits=%lu bytes_sent=%lu session_drops=%lu resumed=%lu bytes_skipped=%lu\n",
+		         family_names[family], load( &f->requests ), load( &f->duplicates ),
+		         load( &f->errors ), load( &f->denied ), load( &f->completed ), load( &f->failed ),
+		         load( &f->retransmits ), load( &f->bytes_sent ), load( &f->session_drops ),
+		         load( &f->resumed ), load( &f->bytes_skipped ) );
+	}
+	dump_delay( stream, "requests", &stats->request_queue );
+	dump_delay( stream, "acks", &stats->ack_queue );
+	batch_dump( stream, "requests", &stats->request_batch );
+	batch_dump( stream, "sends", &stats->send_batch );
+	// Only with -b.
+	if( spins != 0 ) {
+		fprintf( stream, "busy_poll: spins=%lu hits=%lu hit_ratio=%.1f%% spin_us=%lu\n", spins, hits,
+		         100.0 * (double)hits / (double)spins, load( &stats->busy_poll.spin_us ) );
+	}
+	if( issued != 0 ) {
+		fprintf( stream, "prefetch: issued=%lu hits=%lu hit_rate=%.1f%%\n", issued, load( &stats->prefetch.hits ),
+		         100.0 * (double)load( &stats->prefetch.hits ) / (double)issued );
+	}
+	// Only with -i.
+	if( async_reads != 0 || load( &stats->readahead.inline_reads ) != 0 ) {
+		fprintf( stream, "readahead: inline=%lu async=%lu async_mean_us=%lu\n", load( &stats->readahead.inline_reads ),
+		         async_reads, async_reads != 0 ? load( &stats->readahead.async_us ) / async_reads : 0 );
+	}
+	// Only with -C.
+	if( lookups != 0 || load( &stats->cache.netascii_hits ) != 0 || load( &stats->cache.warmed ) != 0 ) {
+		unsigned long hit_bytes = load( &stats->cache.hit_bytes );
+
+		fprintf( stream, "cache: hits=%lu misses=%lu hit_ratio=%.1f%% byte_hit_ratio=%.1f%% admitted=%lu rejected=%lu "
+		         "evicted=%lu bytes=%lu netascii_hits=%lu warmed=%lu\n", load( &stats->cache.hits ),
+		         load( &stats->cache.misses ),
+		         100.0 * (double)load( &stats->cache.hits ) / (double)(lookups + (lookups == 0)),
+		         100.0 * (double)hit_bytes / (double)(hit_bytes + load( &stats->cache.miss_bytes ) + (hit_bytes == 0)),
+		         load( &stats->cache.admitted ), load( &stats->cache.rejected ), load( &stats->cache.evicted ),
+		         load( &stats->cache.bytes ), load( &stats->cache.netascii_hits ), load( &stats->cache.warmed ) );
+	}
+	if( load( &stats->seekable.opened ) != 0 ) {
+		unsigned long frames = load( &stats->seekable.hits ) + load( &stats->seekable.misses );
+
+		fprintf( stream, "compressed: transfers=%lu frame_hits=%lu frames_inflated=%lu frame_hit_ratio=%.1f%% "
+		         "bytes_inflated=%lu\n", load( &stats->seekable.opened ), load( &stats->seekable.hits ),
+		         load( &stats->seekable.misses ),
+		         100.0 * (double)load( &stats->seekable.hits ) / (double)(frames + (frames == 0)),
+		         load( &stats->seekable.inflated ) );
+	}
+	fflush( stream );
+}
@@ -0,0 +1,77 @@
+/*!
+ * \file stats.h
+ * \brief Server-wide counters shared between the listener and its children.
+ *
+ * The counters live in an anonymous shared mapping created before the first
+ * fork(), so transfer processes can bump them and the listening process can
+ * print a consistent picture when it receives SIGUSR1.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "addrkey.h"
+#include "batch.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "profile.h"
+#include "readahead.h"
+#include "seekable.h"
+
+struct family_stats {
+	atomic_ulong requests;    // Request datagrams received.
+	atomic_ulong duplicates;  // Requests for a transfer that is already running.
+	atomic_ulong errors;      // Requests answered with an ERROR packet.
+	atomic_ulong denied;      // Requests refused by the ACL.
+	atomic_ulong completed;   // Transfers acknowledged to the last block.
+	atomic_ulong failed;      // Transfers abandoned after starting.
+	atomic_ulong retransmits; // DATA packets sent again after a timeout.
+	atomic_ulong bytes_sent;  // File bytes acknowledged by clients.
+	atomic_ulong session_drops; // Datagrams the kernel dropped on transfer sockets (see sockfilter.h).
+	atomic_ulong resumed;       // Transfers started part way in with the offset option.
+	atomic_ulong bytes_skipped; // File bytes resumed transfers did not have to send again.
+};
+
+// Time datagrams spent in a socket queue before the server got to them, from kernel receive stamps
+// (see timestamp.h). A growing mean means the server is falling behind.
+struct delay_stats {
+	atomic_ulong count;
+	atomic_ulong total_us;
+	atomic_ulong max_us;
+};
+
+// The event loop's spin before blocking, with -b (see busypoll.h).
+struct busy_poll_stats {
+	atomic_ulong spins;    // Waits that started with a spin.
+	atomic_ulong hits;     // Spins that found a socket ready before the budget ran out.
+	atomic_ulong spin_us;  // Time spent spinning.
+};
+
+struct server_stats {
+	struct family_stats family[FAMILY_COUNT];
+	struct delay_stats request_queue;  // Requests on the listening sockets.
+	struct delay_stats ack_queue;      // ACKs and errors on the transfer sockets.
+	struct busy_poll_stats busy_poll;
+	struct readahead_stats readahead;  // Only used with -i.
+	struct prefetch_stats prefetch;    // Only used by policies with prefetch=N.
+	struct cache_stats cache;          // Only used with -C.
+	struct seekable_stats seekable;    // Only used when compressed files (FILE.tfz) are served.
+	struct batch_stats request_batch;  // recvmmsg() on the listening sockets.
+	struct batch_stats send_batch;     // sendmmsg() of DATA packets.
+	struct phase_stats phases[PHASE_COUNT];  // Only filled in with -DPHASE_PROFILE.
+};
+
+extern struct server_stats *stats;
+
+int  stats_init( void );
+void stats_dump( FILE *stream );
+void stats_add_delay( struct delay_stats *delay, int64_t queued );
+
+#define STATS_ADD(field, amount) atomic_fetch_add_explicit( &stats->field, (amount), memory_order_relaxed )
+#define STATS_INC(field) STATS_ADD( field, 1 )
+
+#endif
@@ -6,47 +6,644 @@
  * \todo Error messages should be logged rather than sent to the console.
  */
 
+ #include <errno.h>
+ #include <signal.h>
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  
  #include <arpa/inet.h>
  #include <netdb.h>
+ #include <netinet/in.h>
+ #include <poll.h>
+ #include <pthread.h>
  #include <sys/socket.h>
+ #include <sys/wait.h>
  #ifndef S_SPLIT_S     // Workaround for splint.
  #include <unistd.h>
  #endif
  
- int send_file( int socket_handle, struct sockaddr_in6 *client_address, const char *file_name );
+ #include "acl.h"
+ #include "addrkey.h"
+ #include "batch.h"
+ #include "bundle.h"
+ #include "busypoll.h"
+ #include "cache.h"
+ #include "classifier.h"
+ #include "client_table.h"
+ #include "iso.h"
+ #include "listener.h"
+ #include "packet.h"
+ #include "policy.h"
+ #include "prefetch.h"
+ #include "probes.h"
+ #include "profile.h"
+ #include "readahead.h"
+ #include "session.h"
+ #include "sockfilter.h"
+ #include "stats.h"
+ #include "timestamp.h"
+ #include "transfer.h"
+ #include "worker.h"
  
- #define REQUEST_BUFFER_LENGTH 512
+ #define REQUEST_BUFFER_LENGTH TFTP_MAX_REQUEST
+ #define ACCEPTOR_MAX 8
+ #define MAX_LISTENERS 32
+ #define MAX_ACTIVE_TRANSFERS 4096
  
- static char *extract_file_name( unsigned char *request_buffer )
+ static struct listener listeners[MAX_LISTENERS];
+ static size_t listener_count;
+ 
+ // With -m event, transfers are sessions run by this process instead of child processes.
+ static int event_mode;
+ static struct session_table sessions;
+ static unsigned busy_poll_us;  // -b: how long the event loop spins before blocking; 0 not to.
+ static unsigned worker_threads;  // -t: run the sessions on this many worker threads; 0 to run them here.
+ static unsigned io_threads;      // -i: sessions read ahead on this many I/O threads; 0 to read in the loop.
+ static unsigned long cache_megabytes;  // -C: keep popular files in this much memory; 0 for no cache.
+ static const char *snapshot_file;      // -S: where the cache index is saved and restored from; NULL for nowhere.
+ 
+ // Guards active and the policies' active_transfers, which worker threads update as their sessions end.
+ static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ // A thread that reads and handles requests (-A). Without -A the main loop does, as acceptors[0].
+ struct acceptor {
+	 pthread_t thread;
+	 struct pollfd poll_set[MAX_LISTENERS];
+	 struct client_table *active;
+	 struct batch_control batch;  // Sizes its recvmmsg() batches on the listeners.
+	 unsigned char buffers[BATCH_MAX][REQUEST_BUFFER_LENGTH];  // Buffers to hold request messages.
+ };
+ 
+ static struct acceptor acceptors[ACCEPTOR_MAX];
+ static unsigned acceptor_threads;  // -A: read requests on this many threads, with -t; 0 to read them in the main loop.
+ 
+ static volatile sig_atomic_t dump_requested;    // Set by SIGUSR1.
+ static volatile sig_atomic_t children_exited;   // Set by SIGCHLD.
+ static volatile sig_atomic_t stop_requested;    // Set by SIGTERM and SIGINT.
+ 
+ 
+ static void handle_signal( int signal_number )
+ {
+	 busypoll_interrupted = 1;
+	 if( signal_number == SIGUSR1 ) {
+		 dump_requested = 1;
+	 }
+	 else if( signal_number == SIGUSR2 ) {
+		 transfer_dump_requested = 1;
+	 }
+	 else if( signal_number == SIGCHLD ) {
+		 children_exited = 1;
+	 }
+	 else if( signal_number == SIGTERM || signal_number == SIGINT ) {
+		 stop_requested = 1;
+	 }
+ }
+ 
+ 
+ // Installs handle_signal() without SA_RESTART so that poll() wakes up for it.
+ static void install_signal_handlers( void )
+ {
+	 struct sigaction action;
+ 
+	 memset( &action, 0, sizeof(action) );
+	 action.sa_handler = handle_signal;
+	 sigemptyset( &action.sa_mask );
+	 sigaction( SIGUSR1, &action, NULL );
+	 sigaction( SIGUSR2, &action, NULL );
+	 sigaction( SIGCHLD, &action, NULL );
+	 sigaction( SIGTERM, &action, NULL );
+	 sigaction( SIGINT, &action, NULL );
+ }
+ 
+ 
+ // Collects finished transfer processes and forgets the clients they served.
+ static void reap_children( struct client_table *active )
+ {
+	 pid_t child_id;
+	 int group;
+ 
+	 children_exited = 0;
+	 while( (child_id = waitpid( -1, NULL, WNOHANG )) > 0 ) {
+		 if( client_table_remove_owner( active, (int)child_id, &group ) == 0 ) {
+			 policy_lookup( group )->active_transfers--;
+		 }
+	 }
+ }
+ 
+ 
+ // Writes the -S snapshot of the cache index, when the server stops.
+ static void save_snapshot( void )
+ {
+	 if( cache_save( snapshot_file ) == -1 ) {
+		 fprintf( stderr, "Unable to save cache snapshot %s: %s\n", snapshot_file, strerror( errno ) );
+	 }
+ }
+ 
+ 
+ // Has every running transfer print its flight recorder: the sessions from here, transfer processes
+ // when they next wake up (they keep handle_signal() for SIGUSR2).
+ static void dump_flights( struct client_table *active )
+ {
+	 transfer_dump_requested = 0;
+	 if( worker_threads != 0 ) {
+		 workers_dump_flights( );
+		 return;
+	 }
+	 if( event_mode ) {
+		 session_dump_flights( &sessions, stderr );
+		 return;
+	 }
+	 for( size_t i = 0; i < active->capacity; ++i ) {
+		 if( active->entries[i].used ) {
+			 kill( (pid_t)active->entries[i].owner, SIGUSR2 );
+		 }
+	 }
+ }
+ 
+ 
+ // Prints what the kernel has dropped on each listening socket, mostly datagrams rejected by the socket filter.
+ static void dump_listener_drops( FILE *stream )
+ {
+	 for( size_t i = 0; i < listener_count; ++i ) {
+		 char name[CLIENT_KEY_STRING_LENGTH];
+		 client_key key;
+ 
+		 client_key_from_sockaddr( &key, (struct sockaddr *)&listeners[i].address );
+		 client_key_format( &key, name, sizeof(name) );
+		 fprintf( stream, "listener %s: kernel_drops=%ld\n", name, sockfilter_drops( listeners[i].handle ) );
+	 }
+	 fflush( stream );
+ }
+ 
+ 
+ // Points the transfer at file_name in the policy's bundle: its translated copy for netascii if the bundle has one.
+ // Returns 0, or -1 with the error for the client.
+ static int open_in_bundle( struct transfer *transfer, const struct policy *policy, const struct tftp_request *request,
+                            int *error_code, const char **message )
+ {
+	 const struct bundle_record *record = bundle_find( policy->bundle, request->file_name );
+ 
+	 if( record == NULL ) {
+		 *error_code = ERR_NOT_FOUND;
+		 *message = "File not found";
+		 return -1;
+	 }
+	 transfer->file_handle = -1;
+	 transfer->netascii_size = (off_t)record->netascii_size;
+	 if( request->mode == MODE_NETASCII && record->netascii_offset != 0 ) {
+		 transfer->contents = policy->bundle->map + record->netascii_offset;
+		 transfer->contents_size = (off_t)record->netascii_size;
+		 transfer->translated = 1;
+	 }
+	 else {
+		 transfer->contents = policy->bundle->map + record->offset;
+		 transfer->contents_size = (off_t)record->size;
+	 }
+	 return 0;
+ }
+ 
+ 
+ // Points the transfer at file_name's extent in the policy's ISO 9660 image. Returns 0, or -1 with the error for
+ // the client.
+ static int open_in_image( struct transfer *transfer, const struct policy *policy, const struct tftp_request *request,
+                           int *error_code, const char **message )
+ {
+	 const struct iso_file *file = iso_find( policy->image, request->file_name );
+ 
+	 if( file == NULL ) {
+		 *error_code = ERR_NOT_FOUND;
+		 *message = "File not found";
+		 return -1;
+	 }
+	 transfer->file_handle = -1;
+	 transfer->contents = policy->image->map + file->offset;
+	 transfer->contents_size = (off_t)file->size;
+	 return 0;
+ }
+ 
+ 
+ // Opens file_name under the policy's root or, if it is not there, its compressed copy file_name.tfz (see
+ // seekable.h). Returns 0, or -1 with the error for the client.
+ static int open_in_directory( struct transfer *transfer, const struct policy *policy, const struct tftp_request *request,
+                               int *error_code, const char **message )
+ {
+	 char compressed[TFTP_MAX_REQUEST + sizeof(SEEKABLE_SUFFIX)];
+	 int ignored_code;
+	 const char *ignored_message;
+	 int handle;
+ 
+	 if( (transfer->file_handle = open_in_root( policy->root_handle, request->file_name, error_code, message )) != -1 ) {
+		 return 0;
+	 }
+	 // The error for the name asked for is the one the client gets if there is no compressed copy either.
+	 snprintf( compressed, sizeof(compressed), "%s%s", request->file_name, SEEKABLE_SUFFIX );
+	 if( *error_code != ERR_NOT_FOUND ||
+	     (handle = open_in_root( policy->root_handle, compressed, &ignored_code, &ignored_message )) == -1 ) {
+		 return -1;
+	 }
+	 if( (transfer->seekable = seekable_open( handle )) == NULL ) {
+		 close( handle );
+		 *error_code = ERR_UNDEFINED;
+		 *message = "Unable to read compressed file";
+		 return -1;
+	 }
+	 transfer->file_handle = handle;
+	 transfer->netascii_size = (off_t)transfer->seekable->header.netascii_size;
+	 return 0;
+ }
+ 
+ 
+ // Creates the transfer socket, opens the file and negotiates the options. Returns 0, or -1 once the
+ // client has been sent an error (or the socket could not be created).
+ static int prepare_transfer( struct transfer *transfer, struct listener *listener, const struct policy *policy,
+                              const struct tftp_request *request, const struct sockaddr *client_address,
+                              socklen_t client_length, const client_key *key )
+ {
+	 int socket_handle;  // Handle for bulk client communication.
+	 int error_code;
+	 const char *message;
+	 int result;
+	 PROFILE_START( open_start );
+ 
+	 // Create a fresh socket to communicate with the client.
+	 if( (socket_handle = socket( client_address->sa_family, SOCK_DGRAM, 0) ) == -1 ) {
+		 perror( "Unable to create socket" );
+		 return -1;
+	 }
+ 
+	 // Answer from the address the request was sent to; a listener on the any-address leaves it to routing.
+	 if( !listener->wildcard ) {
+		 struct sockaddr_storage local = listener->address;
+ 
+		 if( local.ss_family == AF_INET6 ) {
+			 ((struct sockaddr_in6 *)&local)->sin6_port = 0;
+		 }
+		 else {
+			 ((struct sockaddr_in *)&local)->sin_port = 0;
+		 }
+		 bind( socket_handle, (struct sockaddr *)&local, listener->address_length );
+	 }
+	 // Only ACK and ERROR are meaningful on this socket; anything else need not wake us.
+	 sockfilter_attach_session( socket_handle );
+	 // Kernel receive stamps, for round trips measured from the wire and for the queueing delay.
+	 timestamp_enable( socket_handle );
+	 if( busy_poll_us != 0 ) {
+		 busypoll_enable( socket_handle, busy_poll_us );
+	 }
+ 
+	 transfer->cached = NULL;
+	 transfer->contents = NULL;
+	 transfer->contents_size = 0;
+	 transfer->netascii_size = -1;
+	 transfer->translated = 0;
+	 transfer->seekable = NULL;
+	 if( policy->bundle != NULL ) {
+		 result = open_in_bundle( transfer, policy, request, &error_code, &message );
+	 }
+	 else if( policy->image != NULL ) {
+		 result = open_in_image( transfer, policy, request, &error_code, &message );
+	 }
+	 else {
+		 result = open_in_directory( transfer, policy, request, &error_code, &message );
+	 }
+	 if( result == -1 ) {
+		 STATS_INC( family[key->family].errors );
+		 send_error_message( socket_handle, client_address, client_length, error_code, message );
+		 close( socket_handle );
+		 return -1;
+	 }
+	 PROFILE_END( PHASE_OPEN, open_start );
+ 
+	 transfer->id = (int)getpid( );
+	 transfer->socket_handle = socket_handle;
+	 transfer->client_address = client_address;
+	 transfer->client_length = client_length;
+	 transfer->family = key->family;
+	 transfer->mode = request->mode;
+	 transfer_negotiate( transfer, request, policy );
+	 if( transfer->mode == MODE_OCTET && transfer->file_handle != -1 && transfer->seekable == NULL &&
+	     (transfer->cached = cache_get( transfer->file_handle )) != NULL ) {
+		 transfer->contents = transfer->cached->data;
+		 transfer->contents_size = (off_t)transfer->cached->policy.size;
+	 }
+	 return 0;
+ }
+ 
+ 
+ // Runs in the child process: serves the parsed request and never returns.
+ static void serve_request( struct listener *listener, const struct policy *policy, const struct tftp_request *request,
+                            const struct sockaddr *client_address, socklen_t client_length, const client_key *key )
+ {
+	 struct transfer transfer;
+	 long drops;
+ 
+	 if( prepare_transfer( &transfer, listener, policy, request, client_address, client_length, key ) == -1 ) {
+		 exit( EXIT_SUCCESS );
+	 }
+ 
+	 // Send the file!
+	 PROBE_SESSION_CREATE( transfer.id, transfer.blksize, transfer.windowsize, transfer.offset );
+	 if( send_file( &transfer ) == -1 ) {
+		 transfer_dump_flight( &transfer, stderr, "failed" );
+	 }
+	 if( (drops = sockfilter_drops( transfer.socket_handle )) > 0 ) {
+		 STATS_ADD( family[key->family].session_drops, (unsigned long)drops );
+	 }
+	 transfer_close_file( &transfer );
+	 close( transfer.socket_handle );
+	 exit( EXIT_SUCCESS );
+ }
+ 
+ 
+ // Starts the transfer as a session of this process, or with -t of a worker thread. The session takes the
+ // client out of active when it ends.
+ static void start_session( struct listener *listener, struct policy *policy, const struct tftp_request *request,
+                            const struct sockaddr *client_address, socklen_t client_length, const client_key *key,
+                            struct client_table *active )
+ {
+	 struct transfer transfer;
+	 uint32_t id;
+ 
+	 if( prepare_transfer( &transfer, listener, policy, request, client_address, client_length, key ) == -1 ) {
+		 return;
+	 }
+	 // The client goes in active before the worker has it, so the worker always finds it there to take out.
+	 // Another acceptor may have started the same client, or taken the policy's last transfer, since
+	 // handle_request() looked; both are checked again under the lock that counts the transfer.
+	 if( worker_threads != 0 ) {
+		 pthread_mutex_lock( &active_lock );
+		 if( client_table_find( active, key ) != NULL ) {
+			 pthread_mutex_unlock( &active_lock );
+			 STATS_INC( family[key->family].duplicates );
+			 transfer_close_file( &transfer );
+			 close( transfer.socket_handle );
+			 return;
+		 }
+		 if( policy->max_transfers != 0 && policy->active_transfers >= policy->max_transfers ) {
+			 pthread_mutex_unlock( &active_lock );
+			 STATS_INC( family[key->family].errors );
+			 send_error_message( transfer.socket_handle, client_address, client_length,
+			                     ERR_UNDEFINED, "Server busy, try again later" );
+			 transfer_close_file( &transfer );
+			 close( transfer.socket_handle );
+			 return;
+		 }
+		 policy->active_transfers++;
+		 client_table_insert( active, key, -1, policy->id );
+		 pthread_mutex_unlock( &active_lock );
+		 if( workers_place( &transfer, key, policy ) != -1 ) {
+			 return;
+		 }
+		 pthread_mutex_lock( &active_lock );
+		 client_table_remove( active, key );
+		 policy->active_transfers--;
+		 pthread_mutex_unlock( &active_lock );
+		 id = SESSION_NONE;
+	 }
+	 else {
+		 id = session_start( &sessions, &transfer, key, policy );
+	 }
+	 if( id == SESSION_NONE ) {
+		 STATS_INC( family[key->family].errors );
+		 send_error_message( transfer.socket_handle, client_address, client_length,
+		                     ERR_UNDEFINED, "Server busy, try again later" );
+		 transfer_close_file( &transfer );
+		 close( transfer.socket_handle );
+		 return;
+	 }
+	 policy->active_transfers++;
+	 client_table_insert( active, key, (int)id, policy->id );
+ }
+ 
+ 
+ // Handles one request received on listener: starts a transfer process (or session) for it.
+ static void handle_request( struct listener *listener, struct client_table *active, struct timestamp_message *message )
+ {
+	 struct sockaddr_storage client_address = message->address;  // Address of client.
+	 socklen_t client_length = message->address_length;
+	 client_key key;
+	 char client_name[CLIENT_KEY_STRING_LENGTH];
+	 struct tftp_request request;
+	 struct policy *policy;  // Everything below is decided by this.
+ 
+	 // The request message.
+	 unsigned char *request_buffer = message->buffer;
+	 ssize_t request_count = (ssize_t)message->length;
+ 
+	 pid_t child_id;  // Child process ID.
+ 
+	 if( client_key_from_sockaddr( &key, (struct sockaddr *)&client_address ) == -1 ) {
+		 return;
+	 }
+	 STATS_INC( family[key.family].requests );
+	 stats_add_delay( &stats->request_queue, message->queued );
+	 PROBE_REQUEST_RECEIVED( client_address.ss_family, request_count );
+ 
+	 // Extract the file name from the request. Bad requests are answered from here, without a process.
+	 PROFILE_START( parse_start );
+	 if( packet_parse_request( request_buffer, (size_t)request_count, &request ) == -1 ) {
+		 STATS_INC( family[key.family].errors );
+		 send_error_message( listener->handle, (struct sockaddr *)&client_address, client_length,
+		                     request.error_code, request.error_message );
+		 return;
+	 }
+	 PROFILE_END( PHASE_PARSE, parse_start );
+	 PROBE_REQUEST_PARSED( request.opcode, request.file_name, request.mode_name );
+ 
+	 client_key_format( &key, client_name, sizeof(client_name) );
+	 printf( "file \"%s\" requested from %s\n", request.file_name, client_name );
+	 fflush( stdout );
+ 
+	 // The ACL goes first, before anything is allocated for the client.
+	 PROFILE_START( resolve_start );
+	 if( acl_check( &key, request.file_name ) == ACL_DENY ) {
+		 STATS_INC( family[key.family].denied );
+		 send_error_message( listener->handle, (struct sockaddr *)&client_address, client_length,
+		                     ERR_ACCESS, "Access violation" );
+		 return;
+	 }
+ 
+	 // A client class, if one matches, overrides the listener's policy.
+	 if( (policy = classifier_lookup( &key )) == NULL ) {
+		 policy = listener->policy;
+	 }
+ 
+	 // A client that retransmits its request while we are already serving it gets nothing new.
+	 pthread_mutex_lock( &active_lock );
+	 if( client_table_find( active, &key ) != NULL ) {
+		 pthread_mutex_unlock( &active_lock );
+		 STATS_INC( family[key.family].duplicates );
+		 return;
+	 }
+ 
+	 if( policy->max_transfers != 0 && policy->active_transfers >= policy->max_transfers ) {
+		 pthread_mutex_unlock( &active_lock );
+		 STATS_INC( family[key.family].errors );
+		 send_error_message( listener->handle, (struct sockaddr *)&client_address, client_length,
+		                     ERR_UNDEFINED, "Server busy, try again later" );
+		 return;
+	 }
+	 pthread_mutex_unlock( &active_lock );
+	 PROFILE_END( PHASE_RESOLVE, resolve_start );
+ 
+	 // Whatever this client is likely to ask for next starts on its way into the page cache.
+	 prefetch_request( policy, &key, request.file_name );
+ 
+	 if( event_mode ) {
+		 start_session( listener, policy, &request, (struct sockaddr *)&client_address, client_length, &key, active );
+	 }
+	 // Otherwise try to create a child process for this transfer...
+	 else if( (child_id = fork( )) == -1 ) {
+		 perror( "Could not create child process for client" );
+	 }
+	 // Otherwise if we are the child...
+	 else if( child_id == 0 ) {
+		 signal( SIGUSR1, SIG_DFL );
+		 signal( SIGCHLD, SIG_DFL );
+		 signal( SIGTERM, SIG_DFL );
+		 signal( SIGINT, SIG_DFL );
+		 for( size_t i = 0; i < listener_count; ++i ) {
+			 close( listeners[i].handle );
+		 }
+		 serve_request( listener, policy, &request, (struct sockaddr *)&client_address, client_length, &key );
+	 }
+	 // Otherwise remember who is serving this client. If the table is full the transfer still runs, untracked.
+	 else if( client_table_insert( active, &key, (int)child_id, policy->id ) == 0 ) {
+		 policy->active_transfers++;
+	 }
+ }
+ 
+ 
+ // Receives a batch of the requests waiting on listener, as many as the acceptor's batch allows, and handles
+ // each. The time spent on them sizes the next batch.
+ static void handle_requests( struct acceptor *acceptor, struct listener *listener )
  {
-	 // TODO: Implement me!
+	 struct batch_control *batch = &acceptor->batch;
+	 struct timestamp_message messages[BATCH_MAX];
+	 int64_t start;
+	 int count;
+	 PROFILE_START( phase_start );
+ 
+	 for( unsigned i = 0; i < batch->size; ++i ) {
+		 messages[i].buffer = acceptor->buffers[i];
+		 messages[i].length = REQUEST_BUFFER_LENGTH;
+	 }
+	 // Get the request datagrams, with the times the kernel received them.
+	 if( (count = timestamp_recvmmsg( listener->handle, messages, batch->size )) == -1 ) {
+		 if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+			 perror( "Error while receiving client request" );
+		 }
+		 return;
+	 }
+	 PROFILE_END( PHASE_RECEIVE, phase_start );
+ 
+	 start = session_now( );
+	 for( int i = 0; i < count; ++i ) {
+		 handle_request( listener, acceptor->active, &messages[i] );
+	 }
+	 batch_update( batch, (unsigned)count, session_now( ) - start );
+ }
+ 
+ 
+ // An acceptor thread: waits on every listener and hands the transfers it starts to the workers. Each request
+ // is read by one of the threads that wake up for it; the others find nothing and go back to waiting.
+ static void *run_acceptor( void *argument )
+ {
+	 struct acceptor *acceptor = argument;
+ 
+	 while( 1 ) {
+		 if( poll( acceptor->poll_set, listener_count, -1 ) == -1 ) {
+			 if( errno != EINTR ) {
+				 perror( "Error while waiting for client requests" );
+			 }
+			 continue;
+		 }
+		 for( size_t i = 0; i < listener_count; ++i ) {
+			 if( acceptor->poll_set[i].revents & POLLIN ) {
+				 handle_requests( acceptor, &listeners[i] );
+			 }
+		 }
+	 }
 	 return NULL;
  }
  
  
- static void send_error_message( int socket_handle, struct sockaddr_in6 *client_address )
+ // Starts the -A acceptor threads, with every signal blocked so that they are all left to the main thread.
+ static int start_acceptors( void )
  {
-	 char error_datagram[20 + 1];
+	 sigset_t all, previous;
+	 int result = 0;
+ 
+	 sigfillset( &all );
+	 pthread_sigmask( SIG_BLOCK, &all, &previous );
+	 for( unsigned i = 0; i < acceptor_threads && result == 0; ++i ) {
+		 for( size_t j = 0; j < listener_count; ++j ) {
+			 acceptors[i].poll_set[j].fd = listeners[j].handle;
+			 acceptors[i].poll_set[j].events = POLLIN;
+		 }
+		 if( (errno = pthread_create( &acceptors[i].thread, NULL, run_acceptor, &acceptors[i] )) != 0 ) {
+			 result = -1;
+		 }
+	 }
+	 pthread_sigmask( SIG_SETMASK, &previous, NULL );
+	 return result;
+ }
+ 
+ 
+ // Opens the sockets and root directory described by spec. Returns 0, or -1 after reporting why not.
+ static int add_listeners( const struct listener_spec *spec, struct policy *policy, int want_v4, int want_v6 )
+ {
+	 int families[2];
+	 size_t family_count = 0;
+ 
+	 if( strcmp( spec->address, "*" ) == 0 ) {
+		 if( want_v4 ) {
+			 families[family_count++] = AF_INET;
+		 }
+		 if( want_v6 ) {
+			 families[family_count++] = AF_INET6;
+		 }
+	 }
+	 else {
+		 families[family_count++] = strchr( spec->address, ':' ) != NULL ? AF_INET6 : AF_INET;
+	 }
  
-	 error_datagram[0] = 0x00;  // Opcode == 5.
-	 error_datagram[1] = 0x05;
-	 error_datagram[2] = 0x00;  // ErrorCode == 0 (not defined).
-	 error_datagram[3] = 0x00;
-	 strcpy( &error_datagram[4], "Not implemented!" );
+	 if( policy_open_root( policy ) == -1 ) {
+		 fprintf( stderr, "Unable to open %s: %s\n", policy_source( policy ), strerror( errno ) );
+		 return -1;
+	 }
+ 
+	 for( size_t i = 0; i < family_count; ++i ) {
+		 struct listener *listener = &listeners[listener_count];
  
-	 // Send it to the client. Don't worry about if the send succeeds for fails.
-	 sendto(
-		 socket_handle,   // The socket for client communications.
-		 error_datagram,  // Datagram to send.
-		 21,              // Length of the datagram.
-		 0,               // Flags (none selected).
-		 (struct sockaddr *)client_address,  // Destination address.
-		 sizeof(struct sockaddr_in6)         // Size of the distination address structure.
-	 );
+		 if( listener_count == MAX_LISTENERS ) {
+			 fprintf( stderr, "Too many listening sockets\n" );
+			 return -1;
+		 }
+		 // With "*" a family may be missing on this host; only give up if no socket at all opens.
+		 if( listener_open( listener, families[i], spec->address, spec->port ) == -1 ) {
+			 fprintf( stderr, "Unable to listen on %s port %u (%s): %s\n", spec->address, (unsigned)spec->port,
+			          families[i] == AF_INET6 ? "IPv6" : "IPv4", strerror( errno ) );
+			 continue;
+		 }
+		 if( sockfilter_attach_request( listener->handle ) == -1 ) {
+			 fprintf( stderr, "Unable to attach socket filter to %s: %s\n", spec->address, strerror( errno ) );
+		 }
+		 timestamp_enable( listener->handle );
+		 if( busy_poll_us != 0 ) {
+			 busypoll_enable( listener->handle, busy_poll_us );
+		 }
+		 listener->policy = policy;
+		 listener_count++;
+	 }
+	 return 0;
+ }
+ 
+ 
+ static void usage( const char *program )
+ {
+	 fprintf( stderr, "Usage: %s [-4|-6] [-m fork|event] [-t threads] [-A acceptors] [-i io-threads] [-C cache-megabytes [-S snapshot-file]] [-b spin-us] [-a acl-file] [-c class-file] [-l address[,port=N][,setting=value]...]... [port [directory]]\n", program );
  }
  
  
@@ -56,88 +653,265 @@
  
  int main( int argc, char **argv )
  {
-	 int listen_handle;  // Socket for incoming client requests.
-	 int socket_handle;  // Handle for bulk client communication.
+	 struct pollfd listener_poll_set[MAX_LISTENERS];
+	 struct pollfd *poll_set = listener_poll_set;  // With -m event, the session table's, which starts with the listeners.
+	 struct client_table active;  // Clients with a transfer in progress.
  
-	 struct sockaddr_in6 server_address;  // Listening address.
-	 struct sockaddr_in6 client_address;  // Address of client.
-	 socklen_t client_length;
+	 char *listener_arguments[MAX_LISTENERS];
+	 size_t listener_argument_count = 0;
+	 const char *class_file = NULL;
+	 const char *acl_file = NULL;
+	 struct policy *policy;
  
-	 // Buffer to hold request message.
-	 unsigned char request_buffer[REQUEST_BUFFER_LENGTH];
-	 ssize_t request_count;
+	 unsigned short port = 69;      // Default port number to listen on.
+	 const char *directory = ".";   // Default directory to serve.
+	 int want_v4 = 1;
+	 int want_v6 = 1;
+	 int64_t next_snapshot;  // With -S, when the cache index is next saved.
+	 int option;
  
-	 unsigned short port = 69;  // Port number to listen on.
-	 pid_t child_id;            // Child process ID.
-	 const char *file_name;     // Name of file client wants to read.
+	 // -4 and -6 restrict "*" listeners to one address family; -l adds a listener;
+	 // -c loads client classes; -a loads the access control list; -m picks how transfers are run;
+	 // -b makes the event loop busy poll; -t spreads the sessions over worker threads, -A the requests over
+	 // acceptor threads; -i moves file reads onto I/O threads; -C keeps popular files in memory, and -S saves
+	 // what the cache knows across restarts.
+	 while( (option = getopt( argc, argv, "46A:a:b:C:c:i:l:m:S:t:" )) != -1 ) {
+		 switch( option ) {
+		 case 'A':
+			 acceptor_threads = (unsigned)strtoul( optarg, NULL, 10 );
+			 break;
+		 case '4':
+			 want_v6 = 0;
+			 break;
+		 case '6':
+			 want_v4 = 0;
+			 break;
+		 case 'a':
+			 acl_file = optarg;
+			 break;
+		 case 'b':
+			 busy_poll_us = (unsigned)strtoul( optarg, NULL, 10 );
+			 break;
+		 case 'C':
+			 cache_megabytes = strtoul( optarg, NULL, 10 );
+			 break;
+		 case 'c':
+			 class_file = optarg;
+			 break;
+		 case 'i':
+			 io_threads = (unsigned)strtoul( optarg, NULL, 10 );
+			 break;
+		 case 'm':
+			 if( strcmp( optarg, "event" ) == 0 ) {
+				 event_mode = 1;
+			 }
+			 else if( strcmp( optarg, "fork" ) != 0 ) {
+				 usage( argv[0] );
+				 return EXIT_FAILURE;
+			 }
+			 break;
+		 case 'l':
+			 if( listener_argument_count == MAX_LISTENERS ) {
+				 fprintf( stderr, "Too many listeners\n" );
+				 return EXIT_FAILURE;
+			 }
+			 listener_arguments[listener_argument_count++] = optarg;
+			 break;
+		 case 'S':
+			 snapshot_file = optarg;
+			 break;
+		 case 't':
+			 worker_threads = (unsigned)strtoul( optarg, NULL, 10 );
+			 break;
+		 default:
+			 usage( argv[0] );
+			 return EXIT_FAILURE;
+		 }
+	 }
  
+	 if( busy_poll_us != 0 && !event_mode ) {
+		 fprintf( stderr, "-b needs -m event\n" );
+		 return EXIT_FAILURE;
+	 }
+	 if( worker_threads != 0 && (!event_mode || worker_threads > WORKER_MAX) ) {
+		 fprintf( stderr, "-t needs -m event and at most %d threads\n", WORKER_MAX );
+		 return EXIT_FAILURE;
+	 }
+	 if( acceptor_threads != 0 && (worker_threads == 0 || acceptor_threads > ACCEPTOR_MAX) ) {
+		 fprintf( stderr, "-A needs -t and at most %d threads\n", ACCEPTOR_MAX );
+		 return EXIT_FAILURE;
+	 }
+	 if( io_threads != 0 && (!event_mode || io_threads > READAHEAD_THREADS) ) {
+		 fprintf( stderr, "-i needs -m event and at most %d threads\n", READAHEAD_THREADS );
+		 return EXIT_FAILURE;
+	 }
+	 if( cache_megabytes != 0 && !event_mode ) {
+		 fprintf( stderr, "-C needs -m event\n" );
+		 return EXIT_FAILURE;
+	 }
+	 if( snapshot_file != NULL && cache_megabytes == 0 ) {
+		 fprintf( stderr, "-S needs -C\n" );
+		 return EXIT_FAILURE;
+	 }
  
-	 // Do I have an explicit port number?
-	 if( argc == 2 ) {
-		 port = atoi( argv[1] );
+	 // Do I have an explicit port number and directory? They are the defaults for every listener.
+	 if( optind < argc ) {
+		 port = atoi( argv[optind++] );
+	 }
+	 if( optind < argc ) {
+		 directory = argv[optind++];
 	 }
  
-	 // Create the server socket.
-	 if( (listen_handle = socket( PF_INET6, SOCK_DGRAM, 0) ) == -1 ) {
-		 perror( "Unable to create socket" );
+	 // The session tables set up their read-ahead only if the I/O threads are running.
+	 if( io_threads != 0 && readahead_start( io_threads ) == -1 ) {
+		 perror( "Unable to start I/O threads" );
+		 return EXIT_FAILURE;
+	 }
+	 if( stats_init( ) == -1 || client_table_init( &active, MAX_ACTIVE_TRANSFERS ) == -1 ||
+	     (event_mode && worker_threads == 0 &&
+	      session_table_init( &sessions, MAX_ACTIVE_TRANSFERS, MAX_LISTENERS, &active ) == -1) ) {
+		 perror( "Unable to allocate server state" );
+		 return EXIT_FAILURE;
+	 }
+	 if( cache_megabytes != 0 && cache_init( (size_t)cache_megabytes << 20 ) == -1 ) {
+		 perror( "Unable to set up the file cache" );
 		 return EXIT_FAILURE;
 	 }
+	 // A snapshot that cannot be used only means a cold start.
+	 if( snapshot_file != NULL && cache_restore( snapshot_file ) == -1 ) {
+		 fprintf( stderr, "Ignoring cache snapshot %s: %s\n", snapshot_file, strerror( errno ) );
+	 }
+	 for( unsigned i = 0; i == 0 || i < acceptor_threads; ++i ) {
+		 acceptors[i].active = &active;
+		 batch_init( &acceptors[i].batch, &stats->request_batch );
+	 }
+ 
+	 // Without -l, listen on every address of both families.
+	 if( listener_argument_count == 0 ) {
+		 struct listener_spec spec = { "*", port };
  
-	 // Prepare the server socket address structure.
-	 memset( &server_address, 0, sizeof(server_address) );
-	 server_address.sin6_family = AF_INET6;
-	 server_address.sin6_addr = in6addr_any;
-	 server_address.sin6_port = htons( port) ;
+		 if( (policy = policy_create( directory )) == NULL || add_listeners( &spec, policy, want_v4, want_v6 ) == -1 ) {
+			 return EXIT_FAILURE;
+		 }
+	 }
+	 for( size_t i = 0; i < listener_argument_count; ++i ) {
+		 struct listener_spec spec = { NULL, port };
+ 
+		 if( (policy = policy_create( directory )) == NULL ) {
+			 return EXIT_FAILURE;
+		 }
+		 if( listener_parse_spec( listener_arguments[i], &spec, policy ) == -1 ) {
+			 usage( argv[0] );
+			 return EXIT_FAILURE;
+		 }
+		 if( add_listeners( &spec, policy, want_v4, want_v6 ) == -1 ) {
+			 return EXIT_FAILURE;
+		 }
+	 }
+	 if( class_file != NULL && classifier_load( class_file, directory ) == -1 ) {
+		 return EXIT_FAILURE;
+	 }
+	 if( acl_file != NULL && acl_load( acl_file ) == -1 ) {
+		 return EXIT_FAILURE;
+	 }
+	 if( listener_count == 0 ) {
+		 return EXIT_FAILURE;
+	 }
  
-	 // Bind the server socket.
-	 if (bind(listen_handle, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
-		 perror( "Unable to bind listening address" );
-		 close( listen_handle );
+	 // The workers block the signals, so they all come here.
+	 if( worker_threads != 0 &&
+	     workers_start( worker_threads, MAX_ACTIVE_TRANSFERS, &active, &active_lock, busy_poll_us ) == -1 ) {
+		 perror( "Unable to start worker threads" );
+		 return EXIT_FAILURE;
+	 }
+	 if( acceptor_threads != 0 && start_acceptors( ) == -1 ) {
+		 perror( "Unable to start acceptor threads" );
 		 return EXIT_FAILURE;
 	 }
  
-	 while( 1 ) {
-		 // Call recvfrom() to get a request datagram from the client.
-		 client_length = sizeof( client_address );
-		 request_count = recvfrom(
-			 listen_handle,          // Socket for receiving request.
-			 request_buffer,         // Pointer to buffer for request.
-			 REQUEST_BUFFER_LENGTH,  // Size of the request buffer.
-			 0,                      // Flags (none selected).
-			 (struct sockaddr *)&client_address,  // Pointer to structure for client address.
-			 &client_length                       // Pointer to variable holding size of address.
-		 );
- 
-		 if( request_count == -1 ) {
-			 perror( "Error while receiving client request" );
+	 if( event_mode && worker_threads == 0 ) {
+		 poll_set = sessions.poll_set;
+	 }
+	 for( size_t i = 0; i < listener_count; ++i ) {
+		 poll_set[i].fd = listeners[i].handle;
+		 poll_set[i].events = POLLIN;
+	 }
+	 for( size_t i = listener_count; poll_set == sessions.poll_set && i < MAX_LISTENERS; ++i ) {
+		 poll_set[i].fd = -1;
+	 }
+	 install_signal_handlers( );
+ 
+	 next_snapshot = session_now( ) + CACHE_SNAPSHOT_SECONDS * 1000000000LL;
+	 while( !stop_requested ) {
+		 size_t poll_count = acceptor_threads != 0 ? 0 : listener_count;  // With -A, this loop only waits for signals.
+		 int timeout = -1;
+		 if( dump_requested ) {
+			 dump_requested = 0;
+			 stats_dump( stderr );
+			 profile_dump( stderr );
+			 dump_listener_drops( stderr );
+			 if( worker_threads != 0 ) {
+				 workers_dump( stderr );
+			 }
 		 }
-		 // Otherwise try to create a child process for this transfer...
-		 else if( (child_id = fork( )) == -1 ) {
-			 perror( "Could not create child process for client" );
+		 if( transfer_dump_requested ) {
+			 dump_flights( &active );
 		 }
-		 // Otherwise if we are the child...
-		 else if( child_id == 0 ) {
-			 close( listen_handle );
+		 if( children_exited ) {
+			 reap_children( &active );
+		 }
+		 // The index is copied here, and written out on a thread of its own, so the loop does not wait for the disk.
+		 if( snapshot_file != NULL && session_now( ) >= next_snapshot ) {
+			 if( cache_save_background( snapshot_file ) == -1 ) {
+				 fprintf( stderr, "Unable to save cache snapshot %s: %s\n", snapshot_file, strerror( errno ) );
+			 }
+			 next_snapshot = session_now( ) + CACHE_SNAPSHOT_SECONDS * 1000000000LL;
+		 }
+ 
+		 // Sessions send what they can and tell us when the next timer runs out.
+		 if( event_mode && worker_threads == 0 ) {
+			 int64_t next_deadline = session_run( &sessions );
  
-			 // Create a fresh socket in the child to communicate with the client.
-			 if( (socket_handle = socket( PF_INET6, SOCK_DGRAM, 0) ) == -1 ) {
-				 perror( "Unable to create socket" );
-				 exit( EXIT_FAILURE );
+			 if( next_deadline != INT64_MAX ) {
+				 int64_t wait = (next_deadline - session_now( ) + 999999) / 1000000;
+ 
+				 timeout = wait < 0 ? 0 : wait > 1000 ? 1000 : (int)wait;
 			 }
+			 poll_count = sessions.reserved + sessions.high_water;
+		 }
  
-			 // Extract the file name from the request.
-			 if( (file_name = extract_file_name( request_buffer )) == NULL ) {
-				 send_error_message( socket_handle, &client_address );
-				 close( socket_handle );
-				 exit( EXIT_SUCCESS );
+		 // The next snapshot is due even if nothing else happens.
+		 if( snapshot_file != NULL ) {
+			 int64_t wait = (next_snapshot - session_now( ) + 999999) / 1000000;
+ 
+			 if( timeout == -1 || wait < timeout ) {
+				 timeout = wait < 0 ? 0 : (int)wait;
 			 }
+		 }
  
-			 // Send the file!
-			 send_file( socket_handle, &client_address, file_name );
-			 close( socket_handle );
-			 exit( EXIT_SUCCESS );
+		 // With -t the workers do the spinning; requests can wait for the kernel to wake us.
+		 if( busypoll_wait( poll_set, poll_count, timeout, worker_threads != 0 ? 0 : busy_poll_us ) == -1 ) {
+			 if( errno != EINTR ) {
+				 perror( "Error while waiting for client requests" );
+			 }
+			 continue;
+		 }
+ 
+		 for( size_t i = 0; acceptor_threads == 0 && i < listener_count; ++i ) {
+			 if( poll_set[i].revents & POLLIN ) {
+				 handle_requests( &acceptors[0], &listeners[i] );
+			 }
+		 }
+		 // Only the sessions that were polled; ones started just now have no revents yet.
+		 for( size_t i = sessions.reserved; poll_set == sessions.poll_set && i < poll_count; ++i ) {
+			 if( poll_set[i].revents & (POLLIN | POLLERR) ) {
+				 session_receive( &sessions, (uint32_t)(i - sessions.reserved) );
+			 }
 		 }
 	 }
  
+	 if( snapshot_file != NULL ) {
+		 save_snapshot( );
+	 }
 	 return EXIT_SUCCESS;
  }
\ No newline at end of file
@@ -0,0 +1,328 @@
+/*!
+ * \file tftpd_bench.c
+ * \brief Microbenchmarks for the per-packet code paths. No network is used.
+ *
+ * Run with "make bench" (JSON on stdout) or ./tftpd_bench directly; see
+ * bench.h for the options.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "addrkey.h"
+#include "bench.h"
+#include "client_table.h"
+#include "netascii.h"
+#include "packet.h"
+#include "pt.h"
+#include "session.h"
+
+#define TEXT_SIZE      65536
+#define TABLE_CLIENTS  4096  // MAX_ACTIVE_TRANSFERS in tftpd.c.
+#define TIMER_SESSIONS 4096
+#define RESUME_SESSIONS 4096
+
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t next_random( void )
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+
+// Builds an RRQ for name, with the usual PXE options if with_options is set.
+static size_t build_request( unsigned char *buffer, const char *name, int with_options )
+{
+	static const char *options[] = { "blksize", "1468", "tsize", "0", "windowsize", "16", "timeout", "2" };
+	size_t length;
+
+	packet_put_header( buffer, OP_RRQ, 0 );
+	length = 2;
+	memcpy( &buffer[length], name, strlen( name ) + 1 );
+	length += strlen( name ) + 1;
+	memcpy( &buffer[length], "octet", 6 );
+	length += 6;
+	for( size_t i = 0; with_options && i < sizeof(options) / sizeof(options[0]); ++i ) {
+		memcpy( &buffer[length], options[i], strlen( options[i] ) + 1 );
+		length += strlen( options[i] ) + 1;
+	}
+	return length;
+}
+
+
+static void run_parse( struct bench_state *state, int with_options )
+{
+	unsigned char buffer[TFTP_MAX_REQUEST];
+	size_t length = build_request( buffer, "pxelinux.cfg/01-52-54-00-12-34-56", with_options );
+	struct tftp_request request;
+
+	while( bench_keep_running( state ) ) {
+		bench_do_not_optimize( packet_parse_request( buffer, length, &request ) );
+		bench_do_not_optimize_pointer( request.file_name );
+	}
+	bench_set_items_processed( state, state->iterations );
+}
+
+
+static void bench_parse_request( struct bench_state *state )
+{
+	run_parse( state, 0 );
+}
+
+
+static void bench_parse_request_options( struct bench_state *state )
+{
+	run_parse( state, 1 );
+}
+
+
+// Text with lines of varied length, roughly like a configuration file.
+static unsigned char *make_text( size_t size )
+{
+	unsigned char *text = malloc( size );
+
+	for( size_t i = 0; text != NULL && i < size; ++i ) {
+		uint32_t r = next_random( );
+
+		text[i] = r % 40 == 0 ? '\n' : (unsigned char)(' ' + r % 95);
+	}
+	return text;
+}
+
+
+static void bench_netascii_encode( struct bench_state *state )
+{
+	unsigned char *text = make_text( TEXT_SIZE );
+	unsigned char *out = malloc( 2 * TEXT_SIZE );
+
+	while( bench_keep_running( state ) ) {
+		size_t consumed;
+		int pending = -1;
+
+		bench_do_not_optimize( netascii_encode( text, TEXT_SIZE, &consumed, out, 2 * TEXT_SIZE, &pending ) );
+	}
+	bench_set_bytes_processed( state, state->iterations * TEXT_SIZE );
+	free( out );
+	free( text );
+}
+
+
+static void bench_netascii_decode( struct bench_state *state )
+{
+	unsigned char *text = make_text( TEXT_SIZE );
+	unsigned char *encoded = malloc( 2 * TEXT_SIZE );
+	unsigned char *out = malloc( 2 * TEXT_SIZE + 1 );
+	size_t consumed;
+	int pending = -1;
+	size_t length = netascii_encode( text, TEXT_SIZE, &consumed, encoded, 2 * TEXT_SIZE, &pending );
+
+	while( bench_keep_running( state ) ) {
+		int pending_cr = 0;
+
+		bench_do_not_optimize( netascii_decode( encoded, length, out, &pending_cr ) );
+	}
+	bench_set_bytes_processed( state, state->iterations * length );
+	free( out );
+	free( encoded );
+	free( text );
+}
+
+
+// Framing a full window of DATA packets, as send_file() does after each read.
+static void bench_data_header( struct bench_state *state )
+{
+	static unsigned char window[64][TFTP_HEADER_LENGTH + TFTP_BLOCK_SIZE];
+	unsigned block = 1;
+
+	while( bench_keep_running( state ) ) {
+		for( size_t slot = 0; slot < 64; ++slot ) {
+			packet_put_header( window[slot], OP_DATA, block++ & 0xffff );
+		}
+		bench_do_not_optimize_pointer( window );
+	}
+	bench_set_items_processed( state, state->iterations * 64 );
+}
+
+
+// Choosing and building the ERROR for a failed open, as open_in_root() and its caller do.
+static void bench_error_datagram( struct bench_state *state )
+{
+	static const int errors[] = { ENOENT, EACCES, ENOTDIR, EMFILE };
+	unsigned char buffer[TFTP_HEADER_LENGTH + 128];
+	size_t i = 0;
+
+	while( bench_keep_running( state ) ) {
+		const char *message;
+		int code = packet_error_for_errno( errors[i++ & 3], &message );
+
+		bench_do_not_optimize( packet_build_error( buffer, sizeof(buffer), code, message ) );
+	}
+	bench_set_items_processed( state, state->iterations );
+}
+
+
+static void random_key( client_key *key, int family )
+{
+	memset( key, 0, sizeof(*key) );
+	key->family = (uint8_t)family;
+	key->port = (uint16_t)next_random( );
+	if( family == FAMILY_V4 ) {
+		key->addr.v4 = next_random( );
+	}
+	else {
+		for( size_t i = 0; i < 16; i += 4 ) {
+			uint32_t r = next_random( );
+
+			memcpy( &key->addr.v6[i], &r, 4 );
+		}
+	}
+}
+
+
+// Lookups in a table as full as the server lets it get; every other lookup misses.
+static void run_client_lookup( struct bench_state *state, int family )
+{
+	struct client_table table;
+	client_key *keys = malloc( 2 * TABLE_CLIENTS * sizeof(*keys) );
+	size_t i = 0;
+
+	client_table_init( &table, TABLE_CLIENTS );
+	for( size_t k = 0; k < 2 * TABLE_CLIENTS; ++k ) {
+		random_key( &keys[k], family );
+		if( k % 2 == 0 ) {
+			client_table_insert( &table, &keys[k], (int)k, 0 );
+		}
+	}
+
+	while( bench_keep_running( state ) ) {
+		bench_do_not_optimize_pointer( client_table_find( &table, &keys[i++ & (2 * TABLE_CLIENTS - 1)] ) );
+	}
+	bench_set_items_processed( state, state->iterations );
+	client_table_destroy( &table );
+	free( keys );
+}
+
+
+static void bench_client_lookup_v4( struct bench_state *state )
+{
+	run_client_lookup( state, FAMILY_V4 );
+}
+
+
+static void bench_client_lookup_v6( struct bench_state *state )
+{
+	run_client_lookup( state, FAMILY_V6 );
+}
+
+
+// The server has no timer wheel: each session has a deadline in the session table, and a pass of
+// session_run() finds the expired ones with session_table_scan(). This times arming one deadline
+// and one such pass.
+static void bench_timer_scan( struct bench_state *state )
+{
+	struct session_table table;
+	uint32_t due[TIMER_SESSIONS];
+	int64_t now = session_now( );
+	size_t armed = 0;
+
+	session_table_init( &table, TIMER_SESSIONS, 0, NULL );
+	for( size_t id = 0; id < TIMER_SESSIONS; ++id ) {
+		table.state[id] = SESSION_WAITING;
+		table.deadline[id] = now + 1000000 + (int64_t)(next_random( ) % 1000000000);
+	}
+	table.high_water = TIMER_SESSIONS;
+
+	while( bench_keep_running( state ) ) {
+		int64_t next_deadline = INT64_MAX;
+		size_t cursor = 0;
+
+		table.deadline[armed % TIMER_SESSIONS] = now + 1000000 + (int64_t)(armed & 0xffff);
+		++armed;
+		bench_do_not_optimize( session_table_scan( &table, now, &cursor, due, TIMER_SESSIONS, &next_deadline ) );
+		bench_do_not_optimize( next_deadline );
+	}
+	bench_set_items_processed( state, state->iterations * TIMER_SESSIONS );
+	session_table_destroy( &table );
+}
+
+
+// A lock-step transfer reduced to run_session()'s control flow, with the I/O taken out: send a block, wait for
+// its ACK, account for it. What is left per block is one suspend and one resume of the protothread.
+struct block_thread {
+	struct pt thread;
+	uint32_t base;
+	uint32_t next_send;
+	uint64_t acknowledged;
+};
+
+
+static void run_block_thread( struct block_thread *transfer, const uint32_t *ack )
+{
+	PT_BEGIN( &transfer->thread );
+
+	while( 1 ) {
+		while( transfer->next_send <= transfer->base ) {
+			transfer->next_send++;
+		}
+		PT_YIELD( &transfer->thread );
+		transfer->acknowledged += 512 * (*ack + 1 - transfer->base);
+		transfer->base = *ack + 1;
+	}
+
+	PT_END( &transfer->thread );
+}
+
+
+// One block of one of RESUME_SESSIONS lock-step transfers per iteration, taken round robin as ACKs would arrive.
+static void bench_session_resume( struct bench_state *state )
+{
+	struct block_thread *transfers = calloc( RESUME_SESSIONS, sizeof(*transfers) );
+	uint64_t acknowledged = 0;
+	size_t i = 0;
+
+	for( size_t id = 0; id < RESUME_SESSIONS; ++id ) {
+		PT_INIT( &transfers[id].thread );
+		transfers[id].base = 1;
+		transfers[id].next_send = 1;
+		run_block_thread( &transfers[id], NULL );
+	}
+
+	while( bench_keep_running( state ) ) {
+		struct block_thread *transfer = &transfers[i++ & (RESUME_SESSIONS - 1)];
+		uint32_t ack = transfer->base;
+
+		run_block_thread( transfer, &ack );
+	}
+	for( size_t id = 0; id < RESUME_SESSIONS; ++id ) {
+		acknowledged += transfers[id].acknowledged;
+	}
+	bench_do_not_optimize( acknowledged );
+	bench_set_items_processed( state, state->iterations );
+	free( transfers );
+}
+
+
+static const struct bench_case cases[] = {
+	{ "parse_request",         bench_parse_request },
+	{ "parse_request_options", bench_parse_request_options },
+	{ "netascii_encode",       bench_netascii_encode },
+	{ "netascii_decode",       bench_netascii_decode },
+	{ "data_header_window",    bench_data_header },
+	{ "error_datagram",        bench_error_datagram },
+	{ "client_lookup_v4",      bench_client_lookup_v4 },
+	{ "client_lookup_v6",      bench_client_lookup_v6 },
+	{ "timer_scan_4096",       bench_timer_scan },
+	{ "session_resume_block",  bench_session_resume },
+};
+
+
+int main( int argc, char **argv )
+{
+	return bench_main( argc, argv, cases, sizeof(cases) / sizeof(cases[0]) );
+}
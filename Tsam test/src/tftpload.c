@@ -0,0 +1,422 @@
+/*!
+ * \file tftpload.c
+ * \brief Load generator: many concurrent TFTP clients in one process.
+ *
+ * Usage: ./tftpload [-c clients] [-n transfers] [-b blksize] [-w windowsize] [-a] [-V local-file]
+ *                   host port file
+ *
+ * Each of the clients downloads the file -n times in a row (a new socket,
+ * and so a new client port, for every download). Clients are driven by a
+ * single poll() loop, ACK every windowsize-th block (and the last), and
+ * resend their last packet after a second of silence. -a asks for netascii
+ * instead of octet; -V checks every byte received against a local copy of
+ * the file (decoded first in netascii mode).
+ *
+ * The result is one line of name=value pairs, for bench_modes.sh:
+ *
+ *     clients=100 transfers=100 failed=0 bytes=... seconds=... mb_per_s=... p50_ms=... p99_ms=... first_p99_ms=...
+ *
+ * where the latencies are per transfer (request to last block) and to the
+ * first DATA block.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "netascii.h"
+#include "packet.h"
+
+#define CLIENT_TIMEOUT_NS 1000000000LL
+#define CLIENT_RETRIES    5
+
+enum client_state {
+	CLIENT_IDLE,     // Between transfers, or finished.
+	CLIENT_RUNNING
+};
+
+struct client {
+	enum client_state state;
+	int handle;
+	int remaining;                  // Transfers still to start.
+	struct sockaddr_storage server; // The server's transfer port, once it has answered.
+	socklen_t server_length;
+	int have_server;
+	unsigned char last_packet[TFTP_MAX_REQUEST];  // Resent on timeout: the request or the last ACK.
+	size_t last_length;
+	uint32_t expected;              // Next block wanted.
+	unsigned blksize;
+	unsigned long long received;    // Bytes of file data received in this transfer.
+	off_t verified;                 // Bytes of the local copy compared so far (-V).
+	int pending_cr;
+	long long started;
+	long long first_block;          // Time of the first DATA, or 0.
+	long long last_activity;
+	int retries;
+};
+
+static const char *file_name;
+static const char *mode_name = "octet";
+static unsigned requested_blksize;
+static unsigned windowsize = 1;
+static int verify_handle = -1;
+static struct addrinfo *server_address;
+
+static long long *latencies;        // Per completed transfer, in nanoseconds.
+static long long *first_latencies;
+static size_t completed;
+static size_t failed;
+static unsigned long long total_bytes;
+
+
+static long long now_ns( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+static void send_last( struct client *client )
+{
+	const struct sockaddr *to = client->have_server ? (struct sockaddr *)&client->server : server_address->ai_addr;
+	socklen_t to_length = client->have_server ? client->server_length : server_address->ai_addrlen;
+
+	sendto( client->handle, client->last_packet, client->last_length, 0, to, to_length );
+	client->last_activity = now_ns( );
+}
+
+
+static void send_ack( struct client *client, unsigned block )
+{
+	packet_put_header( client->last_packet, OP_ACK, block & 0xffff );
+	client->last_length = TFTP_HEADER_LENGTH;
+	send_last( client );
+}
+
+
+// Opens a new socket and sends the request. Returns 0, or -1 if no socket could be made.
+static int start_transfer( struct client *client )
+{
+	size_t length = 2;
+
+	if( (client->handle = socket( server_address->ai_family, SOCK_DGRAM, 0 )) == -1 ) {
+		perror( "Unable to create client socket" );
+		return -1;
+	}
+	fcntl( client->handle, F_SETFL, fcntl( client->handle, F_GETFL ) | O_NONBLOCK );
+
+	packet_put_header( client->last_packet, OP_RRQ, 0 );
+	memcpy( &client->last_packet[length], file_name, strlen( file_name ) + 1 );
+	length += strlen( file_name ) + 1;
+	memcpy( &client->last_packet[length], mode_name, strlen( mode_name ) + 1 );
+	length += strlen( mode_name ) + 1;
+	if( requested_blksize != 0 ) {
+		length = packet_put_option( client->last_packet, length, sizeof(client->last_packet), "blksize", requested_blksize );
+	}
+	if( windowsize > 1 ) {
+		length = packet_put_option( client->last_packet, length, sizeof(client->last_packet), "windowsize", windowsize );
+	}
+	client->last_length = length;
+
+	client->state = CLIENT_RUNNING;
+	client->remaining--;
+	client->have_server = 0;
+	client->expected = 1;
+	client->blksize = TFTP_BLOCK_SIZE;
+	client->received = 0;
+	client->verified = 0;
+	client->pending_cr = 0;
+	client->retries = 0;
+	client->started = now_ns( );
+	client->first_block = 0;
+	send_last( client );
+	return 0;
+}
+
+
+static void end_transfer( struct client *client, int success )
+{
+	long long now = now_ns( );
+
+	close( client->handle );
+	client->handle = -1;
+	client->state = CLIENT_IDLE;
+	if( success ) {
+		latencies[completed] = now - client->started;
+		first_latencies[completed] = client->first_block - client->started;
+		completed++;
+		total_bytes += client->received;
+	}
+	else {
+		failed++;
+	}
+}
+
+
+// Compares data with the local copy. Returns 0 if it matches.
+static int verify( struct client *client, const unsigned char *data, size_t length )
+{
+	unsigned char decoded[TFTP_MAX_BLKSIZE + 1];
+	unsigned char expected[TFTP_MAX_BLKSIZE + 1];
+
+	if( strcmp( mode_name, "netascii" ) == 0 ) {
+		length = netascii_decode( data, length, decoded, &client->pending_cr );
+		data = decoded;
+	}
+	if( length == 0 ) {
+		return 0;
+	}
+	if( pread( verify_handle, expected, length, client->verified ) != (ssize_t)length ||
+	    memcmp( expected, data, length ) != 0 ) {
+		return -1;
+	}
+	client->verified += (off_t)length;
+	return 0;
+}
+
+
+// Parses the blksize the server accepted; without one the default stays.
+static void read_oack( struct client *client, const unsigned char *packet, size_t length )
+{
+	const char *cursor = (const char *)packet + 2;
+	const char *end = (const char *)packet + length;
+
+	while( cursor < end ) {
+		const char *value = memchr( cursor, '\0', (size_t)(end - cursor) );
+
+		if( value == NULL || ++value >= end || memchr( value, '\0', (size_t)(end - value) ) == NULL ) {
+			return;
+		}
+		if( strcmp( cursor, "blksize" ) == 0 ) {
+			client->blksize = (unsigned)atoi( value );
+		}
+		cursor = value + strlen( value ) + 1;
+	}
+}
+
+
+static void receive( struct client *client )
+{
+	unsigned char packet[TFTP_HEADER_LENGTH + TFTP_MAX_BLKSIZE];
+	struct sockaddr_storage from;
+
+	while( client->state == CLIENT_RUNNING ) {
+		socklen_t from_length = sizeof(from);
+		ssize_t count = recvfrom( client->handle, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_length );
+		size_t data_length;
+		unsigned block;
+
+		if( count < TFTP_HEADER_LENGTH ) {
+			return;
+		}
+		if( !client->have_server ) {
+			client->server = from;
+			client->server_length = from_length;
+			client->have_server = 1;
+		}
+		else if( from_length != client->server_length || memcmp( &from, &client->server, from_length ) != 0 ) {
+			continue;
+		}
+
+		client->retries = 0;
+		client->last_activity = now_ns( );
+		switch( packet_opcode( packet ) ) {
+		case OP_OACK:
+			read_oack( client, packet, (size_t)count );
+			send_ack( client, 0 );
+			break;
+		case OP_DATA:
+			block = packet_block( packet );
+			data_length = (size_t)count - TFTP_HEADER_LENGTH;
+			if( block != (client->expected & 0xffff) ) {
+				// Out of order: ask for everything after what we have.
+				if( windowsize > 1 ) {
+					send_ack( client, client->expected - 1 );
+				}
+				break;
+			}
+			if( client->first_block == 0 ) {
+				client->first_block = now_ns( );
+			}
+			if( verify_handle != -1 && verify( client, &packet[TFTP_HEADER_LENGTH], data_length ) == -1 ) {
+				fprintf( stderr, "Data mismatch at byte %llu\n", client->received );
+				end_transfer( client, 0 );
+				return;
+			}
+			client->received += data_length;
+			client->expected++;
+			if( data_length < client->blksize ) {
+				send_ack( client, block );
+				end_transfer( client, 1 );
+				return;
+			}
+			if( block % windowsize == 0 ) {
+				send_ack( client, block );
+			}
+			break;
+		case OP_ERROR:
+			fprintf( stderr, "Server error %u: %.*s\n", packet_block( packet ),
+			         (int)(count - TFTP_HEADER_LENGTH), (const char *)&packet[TFTP_HEADER_LENGTH] );
+			end_transfer( client, 0 );
+			return;
+		default:
+			break;
+		}
+	}
+}
+
+
+static int compare_latency( const void *a, const void *b )
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double percentile_ms( long long *values, size_t count, double fraction )
+{
+	size_t index;
+
+	if( count == 0 ) {
+		return 0;
+	}
+	qsort( values, count, sizeof(*values), compare_latency );
+	index = (size_t)(fraction * (double)(count - 1) + 0.5);
+	return (double)values[index] / 1e6;
+}
+
+
+static void usage( const char *program )
+{
+	fprintf( stderr, "Usage: %s [-c clients] [-n transfers] [-b blksize] [-w windowsize] [-a] [-V local-file] host port file\n",
+	         program );
+}
+
+
+int main( int argc, char **argv )
+{
+	struct addrinfo hints;
+	struct client *clients;
+	struct pollfd *poll_set;
+	size_t client_count = 1;
+	int transfers = 1;
+	size_t running;
+	long long start;
+	double seconds;
+	int option;
+	int error;
+
+	while( (option = getopt( argc, argv, "ab:c:n:w:V:" )) != -1 ) {
+		switch( option ) {
+		case 'a':
+			mode_name = "netascii";
+			break;
+		case 'b':
+			requested_blksize = (unsigned)atoi( optarg );
+			break;
+		case 'c':
+			client_count = strtoul( optarg, NULL, 10 );
+			break;
+		case 'n':
+			transfers = atoi( optarg );
+			break;
+		case 'w':
+			windowsize = (unsigned)atoi( optarg );
+			break;
+		case 'V':
+			if( (verify_handle = open( optarg, O_RDONLY )) == -1 ) {
+				perror( optarg );
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage( argv[0] );
+			return EXIT_FAILURE;
+		}
+	}
+	if( argc - optind != 3 || client_count == 0 || transfers <= 0 || windowsize == 0 ) {
+		usage( argv[0] );
+		return EXIT_FAILURE;
+	}
+	file_name = argv[optind + 2];
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_socktype = SOCK_DGRAM;
+	if( (error = getaddrinfo( argv[optind], argv[optind + 1], &hints, &server_address )) != 0 ) {
+		fprintf( stderr, "%s: %s\n", argv[optind], gai_strerror( error ) );
+		return EXIT_FAILURE;
+	}
+
+	clients = calloc( client_count, sizeof(*clients) );
+	poll_set = calloc( client_count, sizeof(*poll_set) );
+	latencies = calloc( client_count * (size_t)transfers, sizeof(*latencies) );
+	first_latencies = calloc( client_count * (size_t)transfers, sizeof(*first_latencies) );
+	if( clients == NULL || poll_set == NULL || latencies == NULL || first_latencies == NULL ) {
+		perror( "Unable to allocate clients" );
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns( );
+	for( size_t i = 0; i < client_count; ++i ) {
+		clients[i].remaining = transfers;
+		clients[i].handle = -1;
+		if( start_transfer( &clients[i] ) == -1 ) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	do {
+		long long now;
+
+		for( size_t i = 0; i < client_count; ++i ) {
+			poll_set[i].fd = clients[i].handle;
+			poll_set[i].events = POLLIN;
+		}
+		if( poll( poll_set, client_count, 100 ) == -1 && errno != EINTR ) {
+			perror( "poll" );
+			return EXIT_FAILURE;
+		}
+
+		now = now_ns( );
+		running = 0;
+		for( size_t i = 0; i < client_count; ++i ) {
+			struct client *client = &clients[i];
+
+			if( client->state == CLIENT_RUNNING && (poll_set[i].revents & POLLIN) ) {
+				receive( client );
+			}
+			if( client->state == CLIENT_RUNNING && now - client->last_activity > CLIENT_TIMEOUT_NS ) {
+				if( ++client->retries > CLIENT_RETRIES ) {
+					end_transfer( client, 0 );
+				}
+				else {
+					send_last( client );
+				}
+			}
+			if( client->state == CLIENT_IDLE && client->remaining > 0 && start_transfer( client ) == -1 ) {
+				return EXIT_FAILURE;
+			}
+			running += client->state == CLIENT_RUNNING;
+		}
+	} while( running > 0 );
+
+	seconds = (double)(now_ns( ) - start) / 1e9;
+	printf( "clients=%zu transfers=%zu failed=%zu bytes=%llu seconds=%.3f mb_per_s=%.1f p50_ms=%.2f p99_ms=%.2f "
+	        "first_p99_ms=%.2f\n", client_count, completed, failed, total_bytes, seconds,
+	        (double)total_bytes / 1e6 / seconds, percentile_ms( latencies, completed, 0.5 ),
+	        percentile_ms( latencies, completed, 0.99 ), percentile_ms( first_latencies, completed, 0.99 ) );
+	freeaddrinfo( server_address );
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
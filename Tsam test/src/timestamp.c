@@ -0,0 +1,349 @@
+/*!
+ * \file timestamp.c
+ * \brief SO_TIMESTAMPING on UDP sockets.
+ *
+ * The kernel stamps with CLOCK_REALTIME. Each stamp is moved onto the
+ * monotonic clock by the offset between the two clocks at the time it is
+ * read, which is exact unless the real-time clock is stepped in between.
+ */
+
+#define _GNU_SOURCE  // SO_TIMESTAMPING, MSG_ERRQUEUE, recvmmsg() and sendmmsg().
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "batch.h"
+#include "timestamp.h"
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#include <linux/net_tstamp.h>
+
+#define CONTROL_LENGTH 256  // Room for SCM_TIMESTAMPING and the IP_RECVERR that comes with a sent stamp.
+
+
+static int64_t nanoseconds( const struct timespec *time )
+{
+	return (int64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+}
+
+
+// Returns the software stamp carried by message, moved onto the monotonic clock, and sets *now to the
+// current monotonic time. Returns 0 if there is none.
+static int64_t find_stamp( struct msghdr *message, int64_t *now )
+{
+	struct timespec realtime, monotonic;
+
+	clock_gettime( CLOCK_MONOTONIC, &monotonic );
+	*now = nanoseconds( &monotonic );
+	for( struct cmsghdr *control = CMSG_FIRSTHDR( message ); control != NULL; control = CMSG_NXTHDR( message, control ) ) {
+		struct timespec stamps[3];  // Software, (deprecated), hardware.
+
+		if( control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_TIMESTAMPING ) {
+			continue;
+		}
+		memcpy( stamps, CMSG_DATA( control ), sizeof(stamps) );
+		if( stamps[0].tv_sec == 0 && stamps[0].tv_nsec == 0 ) {
+			return 0;
+		}
+		clock_gettime( CLOCK_REALTIME, &realtime );
+		return nanoseconds( &stamps[0] ) - (nanoseconds( &realtime ) - *now);
+	}
+	return 0;
+}
+
+
+//! Asks the kernel to stamp datagrams received on handle, and sent ones on request. Returns 0 or -1.
+int timestamp_enable( int handle )
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	return setsockopt( handle, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags) );
+}
+
+
+//! Like recvfrom(). Sets *received to when the datagram arrived, or to the current time if it was not
+//! stamped, and *queued to the nanoseconds it waited in the socket queue, or -1 if unknown.
+ssize_t timestamp_recvfrom( int handle, void *buffer, size_t length, struct sockaddr *address, socklen_t *address_length,
+                            int64_t *received, int64_t *queued )
+{
+	union {
+		char buffer[CONTROL_LENGTH];
+		struct cmsghdr align;
+	} control;
+	struct iovec data = { buffer, length };
+	struct msghdr message;
+	ssize_t count;
+	int64_t now;
+	int64_t stamp;
+
+	memset( &message, 0, sizeof(message) );
+	message.msg_name = address;
+	message.msg_namelen = *address_length;
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+	if( (count = recvmsg( handle, &message, 0 )) < 0 ) {
+		return count;
+	}
+	*address_length = message.msg_namelen;
+
+	stamp = find_stamp( &message, &now );
+	*received = stamp != 0 ? stamp : now;
+	*queued = stamp != 0 ? (now > stamp ? now - stamp : 0) : -1;
+	return count;
+}
+
+
+//! Like sendto(), but with want_stamp set asks the kernel to stamp the datagram as it leaves. Returns 1
+//! if a stamp will be queued for timestamp_read_sent(), 0 if the datagram was sent without, -1 on error.
+int timestamp_sendto( int handle, const void *buffer, size_t length, const struct sockaddr *address,
+                      socklen_t address_length, int want_stamp )
+{
+	union {
+		char buffer[CMSG_SPACE( sizeof(uint32_t) )];
+		struct cmsghdr align;
+	} control;
+	struct iovec data = { (void *)buffer, length };
+	struct msghdr message;
+	struct cmsghdr *request;
+	uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+
+	if( want_stamp ) {
+		memset( &message, 0, sizeof(message) );
+		message.msg_name = (void *)address;
+		message.msg_namelen = address_length;
+		message.msg_iov = &data;
+		message.msg_iovlen = 1;
+		message.msg_control = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+		request = CMSG_FIRSTHDR( &message );
+		request->cmsg_level = SOL_SOCKET;
+		request->cmsg_type = SO_TIMESTAMPING;
+		request->cmsg_len = CMSG_LEN( sizeof(flags) );
+		memcpy( CMSG_DATA( request ), &flags, sizeof(flags) );
+		if( sendmsg( handle, &message, 0 ) >= 0 ) {
+			return 1;
+		}
+		// Kernels before 4.13 take no per-datagram request; send it unstamped.
+		if( errno != EINVAL ) {
+			return -1;
+		}
+	}
+	return sendto( handle, buffer, length, 0, address, address_length ) < 0 ? -1 : 0;
+}
+
+
+//! Receives up to count datagrams (at most BATCH_MAX) that are already queued, without waiting. Returns
+//! how many, with each one's length, sender and times filled in, or -1 with errno EAGAIN if there are none.
+int timestamp_recvmmsg( int handle, struct timestamp_message *messages, unsigned count )
+{
+	union {
+		char buffer[CONTROL_LENGTH];
+		struct cmsghdr align;
+	} control[BATCH_MAX];
+	struct mmsghdr headers[BATCH_MAX];
+	struct iovec data[BATCH_MAX];
+	int received;
+
+	if( count > BATCH_MAX ) {
+		count = BATCH_MAX;
+	}
+	memset( headers, 0, count * sizeof(headers[0]) );
+	for( unsigned i = 0; i < count; ++i ) {
+		data[i].iov_base = messages[i].buffer;
+		data[i].iov_len = messages[i].length;
+		headers[i].msg_hdr.msg_name = &messages[i].address;
+		headers[i].msg_hdr.msg_namelen = sizeof(messages[i].address);
+		headers[i].msg_hdr.msg_iov = &data[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+		headers[i].msg_hdr.msg_control = control[i].buffer;
+		headers[i].msg_hdr.msg_controllen = sizeof(control[i].buffer);
+	}
+	if( (received = recvmmsg( handle, headers, count, MSG_DONTWAIT, NULL )) <= 0 ) {
+		return received;
+	}
+
+	for( int i = 0; i < received; ++i ) {
+		int64_t now;
+		int64_t stamp = find_stamp( &headers[i].msg_hdr, &now );
+
+		messages[i].length = headers[i].msg_len;
+		messages[i].address_length = headers[i].msg_hdr.msg_namelen;
+		messages[i].received = stamp != 0 ? stamp : now;
+		messages[i].queued = stamp != 0 ? (now > stamp ? now - stamp : 0) : -1;
+	}
+	return received;
+}
+
+
+//! Sends count datagrams (at most BATCH_MAX) to address in one call. If stamp_index is one of them, the
+//! kernel is asked to stamp that one, and *stamped says whether it will. Returns how many were sent, or -1.
+int timestamp_sendmmsg( int handle, const struct iovec *datagrams, unsigned count, const struct sockaddr *address,
+                        socklen_t address_length, int stamp_index, int *stamped )
+{
+	union {
+		char buffer[CMSG_SPACE( sizeof(uint32_t) )];
+		struct cmsghdr align;
+	} control;
+	struct mmsghdr headers[BATCH_MAX];
+	uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+	int sent;
+
+	if( count > BATCH_MAX ) {
+		count = BATCH_MAX;
+	}
+	memset( headers, 0, count * sizeof(headers[0]) );
+	for( unsigned i = 0; i < count; ++i ) {
+		headers[i].msg_hdr.msg_name = (void *)address;
+		headers[i].msg_hdr.msg_namelen = address_length;
+		headers[i].msg_hdr.msg_iov = (struct iovec *)&datagrams[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+	*stamped = 0;
+	if( stamp_index >= 0 && (unsigned)stamp_index < count ) {
+		struct msghdr *message = &headers[stamp_index].msg_hdr;
+		struct cmsghdr *request;
+
+		message->msg_control = control.buffer;
+		message->msg_controllen = sizeof(control.buffer);
+		request = CMSG_FIRSTHDR( message );
+		request->cmsg_level = SOL_SOCKET;
+		request->cmsg_type = SO_TIMESTAMPING;
+		request->cmsg_len = CMSG_LEN( sizeof(flags) );
+		memcpy( CMSG_DATA( request ), &flags, sizeof(flags) );
+		*stamped = 1;
+	}
+
+	sent = sendmmsg( handle, headers, count, 0 );
+	// Stopped at the stamped datagram: as in timestamp_sendto(), a kernel before 4.13 refuses the
+	// request. Send the rest without it.
+	if( *stamped && (sent == -1 ? stamp_index == 0 && errno == EINVAL : sent == stamp_index) ) {
+		int rest;
+
+		headers[stamp_index].msg_hdr.msg_control = NULL;
+		headers[stamp_index].msg_hdr.msg_controllen = 0;
+		rest = sendmmsg( handle, &headers[stamp_index], count - (unsigned)stamp_index, 0 );
+		sent = rest >= 0 ? stamp_index + rest : stamp_index > 0 ? stamp_index : -1;
+		*stamped = 0;
+	}
+	else if( *stamped && stamp_index >= sent ) {
+		*stamped = 0;
+	}
+	return sent;
+}
+
+
+//! Takes the next stamp of a sent datagram off handle's error queue. Returns 1 and sets *sent, or 0 if
+//! there is none.
+int timestamp_read_sent( int handle, int64_t *sent )
+{
+	union {
+		char buffer[CONTROL_LENGTH];
+		struct cmsghdr align;
+	} control;
+	struct msghdr message;
+	int64_t now;
+
+	while( 1 ) {
+		memset( &message, 0, sizeof(message) );
+		message.msg_control = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+		if( recvmsg( handle, &message, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 ) {
+			return 0;
+		}
+		// Anything else on the error queue is not ours to report.
+		if( (*sent = find_stamp( &message, &now )) != 0 ) {
+			return 1;
+		}
+	}
+}
+
+#else
+
+static void timestamp_now( int64_t *now )
+{
+	struct timespec time;
+
+	clock_gettime( CLOCK_MONOTONIC, &time );
+	*now = (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+int timestamp_enable( int handle )
+{
+	(void)handle;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+ssize_t timestamp_recvfrom( int handle, void *buffer, size_t length, struct sockaddr *address, socklen_t *address_length,
+                            int64_t *received, int64_t *queued )
+{
+	ssize_t count = recvfrom( handle, buffer, length, 0, address, address_length );
+
+	timestamp_now( received );
+	*queued = -1;
+	return count;
+}
+
+
+int timestamp_sendto( int handle, const void *buffer, size_t length, const struct sockaddr *address,
+                      socklen_t address_length, int want_stamp )
+{
+	(void)want_stamp;
+	return sendto( handle, buffer, length, 0, address, address_length ) < 0 ? -1 : 0;
+}
+
+
+int timestamp_recvmmsg( int handle, struct timestamp_message *messages, unsigned count )
+{
+	unsigned received = 0;
+
+	while( received < count ) {
+		struct timestamp_message *message = &messages[received];
+		ssize_t length;
+
+		message->address_length = sizeof(message->address);
+		length = recvfrom( handle, message->buffer, message->length, MSG_DONTWAIT,
+		                   (struct sockaddr *)&message->address, &message->address_length );
+		if( length < 0 ) {
+			break;
+		}
+		message->length = (size_t)length;
+		timestamp_now( &message->received );
+		message->queued = -1;
+		++received;
+	}
+	return received > 0 ? (int)received : -1;
+}
+
+
+int timestamp_sendmmsg( int handle, const struct iovec *datagrams, unsigned count, const struct sockaddr *address,
+                        socklen_t address_length, int stamp_index, int *stamped )
+{
+	unsigned sent = 0;
+
+	(void)stamp_index;
+	*stamped = 0;
+	while( sent < count && sendto( handle, datagrams[sent].iov_base, datagrams[sent].iov_len, 0, address,
+	                               address_length ) >= 0 ) {
+		++sent;
+	}
+	return sent > 0 || count == 0 ? (int)sent : -1;
+}
+
+
+int timestamp_read_sent( int handle, int64_t *sent )
+{
+	(void)handle;
+	(void)sent;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*!
+ * \file timestamp.h
+ * \brief Kernel software timestamps for datagrams received and sent.
+ *
+ * A time taken in user space after recvfrom() includes however long the
+ * datagram sat in the socket queue while the server was busy, and the time
+ * it took to be scheduled. With SO_TIMESTAMPING the kernel stamps each
+ * datagram as it arrives, so round trips can be measured from the wire and
+ * the time spent queued can be reported on its own. Sent datagrams are only
+ * stamped on request, one at a time, and the stamp is read back from the
+ * socket's error queue (which makes poll() report POLLERR).
+ *
+ * All times are CLOCK_MONOTONIC nanoseconds, like session_now() and
+ * flight_clock(). Where SO_TIMESTAMPING is not available the functions
+ * behave like recvfrom() and sendto() and report no stamps, and where
+ * recvmmsg() and sendmmsg() are not, the batch forms make one call per
+ * datagram.
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// One datagram of a batch received by timestamp_recvmmsg().
+struct timestamp_message {
+	void *buffer;                     // Where to put the datagram.
+	size_t length;                    // Size of buffer; on return, the length of the datagram.
+	struct sockaddr_storage address;  // Its sender.
+	socklen_t address_length;
+	int64_t received;                 // As for timestamp_recvfrom().
+	int64_t queued;
+};
+
+int timestamp_enable( int handle );
+ssize_t timestamp_recvfrom( int handle, void *buffer, size_t length, struct sockaddr *address, socklen_t *address_length,
+                            int64_t *received, int64_t *queued );
+int timestamp_sendto( int handle, const void *buffer, size_t length, const struct sockaddr *address,
+                      socklen_t address_length, int want_stamp );
+int timestamp_recvmmsg( int handle, struct timestamp_message *messages, unsigned count );
+int timestamp_sendmmsg( int handle, const struct iovec *datagrams, unsigned count, const struct sockaddr *address,
+                        socklen_t address_length, int stamp_index, int *stamped );
+int timestamp_read_sent( int handle, int64_t *sent );
+
+#endif
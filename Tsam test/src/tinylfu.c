@@ -0,0 +1,247 @@
+/*!
+ * \file tinylfu.c
+ * \brief The count-min sketch, the window and segmented LRU lists, and the admission test.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinylfu.h"
+
+
+//! Sets up a policy for capacity bytes, with a sketch sized for about expected_entries distinct entries.
+//! Returns 0, or -1 if out of memory.
+int tinylfu_init( struct tinylfu *policy, size_t capacity, size_t expected_entries )
+{
+	size_t width = 64;
+
+	memset( policy, 0, sizeof(*policy) );
+	while( width < 4 * expected_entries ) {
+		width <<= 1;
+	}
+	if( (policy->sketch = calloc( TINYLFU_SKETCH_ROWS * width, 1 )) == NULL ) {
+		return -1;
+	}
+	policy->width = width;
+	policy->capacity = capacity;
+	policy->window_capacity = capacity / 100 * TINYLFU_WINDOW_PERCENT;
+	policy->protected_capacity = (capacity - policy->window_capacity) / 100 * TINYLFU_PROTECTED_PERCENT;
+	return 0;
+}
+
+
+void tinylfu_destroy( struct tinylfu *policy )
+{
+	free( policy->sketch );
+	memset( policy, 0, sizeof(*policy) );
+}
+
+
+// The counter for hash in row: double hashing over the two halves of the hash.
+static uint8_t *counter( const struct tinylfu *policy, uint64_t hash, int row )
+{
+	uint32_t low = (uint32_t)hash;
+	uint32_t high = (uint32_t)(hash >> 32) | 1;
+
+	return &policy->sketch[(size_t)row * policy->width + ((low + (uint32_t)row * high) & (policy->width - 1))];
+}
+
+
+//! Counts an access to hash, hit or miss. Every TINYLFU_RESET_FACTOR * width accesses, all counts are halved.
+void tinylfu_record( struct tinylfu *policy, uint64_t hash )
+{
+	for( int row = 0; row < TINYLFU_SKETCH_ROWS; ++row ) {
+		uint8_t *count = counter( policy, hash, row );
+
+		if( *count != UINT8_MAX ) {
+			++*count;
+		}
+	}
+	if( ++policy->additions >= TINYLFU_RESET_FACTOR * policy->width ) {
+		for( size_t i = 0; i < TINYLFU_SKETCH_ROWS * policy->width; ++i ) {
+			policy->sketch[i] >>= 1;
+		}
+		policy->additions /= 2;
+	}
+}
+
+
+//! Estimates how often hash was accessed recently: the least of its counters.
+unsigned tinylfu_frequency( const struct tinylfu *policy, uint64_t hash )
+{
+	unsigned least = UINT8_MAX;
+
+	for( int row = 0; row < TINYLFU_SKETCH_ROWS; ++row ) {
+		uint8_t count = *counter( policy, hash, row );
+
+		if( count < least ) {
+			least = count;
+		}
+	}
+	return least;
+}
+
+
+static void push_front( struct tinylfu *policy, struct tinylfu_entry *entry, enum tinylfu_segment segment )
+{
+	struct tinylfu_list *list = &policy->segments[segment];
+
+	entry->segment = (uint8_t)segment;
+	entry->prev = NULL;
+	entry->next = list->head;
+	if( list->head != NULL ) {
+		list->head->prev = entry;
+	}
+	else {
+		list->tail = entry;
+	}
+	list->head = entry;
+	list->bytes += entry->size;
+}
+
+
+static void unlink_entry( struct tinylfu *policy, struct tinylfu_entry *entry )
+{
+	struct tinylfu_list *list = &policy->segments[entry->segment];
+
+	if( entry->prev != NULL ) {
+		entry->prev->next = entry->next;
+	}
+	else {
+		list->head = entry->next;
+	}
+	if( entry->next != NULL ) {
+		entry->next->prev = entry->prev;
+	}
+	else {
+		list->tail = entry->prev;
+	}
+	list->bytes -= entry->size;
+	entry->segment = TINYLFU_NONE;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+
+//! Notes a hit on an entry in the cache: to the front of its segment, or from probation into protected, which
+//! hands its least recently used entries back to probation if it overflows.
+void tinylfu_touch( struct tinylfu *policy, struct tinylfu_entry *entry )
+{
+	enum tinylfu_segment segment = entry->segment == TINYLFU_PROBATION ? TINYLFU_PROTECTED : entry->segment;
+
+	unlink_entry( policy, entry );
+	push_front( policy, entry, segment );
+	while( policy->segments[TINYLFU_PROTECTED].bytes > policy->protected_capacity ) {
+		struct tinylfu_entry *demoted = policy->segments[TINYLFU_PROTECTED].tail;
+
+		unlink_entry( policy, demoted );
+		push_front( policy, demoted, TINYLFU_PROBATION );
+	}
+}
+
+
+// The entry to consider after victim as making room in the main area: towards the most recently used end of
+// probation, then of protected.
+static struct tinylfu_entry *next_victim( struct tinylfu *policy, struct tinylfu_entry *victim )
+{
+	if( victim == NULL ) {
+		victim = policy->segments[TINYLFU_PROBATION].tail;
+		return victim != NULL ? victim : policy->segments[TINYLFU_PROTECTED].tail;
+	}
+	if( victim->prev == NULL && victim->segment == TINYLFU_PROBATION ) {
+		return policy->segments[TINYLFU_PROTECTED].tail;
+	}
+	return victim->prev;
+}
+
+
+// Lets candidate into probation if it is more frequent than the entries that would have to make room for it
+// together. Returns 1 if it is in (and they have been evicted), 0 if it is not.
+static int admit( struct tinylfu *policy, struct tinylfu_entry *candidate, tinylfu_evict_fn *evict, void *context )
+{
+	size_t main_capacity = policy->capacity - policy->window_capacity;
+	size_t used = policy->segments[TINYLFU_PROBATION].bytes + policy->segments[TINYLFU_PROTECTED].bytes;
+	unsigned wanted = tinylfu_frequency( policy, candidate->hash );
+	unsigned against = 0;
+	size_t freed = 0;
+	struct tinylfu_entry *last = NULL;
+
+	if( candidate->size > main_capacity ) {
+		return 0;
+	}
+	while( used - freed + candidate->size > main_capacity ) {
+		last = next_victim( policy, last );
+		freed += last->size;
+		if( (against += tinylfu_frequency( policy, last->hash )) >= wanted ) {
+			return 0;
+		}
+	}
+
+	// Evict the victims, least recently used first, up to and including the last one counted.
+	while( last != NULL ) {
+		struct tinylfu_entry *victim = next_victim( policy, NULL );
+		int done = victim == last;
+
+		unlink_entry( policy, victim );
+		evict( victim, context );
+		if( done ) {
+			break;
+		}
+	}
+	push_front( policy, candidate, TINYLFU_PROBATION );
+	return 1;
+}
+
+
+//! Offers a new entry to the cache: it goes into the window, whose least recently used entries may then have to
+//! win their way into the main area, or straight to that test if it is bigger than the whole window. Entries that
+//! lose, or make way, are passed to evict. Returns 0 if the new entry is in the cache, -1 if it was turned away
+//! (and was not passed to evict).
+int tinylfu_insert( struct tinylfu *policy, struct tinylfu_entry *entry, tinylfu_evict_fn *evict, void *context )
+{
+	if( entry->size > policy->window_capacity ) {
+		return admit( policy, entry, evict, context ) ? 0 : -1;
+	}
+	push_front( policy, entry, TINYLFU_WINDOW );
+	while( policy->segments[TINYLFU_WINDOW].bytes > policy->window_capacity ) {
+		struct tinylfu_entry *candidate = policy->segments[TINYLFU_WINDOW].tail;
+
+		unlink_entry( policy, candidate );
+		if( !admit( policy, candidate, evict, context ) ) {
+			evict( candidate, context );
+		}
+	}
+	return 0;
+}
+
+
+//! Puts an entry straight into segment, at its most recently used end, as when restoring a cache that was saved.
+//! Nothing is evicted for it. Returns 0, or -1 if the segment has no room left.
+int tinylfu_place( struct tinylfu *policy, struct tinylfu_entry *entry, enum tinylfu_segment segment )
+{
+	size_t main_bytes = policy->segments[TINYLFU_PROBATION].bytes + policy->segments[TINYLFU_PROTECTED].bytes;
+	int room;
+
+	if( segment == TINYLFU_WINDOW ) {
+		room = policy->segments[TINYLFU_WINDOW].bytes + entry->size <= policy->window_capacity;
+	}
+	else {
+		room = main_bytes + entry->size <= policy->capacity - policy->window_capacity &&
+		       (segment != TINYLFU_PROTECTED ||
+		        policy->segments[TINYLFU_PROTECTED].bytes + entry->size <= policy->protected_capacity);
+	}
+	if( !room ) {
+		return -1;
+	}
+	push_front( policy, entry, segment );
+	return 0;
+}
+
+
+//! Takes an entry out of the cache without passing it to evict.
+void tinylfu_remove( struct tinylfu *policy, struct tinylfu_entry *entry )
+{
+	if( entry->segment != TINYLFU_NONE ) {
+		unlink_entry( policy, entry );
+	}
+}
@@ -0,0 +1,78 @@
+/*!
+ * \file tinylfu.h
+ * \brief Size-aware W-TinyLFU: which entries a byte-bounded cache admits, and which it evicts.
+ *
+ * The policy only decides; its caller owns the entries and their contents.
+ * Capacity is split into a small LRU window (TINYLFU_WINDOW_PERCENT) that
+ * takes every new entry, and a main area run as a segmented LRU: entries
+ * enter its probation segment and move to the protected segment (at most
+ * TINYLFU_PROTECTED_PERCENT of the main area) when they are used again.
+ *
+ * What leaves the window, and anything too big for the window to begin
+ * with, only gets into the main area if it has been asked for more often
+ * than all of the entries it would push out together. Frequencies come from
+ * a count-min sketch of recent accesses, halved every so often so that it
+ * follows changes in popularity (Einziger, Friedman and Manes, "TinyLFU: A
+ * highly efficient cache admission policy", 2017). Summing over the victims
+ * is what makes it size-aware: a one-off 4 GB image cannot displace a
+ * hundred boot files asked for every minute, since it would have to beat
+ * their frequencies added up, not just that of the least popular one.
+ */
+
+#ifndef TINYLFU_H
+#define TINYLFU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TINYLFU_WINDOW_PERCENT    1
+#define TINYLFU_PROTECTED_PERCENT 80
+#define TINYLFU_SKETCH_ROWS       4
+#define TINYLFU_RESET_FACTOR      10  // The sketch is halved after this many accesses per counter in a row.
+
+enum tinylfu_segment {
+	TINYLFU_NONE,  // Not in the cache.
+	TINYLFU_WINDOW,
+	TINYLFU_PROBATION,
+	TINYLFU_PROTECTED,
+	TINYLFU_SEGMENTS
+};
+
+// Embedded in the caller's entry.
+struct tinylfu_entry {
+	uint64_t hash;  // Identifies the content for the sketch.
+	size_t size;    // Bytes it counts against the capacity.
+	uint8_t segment;
+	struct tinylfu_entry *prev;  // Towards the most recently used end of its segment.
+	struct tinylfu_entry *next;
+};
+
+struct tinylfu_list {
+	struct tinylfu_entry *head;  // Most recently used.
+	struct tinylfu_entry *tail;
+	size_t bytes;
+};
+
+struct tinylfu {
+	size_t capacity;
+	size_t window_capacity;
+	size_t protected_capacity;
+	struct tinylfu_list segments[TINYLFU_SEGMENTS];
+	uint8_t *sketch;     // TINYLFU_SKETCH_ROWS rows of width counters.
+	size_t width;        // A power of two.
+	size_t additions;    // Accesses counted since the sketch was last halved.
+};
+
+// Called for each entry the policy drops, after it has been unlinked.
+typedef void tinylfu_evict_fn( struct tinylfu_entry *entry, void *context );
+
+int      tinylfu_init( struct tinylfu *policy, size_t capacity, size_t expected_entries );
+void     tinylfu_destroy( struct tinylfu *policy );
+void     tinylfu_record( struct tinylfu *policy, uint64_t hash );
+unsigned tinylfu_frequency( const struct tinylfu *policy, uint64_t hash );
+void     tinylfu_touch( struct tinylfu *policy, struct tinylfu_entry *entry );
+int      tinylfu_insert( struct tinylfu *policy, struct tinylfu_entry *entry, tinylfu_evict_fn *evict, void *context );
+void     tinylfu_remove( struct tinylfu *policy, struct tinylfu_entry *entry );
+int      tinylfu_place( struct tinylfu *policy, struct tinylfu_entry *entry, enum tinylfu_segment segment );
+
+#endif
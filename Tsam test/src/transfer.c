@@ -0,0 +1,724 @@
+/*!
+ * \file transfer.c
+ * \brief Windowed DATA/ACK exchange for a single read request.
+ *
+ * Up to windowsize blocks (RFC 7440; one without the option) are sent and then
+ * held until the client acknowledges them. Duplicate ACKs for an earlier block
+ * are ignored rather than answered, which avoids the Sorcerer's Apprentice
+ * problem; an ACK from inside the window, or a timeout, makes the server go
+ * back and resend from the first unacknowledged block.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "addrkey.h"
+#include "netascii.h"
+#include "probes.h"
+#include "profile.h"
+#include "stats.h"
+#include "timestamp.h"
+#include "transfer.h"
+
+
+volatile sig_atomic_t transfer_dump_requested;
+
+
+void send_error_message( int socket_handle, const struct sockaddr *client_address, socklen_t client_length,
+                         int error_code, const char *message )
+{
+	unsigned char error_datagram[TFTP_HEADER_LENGTH + 128];
+	size_t length = packet_build_error( error_datagram, sizeof(error_datagram), error_code, message );
+
+	// Send it to the client. Don't worry about if the send succeeds for fails.
+	sendto( socket_handle, error_datagram, length, 0, client_address, client_length );
+}
+
+
+// Returns non-zero if name contains a ".." path component.
+static int has_parent_component( const char *name )
+{
+	const char *component = name;
+
+	while( *component != '\0' ) {
+		size_t length = strcspn( component, "/" );
+
+		if( length == 2 && component[0] == '.' && component[1] == '.' ) {
+			return 1;
+		}
+		component += length;
+		while( *component == '/' ) {
+			++component;
+		}
+	}
+	return 0;
+}
+
+
+//! Opens file_name beneath root_handle. Returns the handle, or -1 with the error to report.
+int open_in_root( int root_handle, const char *file_name, int *error_code, const char **message )
+{
+	struct stat status;
+	int handle;
+
+	// Every name is relative to the root, even if the client sent an absolute path.
+	while( *file_name == '/' ) {
+		++file_name;
+	}
+	if( *file_name == '\0' || has_parent_component( file_name ) ) {
+		*error_code = ERR_ACCESS;
+		*message = "Access violation";
+		return -1;
+	}
+
+	if( (handle = openat( root_handle, file_name, O_RDONLY )) == -1 ) {
+		*error_code = packet_error_for_errno( errno, message );
+		return -1;
+	}
+
+	if( fstat( handle, &status ) == -1 || !S_ISREG( status.st_mode ) ) {
+		close( handle );
+		*error_code = ERR_ACCESS;
+		*message = "Not a regular file";
+		return -1;
+	}
+	return handle;
+}
+
+
+// The size of the file as it is stored, or -1 if it cannot be told.
+static off_t file_size( const struct transfer *transfer )
+{
+	struct stat status;
+
+	if( transfer->contents != NULL ) {
+		return transfer->contents_size;
+	}
+	if( transfer->seekable != NULL ) {
+		return (off_t)transfer->seekable->header.size;
+	}
+	return fstat( transfer->file_handle, &status ) == 0 ? status.st_size : -1;
+}
+
+
+//! Settles the transfer parameters: what the client asked for, capped by the policy.
+void transfer_negotiate( struct transfer *transfer, const struct tftp_request *request, const struct policy *policy )
+{
+	off_t size = file_size( transfer );
+
+	transfer->options = 0;
+	transfer->blksize = TFTP_BLOCK_SIZE;
+	transfer->windowsize = 1;
+	transfer->timeout_ms = TRANSFER_TIMEOUT_MS;
+	transfer->offset = 0;
+	transfer->rate_limit = policy->rate_limit;
+	transfer->acknowledged = 0;
+	transfer->srtt_us = 0;
+	transfer->rttvar_us = 0;
+	transfer->sampling = 0;
+	transfer->stamps_asked = 0;
+	transfer->stamps_read = 0;
+	transfer->sent_to = 0;
+
+	if( request->blksize != 0 ) {
+		transfer->blksize = request->blksize < policy->max_blksize ? request->blksize : policy->max_blksize;
+		transfer->options |= OPTION_BLKSIZE;
+	}
+	if( request->windowsize != 0 ) {
+		transfer->windowsize = request->windowsize < policy->max_windowsize ? request->windowsize : policy->max_windowsize;
+		transfer->options |= OPTION_WINDOWSIZE;
+	}
+	if( request->timeout != 0 ) {
+		transfer->timeout_ms = request->timeout * 1000;
+		transfer->options |= OPTION_TIMEOUT;
+	}
+	if( request->tsize ) {
+		// The size must be the number of octets the client will receive, so netascii files are measured.
+		if( transfer->mode == MODE_NETASCII ) {
+			if( transfer->netascii_size >= 0 ) {
+				transfer->tsize = transfer->netascii_size;
+			}
+			else if( transfer->contents != NULL ) {
+				transfer->tsize = netascii_size_memory( transfer->contents, transfer->contents_size );
+			}
+			else {
+				transfer->tsize = cache_netascii_size( transfer->file_handle );
+			}
+		}
+		else {
+			transfer->tsize = size;
+		}
+		if( transfer->tsize >= 0 ) {
+			transfer->options |= OPTION_TSIZE;
+		}
+	}
+	// Resuming is only offered for octet transfers: a netascii offset would be into the translated
+	// stream, which cannot be reached without translating everything before it. An offset past the
+	// end is not acknowledged, so the client gets the whole file and can tell.
+	if( request->has_offset && transfer->mode == MODE_OCTET &&
+	    size >= 0 && request->offset <= (unsigned long long)size ) {
+		transfer->offset = (off_t)request->offset;
+		transfer->options |= OPTION_OFFSET;
+		STATS_INC( family[transfer->family].resumed );
+		STATS_ADD( family[transfer->family].bytes_skipped, (unsigned long)transfer->offset );
+	}
+
+	transfer->rto_ms = transfer->timeout_ms;
+	flight_start( &transfer->flight );
+	flight_record_at( &transfer->flight, transfer->flight.start_ns, FLIGHT_START, transfer->windowsize, transfer->blksize );
+}
+
+
+//! File bytes still to be acknowledged: the file size past the offset, less what has been acknowledged. Netascii
+//! files are counted untranslated. Used to weigh transfers against each other, so it need not be exact.
+unsigned long long transfer_bytes_left( const struct transfer *transfer )
+{
+	off_t size = file_size( transfer );
+	unsigned long long left;
+
+	if( size <= transfer->offset ) {
+		return 0;
+	}
+	left = (unsigned long long)(size - transfer->offset);
+	return left > transfer->acknowledged ? left - transfer->acknowledged : 0;
+}
+
+
+// Returns non-zero if block should be timed when it is sent: it is new, and nothing else is being timed.
+static int wants_sample( const struct transfer *transfer, uint32_t block )
+{
+	return block >= transfer->sent_to && !transfer->sampling;
+}
+
+
+// Records block as sent, and starts timing it if wants_sample() said so; stamped says whether the kernel
+// was asked to stamp it.
+static void note_sent( struct transfer *transfer, uint32_t block, size_t length, int64_t now, int sample, int stamped )
+{
+	flight_record_at( &transfer->flight, now, FLIGHT_SEND, block, (uint32_t)length );
+	if( block >= transfer->sent_to ) {
+		transfer->sent_to = block + 1;
+	}
+	if( sample ) {
+		transfer->sampling = 1;
+		transfer->sample_block = block;
+		transfer->sample_sent = now;
+		transfer->sample_stamp = stamped ? ++transfer->stamps_asked : 0;
+	}
+}
+
+
+//! Sends a DATA packet (or the OACK, as block 0) and records it. A block sent for the first time is timed
+//! for the round-trip estimate, unless one is being timed already; the kernel is asked to stamp it.
+void transfer_send( struct transfer *transfer, const unsigned char *packet, size_t length, uint32_t block, int64_t now )
+{
+	int sample = wants_sample( transfer, block );
+	int stamped = timestamp_sendto( transfer->socket_handle, packet, length, transfer->client_address,
+	                                transfer->client_length, sample );
+
+	note_sent( transfer, block, length, now, sample, stamped == 1 );
+}
+
+
+//! Sends count consecutive blocks from first out of window (slot block % windowsize, lengths[slot]
+//! bytes each), as many per sendmmsg() as batch allows, and records them as transfer_send() does.
+//! Returns the number of blocks sent; a datagram the kernel refuses counts as sent and lost.
+uint32_t transfer_send_blocks( struct transfer *transfer, struct batch_control *batch, const unsigned char *window,
+                               const size_t *lengths, uint32_t first, uint32_t count, int64_t now )
+{
+	size_t slot_size = TFTP_HEADER_LENGTH + transfer->blksize;
+	uint32_t done = 0;
+
+	while( done < count ) {
+		struct iovec datagrams[BATCH_MAX];
+		unsigned size = count - done < batch->size ? count - done : batch->size;
+		int sample_index = -1;
+		int64_t start = flight_clock( );
+		int stamped;
+		int sent;
+
+		for( unsigned i = 0; i < size; ++i ) {
+			size_t slot = (first + done + i) % transfer->windowsize;
+
+			datagrams[i].iov_base = (void *)&window[slot * slot_size];
+			datagrams[i].iov_len = lengths[slot];
+			if( sample_index == -1 && wants_sample( transfer, first + done + i ) ) {
+				sample_index = (int)i;
+			}
+		}
+		sent = timestamp_sendmmsg( transfer->socket_handle, datagrams, size, transfer->client_address,
+		                           transfer->client_length, sample_index, &stamped );
+		// Say a batch that left blocks behind was full, so that the batches grow while there is a queue.
+		batch_update( batch, count - done > size ? size : sent > 0 ? (unsigned)sent : 0, flight_clock( ) - start );
+
+		for( unsigned i = 0; i < size; ++i ) {
+			uint32_t block = first + done + i;
+
+			PROBE_DATA_SEND( transfer->id, block, datagrams[i].iov_len - TFTP_HEADER_LENGTH );
+			note_sent( transfer, block, datagrams[i].iov_len, now, (int)i == sample_index, stamped );
+		}
+		done += size;
+	}
+	return done;
+}
+
+
+//! Reads the kernel's stamps of sent datagrams; the one for the block being timed replaces its send time.
+//! Must be called when poll() reports POLLERR on the socket, which it does until they are read.
+void transfer_read_send_stamps( struct transfer *transfer )
+{
+	int64_t sent;
+
+	while( timestamp_read_sent( transfer->socket_handle, &sent ) == 1 ) {
+		if( ++transfer->stamps_read == transfer->sample_stamp && transfer->sampling ) {
+			transfer->sample_sent = sent;
+		}
+	}
+}
+
+
+// Moves the retransmission timeout to rto_ms, within bounds, and records the change.
+static void set_rto( struct transfer *transfer, uint32_t block, int64_t rto_ms, int64_t now )
+{
+	if( rto_ms < TRANSFER_MIN_RTO_MS ) {
+		rto_ms = TRANSFER_MIN_RTO_MS;
+	}
+	if( rto_ms > TRANSFER_TIMEOUT_MS ) {
+		rto_ms = TRANSFER_TIMEOUT_MS;
+	}
+	if( (unsigned)rto_ms != transfer->rto_ms ) {
+		transfer->rto_ms = (unsigned)rto_ms;
+		flight_record_at( &transfer->flight, now, FLIGHT_RTO, block, (uint32_t)rto_ms );
+	}
+}
+
+
+//! Records an ACK that moved the window, received (by the kernel, where it stamps datagrams) at
+//! received. If it covers the block being timed, the round trip updates the estimate and the
+//! retransmission timeout (RFC 6298).
+void transfer_note_ack( struct transfer *transfer, uint32_t block, int64_t received )
+{
+	int64_t rtt_us = 0;
+
+	if( transfer->sampling && block >= transfer->sample_block ) {
+		transfer->sampling = 0;
+		rtt_us = (received - transfer->sample_sent) / 1000;
+		if( rtt_us < 1 ) {
+			rtt_us = 1;
+		}
+		if( transfer->srtt_us == 0 ) {
+			transfer->srtt_us = rtt_us;
+			transfer->rttvar_us = rtt_us / 2;
+		}
+		else {
+			int64_t error = rtt_us - transfer->srtt_us;
+
+			transfer->rttvar_us += ((error < 0 ? -error : error) - transfer->rttvar_us) / 4;
+			transfer->srtt_us += error / 8;
+		}
+	}
+	flight_record_at( &transfer->flight, received, FLIGHT_ACK, block, (uint32_t)rtt_us );
+	if( rtt_us != 0 && !(transfer->options & OPTION_TIMEOUT) ) {
+		set_rto( transfer, block, (transfer->srtt_us + 4 * transfer->rttvar_us + 999) / 1000, received );
+	}
+}
+
+
+//! Records a timeout waiting for block and backs the retransmission timeout off.
+void transfer_note_timeout( struct transfer *transfer, uint32_t block, unsigned retries, int64_t now )
+{
+	flight_record_at( &transfer->flight, now, FLIGHT_TIMEOUT, block, retries );
+	transfer->sampling = 0;
+	if( !(transfer->options & OPTION_TIMEOUT) ) {
+		set_rto( transfer, block, 2 * (int64_t)transfer->rto_ms, now );
+	}
+}
+
+
+//! Records going back to resend count blocks from block. An ACK for a resent block cannot be told
+//! from one for the first copy, so such a block is no longer timed (Karn's algorithm).
+void transfer_note_go_back( struct transfer *transfer, uint32_t block, uint32_t count, int64_t now )
+{
+	flight_record_at( &transfer->flight, now, FLIGHT_GO_BACK, block, count );
+	if( transfer->sampling && transfer->sample_block >= block ) {
+		transfer->sampling = 0;
+	}
+}
+
+
+//! Prints the transfer's flight recorder, headed by its client and how it ended (outcome).
+void transfer_dump_flight( const struct transfer *transfer, FILE *stream, const char *outcome )
+{
+	char client_name[CLIENT_KEY_STRING_LENGTH] = "?";
+	char heading[256];
+	client_key key;
+
+	if( client_key_from_sockaddr( &key, transfer->client_address ) == 0 ) {
+		client_key_format( &key, client_name, sizeof(client_name) );
+	}
+	snprintf( heading, sizeof(heading),
+	          "transfer %d to %s %s: acknowledged=%llu blksize=%u windowsize=%u srtt_us=%lld rto_ms=%u",
+	          transfer->id, client_name, outcome, transfer->acknowledged, transfer->blksize, transfer->windowsize,
+	          (long long)transfer->srtt_us, transfer->rto_ms );
+	flight_dump( &transfer->flight, stream, heading );
+}
+
+
+static long elapsed_ms( const struct timespec *since )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+// Waits for an ACK of a block numbered low to high (block numbers wrap at 16 bits, so the
+// reply is mapped back into that range). Returns 1 and sets *acked, and *received to when it
+// arrived, when one arrives; 0 on timeout, -1 if the client gave up.
+static int wait_for_ack( struct transfer *transfer, uint32_t low, uint32_t high, uint32_t *acked, int64_t *received )
+{
+	client_key client;
+	struct timespec sent;
+
+	client_key_from_sockaddr( &client, transfer->client_address );
+	clock_gettime( CLOCK_MONOTONIC, &sent );
+
+	while( 1 ) {
+		struct pollfd poll_set = { transfer->socket_handle, POLLIN, 0 };
+		unsigned char reply[TFTP_MAX_REQUEST];
+		struct sockaddr_storage sender_address;
+		socklen_t sender_length = sizeof(sender_address);
+		client_key sender;
+		long remaining = (long)transfer->rto_ms - elapsed_ms( &sent );
+		int64_t queued;
+		ssize_t count;
+		uint32_t block;
+
+		if( transfer_dump_requested ) {
+			transfer_dump_requested = 0;
+			transfer_dump_flight( transfer, stderr, "running" );
+		}
+		if( remaining <= 0 ) {
+			return 0;
+		}
+		if( poll( &poll_set, 1, (int)remaining ) <= 0 ) {
+			continue;
+		}
+		if( poll_set.revents & POLLERR ) {
+			transfer_read_send_stamps( transfer );
+		}
+		if( !(poll_set.revents & POLLIN) ) {
+			continue;
+		}
+
+		count = timestamp_recvfrom( transfer->socket_handle, reply, sizeof(reply),
+		                            (struct sockaddr *)&sender_address, &sender_length, received, &queued );
+		if( count < TFTP_HEADER_LENGTH ) {
+			continue;
+		}
+		stats_add_delay( &stats->ack_queue, queued );
+		PROFILE_START( ack_start );
+
+		// Someone other than our client found our port; tell them and carry on.
+		if( client_key_from_sockaddr( &sender, (struct sockaddr *)&sender_address ) == -1 ||
+		    !client_key_equal( &sender, &client ) ) {
+			flight_record( &transfer->flight, FLIGHT_STRAY, packet_block( reply ), ntohs( sender.port ) );
+			send_error_message( transfer->socket_handle, (struct sockaddr *)&sender_address, sender_length,
+			                    ERR_UNKNOWN_TID, "Unknown transfer ID" );
+			continue;
+		}
+
+		if( packet_opcode( reply ) == OP_ERROR ) {
+			flight_record( &transfer->flight, FLIGHT_PEER_ERROR, low, packet_block( reply ) );
+			return -1;
+		}
+		if( packet_opcode( reply ) != OP_ACK ) {
+			continue;
+		}
+		block = low + ((packet_block( reply ) - low) & 0xffff);
+		PROFILE_END( PHASE_ACK, ack_start );
+		if( block <= high ) {
+			*acked = block;
+			return 1;
+		}
+		// Anything else, typically a duplicate ACK for an earlier block, is ignored.
+		flight_record( &transfer->flight, FLIGHT_IGNORED_ACK, packet_block( reply ), 0 );
+	}
+}
+
+
+// Sleeps as needed so that the transfer does not exceed its rate limit.
+static void pace( struct transfer *transfer, struct timespec *next, size_t bytes )
+{
+	struct timespec now;
+	long long delay;
+
+	if( transfer->rate_limit == 0 ) {
+		return;
+	}
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	delay = (long long)(next->tv_sec - now.tv_sec) * 1000000000LL + (next->tv_nsec - now.tv_nsec);
+	if( delay > 0 ) {
+		struct timespec pause = { (time_t)(delay / 1000000000LL), (long)(delay % 1000000000LL) };
+
+		nanosleep( &pause, NULL );
+	}
+	else {
+		// Idle time is not saved up as credit for a later burst.
+		*next = now;
+	}
+
+	delay = (long long)((unsigned long long)bytes * 1000000000ULL / transfer->rate_limit);
+	next->tv_sec += (time_t)(delay / 1000000000LL);
+	next->tv_nsec += (long)(delay % 1000000000LL);
+	if( next->tv_nsec >= 1000000000L ) {
+		next->tv_sec++;
+		next->tv_nsec -= 1000000000L;
+	}
+}
+
+
+//! Writes the OACK for the negotiated options into packet. Returns its length.
+size_t transfer_build_oack( const struct transfer *transfer, unsigned char *packet, size_t size )
+{
+	size_t length = 2;
+
+	packet[0] = 0;
+	packet[1] = OP_OACK;
+	if( transfer->options & OPTION_BLKSIZE ) {
+		length = packet_put_option( packet, length, size, "blksize", transfer->blksize );
+	}
+	if( transfer->options & OPTION_WINDOWSIZE ) {
+		length = packet_put_option( packet, length, size, "windowsize", transfer->windowsize );
+	}
+	if( transfer->options & OPTION_TIMEOUT ) {
+		length = packet_put_option( packet, length, size, "timeout", transfer->timeout_ms / 1000 );
+	}
+	if( transfer->options & OPTION_TSIZE ) {
+		length = packet_put_option( packet, length, size, "tsize", (unsigned long)transfer->tsize );
+	}
+	if( transfer->options & OPTION_OFFSET ) {
+		length = packet_put_option( packet, length, size, "offset", (unsigned long)transfer->offset );
+	}
+	return length;
+}
+
+
+// Sends the OACK and waits for the client to acknowledge it as block 0. Returns 0 on success.
+static int send_option_acknowledgement( struct transfer *transfer )
+{
+	unsigned char packet[TFTP_MAX_REQUEST];
+	size_t length = transfer_build_oack( transfer, packet, sizeof(packet) );
+	uint32_t acked;
+	int64_t received;
+	int retries = 0;
+	int result;
+
+	do {
+		if( retries > 0 ) {
+			transfer_note_timeout( transfer, 0, (unsigned)retries - 1, flight_clock( ) );
+		}
+		transfer_send( transfer, packet, length, 0, flight_clock( ) );
+		result = wait_for_ack( transfer, 0, 0, &acked, &received );
+	} while( result == 0 && ++retries <= TRANSFER_MAX_RETRIES );
+
+	if( result != 1 ) {
+		return -1;
+	}
+	transfer_note_ack( transfer, 0, received );
+	return 0;
+}
+
+
+//! Closes the file of a transfer that is over, or never started, and lets go of what it was read from.
+void transfer_close_file( struct transfer *transfer )
+{
+	close( transfer->file_handle );
+	cache_release( transfer->cached );
+	seekable_close( transfer->seekable );
+}
+
+
+// netascii_read_fn for compressed files.
+static ssize_t read_seekable( void *context, unsigned char *buffer, size_t size, off_t offset )
+{
+	return seekable_read( context, buffer, size, offset );
+}
+
+
+//! Sets up reader for a netascii transfer that is translated as it is sent (not one already translated).
+void transfer_init_reader( const struct transfer *transfer, struct netascii_reader *reader )
+{
+	if( transfer->contents != NULL ) {
+		netascii_reader_init_memory( reader, transfer->contents, transfer->contents_size );
+	}
+	else if( transfer->seekable != NULL ) {
+		netascii_reader_init_source( reader, read_seekable, transfer->seekable );
+	}
+	else {
+		netascii_reader_init( reader, transfer->file_handle );
+	}
+}
+
+
+//! Reads the next block into packet (after its header). Returns the data length or -1.
+ssize_t transfer_read_block( struct transfer *transfer, struct netascii_reader *reader, unsigned char *packet, off_t offset )
+{
+	if( transfer->mode == MODE_NETASCII && !transfer->translated ) {
+		return netascii_read( reader, &packet[TFTP_HEADER_LENGTH], transfer->blksize );
+	}
+	if( transfer->contents != NULL ) {
+		size_t size = (size_t)transfer->contents_size;
+		size_t count = (size_t)offset >= size ? 0 : size - (size_t)offset;
+
+		count = count < transfer->blksize ? count : transfer->blksize;
+		memcpy( &packet[TFTP_HEADER_LENGTH], transfer->contents + offset, count );
+		return (ssize_t)count;
+	}
+	if( transfer->seekable != NULL ) {
+		return seekable_read( transfer->seekable, &packet[TFTP_HEADER_LENGTH], transfer->blksize, offset );
+	}
+	return pread( transfer->file_handle, &packet[TFTP_HEADER_LENGTH], transfer->blksize, offset );
+}
+
+
+//! Sends the whole file, windowsize blocks at a time. Returns 0 when the last block is acknowledged, -1 otherwise.
+int send_file( struct transfer *transfer )
+{
+	size_t slot_size = TFTP_HEADER_LENGTH + transfer->blksize;
+	unsigned char *window;                       // windowsize packets, indexed by block % windowsize.
+	size_t lengths[POLICY_WINDOWSIZE_LIMIT];     // Datagram length of each slot.
+	struct netascii_reader reader;
+	struct timespec next_send_time = { 0, 0 };
+	struct batch_control batch;
+	uint32_t base = 1;       // Oldest unacknowledged block.
+	uint32_t filled = 1;     // Next block to read into the window.
+	uint32_t next_send = 1;  // Next block to put on the wire.
+	uint32_t last = 0;       // Final block, once it has been read.
+	off_t offset = transfer->offset;  // Resumed transfers start reading part way in.
+	int retries = 0;
+
+	if( transfer->options && send_option_acknowledgement( transfer ) == -1 ) {
+		STATS_INC( family[transfer->family].failed );
+		PROBE_TRANSFER_ERROR( transfer->id, 0, 0 );
+		return -1;
+	}
+
+	if( (window = malloc( slot_size * transfer->windowsize )) == NULL ) {
+		send_error_message( transfer->socket_handle, transfer->client_address, transfer->client_length,
+		                    ERR_UNDEFINED, "Out of memory" );
+		flight_record( &transfer->flight, FLIGHT_LOCAL_ERROR, base, ERR_UNDEFINED );
+		STATS_INC( family[transfer->family].failed );
+		PROBE_TRANSFER_ERROR( transfer->id, 0, 0 );
+		return -1;
+	}
+	if( transfer->mode == MODE_NETASCII && !transfer->translated ) {
+		transfer_init_reader( transfer, &reader );
+	}
+	batch_init( &batch, &stats->send_batch );
+
+	while( 1 ) {
+		uint32_t acked;
+		int64_t received;
+		int result;
+
+		// Top up the window with blocks that have not been read yet.
+		while( last == 0 && filled < base + transfer->windowsize ) {
+			size_t slot = filled % transfer->windowsize;
+			unsigned char *packet = &window[slot * slot_size];
+			PROFILE_START( read_start );
+			ssize_t count = transfer_read_block( transfer, &reader, packet, offset );
+
+			if( filled == 1 ) {
+				PROFILE_END( PHASE_FIRST_READ, read_start );
+			}
+			if( count < 0 ) {
+				send_error_message( transfer->socket_handle, transfer->client_address, transfer->client_length,
+				                    ERR_UNDEFINED, "Error reading file" );
+				flight_record( &transfer->flight, FLIGHT_LOCAL_ERROR, filled, ERR_UNDEFINED );
+				free( window );
+				STATS_INC( family[transfer->family].failed );
+				PROBE_TRANSFER_ERROR( transfer->id, base - 1, transfer->acknowledged );
+				return -1;
+			}
+			packet_put_header( packet, OP_DATA, filled & 0xffff );
+			lengths[slot] = TFTP_HEADER_LENGTH + (size_t)count;
+			offset += count;
+			if( (size_t)count < transfer->blksize ) {
+				last = filled;
+			}
+			++filled;
+		}
+
+		// Everything read and not yet sent goes out in batches, or one block at a time when paced.
+		while( next_send < filled ) {
+			uint32_t count = filled - next_send;
+
+			if( transfer->rate_limit != 0 ) {
+				pace( transfer, &next_send_time, lengths[next_send % transfer->windowsize] );
+				count = 1;
+			}
+			PROFILE_START( send_start );
+			next_send += transfer_send_blocks( transfer, &batch, window, lengths, next_send, count, flight_clock( ) );
+			PROFILE_END( PHASE_SEND, send_start );
+		}
+
+		result = wait_for_ack( transfer, base, filled - 1, &acked, &received );
+		if( result == -1 ) {
+			break;
+		}
+		if( result == 0 ) {
+			PROFILE_START( timer_start );
+			PROBE_TIMEOUT( transfer->id, base, retries );
+			transfer_note_timeout( transfer, base, (unsigned)retries, flight_clock( ) );
+			if( ++retries > TRANSFER_MAX_RETRIES ) {
+				break;
+			}
+			// Go back and resend everything not yet acknowledged.
+			STATS_ADD( family[transfer->family].retransmits, next_send - base );
+			PROBE_DATA_RETRANSMIT( transfer->id, base, next_send - base );
+			transfer_note_go_back( transfer, base, next_send - base, flight_clock( ) );
+			next_send = base;
+			PROFILE_END( PHASE_TIMER, timer_start );
+			continue;
+		}
+
+		for( uint32_t block = base; block <= acked; ++block ) {
+			size_t bytes = lengths[block % transfer->windowsize] - TFTP_HEADER_LENGTH;
+
+			STATS_ADD( family[transfer->family].bytes_sent, bytes );
+			transfer->acknowledged += bytes;
+		}
+		PROBE_ACK_RECEIVED( transfer->id, acked, transfer->acknowledged );
+		transfer_note_ack( transfer, acked, received );
+		retries = 0;
+		base = acked + 1;
+		if( last != 0 && base > last ) {
+			free( window );
+			STATS_INC( family[transfer->family].completed );
+			PROBE_TRANSFER_DONE( transfer->id, last, transfer->acknowledged );
+			return 0;
+		}
+		// An ACK inside the window means the client lost what followed it.
+		if( next_send > base ) {
+			PROBE_DATA_RETRANSMIT( transfer->id, base, next_send - base );
+			transfer_note_go_back( transfer, base, next_send - base, flight_clock( ) );
+			next_send = base;
+		}
+	}
+
+	free( window );
+	STATS_INC( family[transfer->family].failed );
+	PROBE_TRANSFER_ERROR( transfer->id, base - 1, transfer->acknowledged );
+	return -1;
+}
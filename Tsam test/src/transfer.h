@@ -0,0 +1,100 @@
+/*!
+ * \file transfer.h
+ * \brief Serving one read request to one client.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "flight.h"
+#include "netascii.h"
+#include "packet.h"
+#include "policy.h"
+#include "seekable.h"
+
+#define TRANSFER_TIMEOUT_MS  1000  // How long to wait for an ACK unless the client negotiated a timeout.
+#define TRANSFER_MAX_RETRIES 5     // Retransmissions of one block before giving up.
+#define TRANSFER_MIN_RTO_MS  200   // Floor for the retransmission timeout learnt from round trips.
+
+// Options accepted for the OACK.
+enum transfer_option {
+	OPTION_BLKSIZE    = 1 << 0,
+	OPTION_WINDOWSIZE = 1 << 1,
+	OPTION_TIMEOUT    = 1 << 2,
+	OPTION_TSIZE      = 1 << 3,
+	OPTION_OFFSET     = 1 << 4
+};
+
+struct transfer {
+	int id;                                // Process id, or session id with -m event; see probes.h.
+	int socket_handle;                     // Socket for this transfer only (its port is our TID).
+	const struct sockaddr *client_address;
+	socklen_t client_length;
+	int family;                            // FAMILY_V4 or FAMILY_V6, for the counters.
+	int file_handle;               // -1 for a file served from a bundle.
+	enum tftp_mode mode;
+	struct cache_entry *cached;  // With -C, the cache's reference on contents, given back with cache_release().
+	const unsigned char *contents;  // The file in memory, from the cache or a bundle; NULL to read file_handle.
+	off_t contents_size;
+	off_t netascii_size;            // Length of the file in netascii, if known without reading it; -1 if not.
+	int translated;                 // Set if contents already are in netascii (a bundle made with mkbundle -n).
+	struct seekable *seekable;      // If file_handle is a compressed copy of the file (see seekable.h); else NULL.
+
+	// Filled in by transfer_negotiate().
+	unsigned options;          // transfer_option bits to acknowledge; an OACK precedes the data if any are set.
+	unsigned blksize;
+	unsigned windowsize;
+	unsigned timeout_ms;
+	off_t tsize;
+	off_t offset;              // Byte of the file carried by block 1 (non-zero when resuming).
+	unsigned long rate_limit;  // Bytes per second; 0 for no pacing.
+
+	unsigned long long acknowledged;  // File bytes the client has acknowledged so far.
+
+	// Retransmission timeout (RFC 6298), kept by the transfer_note_ functions. Fixed at
+	// timeout_ms if the client negotiated a timeout.
+	unsigned rto_ms;
+	int64_t srtt_us;        // Smoothed round-trip time; 0 before the first sample.
+	int64_t rttvar_us;
+	int sampling;           // Set while sample_block is being timed.
+	uint32_t sample_block;
+	int64_t sample_sent;    // When sample_block was first sent: the kernel's stamp once it has been read.
+	uint32_t sample_stamp;  // Number of the kernel send stamp asked for sample_block; 0 for none.
+	uint32_t stamps_asked;  // Send stamps asked for (see timestamp.h) and read back so far.
+	uint32_t stamps_read;
+	uint32_t sent_to;       // Blocks below this have been sent at least once (the OACK is block 0).
+
+	struct flight_recorder flight;
+};
+
+extern volatile sig_atomic_t transfer_dump_requested;  // Set by SIGUSR2: print the flight recorders.
+
+int  open_in_root( int root_handle, const char *file_name, int *error_code, const char **message );
+void transfer_negotiate( struct transfer *transfer, const struct tftp_request *request, const struct policy *policy );
+unsigned long long transfer_bytes_left( const struct transfer *transfer );
+size_t  transfer_build_oack( const struct transfer *transfer, unsigned char *packet, size_t size );
+void    transfer_close_file( struct transfer *transfer );
+void    transfer_init_reader( const struct transfer *transfer, struct netascii_reader *reader );
+ssize_t transfer_read_block( struct transfer *transfer, struct netascii_reader *reader, unsigned char *packet, off_t offset );
+void transfer_send( struct transfer *transfer, const unsigned char *packet, size_t length, uint32_t block, int64_t now );
+uint32_t transfer_send_blocks( struct transfer *transfer, struct batch_control *batch, const unsigned char *window,
+                               const size_t *lengths, uint32_t first, uint32_t count, int64_t now );
+void transfer_read_send_stamps( struct transfer *transfer );
+void transfer_note_ack( struct transfer *transfer, uint32_t block, int64_t received );
+void transfer_note_timeout( struct transfer *transfer, uint32_t block, unsigned retries, int64_t now );
+void transfer_note_go_back( struct transfer *transfer, uint32_t block, uint32_t count, int64_t now );
+void transfer_dump_flight( const struct transfer *transfer, FILE *stream, const char *outcome );
+int  send_file( struct transfer *transfer );
+void send_error_message( int socket_handle, const struct sockaddr *client_address, socklen_t client_length,
+                         int error_code, const char *message );
+
+#endif
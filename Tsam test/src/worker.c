@@ -0,0 +1,376 @@
+/*!
+ * \file worker.c
+ * \brief Transfer worker threads, placement of new sessions and work stealing between workers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "busypoll.h"
+#include "stats.h"
+#include "worker.h"
+
+#define WORKER_BALANCE_MS 10        // Longest a worker below the mean load sleeps before it looks for work again.
+#define WORKER_MIN_EXCESS 1048576   // Load above the mean, in bytes, below which no sessions are offered.
+#define WORKER_OFFER_SCAN 256       // Sessions looked at per pass when choosing sessions to offer.
+
+static struct worker workers[WORKER_MAX];
+static unsigned worker_count;
+static _Thread_local uint32_t placement_random;  // Each thread that places sessions has its own.
+
+
+static uint32_t next_random( uint32_t *state )
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+
+static unsigned long long worker_load( struct worker *worker )
+{
+	return atomic_load_explicit( &worker->sessions.load, memory_order_relaxed ) +
+	       atomic_load_explicit( &worker->queued_bytes, memory_order_relaxed );
+}
+
+
+static unsigned long long mean_load( void )
+{
+	unsigned long long total = 0;
+
+	for( unsigned i = 0; i < worker_count; ++i ) {
+		total += worker_load( &workers[i] );
+	}
+	return total / worker_count;
+}
+
+
+static void wake( struct worker *worker )
+{
+	char byte = 0;
+
+	// A full pipe already has the worker's attention.
+	if( write( worker->wake[1], &byte, 1 ) == -1 && errno != EAGAIN ) {
+		perror( "Unable to wake transfer worker" );
+	}
+}
+
+
+//! Queues a negotiated transfer (its socket and file) on the less loaded of two workers picked at random.
+//! Returns the worker's index, or -1 if its inbox is full. Any number of threads may place sessions at once.
+int workers_place( const struct transfer *transfer, const client_key *key, struct policy *policy )
+{
+	unsigned first;
+	unsigned second;
+	struct worker *worker;
+	struct worker_job job;
+
+	// The address of the thread's own variable tells the threads apart, so their choices do not move in step.
+	if( placement_random == 0 ) {
+		placement_random = (uint32_t)(uintptr_t)&placement_random | 1;
+	}
+	first = next_random( &placement_random ) % worker_count;
+	second = worker_count > 1 ? (first + 1 + next_random( &placement_random ) % (worker_count - 1)) % worker_count
+	                          : first;
+	worker = worker_load( &workers[second] ) < worker_load( &workers[first] ) ? &workers[second] : &workers[first];
+
+	job.transfer = *transfer;
+	memcpy( &job.client_address, transfer->client_address, transfer->client_length );
+	job.key = *key;
+	job.policy = policy;
+	job.bytes = transfer_bytes_left( transfer );
+	// Counted first, so that the worker never takes away bytes that were not added.
+	atomic_fetch_add_explicit( &worker->queued_bytes, job.bytes, memory_order_relaxed );
+	if( mpsc_push( &worker->inbox, &job ) == -1 ) {
+		atomic_fetch_sub_explicit( &worker->queued_bytes, job.bytes, memory_order_relaxed );
+		return -1;
+	}
+
+	atomic_fetch_add_explicit( &worker->stats.placed, 1, memory_order_relaxed );
+	wake( worker );
+	return (int)worker->index;
+}
+
+
+// Turns a job away when the worker's table is full: the client is told, and forgotten.
+static void reject_job( struct worker *worker, struct worker_job *job )
+{
+	STATS_INC( family[job->key.family].errors );
+	send_error_message( job->transfer.socket_handle, (struct sockaddr *)&job->client_address,
+	                    job->transfer.client_length, ERR_UNDEFINED, "Server busy, try again later" );
+	transfer_close_file( &job->transfer );
+	close( job->transfer.socket_handle );
+	pthread_mutex_lock( worker->sessions.clients_lock );
+	client_table_remove( worker->sessions.clients, &job->key );
+	job->policy->active_transfers--;
+	pthread_mutex_unlock( worker->sessions.clients_lock );
+}
+
+
+// Starts the sessions placed on the worker since it last looked.
+static void start_jobs( struct worker *worker )
+{
+	struct worker_job job;
+
+	while( mpsc_pop( &worker->inbox, &job ) == 0 ) {
+		job.transfer.client_address = (struct sockaddr *)&job.client_address;
+		if( session_start( &worker->sessions, &job.transfer, &job.key, job.policy ) == SESSION_NONE ) {
+			reject_job( worker, &job );
+		}
+		atomic_fetch_sub_explicit( &worker->queued_bytes, job.bytes, memory_order_relaxed );
+	}
+}
+
+
+// Takes back whatever is still on offer. Offered sessions that are no longer on the deque were stolen, and the
+// worker that stole them now owns their socket, file and buffers: only their ids are given up here.
+static void reclaim_offers( struct worker *worker )
+{
+	struct session *moved;
+
+	while( (moved = deque_pop( &worker->offers )) != NULL ) {
+		session_reclaim( &worker->sessions, (uint32_t)moved->transfer.id, 0 );
+		free( moved );
+	}
+	for( size_t i = 0; i < worker->offered_count; ++i ) {
+		uint32_t id = worker->offered_ids[i];
+
+		if( worker->sessions.state[id] == SESSION_OFFERED ) {
+			session_reclaim( &worker->sessions, id, 1 );
+			atomic_fetch_add_explicit( &worker->stats.stolen, 1, memory_order_relaxed );
+		}
+	}
+	worker->offered_count = 0;
+}
+
+
+// Returns non-zero if an offered session has a datagram waiting or its timer has run out.
+static int offers_need_attention( struct worker *worker, int64_t now )
+{
+	struct session_table *sessions = &worker->sessions;
+
+	for( size_t i = 0; i < worker->offered_count; ++i ) {
+		uint32_t id = worker->offered_ids[i];
+
+		if( sessions->poll_set[sessions->reserved + id].revents != 0 || sessions->deadline[id] <= now ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// Offers sessions waiting for an ACK, none of them bigger than excess (so that moving one cannot just move the
+// imbalance), until about half the excess is on offer.
+static void offer( struct worker *worker, unsigned long long excess )
+{
+	struct session_table *sessions = &worker->sessions;
+	unsigned long long offered = 0;
+
+	for( size_t i = 0; i < worker->offered_count; ++i ) {
+		offered += sessions->sessions[worker->offered_ids[i]].bytes_left;
+	}
+	for( size_t scanned = 0; scanned < WORKER_OFFER_SCAN && scanned < sessions->high_water; ++scanned ) {
+		uint32_t id = (uint32_t)(worker->offer_cursor++ % sessions->high_water);
+		unsigned long long bytes = sessions->sessions[id].bytes_left;
+		struct session *moved;
+
+		if( offered >= excess / 2 || worker->offered_count == DEQUE_SIZE ) {
+			break;
+		}
+		if( sessions->state[id] != SESSION_WAITING || bytes > excess || (moved = session_offer( sessions, id )) == NULL ) {
+			continue;
+		}
+		// Once pushed, the copy belongs to whoever takes it.
+		if( deque_push( &worker->offers, moved ) == -1 ) {
+			session_reclaim( sessions, id, 0 );
+			free( moved );
+			break;
+		}
+		worker->offered_ids[worker->offered_count++] = id;
+		offered += bytes;
+		atomic_fetch_add_explicit( &worker->stats.offered, 1, memory_order_relaxed );
+	}
+}
+
+
+// Takes one offered session from another worker, trying them in turn from a random one. Returns non-zero if it
+// got one.
+static int steal( struct worker *worker )
+{
+	unsigned start = next_random( &worker->random_state ) % worker_count;
+
+	// Only steal what can be adopted: a stolen session has nowhere else to go.
+	if( worker->sessions.free_count == 0 ) {
+		return 0;
+	}
+	for( unsigned i = 0; i < worker_count; ++i ) {
+		struct worker *victim = &workers[(start + i) % worker_count];
+		struct session *moved;
+
+		if( victim == worker || deque_size( &victim->offers ) == 0 ) {
+			continue;
+		}
+		if( (moved = deque_steal( &victim->offers )) == NULL ) {
+			atomic_fetch_add_explicit( &worker->stats.steal_misses, 1, memory_order_relaxed );
+			continue;
+		}
+		session_adopt( &worker->sessions, moved );
+		free( moved );
+		atomic_fetch_add_explicit( &worker->stats.steals, 1, memory_order_relaxed );
+		return 1;
+	}
+	return 0;
+}
+
+
+// Compares the worker's load with the mean: well above it, offers sessions; below it, steals one. Returns -1
+// if the worker is below the mean and should look again soon, 1 if it stole a session, 0 otherwise.
+static int balance( struct worker *worker )
+{
+	unsigned long long load = worker_load( worker );
+	unsigned long long mean = mean_load( );
+
+	if( load > mean + mean / 4 + WORKER_MIN_EXCESS ) {
+		offer( worker, load - mean );
+		return 0;
+	}
+	if( worker->offered_count != 0 ) {
+		reclaim_offers( worker );
+	}
+	if( load < mean - mean / 4 ) {
+		return steal( worker ) ? 1 : -1;
+	}
+	return 0;
+}
+
+
+// Empties the pipe that wakes the worker; its poll() only needed interrupting.
+static void drain_wake_pipe( struct worker *worker )
+{
+	char buffer[64];
+
+	while( read( worker->wake[0], buffer, sizeof(buffer) ) > 0 ) {
+	}
+}
+
+
+// The worker's event loop: the same as the request loop's with -m event and no -t, over its own sessions.
+static void *run_worker( void *argument )
+{
+	struct worker *worker = argument;
+	struct session_table *sessions = &worker->sessions;
+
+	while( 1 ) {
+		int64_t next_deadline;
+		int timeout = -1;
+		int balanced;
+
+		if( atomic_exchange_explicit( &worker->dump_requested, 0, memory_order_relaxed ) ) {
+			session_dump_flights( sessions, stderr );
+		}
+		start_jobs( worker );
+		next_deadline = session_run( sessions );
+		// A stolen session may already have its ACK waiting: go round again at once.
+		if( (balanced = balance( worker )) == 1 ) {
+			next_deadline = 0;
+		}
+		if( next_deadline != INT64_MAX ) {
+			int64_t wait = (next_deadline - session_now( ) + 999999) / 1000000;
+
+			timeout = wait < 0 ? 0 : wait > 1000 ? 1000 : (int)wait;
+		}
+		if( balanced == -1 && (timeout == -1 || timeout > WORKER_BALANCE_MS) ) {
+			timeout = WORKER_BALANCE_MS;
+		}
+		atomic_store_explicit( &worker->stats.sessions, sessions->count, memory_order_relaxed );
+
+		if( busypoll_wait( sessions->poll_set, sessions->reserved + sessions->high_water, timeout,
+		                   worker->busy_poll_us ) == -1 ) {
+			continue;
+		}
+		if( sessions->poll_set[0].revents & POLLIN ) {
+			drain_wake_pipe( worker );
+		}
+		if( worker->offered_count != 0 && offers_need_attention( worker, session_now( ) ) ) {
+			reclaim_offers( worker );
+		}
+		for( size_t id = 0; id < sessions->high_water; ++id ) {
+			if( sessions->poll_set[sessions->reserved + id].revents & (POLLIN | POLLERR) ) {
+				session_receive( sessions, (uint32_t)id );
+			}
+		}
+	}
+	return NULL;
+}
+
+
+//! Starts count worker threads, each with a session table of the given capacity. Sessions take their client out of
+//! clients, under clients_lock, when they end. Returns 0, or -1 if a worker could not be started.
+int workers_start( unsigned count, size_t capacity, struct client_table *clients, pthread_mutex_t *clients_lock,
+                   unsigned busy_poll_us )
+{
+	sigset_t all, previous;
+	int result = 0;
+
+	for( unsigned i = 0; i < count; ++i ) {
+		struct worker *worker = &workers[i];
+
+		worker->index = i;
+		worker->busy_poll_us = busy_poll_us;
+		worker->random_state = placement_random + 7919 * (i + 1);
+		if( session_table_init( &worker->sessions, capacity, 1, clients ) == -1 || pipe( worker->wake ) == -1 ||
+		    mpsc_init( &worker->inbox, WORKER_INBOX, sizeof(struct worker_job) ) == -1 ) {
+			return -1;
+		}
+		worker->sessions.clients_lock = clients_lock;
+		fcntl( worker->wake[0], F_SETFL, O_NONBLOCK );
+		fcntl( worker->wake[1], F_SETFL, O_NONBLOCK );
+		worker->sessions.poll_set[0].fd = worker->wake[0];
+		worker->sessions.poll_set[0].events = POLLIN;
+		deque_init( &worker->offers );
+	}
+	worker_count = count;
+
+	// Signals are left to the request loop.
+	sigfillset( &all );
+	pthread_sigmask( SIG_BLOCK, &all, &previous );
+	for( unsigned i = 0; i < count && result == 0; ++i ) {
+		if( (errno = pthread_create( &workers[i].thread, NULL, run_worker, &workers[i] )) != 0 ) {
+			result = -1;
+		}
+	}
+	pthread_sigmask( SIG_SETMASK, &previous, NULL );
+	return result;
+}
+
+
+//! Has every worker print the flight recorders of its sessions.
+void workers_dump_flights( void )
+{
+	for( unsigned i = 0; i < worker_count; ++i ) {
+		atomic_store_explicit( &workers[i].dump_requested, 1, memory_order_relaxed );
+		wake( &workers[i] );
+	}
+}
+
+
+void workers_dump( FILE *stream )
+{
+	for( unsigned i = 0; i < worker_count; ++i ) {
+		struct worker_stats *counters = &workers[i].stats;
+
+		fprintf( stream, "worker %u: sessions=%lu load_bytes=%llu placed=%lu offered=%lu stolen=%lu steals=%lu "
+		         "steal_misses=%lu\n", i, atomic_load( &counters->sessions ), worker_load( &workers[i] ),
+		         atomic_load( &counters->placed ), atomic_load( &counters->offered ), atomic_load( &counters->stolen ),
+		         atomic_load( &counters->steals ), atomic_load( &counters->steal_misses ) );
+	}
+	fflush( stream );
+}
@@ -0,0 +1,83 @@
+/*!
+ * \file worker.h
+ * \brief Transfer worker threads (-m event -t N) with load-aware placement and work stealing.
+ *
+ * Each worker is a thread running its own session table and event loop, as
+ * the listening process does for all sessions without -t. A new session goes
+ * to the less loaded of two workers picked at random (power of two choices),
+ * a worker's load being the file bytes its sessions still have to send.
+ *
+ * Placement cannot foresee which transfers will last, so a worker whose load
+ * is well above the mean offers sessions that are idle between blocks (window
+ * sent, no ACK yet) on a work-stealing deque, and a worker below the mean
+ * steals from the other workers' deques. An offered session stays in its
+ * owner's table and poll set; as soon as its socket or its timer needs
+ * attention the owner takes back everything nobody has stolen, so an offer
+ * never delays a transfer.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include "addrkey.h"
+#include "client_table.h"
+#include "deque.h"
+#include "mpsc.h"
+#include "policy.h"
+#include "session.h"
+#include "transfer.h"
+
+#define WORKER_MAX   16
+#define WORKER_INBOX 256  // New sessions waiting for a worker to start them; a power of two.
+
+struct worker_stats {
+	atomic_ulong sessions;      // Running now.
+	atomic_ulong placed;        // New sessions placed on this worker.
+	atomic_ulong offered;       // Sessions it put on its deque.
+	atomic_ulong stolen;        // Of those, taken by another worker.
+	atomic_ulong steals;        // Sessions it took from other workers.
+	atomic_ulong steal_misses;  // Steal attempts that found a deque empty or lost a race for it.
+};
+
+// A negotiated transfer handed to a worker to run as a session.
+struct worker_job {
+	struct transfer transfer;
+	struct sockaddr_storage client_address;
+	client_key key;
+	struct policy *policy;
+	unsigned long long bytes;  // transfer_bytes_left(), counted in the worker's load until it starts.
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned index;
+	struct session_table sessions;  // Poll slot 0, before the sessions, is wake[0].
+	int wake[2];                    // A pipe: a byte written to wake[1] interrupts the worker's poll().
+	unsigned busy_poll_us;
+	uint32_t random_state;
+
+	struct mpsc inbox;           // Of struct worker_job, pushed by the threads that accept requests.
+	atomic_ullong queued_bytes;  // Load of the jobs in the inbox.
+
+	struct deque offers;                 // Sessions it offers to other workers; it is the owner.
+	uint32_t offered_ids[DEQUE_SIZE];    // Their ids in its own table.
+	size_t offered_count;
+	size_t offer_cursor;                 // Where the search for sessions to offer resumes.
+
+	atomic_int dump_requested;  // Print the flight recorders of its sessions.
+	struct worker_stats stats;
+};
+
+int  workers_start( unsigned count, size_t capacity, struct client_table *clients, pthread_mutex_t *clients_lock,
+                    unsigned busy_poll_us );
+int  workers_place( const struct transfer *transfer, const client_key *key, struct policy *policy );
+void workers_dump_flights( void );
+void workers_dump( FILE *stream );
+
+#endif